@@ -4,28 +4,40 @@
  */
 #include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <new>
+#include <set>
 #include <string>
 #include <utility>
 #include <vector>
 #include <cerrno>
+#include <cstdlib>
 #include <cstring>
 #include <pthread.h>
 #include <mapidefs.h>
+#include <mapiutil.h>
 #include <edkmdb.h>
 #include <kopano/CommonUtil.h>
 #include <kopano/ECConfig.h>
+#include <kopano/ECGuid.h>
 #include <kopano/ECLogger.h>
 #include <kopano/ECRestriction.h>
 #include <kopano/ECThreadPool.h>
+#include <kopano/ECUnknown.h>
+#include <kopano/IECInterfaces.hpp>
 #include <kopano/fileutil.hpp>
+#include <kopano/hl.hpp>
 #include <kopano/MAPIErrors.h>
 #include <kopano/mapiext.h>
 #include <kopano/memory.hpp>
 #include <kopano/scope.hpp>
 #include <kopano/stringutil.h>
+#include <kopano/timeutil.hpp>
+#include <kopano/Util.h>
 #include <kopano/charset/convert.h>
 #include <db_cxx.h>
 #include "indexer.hpp"
@@ -43,6 +55,31 @@ enum {
 	ST_RECURSE_CVD = 1 << 3,
 };
 
+/* Messages handed to one IndexTask */
+static constexpr size_t INDEX_CHUNK = 64;
+
+struct StoreInfo;
+
+/**
+ * A Berkeley DB hash file, kept open for the lifetime of the service and
+ * shared by the worker threads.
+ */
+class IndexDb final {
+	public:
+	~IndexDb();
+	HRESULT open(const std::string &file);
+	std::string get(const std::string &key);
+	HRESULT put(const std::string &key, const std::string &value);
+	void del(const std::string &key);
+
+	private:
+	void error(const char *op, const DbException &);
+
+	std::mutex m_lock;
+	std::unique_ptr<Db> m_db;
+	std::string m_file;
+};
+
 /**
  * An extended worker that has state and holds a server connection open.
  * Without it, ECIndexService would have to keep and manage the connections for
@@ -52,13 +89,13 @@ class ECIndexWorker final : public ECThreadWorker {
 	public:
 	ECIndexWorker(ECThreadPool *p, ECIndexService *i) : ECThreadWorker(p), m_indexer(i) {}
 	virtual bool init();
+	HRESULT open_store(const std::string &eid, object_ptr<IMsgStore> &, std::shared_ptr<StoreInfo> &);
 
 	private:
 	ECIndexService *m_indexer = nullptr;
 	KServerContext m_srvctx;
-	std::string m_state_db;
-
-	friend class StoreOpener;
+	/* Stores this worker has opened, with their special folders */
+	std::map<std::string, std::pair<object_ptr<IMsgStore>, std::shared_ptr<StoreInfo>>> m_stores;
 };
 
 /**
@@ -73,6 +110,8 @@ class ECIndexerPool final : public ECThreadPool {
 	ECIndexService *m_indexer = nullptr;
 };
 
+struct SyncState;
+
 class ECIndexService final : public IIndexer {
 	public:
 	static HRESULT create(const char *file, IIndexer **);
@@ -88,6 +127,11 @@ class ECIndexService final : public IIndexer {
 	HRESULT init(const char *);
 	HRESULT initial_sync(bool reindex = false);
 	void incr_sync();
+	void incr_round(std::vector<std::string> &&reindex);
+	bool wait_round(const SyncState &);
+	std::shared_ptr<SyncState> make_state();
+	HRESULT load_stores(IMAPITable *);
+	std::string store_eid(const std::string &guid);
 	std::string cmd_props();
 	std::string cmd_syncrun();
 	std::string cmd_scope(client_state &, const std::vector<std::string> &);
@@ -97,24 +141,76 @@ class ECIndexService final : public IIndexer {
 	void cmd_reindex(const std::string &);
 
 	std::shared_ptr<ECConfig> m_config;
+	std::shared_ptr<IndexDb> m_state_db, m_map_db;
 	std::unique_ptr<IIndexerPlugin> m_plugin;
 	ECIndexerPool m_pool;
 	KServerContext m_srvctx;
 	GUID m_server_guid;
+	unsigned int m_disc_flags = ST_RECURSE_BFS;
+
+	/* Incremental sync thread; the members below are guarded by m_sync_lock */
+	pthread_t m_sync_tid{};
+	bool m_sync_running = false, m_in_round = false, m_kick = false;
+	std::atomic<bool> m_quit{false};
+	unsigned int m_rounds = 0;
 	std::vector<std::string> m_reindex_queue;
-	std::mutex m_reindex_qlock;
+	std::mutex m_sync_lock;
+	std::condition_variable m_sync_cond;
+
+	/* Only used by the sync thread (and before it starts) */
+	std::string m_server_state;
+	std::map<std::string, std::string> m_store_eids; /* store guid -> entryid */
+	bool m_stores_fresh = false;
+	std::set<std::pair<std::string, std::string>> m_retry; /* store eid, folder sourcekey */
 };
 
-/* used for initial sync */
+/*
+ * One synchronization run: the initial sync, a reindex, or one round of the
+ * incremental sync.
+ */
 struct SyncState final {
 	ECThreadPool *pool = nullptr;
 	std::shared_ptr<ECConfig> config;
+	IIndexerPlugin *plugin = nullptr;
+	std::shared_ptr<IndexDb> state_db, map_db;
+	GUID server_guid{};
+	std::set<unsigned int> excludes;
+	bool index_attachments = false;
+	size_t attachment_max_size = 0;
 	std::atomic<size_t> in_flight{0}, processed{0};
+	/* Folder states waiting for the index to commit */
+	std::atomic<size_t> commits{0};
+	/* Folders whose pass failed and which are to be tried again */
+	std::mutex retry_lock;
+	std::set<std::pair<std::string, std::string>> retry;
+
+	void fail(const std::string &seid, const std::string &fsk);
 };
 
-/* used for initial sync */
 struct StoreInfo final {
-	std::string outbox, wastebasket, drafts;
+	std::string store_eid, outbox, wastebasket, drafts;
+	GUID store_guid{};
+};
+
+/**
+ * One sync pass over a folder. The index tasks it hands out share it; when
+ * the last one is done, the folder's new sync state is saved as soon as the
+ * index has committed their work.
+ */
+struct FolderPass final {
+	FolderPass(std::shared_ptr<SyncState> s, std::shared_ptr<StoreInfo> i, std::string &&fsk) :
+		state(std::move(s)), info(std::move(i)), key(std::move(fsk))
+	{}
+	~FolderPass();
+
+	std::shared_ptr<SyncState> state;
+	std::shared_ptr<StoreInfo> info;
+	std::string key, new_state;
+	unsigned int folderid = 0;
+	bool spelling = false;
+	std::atomic<bool> failed{false};
+	std::atomic<size_t> changes{0}, deletes{0};
+	KC::time_point start = std::chrono::steady_clock::now();
 };
 
 /**
@@ -124,7 +220,7 @@ struct StoreInfo final {
 class ScanTask : public ECTask {
 	public:
 	ScanTask(std::shared_ptr<SyncState> st, unsigned int flags) :
-		m_state(std::move(st))
+		m_state(std::move(st)), m_flags(flags)
 	{
 		++m_state->in_flight;
 	}
@@ -145,12 +241,11 @@ class ScanTask : public ECTask {
 class StoreOpener final : public ScanTask {
 	public:
 	StoreOpener(std::shared_ptr<SyncState> st, std::string &&seid, unsigned int flags) :
-		ScanTask(std::move(st), flags), m_info(std::make_shared<StoreInfo>()), m_seid(std::move(seid))
+		ScanTask(std::move(st), flags), m_seid(std::move(seid))
 	{}
 	virtual void run();
 
 	private:
-	std::shared_ptr<StoreInfo> m_info;
 	std::string m_seid;
 };
 
@@ -159,7 +254,7 @@ class StoreOpener final : public ScanTask {
  */
 class FolderScanner final : public ScanTask {
 	public:
-	FolderScanner(std::shared_ptr<SyncState> &&s, std::shared_ptr<StoreInfo> &&i, object_ptr<IMAPIContainer> &&c, std::string &&feid, unsigned int flags) :
+	FolderScanner(std::shared_ptr<SyncState> s, std::shared_ptr<StoreInfo> i, object_ptr<IMAPIContainer> &&c, std::string &&feid, unsigned int flags) :
 		ScanTask(std::move(s), flags), m_info(std::move(i)), m_cont(std::move(c)), m_feid(std::move(feid))
 	{}
 	virtual void run();
@@ -189,17 +284,100 @@ class FolderOpener final : public ScanTask {
 	std::string m_feid;
 };
 
+/**
+ * A task that finds a folder by its sourcekey, for the incremental sync.
+ */
+class FolderLocator final : public ScanTask {
+	public:
+	FolderLocator(std::shared_ptr<SyncState> s, const std::string &seid, const std::string &fsk) :
+		ScanTask(std::move(s), 0), m_seid(seid), m_fsk(fsk)
+	{}
+	virtual void run();
+
+	private:
+	std::string m_seid, m_fsk;
+};
+
+/**
+ * A task that reads a batch of messages and hands them to the index.
+ */
+class IndexTask final : public ScanTask {
+	public:
+	IndexTask(std::shared_ptr<FolderPass> p, std::vector<std::string> &&eids) :
+		ScanTask(p->state, 0), m_pass(std::move(p)), m_eids(std::move(eids))
+	{}
+	virtual void run();
+
+	private:
+	HRESULT extract(IMessage *, index_doc &, unsigned int depth);
+	HRESULT extract_attachments(IMessage *, index_doc &, std::string &text, unsigned int depth);
+
+	std::shared_ptr<FolderPass> m_pass;
+	std::vector<std::string> m_eids;
+};
+
+/**
+ * Receives the contents changes of one folder. New and changed messages are
+ * collected into IndexTasks, which go to the pool while the exporter goes
+ * on; deletions are passed to the index right away.
+ */
+class FolderImporter KC_FINAL_OPG :
+    public ECUnknown, public IExchangeImportContentsChanges {
+	public:
+	FolderImporter(std::shared_ptr<FolderPass> p) : m_pass(std::move(p)) {}
+	virtual HRESULT QueryInterface(const IID &, void **) override;
+	virtual HRESULT GetLastError(HRESULT, unsigned int, MAPIERROR **) override { return MAPI_E_NO_SUPPORT; }
+	virtual HRESULT Config(IStream *, unsigned int) override { return hrSuccess; }
+	virtual HRESULT UpdateState(IStream *) override { return hrSuccess; }
+	virtual HRESULT ImportMessageChange(unsigned int nvals, SPropValue *, unsigned int flags, IMessage **) override;
+	virtual HRESULT ImportMessageDeletion(unsigned int flags, ENTRYLIST *) override;
+	virtual HRESULT ImportPerUserReadStateChange(unsigned int, READSTATE *) override { return hrSuccess; }
+	virtual HRESULT ImportMessageMove(unsigned int, BYTE *, unsigned int, BYTE *, unsigned int, BYTE *, unsigned int, BYTE *, unsigned int, BYTE *) override { return MAPI_E_NO_SUPPORT; }
+	void finish();
+
+	private:
+	std::shared_ptr<FolderPass> m_pass;
+	std::vector<std::string> m_chunk;
+};
+
+/**
+ * Receives the server-wide contents changes, and only notes which folders
+ * they are in. The stream variant is what a current server exporter uses;
+ * it carries the store of each change.
+ */
+class ServerImporter KC_FINAL_OPG :
+    public ECUnknown, public IECImportContentsChanges {
+	public:
+	ServerImporter(IndexDb &map) : m_map(map) {}
+	virtual HRESULT QueryInterface(const IID &, void **) override;
+	virtual HRESULT GetLastError(HRESULT, unsigned int, MAPIERROR **) override { return MAPI_E_NO_SUPPORT; }
+	virtual HRESULT Config(IStream *, unsigned int) override { return hrSuccess; }
+	virtual HRESULT UpdateState(IStream *) override { return hrSuccess; }
+	virtual HRESULT ImportMessageChange(unsigned int nvals, SPropValue *, unsigned int flags, IMessage **) override;
+	virtual HRESULT ImportMessageChangeAsAStream(unsigned int nvals, SPropValue *, unsigned int flags, IStream **) override;
+	virtual HRESULT ImportMessageDeletion(unsigned int flags, ENTRYLIST *) override;
+	virtual HRESULT ImportPerUserReadStateChange(unsigned int, READSTATE *) override { return hrSuccess; }
+	virtual HRESULT ImportMessageMove(unsigned int, BYTE *, unsigned int, BYTE *, unsigned int, BYTE *, unsigned int, BYTE *, unsigned int, BYTE *) override { return MAPI_E_NO_SUPPORT; }
+
+	/* folder sourcekey -> store guid */
+	std::map<std::string, std::string> m_folders;
+
+	private:
+	IndexDb &m_map;
+};
+
 static constexpr configsetting_t idx_defaults[] = {
 	{"index_attachments", "yes", CONFIGSETTING_RELOADABLE},
 	{"index_attachment_extension_filter", "", CONFIGSETTING_UNUSED},
 	{"index_attachment_mime_filter", "", CONFIGSETTING_UNUSED},
-	{"index_attachment_max_size", "16777216", CONFIGSETTING_RELOADABLE},
+	{"index_attachment_max_size", "16777216", CONFIGSETTING_RELOADABLE | CONFIGSETTING_SIZE},
 	{"index_attachment_parser", "", CONFIGSETTING_UNUSED},
 	{"index_attachment_parser_max_memory", "", CONFIGSETTING_UNUSED},
 	{"index_attachment_parser_max_cputime", "", CONFIGSETTING_UNUSED},
 	{"index_exclude_properties", "0x007d 0x0064 0x0c1e 0x0075 0x678e 0x678f 0x001a", CONFIGSETTING_RELOADABLE},
 	{"index_path", "/var/lib/kopano/search"},
 	{"index_processes", "0"},
+	{"thread_scheduler", "fifo"},
 	{"limit_results", "1000"},
 	{"optimize_age", "", CONFIGSETTING_UNUSED},
 	{"optimize_start", "", CONFIGSETTING_UNUSED},
@@ -208,7 +386,8 @@ static constexpr configsetting_t idx_defaults[] = {
 	{"suggestions", "yes"},
 	{"index_junk", "yes"},
 	{"index_drafts", "yes"},
-	{"term_cache_size", "64000000"},
+	{"term_cache_size", "64000000", CONFIGSETTING_SIZE},
+	{"index_batch_interval", "5"},
 
 	{"discovery_mode", "bfs"},
 	{"server_socket", "default:"},
@@ -225,41 +404,121 @@ static constexpr configsetting_t idx_defaults[] = {
 	{nullptr, nullptr},
 };
 
-static constexpr SizedSPropTagArray(5, spta_mbox) =
-	{5, {PR_ENTRYID, PR_MAILBOX_OWNER_ENTRYID, PR_EC_STORETYPE,
-	PR_OBJECT_TYPE, PR_DISPLAY_NAME_W}};
+static constexpr SizedSPropTagArray(6, spta_mbox) =
+	{6, {PR_ENTRYID, PR_MAILBOX_OWNER_ENTRYID, PR_EC_STORETYPE,
+	PR_OBJECT_TYPE, PR_DISPLAY_NAME_W, PR_STORE_RECORD_KEY}};
 
-static std::string db_get(const char *file, const char *key)
+static inline std::string bin2str(const SBinary &b)
 {
-	Db db(nullptr, 0);
-	db.open(nullptr, file, nullptr, DB_HASH, DB_CREATE, 0);
-	Dbt xk(const_cast<char *>(key), strlen(key)), xv{};
-	db.get(nullptr, &xk, &xv, 0);
-	return std::string(reinterpret_cast<char *>(xv.get_data()), xv.get_size());
+	return std::string(reinterpret_cast<const char *>(b.lpb), b.cb);
 }
 
-static HRESULT db_put(const char *file, const char *key, const char *value)
+IndexDb::~IndexDb()
 {
-	Db db(nullptr, 0);
-	db.open(nullptr, file, nullptr, DB_HASH, DB_CREATE, 0);
-	Dbt xk(const_cast<char *>(key), strlen(key)), xv(const_cast<char *>(value), strlen(value));
-	return db.put(nullptr, &xk, &xv, 0) == 0 ? hrSuccess : MAPI_E_CALL_FAILED;
+	if (m_db == nullptr)
+		return;
+	try {
+		m_db->close(0);
+	} catch (const DbException &ex) {
+		error("close", ex);
+	}
 }
 
-#if 0
-ServerImporter::ServerImporter(const std::string &serverid, std::shared_ptr<ECConfig> config)
+void IndexDb::error(const char *op, const DbException &ex)
 {
-	m_mapping_db = config->GetSetting("index_path") + serverid + "_mapping");
+	ec_log_err("%s \"%s\": %s (errno %d: %s)", op, m_file.c_str(),
+		ex.what(), ex.get_errno(), strerror(ex.get_errno()));
 }
 
-ServerImporter::update(
-	queue({0, item.storeid, item.folder.entryid});
+HRESULT IndexDb::open(const std::string &file)
+{
+	m_file = file;
+	try {
+		m_db.reset(new Db(nullptr, 0));
+		m_db->open(nullptr, file.c_str(), nullptr, DB_HASH, DB_CREATE, 0);
+	} catch (const DbException &ex) {
+		error("Cannot access", ex);
+		m_db.reset();
+		return MAPI_E_CALL_FAILED;
+	}
+	return hrSuccess;
+}
+
+std::string IndexDb::get(const std::string &key)
+{
+	std::lock_guard<std::mutex> lk(m_lock);
+	if (m_db == nullptr)
+		return {};
+	Dbt xk(const_cast<char *>(key.data()), key.size()), xv;
+	try {
+		if (m_db->get(nullptr, &xk, &xv, 0) != 0)
+			return {};
+	} catch (const DbException &ex) {
+		error("Read from", ex);
+		return {};
+	}
+	return std::string(static_cast<const char *>(xv.get_data()), xv.get_size());
 }
 
-ServerImporter::del()
+HRESULT IndexDb::put(const std::string &key, const std::string &value)
 {
+	std::lock_guard<std::mutex> lk(m_lock);
+	if (m_db == nullptr)
+		return MAPI_E_CALL_FAILED;
+	Dbt xk(const_cast<char *>(key.data()), key.size());
+	Dbt xv(const_cast<char *>(value.data()), value.size());
+	try {
+		if (m_db->put(nullptr, &xk, &xv, 0) != 0)
+			return MAPI_E_CALL_FAILED;
+		m_db->sync(0);
+	} catch (const DbException &ex) {
+		error("Write to", ex);
+		return MAPI_E_CALL_FAILED;
+	}
+	return hrSuccess;
+}
+
+void IndexDb::del(const std::string &key)
+{
+	std::lock_guard<std::mutex> lk(m_lock);
+	if (m_db == nullptr)
+		return;
+	Dbt xk(const_cast<char *>(key.data()), key.size());
+	try {
+		m_db->del(nullptr, &xk, 0);
+	} catch (const DbException &ex) {
+		error("Write to", ex);
+	}
+}
+
+void SyncState::fail(const std::string &seid, const std::string &fsk)
+{
+	std::lock_guard<std::mutex> lk(retry_lock);
+	retry.emplace(seid, fsk);
+}
+
+FolderPass::~FolderPass()
+{
+	if (changes > 0 || deletes > 0)
+		ec_log_debug("Folder %s: %zu changes, %zu deletions in %.2f seconds",
+			bin2hex(key).c_str(), changes.load(), deletes.load(),
+			dur2dbl(std::chrono::steady_clock::now() - start));
+	if (failed) {
+		state->fail(info->store_eid, key);
+		return;
+	}
+	auto st = state;
+	auto seid = info->store_eid;
+	auto fsk = key;
+	auto fstate = bin2hex(new_state);
+	++st->commits;
+	st->plugin->commit(st->server_guid, info->store_guid,
+		[st, seid, fsk, fstate](bool ok) {
+			if (!ok || st->state_db->put(bin2hex(fsk), fstate) != hrSuccess)
+				st->fail(seid, fsk);
+			--st->commits;
+		});
 }
-#endif
 
 HRESULT IIndexer::create(const char *file, IIndexer **out)
 {
@@ -298,7 +557,11 @@ HRESULT ECIndexService::init(const char *cfg_file)
 		ec_log_err("Could not create \"%s\": %s\n", index_path, strerror(errno));
 		return MAPI_E_CALL_FAILED;
 	}
-	m_plugin.reset(make_xapian_plugin(index_path));
+	m_plugin.reset(make_xapian_plugin(index_path,
+		strtoull(m_config->GetSetting("term_cache_size"), nullptr, 0),
+		atoui(m_config->GetSetting("index_batch_interval"))));
+	m_disc_flags = strcmp(m_config->GetSetting("discovery_mode"), "cvd") == 0 ?
+	               ST_RECURSE_CVD : ST_RECURSE_BFS;
 	return hrSuccess;
 }
 
@@ -315,52 +578,127 @@ HRESULT ECIndexService::service_start()
 	if (ncpus == 0)
 		ncpus = 1;
 	m_pool.set_thread_count(ncpus, 0, false);
+	m_pool.enable_work_stealing(strcmp(m_config->GetSetting("thread_scheduler"), "steal") == 0);
 
 	m_srvctx.m_app_misc = "kindexd";
 	m_srvctx.m_host = m_config->GetSetting("server_socket");
 	auto ret = m_srvctx.logon();
-	if (ret != hrSuccess) {
-		ec_log_err("logon");
-		return false;
-	}
+	if (ret != hrSuccess)
+		return kc_perror("logon", ret);
 	ret = server_guid(m_srvctx.m_admstore, m_server_guid);
-	if (ret != hrSuccess) {
-		ec_log_err("server_guid");
-		return false;
-	}
-	auto state_db = m_config->GetSetting("index_path") + "/"s + bin2hex(sizeof(m_server_guid), &m_server_guid) + "_state";
-	std::string state;
-	try {
-		state = db_get(state_db.c_str(), "SERVER");
-	} catch (const DbException &ex) {
-		ec_log_err("Cannot access \"%s\": %s (errno %d: %s)", state_db.c_str(),
-			ex.what(), ex.get_errno(), strerror(ex.get_errno()));
-		return MAPI_E_CALL_FAILED;
-	}
+	if (ret != hrSuccess)
+		return kc_perror("server_guid", ret);
+	auto prefix = m_config->GetSetting("index_path") + "/"s + bin2hex(sizeof(m_server_guid), &m_server_guid);
+	m_state_db = std::make_shared<IndexDb>();
+	m_map_db = std::make_shared<IndexDb>();
+	ret = m_state_db->open(prefix + "_state");
+	if (ret != hrSuccess)
+		return ret;
+	ret = m_map_db->open(prefix + "_mapping");
+	if (ret != hrSuccess)
+		return ret;
+	auto state = hex2bin(m_state_db->get("SERVER"));
 	if (!state.empty()) {
-		ec_log_info("No previous state (%s)", state_db.c_str());
+		ec_log_info("Found previous server sync state %s", bin2hex(state).c_str());
+		m_server_state = std::move(state);
 	} else {
-		std::string new_state;
-		ret = ics_state(m_srvctx.m_admstore, false, new_state);
+		ec_log_info("No previous state (%s_state)", prefix.c_str());
+		ret = ics_state(m_srvctx.m_admstore, false, m_server_state);
 		if (ret != hrSuccess)
 			return kc_perror("ics_state", ret);
+		/* Syncing will reach at least this state */
 		initial_sync();
-		db_put(state_db.c_str(), "SERVER", new_state.c_str());
-		ec_log_info("Saved server sync state %s", bin2hex(new_state).c_str());
+		if (m_retry.empty()) {
+			m_state_db->put("SERVER", bin2hex(m_server_state));
+			ec_log_info("Saved server sync state %s", bin2hex(m_server_state).c_str());
+		}
 	}
 
-	pthread_t tid;
-	auto err = pthread_create(&tid, nullptr, [](void *a) -> void * { static_cast<ECIndexService *>(a)->incr_sync(); return nullptr; }, this);
+	auto err = pthread_create(&m_sync_tid, nullptr, [](void *a) -> void * { static_cast<ECIndexService *>(a)->incr_sync(); return nullptr; }, this);
 	if (err != 0) {
 		ec_log_err("pthread create: %s", strerror(err));
 		return MAPI_E_CALL_FAILED;
 	}
+	std::lock_guard<std::mutex> lk(m_sync_lock);
+	m_sync_running = true;
 	return hrSuccess;
 }
 
 void ECIndexService::service_stop()
 {
-	
+	bool running;
+	{
+		std::lock_guard<std::mutex> lk(m_sync_lock);
+		m_quit = true;
+		running = m_sync_running;
+		m_sync_running = false;
+		m_sync_cond.notify_all();
+	}
+	if (running)
+		pthread_join(m_sync_tid, nullptr);
+	/* Commit what is there; that also saves the folder states it covers. */
+	if (m_plugin != nullptr)
+		m_plugin->flush(true);
+}
+
+std::shared_ptr<SyncState> ECIndexService::make_state()
+{
+	auto st = std::make_shared<SyncState>();
+	st->pool = &m_pool;
+	st->config = m_config;
+	st->plugin = m_plugin.get();
+	st->state_db = m_state_db;
+	st->map_db = m_map_db;
+	st->server_guid = m_server_guid;
+	/* PR_BODY, PR_RTF_COMPRESSED, PR_HTML, PR_EC_IMAP_EMAIL, PR_EC_BODY_FILTERED */
+	st->excludes = {0x1000, 0x1009, 0x1013, 0x678C, 0x6791};
+	for (const auto &id : tokenize(std::string(m_config->GetSetting("index_exclude_properties")), ' ', true))
+		st->excludes.emplace(strtoul(id.c_str(), nullptr, 16));
+	st->index_attachments = parseBool(m_config->GetSetting("index_attachments"));
+	st->attachment_max_size = strtoull(m_config->GetSetting("index_attachment_max_size"), nullptr, 0);
+	return st;
+}
+
+HRESULT ECIndexService::load_stores(IMAPITable *storetbl)
+{
+	auto ret = storetbl->SetColumns(spta_mbox, TBL_BATCH);
+	if (ret != hrSuccess)
+		return kc_perror("SetColumns", ret);
+	ret = storetbl->SeekRow(BOOKMARK_BEGINNING, 0, nullptr);
+	if (ret != hrSuccess)
+		return kc_perror("SeekRow", ret);
+	m_store_eids.clear();
+	for (const auto &row : mapitable_range(storetbl))
+		if (row.lpProps[5].ulPropTag == PR_STORE_RECORD_KEY)
+			m_store_eids[bin2str(row.lpProps[5].Value.bin)] = bin2str(row.lpProps[0].Value.bin);
+	m_stores_fresh = true;
+	return hrSuccess;
+}
+
+/**
+ * Find the entryid of the store with the given GUID. New stores are picked up
+ * by rereading the mailbox table, at most once per round.
+ */
+std::string ECIndexService::store_eid(const std::string &guid)
+{
+	auto i = m_store_eids.find(guid);
+	if (i != m_store_eids.cend())
+		return i->second;
+	if (m_stores_fresh)
+		return {};
+	object_ptr<IExchangeManageStore> ems;
+	object_ptr<IMAPITable> storetbl;
+	auto ret = m_srvctx.m_ecobject->QueryInterface(IID_IExchangeManageStore, &~ems);
+	if (ret == hrSuccess)
+		ret = ems->GetMailboxTable(nullptr, &~storetbl, MAPI_DEFERRED_ERRORS);
+	if (ret == hrSuccess)
+		ret = load_stores(storetbl);
+	if (ret != hrSuccess) {
+		kc_perror("Reading the mailbox table", ret);
+		return {};
+	}
+	i = m_store_eids.find(guid);
+	return i != m_store_eids.cend() ? i->second : std::string();
 }
 
 HRESULT ECIndexService::initial_sync(bool reindex)
@@ -373,35 +711,126 @@ HRESULT ECIndexService::initial_sync(bool reindex)
 	ret = ems->GetMailboxTable(nullptr, &~storetbl, MAPI_DEFERRED_ERRORS);
 	if (ret != hrSuccess)
 		return kc_perror("GetMailboxTable", ret);
-	ret = storetbl->SetColumns(spta_mbox, TBL_BATCH);
+	ret = load_stores(storetbl);
 	if (ret != hrSuccess)
-		return kc_perror("SetColumns", ret);
+		return ret;
 
-	auto disc_mode = m_config->GetSetting("discovery_mode");
-	auto do_cvd = strcmp(disc_mode, "cvd") == 0;
 	ec_log_info("Starting initial sync");
-	auto st = std::make_shared<SyncState>();
-	st->pool = &m_pool;
-	st->config = m_config;
-
-	for (const auto &row : mapitable_range(storetbl.get())) {
-		const auto &eid = row.lpProps[0].Value.bin;
+	auto st = make_state();
+	for (const auto &s : m_store_eids) {
 		unsigned int flags = reindex ? ST_REINDEX : 0;
-		flags |= do_cvd ? ST_RECURSE_CVD : ST_RECURSE_BFS;
-		auto task = new StoreOpener(st, std::string(reinterpret_cast<const char *>(eid.lpb), eid.cb), flags);
+		flags |= m_disc_flags;
+		auto task = new StoreOpener(st, std::string(s.second), flags);
 		m_pool.enqueue(task, true);
 	}
 	while (st->in_flight > 0) {
 		ec_log_debug("initial_sync: %zu objects done so far, %zu more are scheduled", st->processed.load(), st->in_flight.load());
 		Sleep(200);
 	}
-	ec_log_debug("initial_sync: completed after %zu objects", st->processed.load());
+	m_plugin->flush(true);
+	std::lock_guard<std::mutex> lk(st->retry_lock);
+	m_retry = std::move(st->retry);
+	ec_log_debug("initial_sync: completed after %zu objects, %zu folders left to retry",
+		st->processed.load(), m_retry.size());
 	return hrSuccess;
 }
 
 void ECIndexService::incr_sync()
 {
-	
+	set_thread_name(pthread_self(), "IndexSync");
+	std::unique_lock<std::mutex> lk(m_sync_lock);
+	while (!m_quit) {
+		m_sync_cond.wait_for(lk, std::chrono::seconds(1), [&]() { return m_quit || m_kick; });
+		if (m_quit)
+			break;
+		m_kick = false;
+		m_in_round = true;
+		auto reindex = std::move(m_reindex_queue);
+		m_reindex_queue.clear();
+		lk.unlock();
+		incr_round(std::move(reindex));
+		lk.lock();
+		m_in_round = false;
+		++m_rounds;
+		m_sync_cond.notify_all();
+	}
+}
+
+/**
+ * Wait for the tasks of a round and then for the commits that cover them,
+ * which the plugin makes once the batch is large or old enough.
+ */
+bool ECIndexService::wait_round(const SyncState &st)
+{
+	while (st.in_flight > 0 || st.commits > 0) {
+		if (m_quit)
+			return false;
+		m_plugin->flush(false);
+		std::unique_lock<std::mutex> lk(m_sync_lock);
+		m_sync_cond.wait_for(lk, std::chrono::milliseconds(100), [&]() { return m_quit.load(); });
+	}
+	return true;
+}
+
+/**
+ * One round of the incremental sync. The server-wide exporter tells which
+ * folders have changed; each of them is then synced from its own state
+ * by the workers, and their messages are indexed in parallel.
+ */
+void ECIndexService::incr_round(std::vector<std::string> &&reindex)
+{
+	auto st = make_state();
+	m_stores_fresh = false;
+	for (const auto &guid : reindex) {
+		auto seid = store_eid(guid);
+		if (seid.empty()) {
+			ec_log_err("Store %s not found for reindexing", bin2hex(guid).c_str());
+			continue;
+		}
+		GUID sg;
+		memcpy(&sg, guid.data(), sizeof(sg));
+		m_plugin->reindex(m_server_guid, sg);
+		ec_log_info("Reindexing store %s", bin2hex(guid).c_str());
+		m_pool.enqueue(new StoreOpener(st, std::move(seid), m_disc_flags | ST_REINDEX), true);
+	}
+
+	object_ptr<ServerImporter> imp(new(std::nothrow) ServerImporter(*m_map_db));
+	if (imp == nullptr)
+		return;
+	std::string new_state;
+	auto ret = ics_sync(m_srvctx.m_admstore, m_server_state, imp, 0, new_state);
+	if (ret != hrSuccess) {
+		kc_perror("Server-wide sync", ret);
+		wait_round(*st);
+		return;
+	}
+	auto todo = std::move(m_retry);
+	m_retry.clear();
+	for (const auto &f : imp->m_folders) {
+		auto seid = store_eid(f.second);
+		if (!seid.empty())
+			todo.emplace(std::move(seid), f.first);
+	}
+	for (const auto &f : todo)
+		m_pool.enqueue(new FolderLocator(st, f.first, f.second), true);
+	if (!wait_round(*st))
+		/* Stopping; the next start resumes from the saved states */
+		return;
+	{
+		std::lock_guard<std::mutex> lk(st->retry_lock);
+		m_retry = std::move(st->retry);
+	}
+	if (!todo.empty())
+		ec_log_debug("incr_sync: %zu folders synced, %zu to retry", todo.size(), m_retry.size());
+	if (new_state == m_server_state)
+		return;
+	m_server_state = std::move(new_state);
+	/*
+	 * With folders left to retry, the saved state must stay behind, so
+	 * that a restart still visits them.
+	 */
+	if (m_retry.empty())
+		m_state_db->put("SERVER", bin2hex(m_server_state));
 }
 
 std::string ECIndexService::cmd_props()
@@ -421,6 +850,9 @@ std::string ECIndexService::cmd_scope(client_state &cs, const std::vector<std::s
 		return "ERROR: Invalid store GUID";
 	memcpy(&cs.m_server_guid, svg.data(), sizeof(GUID));
 	memcpy(&cs.m_store_guid, stg.data(), sizeof(GUID));
+	/* A new query; the connection may have served others before */
+	cs.m_orig.clear();
+	cs.m_fields_terms.clear();
 	cs.m_folder_ids.clear();
 	std::transform(arg.cbegin() + 3, arg.cend(), std::back_inserter(cs.m_folder_ids),
 		[](const auto &s) { return atoui(s.c_str()); });
@@ -495,16 +927,33 @@ std::string ECIndexService::cmd_query(client_state &cs)
 	return ret;
 }
 
+/**
+ * Wait until the incremental sync has run a round that started after this
+ * request.
+ */
+std::string ECIndexService::cmd_syncrun()
+{
+	std::unique_lock<std::mutex> lk(m_sync_lock);
+	if (!m_sync_running)
+		return "OK:";
+	auto want = m_rounds + (m_in_round ? 2 : 1);
+	m_kick = true;
+	m_sync_cond.notify_all();
+	m_sync_cond.wait(lk, [&]() { return m_quit || m_rounds >= want; });
+	return "OK:";
+}
+
 void ECIndexService::cmd_reindex(const std::string &guid)
 {
-	auto disc_mode = m_config->GetSetting("discovery_mode");
-	auto st = std::make_shared<SyncState>();
-	st->pool = &m_pool;
-	st->config = m_config;
-	unsigned int flags = strcmp(disc_mode, "cvd") == 0 ? ST_RECURSE_CVD : ST_RECURSE_BFS;
-	flags |= ST_REINDEX;
-	auto task = new StoreOpener(st, hex2bin(guid), flags);
-	m_pool.enqueue(task, true);
+	auto bin = hex2bin(guid);
+	if (bin.size() != sizeof(GUID)) {
+		ec_log_err("REINDEX: invalid store GUID \"%s\"", guid.c_str());
+		return;
+	}
+	std::lock_guard<std::mutex> lk(m_sync_lock);
+	m_reindex_queue.emplace_back(std::move(bin));
+	m_kick = true;
+	m_sync_cond.notify_all();
 	ec_log_info("Store \"%s\" queued for reindexing", guid.c_str());
 }
 
@@ -518,9 +967,9 @@ std::string ECIndexService::exec(client_state &cs, const std::vector<std::string
 	if (arg.size() == 0)
 		return "ERROR: no command";
 	if (arg[0] == "PROPS")
-		return "OK:"s + m_config->GetSetting("index_exclude_properties");
+		return cmd_props();
 	if (arg[0] == "SYNCRUN")
-		return "OK:";
+		return cmd_syncrun();
 	if (arg[0] == "SCOPE")
 		return cmd_scope(cs, arg);
 	if (arg[0] == "FIND")
@@ -530,7 +979,7 @@ std::string ECIndexService::exec(client_state &cs, const std::vector<std::string
 	if (arg[0] == "QUERY")
 		return cmd_query(cs);
 	if (arg[0] == "REINDEX") {
-		if (arg.size() > 0)
+		if (arg.size() > 1)
 			cmd_reindex(arg[1]);
 		return "OK:";
 	}
@@ -551,42 +1000,76 @@ bool ECIndexWorker::init()
 		ec_log_err("logon");
 		return false;
 	}
-	GUID guid;
-	ret = server_guid(m_srvctx.m_admstore, guid);
-	if (ret != hrSuccess) {
-		ec_log_err("Could not determine server guid");
-		return false;
-	}
-	m_state_db = cfg->GetSetting("index_path") + "/"s + bin2hex(sizeof(guid), &guid) + "_state";
 	return true;
 }
 
+static HRESULT store_info(IMsgStore *store, StoreInfo &info)
+{
+	static constexpr SizedSPropTagArray(4, tags) = {4, {PR_STORE_RECORD_KEY, PR_IPM_OUTBOX_ENTRYID, PR_IPM_WASTEBASKET_ENTRYID, PR_IPM_DRAFTS_ENTRYID}};
+	unsigned int nvals = 0;
+	memory_ptr<SPropValue> prop;
+	auto ret = store->GetProps(tags, 0, &nvals, &~prop);
+	if (FAILED(ret))
+		return ret;
+	if (prop[0].ulPropTag != PR_STORE_RECORD_KEY || prop[0].Value.bin.cb != sizeof(GUID))
+		return MAPI_E_NOT_FOUND;
+	memcpy(&info.store_guid, prop[0].Value.bin.lpb, sizeof(GUID));
+	if (prop[1].ulPropTag == tags.aulPropTag[1])
+		info.outbox = bin2str(prop[1].Value.bin);
+	if (prop[2].ulPropTag == tags.aulPropTag[2])
+		info.wastebasket = bin2str(prop[2].Value.bin);
+	if (prop[3].ulPropTag == tags.aulPropTag[3])
+		info.drafts = bin2str(prop[3].Value.bin);
+	return hrSuccess;
+}
+
+/**
+ * Open a store through this worker's session. Stores stay open, so that the
+ * tasks of a busy store do not keep reopening it.
+ */
+HRESULT ECIndexWorker::open_store(const std::string &eid,
+    object_ptr<IMsgStore> &store, std::shared_ptr<StoreInfo> &info)
+{
+	auto i = m_stores.find(eid);
+	if (i != m_stores.cend()) {
+		store = i->second.first;
+		info = i->second.second;
+		return hrSuccess;
+	}
+	auto ret = m_srvctx.m_session->OpenMsgStore(0, eid.size(), reinterpret_cast<const ENTRYID *>(eid.data()), &iid_of(store), 0, &~store);
+	if (ret != hrSuccess)
+		return ret;
+	info = std::make_shared<StoreInfo>();
+	info->store_eid = eid;
+	ret = store_info(store, *info);
+	if (ret != hrSuccess)
+		return ret;
+	if (m_stores.size() >= 256)
+		m_stores.clear();
+	m_stores.emplace(eid, std::make_pair(store, info));
+	return hrSuccess;
+}
+
 void StoreOpener::run()
 {
 	auto worker = static_cast<ECIndexWorker *>(m_worker);
 	object_ptr<IMsgStore> store;
-	auto ret = worker->m_srvctx.m_session->OpenMsgStore(0, m_seid.size(), reinterpret_cast<const ENTRYID *>(m_seid.data()), &iid_of(store), 0, &~store);
-	if (ret != hrSuccess)
+	std::shared_ptr<StoreInfo> info;
+	auto ret = worker->open_store(m_seid, store, info);
+	if (ret != hrSuccess) {
+		ec_log_notice("No open store %s: %s", bin2hex(m_seid).c_str(), GetMAPIErrorMessage(ret));
 		return;
+	}
 	object_ptr<IMAPIContainer> root;
 	unsigned int objtype = 0;
 	ret = store->OpenEntry(0, nullptr, &iid_of(root), 0, &objtype, &~root);
 	if (ret != hrSuccess || objtype != MAPI_FOLDER)
 		return;
-	static const SizedSPropTagArray(4, tags) = {4, {PR_ENTRYID, PR_IPM_OUTBOX_ENTRYID, PR_IPM_WASTEBASKET_ENTRYID, PR_IPM_DRAFTS_ENTRYID}};
-	unsigned int nvals = 0;
 	memory_ptr<SPropValue> prop;
-	ret = store->GetProps(tags, 0, &nvals, &~prop);
-	if (FAILED(ret) || prop == nullptr || prop[0].ulPropTag != PR_ENTRYID)
+	ret = HrGetOneProp(root, PR_ENTRYID, &~prop);
+	if (ret != hrSuccess)
 		return;
-	if (prop[1].ulPropTag == tags.aulPropTag[1])
-		m_info->outbox.assign(reinterpret_cast<char *>(prop[1].Value.bin.lpb), prop[1].Value.bin.cb);
-	if (prop[2].ulPropTag == tags.aulPropTag[2])
-		m_info->wastebasket.assign(reinterpret_cast<char *>(prop[2].Value.bin.lpb), prop[2].Value.bin.cb);
-	if (prop[3].ulPropTag == tags.aulPropTag[3])
-		m_info->drafts.assign(reinterpret_cast<char *>(prop[3].Value.bin.lpb), prop[3].Value.bin.cb);
-	auto reid = std::string(reinterpret_cast<char *>(prop[0].Value.bin.lpb), prop[0].Value.bin.cb);
-	FolderScanner(std::move(m_state), std::move(m_info), std::move(root), std::move(reid), m_flags | ST_IS_ROOT).run();
+	FolderScanner(m_state, std::move(info), std::move(root), bin2str(prop->Value.bin), m_flags | ST_IS_ROOT).run();
 }
 
 void FolderScanner::run()
@@ -620,18 +1103,49 @@ void FolderScanner::enlist_children()
 	}
 }
 
+/**
+ * Sync the folder's contents from its last state. The messages are indexed
+ * by IndexTasks on the pool while the exporter is still going; the new
+ * state is saved once all of them are committed (see FolderPass).
+ */
 void FolderScanner::index_me()
 {
+	auto cfg = m_state->config;
 	if (m_feid == m_info->outbox)
 		return;
-	if (m_feid == m_info->wastebasket /* && !config[index_junk] */)
+	if (m_feid == m_info->wastebasket && !parseBool(cfg->GetSetting("index_junk")))
 		return;
-	if (m_feid == m_info->drafts /* && !config[index_drafts] */)
+	if (m_feid == m_info->drafts && !parseBool(cfg->GetSetting("index_drafts")))
 		return;
-	//ec_log_info("Syncing folder %s", "%SSSS");
-	auto sugg = m_state->config->GetSetting("suggestions")[0] != '\0' && m_feid != m_info->wastebasket;
-//	auto importer = FolderImporter(
-	
+	static constexpr SizedSPropTagArray(2, tags) = {2, {PR_SOURCE_KEY, PR_EC_HIERARCHYID}};
+	unsigned int nvals = 0;
+	memory_ptr<SPropValue> prop;
+	auto ret = m_cont->GetProps(tags, 0, &nvals, &~prop);
+	if (FAILED(ret) || prop[0].ulPropTag != PR_SOURCE_KEY ||
+	    prop[1].ulPropTag != PR_EC_HIERARCHYID) {
+		ec_log_err("Folder %s has no sourcekey", bin2hex(m_feid).c_str());
+		return;
+	}
+	auto pass = std::make_shared<FolderPass>(m_state, m_info, bin2str(prop[0].Value.bin));
+	pass->folderid = prop[1].Value.ul;
+	pass->spelling = parseBool(cfg->GetSetting("suggestions")) && m_feid != m_info->wastebasket;
+	/* For the server-wide importer, whose older form does not say the store */
+	m_state->map_db->put("F:" + bin2hex(pass->key), bin2hex(sizeof(GUID), &m_info->store_guid));
+	std::string state;
+	if (!(m_flags & ST_REINDEX))
+		state = hex2bin(m_state->state_db->get(bin2hex(pass->key)));
+
+	object_ptr<FolderImporter> imp(new(std::nothrow) FolderImporter(pass));
+	if (imp == nullptr) {
+		pass->failed = true;
+		return;
+	}
+	ret = ics_sync(m_cont, state, imp, 0, pass->new_state);
+	if (ret != hrSuccess) {
+		ec_log_err("Sync of folder %s failed: %s (%x)", bin2hex(pass->key).c_str(), GetMAPIErrorMessage(ret), ret);
+		pass->failed = true;
+	}
+	imp->finish();
 }
 
 void FolderOpener::run()
@@ -643,7 +1157,324 @@ void FolderOpener::run()
 		ec_log_notice("No open folder %s type %u: %s", bin2hex(m_feid.size(), m_feid.data()).c_str(), objtype, GetMAPIErrorMessage(ret));
 		return;
 	}
-	FolderScanner(std::move(m_state), std::move(m_info), std::move(child), std::move(m_feid), m_flags).run();
+	FolderScanner(m_state, m_info, std::move(child), std::move(m_feid), m_flags).run();
+}
+
+void FolderLocator::run()
+{
+	auto worker = static_cast<ECIndexWorker *>(m_worker);
+	object_ptr<IMsgStore> store;
+	std::shared_ptr<StoreInfo> info;
+	auto ret = worker->open_store(m_seid, store, info);
+	if (ret == MAPI_E_NOT_FOUND)
+		/* Store is gone */
+		return;
+	object_ptr<IExchangeManageStore> ems;
+	if (ret == hrSuccess)
+		ret = store->QueryInterface(IID_IExchangeManageStore, &~ems);
+	unsigned int neid = 0, objtype = 0;
+	memory_ptr<ENTRYID> eid;
+	if (ret == hrSuccess)
+		ret = ems->EntryIDFromSourceKey(m_fsk.size(), reinterpret_cast<BYTE *>(&m_fsk[0]), 0, nullptr, &neid, &~eid);
+	if (ret == MAPI_E_NOT_FOUND)
+		/* Folder is gone */
+		return;
+	object_ptr<IMAPIContainer> folder;
+	if (ret == hrSuccess)
+		ret = store->OpenEntry(neid, eid, &iid_of(folder), 0, &objtype, &~folder);
+	if (ret == MAPI_E_NOT_FOUND)
+		return;
+	if (ret != hrSuccess || objtype != MAPI_FOLDER) {
+		ec_log_err("Cannot open folder %s: %s (%x)", bin2hex(m_fsk).c_str(), GetMAPIErrorMessage(ret), ret);
+		m_state->fail(m_seid, m_fsk);
+		return;
+	}
+	FolderScanner(m_state, std::move(info), std::move(folder), std::string(reinterpret_cast<const char *>(eid.get()), neid), m_flags).run();
+}
+
+HRESULT FolderImporter::QueryInterface(REFIID refiid, void **lppInterface)
+{
+	REGISTER_INTERFACE2(IExchangeImportContentsChanges, this);
+	REGISTER_INTERFACE2(IUnknown, this);
+	return MAPI_E_INTERFACE_NOT_SUPPORTED;
+}
+
+HRESULT FolderImporter::ImportMessageChange(unsigned int nvals,
+    SPropValue *props, unsigned int flags, IMessage **)
+{
+	auto eid = PCpropFindProp(props, nvals, PR_ENTRYID);
+	if (eid == nullptr)
+		return SYNC_E_IGNORE;
+	m_chunk.emplace_back(bin2str(eid->Value.bin));
+	++m_pass->changes;
+	if (m_chunk.size() >= INDEX_CHUNK) {
+		m_pass->state->pool->enqueue(new IndexTask(m_pass, std::move(m_chunk)), true);
+		m_chunk.clear();
+	}
+	/* The message is read by the IndexTask, not copied by the exporter */
+	return SYNC_E_IGNORE;
+}
+
+HRESULT FolderImporter::ImportMessageDeletion(unsigned int flags, ENTRYLIST *list)
+{
+	index_doc doc;
+	doc.serverid = m_pass->state->server_guid;
+	doc.storeid = m_pass->info->store_guid;
+	doc.folderid = m_pass->folderid;
+	auto fsk = bin2hex(m_pass->key);
+	for (unsigned int i = 0; i < list->cValues; ++i) {
+		doc.sourcekey = bin2str(list->lpbin[i]);
+		m_pass->state->plugin->delete_doc(doc);
+		auto key = bin2hex(doc.sourcekey);
+		auto ids = m_pass->state->map_db->get(key);
+		auto pos = ids.find(' ');
+		if (pos != std::string::npos && ids.compare(pos + 1, std::string::npos, fsk) == 0)
+			m_pass->state->map_db->del(key);
+		++m_pass->deletes;
+	}
+	return hrSuccess;
+}
+
+void FolderImporter::finish()
+{
+	if (m_chunk.empty())
+		return;
+	m_pass->state->pool->enqueue(new IndexTask(m_pass, std::move(m_chunk)), true);
+	m_chunk.clear();
+}
+
+HRESULT ServerImporter::QueryInterface(REFIID refiid, void **lppInterface)
+{
+	REGISTER_INTERFACE2(IECImportContentsChanges, this);
+	REGISTER_INTERFACE2(IExchangeImportContentsChanges, this);
+	REGISTER_INTERFACE2(IUnknown, this);
+	return MAPI_E_INTERFACE_NOT_SUPPORTED;
+}
+
+HRESULT ServerImporter::ImportMessageChange(unsigned int nvals,
+    SPropValue *props, unsigned int flags, IMessage **)
+{
+	auto psk = PCpropFindProp(props, nvals, PR_PARENT_SOURCE_KEY);
+	if (psk == nullptr)
+		return SYNC_E_IGNORE;
+	auto fsk = bin2str(psk->Value.bin);
+	if (m_folders.find(fsk) != m_folders.cend())
+		return SYNC_E_IGNORE;
+	auto store = hex2bin(m_map.get("F:" + bin2hex(fsk)));
+	if (store.size() == sizeof(GUID))
+		m_folders.emplace(std::move(fsk), std::move(store));
+	else
+		ec_log_debug("Change in unknown folder %s", bin2hex(fsk).c_str());
+	return SYNC_E_IGNORE;
+}
+
+HRESULT ServerImporter::ImportMessageChangeAsAStream(unsigned int nvals,
+    SPropValue *props, unsigned int flags, IStream **)
+{
+	auto psk = PCpropFindProp(props, nvals, PR_PARENT_SOURCE_KEY);
+	auto srk = PCpropFindProp(props, nvals, PR_STORE_RECORD_KEY);
+	if (psk == nullptr || srk == nullptr)
+		return ImportMessageChange(nvals, props, flags, nullptr);
+	m_folders.emplace(bin2str(psk->Value.bin), bin2str(srk->Value.bin));
+	/* Discards the message stream */
+	return SYNC_E_IGNORE;
+}
+
+HRESULT ServerImporter::ImportMessageDeletion(unsigned int flags, ENTRYLIST *list)
+{
+	for (unsigned int i = 0; i < list->cValues; ++i) {
+		/* "<store guid> <folder sourcekey>", from when it was indexed */
+		auto ids = m_map.get(bin2hex(list->lpbin[i]));
+		auto pos = ids.find(' ');
+		if (pos == std::string::npos)
+			continue;
+		m_folders.emplace(hex2bin(ids.substr(pos + 1)), hex2bin(ids.substr(0, pos)));
+	}
+	return hrSuccess;
+}
+
+void IndexTask::run()
+{
+	auto worker = static_cast<ECIndexWorker *>(m_worker);
+	object_ptr<IMsgStore> store;
+	std::shared_ptr<StoreInfo> info;
+	auto ret = worker->open_store(m_pass->info->store_eid, store, info);
+	if (ret != hrSuccess) {
+		kc_perror("IndexTask: open store", ret);
+		m_pass->failed = true;
+		return;
+	}
+	auto ids = bin2hex(sizeof(GUID), &m_pass->info->store_guid) + " " + bin2hex(m_pass->key);
+	for (const auto &eid : m_eids) {
+		object_ptr<IMessage> msg;
+		unsigned int objtype = 0;
+		ret = store->OpenEntry(eid.size(), reinterpret_cast<const ENTRYID *>(eid.data()), &iid_of(msg), 0, &objtype, &~msg);
+		if (ret == MAPI_E_NOT_FOUND)
+			/* Deleted meanwhile; a later pass sees the deletion. */
+			continue;
+		index_doc doc;
+		doc.serverid = m_state->server_guid;
+		doc.storeid = m_pass->info->store_guid;
+		doc.folderid = m_pass->folderid;
+		try {
+			if (ret == hrSuccess)
+				ret = extract(msg, doc, 0);
+		} catch (const KMAPIError &e) {
+			ret = e.code();
+		}
+		if (ret != hrSuccess) {
+			ec_log_err("Cannot index message %s: %s (%x)", bin2hex(eid).c_str(), GetMAPIErrorMessage(ret), ret);
+			m_pass->failed = true;
+			continue;
+		}
+		m_state->plugin->update_doc(doc, m_pass->spelling);
+		/* ICS does not remember which store a deletion belongs to */
+		m_state->map_db->put(bin2hex(doc.sourcekey), ids);
+	}
+}
+
+static void add_text(index_doc &doc, unsigned int id, const wchar_t *s)
+{
+	if (s == nullptr || *s == L'\0')
+		return;
+	auto &f = doc.items["mapi" + stringify(id)];
+	f += ' ';
+	f += convert_to<std::string>("UTF-8", s, rawsize(s), CHARSET_WCHAR);
+}
+
+/**
+ * Collect the text of a message, the way kopano-search does: string
+ * properties go under their property id, the body and the attachments under
+ * PR_BODY, and sender and recipient addresses under the display fields.
+ */
+HRESULT IndexTask::extract(IMessage *msg, index_doc &doc, unsigned int depth)
+{
+	unsigned int nvals = 0;
+	memory_ptr<SPropValue> props;
+	auto ret = msg->GetProps(nullptr, MAPI_UNICODE, &nvals, &~props);
+	if (FAILED(ret))
+		return ret;
+	for (unsigned int i = 0; i < nvals; ++i) {
+		const auto &p = props[i];
+		if (m_state->excludes.find(PROP_ID(p.ulPropTag)) != m_state->excludes.cend())
+			continue;
+		if (PROP_TYPE(p.ulPropTag) == PT_UNICODE)
+			add_text(doc, PROP_ID(p.ulPropTag), p.Value.lpszW);
+		else if (PROP_TYPE(p.ulPropTag) == PT_MV_UNICODE)
+			for (unsigned int j = 0; j < p.Value.MVszW.cValues; ++j)
+				add_text(doc, PROP_ID(p.ulPropTag), p.Value.MVszW.lppszW[j]);
+	}
+	if (depth == 0) {
+		static constexpr SizedSPropTagArray(3, tags) = {3, {PR_SOURCE_KEY, PR_EC_HIERARCHYID, PR_SUBJECT_W}};
+		memory_ptr<SPropValue> ids;
+		ret = msg->GetProps(tags, 0, &nvals, &~ids);
+		if (FAILED(ret))
+			return ret;
+		if (ids[0].ulPropTag != PR_SOURCE_KEY || ids[1].ulPropTag != PR_EC_HIERARCHYID)
+			return MAPI_E_NOT_FOUND;
+		doc.sourcekey = bin2str(ids[0].Value.bin);
+		doc.docid = ids[1].Value.ul;
+		doc.data = "subject: ";
+		if (ids[2].ulPropTag == PR_SUBJECT_W)
+			doc.data += convert_to<std::string>("UTF-8", ids[2].Value.lpszW, rawsize(ids[2].Value.lpszW), CHARSET_WCHAR);
+		doc.data += "\n";
+	}
+
+	/* The sender fields are excluded above only if configured so. */
+	static constexpr unsigned int senders[] = {
+		PR_SENDER_NAME_W, PR_SENDER_EMAIL_ADDRESS_W,
+		PR_SENT_REPRESENTING_NAME_W, PR_SENT_REPRESENTING_EMAIL_ADDRESS_W,
+	};
+	for (auto tag : senders) {
+		auto p = PCpropFindProp(props, nvals, tag);
+		if (p != nullptr)
+			add_text(doc, PROP_ID(PR_SENDER_NAME_W), p->Value.lpszW);
+	}
+
+	object_ptr<IMAPITable> rtbl;
+	ret = msg->GetRecipientTable(MAPI_UNICODE, &~rtbl);
+	if (ret == hrSuccess) {
+		static constexpr SizedSPropTagArray(3, rcols) = {3, {PR_RECIPIENT_TYPE, PR_DISPLAY_NAME_W, PR_SMTP_ADDRESS_W}};
+		ret = rtbl->SetColumns(rcols, TBL_BATCH);
+		if (ret != hrSuccess)
+			return ret;
+		for (const auto &row : mapitable_range(rtbl.get())) {
+			if (row.lpProps[0].ulPropTag != PR_RECIPIENT_TYPE)
+				continue;
+			auto type = row.lpProps[0].Value.ul & ~MAPI_SUBMITTED;
+			auto id = type == MAPI_CC ? PROP_ID(PR_DISPLAY_CC_W) :
+			          type == MAPI_BCC ? PROP_ID(PR_DISPLAY_BCC_W) : PROP_ID(PR_DISPLAY_TO_W);
+			for (unsigned int i = 1; i < 3; ++i)
+				if (PROP_TYPE(row.lpProps[i].ulPropTag) == PT_UNICODE)
+					add_text(doc, id, row.lpProps[i].Value.lpszW);
+		}
+	}
+
+	std::wstring body;
+	object_ptr<IStream> stream;
+	if (msg->OpenProperty(PR_BODY_W, &IID_IStream, 0, 0, &~stream) == hrSuccess)
+		Util::HrStreamToString(stream, body);
+	std::string text = convert_to<std::string>("UTF-8", body, rawsize(body), CHARSET_WCHAR);
+	ret = extract_attachments(msg, doc, text, depth);
+	if (ret != hrSuccess)
+		return ret;
+	auto &f = doc.items["mapi" + stringify(PROP_ID(PR_BODY_W))];
+	f += ' ';
+	f += text;
+	return hrSuccess;
+}
+
+/**
+ * There are no document converters here, so of the attachments, only the
+ * file names and plain text content are indexed, and embedded messages
+ * (one level deep).
+ */
+HRESULT IndexTask::extract_attachments(IMessage *msg, index_doc &doc,
+    std::string &text, unsigned int depth)
+{
+	object_ptr<IMAPITable> tbl;
+	auto ret = msg->GetAttachmentTable(MAPI_UNICODE, &~tbl);
+	if (ret != hrSuccess)
+		return hrSuccess;
+	static constexpr SizedSPropTagArray(5, cols) = {5, {PR_ATTACH_NUM,
+		PR_ATTACH_METHOD, PR_ATTACH_LONG_FILENAME_W, PR_ATTACH_MIME_TAG_W,
+		PR_ATTACH_SIZE}};
+	ret = tbl->SetColumns(cols, TBL_BATCH);
+	if (ret != hrSuccess)
+		return ret;
+	for (const auto &row : mapitable_range(tbl.get())) {
+		if (row.lpProps[0].ulPropTag != PR_ATTACH_NUM)
+			continue;
+		std::string name, mime;
+		if (row.lpProps[2].ulPropTag == PR_ATTACH_LONG_FILENAME_W)
+			name = convert_to<std::string>("UTF-8", row.lpProps[2].Value.lpszW, rawsize(row.lpProps[2].Value.lpszW), CHARSET_WCHAR);
+		if (row.lpProps[3].ulPropTag == PR_ATTACH_MIME_TAG_W)
+			mime = convert_to<std::string>(row.lpProps[3].Value.lpszW);
+		auto method = row.lpProps[1].ulPropTag == PR_ATTACH_METHOD ? row.lpProps[1].Value.ul : NO_ATTACHMENT;
+		size_t size = row.lpProps[4].ulPropTag == PR_ATTACH_SIZE ? row.lpProps[4].Value.ul : 0;
+		object_ptr<IAttach> att;
+		if (method == ATTACH_EMBEDDED_MSG && depth == 0) {
+			object_ptr<IMessage> sub;
+			if (msg->OpenAttach(row.lpProps[0].Value.ul, &iid_of(att), 0, &~att) == hrSuccess &&
+			    att->OpenProperty(PR_ATTACH_DATA_OBJ, &IID_IMessage, 0, 0, &~sub) == hrSuccess) {
+				ret = extract(sub, doc, depth + 1);
+				if (ret != hrSuccess)
+					return ret;
+			}
+		} else if (method == ATTACH_BY_VALUE && m_state->index_attachments &&
+		    strncasecmp(mime.c_str(), "text/", 5) == 0 && size > 0 &&
+		    size < m_state->attachment_max_size && name != "inline.txt") {
+			std::string data;
+			if (msg->OpenAttach(row.lpProps[0].Value.ul, &iid_of(att), 0, &~att) == hrSuccess &&
+			    Util::ReadProperty(att, PR_ATTACH_DATA_BIN, data) == hrSuccess) {
+				text += ' ';
+				text += data;
+			}
+		}
+		text += ' ';
+		text += name;
+	}
+	return hrSuccess;
 }
 
 } /* namespace */
@@ -1,3 +1,4 @@
+#include <functional>
 #include <map>
 #include <string>
 #include <vector>
@@ -6,8 +7,9 @@
 namespace KC {
 
 struct index_doc {
-	const GUID serverid, storeid, sourcekey;
-	unsigned int folderid, docid;
+	GUID serverid{}, storeid{};
+	std::string sourcekey;
+	unsigned int folderid = 0, docid = 0;
 	std::map<std::string, std::string> items;
 	std::string data;
 };
@@ -18,12 +20,22 @@ class IIndexerPlugin {
 	virtual std::vector<std::string> extract_terms(const char *) = 0;
 	virtual std::vector<std::string> search(const GUID &server, const GUID &store, const std::vector<unsigned int> &folders, const FIELDTERMS &, const std::string &query, size_t limit = 0) = 0;
 	virtual std::string suggest(const GUID &server, const GUID &store, const std::vector<std::string> &terms, const std::string &orig) = 0;
-	virtual void update_doc(const index_doc &) = 0;
+	/*
+	 * Documents are written to the store's index right away (from any
+	 * thread), and become visible with the store's next commit.
+	 */
+	virtual void update_doc(const index_doc &, bool spelling) = 0;
 	virtual void delete_doc(const index_doc &) = 0;
-	virtual void commit(const std::string &sugg) = 0;
+	/*
+	 * Call @done once everything handed in for this store so far is
+	 * committed, with false if some of it could not be written.
+	 */
+	virtual void commit(const GUID &server, const GUID &store, std::function<void(bool)> &&done) = 0;
+	/* Commit the batches that have reached their age limit, or all of them. */
+	virtual void flush(bool all) = 0;
 	virtual void reindex(const GUID &server, const GUID &store) {}
 };
 
-extern IIndexerPlugin *make_xapian_plugin(const char *);
+extern IIndexerPlugin *make_xapian_plugin(const char *path, size_t batch_size, unsigned int batch_secs);
 
 } /* namespace */
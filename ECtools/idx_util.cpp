@@ -59,33 +59,52 @@ HRESULT server_guid(IMsgStore *store, GUID &out)
 	return hrSuccess;
 }
 
-HRESULT ics_state(IMAPIProp *p, bool assoc, std::string &out)
+/**
+ * Run the contents exporter of @p from @state (empty for a fresh start),
+ * feeding @importer, and return the state it reached in @out. Without an
+ * importer, the exporter just catches up.
+ */
+HRESULT ics_sync(IMAPIProp *p, const std::string &state, IUnknown *importer,
+    unsigned int flags, std::string &out)
 {
 	object_ptr<IExchangeExportChanges> exp;
 	auto ret = p->OpenProperty(PR_CONTENTS_SYNCHRONIZER, &IID_IExchangeExportChanges, 0, 0, &~exp);
 	if (ret != hrSuccess)
 		return kc_perror("OpenProperty", ret);
-	ret = exp->Config(nullptr, SYNC_NORMAL | SYNC_CATCHUP | (assoc ? SYNC_ASSOCIATED : 0),
-	                  nullptr, nullptr, nullptr, nullptr, 0);
+	object_ptr<IStream> stream;
+	ret = CreateStreamOnHGlobal(nullptr, true, &~stream);
+	if (ret != hrSuccess)
+		return kc_perror("CreateStream", ret);
+	if (!state.empty()) {
+		ret = stream->Write(state.data(), state.size(), nullptr);
+		if (ret != hrSuccess)
+			return kc_perror("Write", ret);
+		ret = stream->Seek(large_int_zero, STREAM_SEEK_SET, nullptr);
+		if (ret != hrSuccess)
+			return kc_perror("Seek", ret);
+	}
+	if (importer == nullptr)
+		flags |= SYNC_CATCHUP;
+	ret = exp->Config(state.empty() ? nullptr : stream.get(), SYNC_NORMAL | flags,
+	                  importer, nullptr, nullptr, nullptr, 0);
 	if (ret != hrSuccess)
 		return kc_perror("Exporter::Config", ret);
 	unsigned int steps = 0, progress = 0;
 	do {
 		ret = exp->Synchronize(&steps, &progress);
-		if (ret != hrSuccess)
+		if (FAILED(ret))
 			return ret;
 	} while (ret == SYNC_W_PROGRESS);
 
-	object_ptr<IStream> stream;
-	ret = CreateStreamOnHGlobal(nullptr, true, &~stream);
+	ret = stream->SetSize(ularge_int_zero);
 	if (ret != hrSuccess)
-		return kc_perror("CreateStream", ret);
-	ret = exp->UpdateState(stream);
-	if (ret != hrSuccess)
-		return kc_perror("UpdateState", ret);
+		return kc_perror("SetSize", ret);
 	ret = stream->Seek(large_int_zero, STREAM_SEEK_SET, nullptr);
 	if (ret != hrSuccess)
 		return kc_perror("Seek", ret);
+	ret = exp->UpdateState(stream);
+	if (ret != hrSuccess)
+		return kc_perror("UpdateState", ret);
 	STATSTG st{};
 	ret = stream->Stat(&st, STATFLAG_NONAME);
 	if (ret != hrSuccess)
@@ -101,4 +120,9 @@ HRESULT ics_state(IMAPIProp *p, bool assoc, std::string &out)
 	abort();
 }
 
+HRESULT ics_state(IMAPIProp *p, bool assoc, std::string &out)
+{
+	return ics_sync(p, {}, nullptr, assoc ? SYNC_ASSOCIATED : 0, out);
+}
+
 } /* namesapce */
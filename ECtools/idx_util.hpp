@@ -33,5 +33,6 @@ class mapitable_range {
 
 extern HRESULT server_guid(IMsgStore *, GUID &);
 extern HRESULT ics_state(IMAPIProp *, bool assoc, std::string &);
+extern HRESULT ics_sync(IMAPIProp *, const std::string &state, IUnknown *importer, unsigned int flags, std::string &new_state);
 
 } /* namespace */
@@ -4,12 +4,18 @@
  */
 #include <algorithm>
 #include <chrono>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <new>
 #include <string>
 #include <utility>
 #include <vector>
 #include <cctype>
 #include <cstring>
+#include <unistd.h>
 #include <libHX/io.h>
 #include <kopano/ECLogger.h>
 #include <kopano/stringutil.h>
@@ -21,33 +27,64 @@
 
 namespace KC {
 
+/**
+ * An open writer on one store's database. Changes go into it as they come
+ * in, and are committed in batches: when enough text has been indexed, when
+ * the oldest uncommitted change reaches the batch age, or on flush.
+ */
+struct xap_writer {
+	std::mutex lock;
+	Xapian::WritableDatabase db;
+	bool open = false, broken = false;
+	size_t pending = 0, ndocs = 0;
+	time_point since{}, last_use{};
+	std::vector<std::function<void(bool)>> done;
+};
+
 class ECXapianIndexer final : public IIndexerPlugin {
 	public:
-	ECXapianIndexer(const char *index_path);
+	ECXapianIndexer(const char *index_path, size_t batch_size, unsigned int batch_secs);
+	~ECXapianIndexer();
 	virtual std::vector<std::string> extract_terms(const char *) override;
 	virtual std::vector<std::string> search(const GUID &server, const GUID &store, const std::vector<unsigned int> &folders, const FIELDTERMS &, const std::string &query, size_t limit) override;
 	virtual std::string suggest(const GUID &server, const GUID &store, const std::vector<std::string> &terms, const std::string &orig) override;
-	virtual void update_doc(const index_doc &) override;
+	virtual void update_doc(const index_doc &, bool spelling) override;
 	virtual void delete_doc(const index_doc &) override;
-	virtual void commit(const std::string &sugg) override;
+	virtual void commit(const GUID &server, const GUID &store, std::function<void(bool)> &&) override;
+	virtual void flush(bool all) override;
 	virtual void reindex(const GUID &server, const GUID &store) override;
 
 	private:
 	std::string mkpath(const GUID &server, const GUID &store) const;
+	std::shared_ptr<xap_writer> writer(const std::string &path);
+	bool open_locked(xap_writer &, const std::string &path);
+	void commit_locked(xap_writer &, const std::string &path, std::vector<std::function<void()>> &run);
+	void note_locked(xap_writer &, size_t bytes, std::vector<std::function<void()>> &run, const std::string &path);
 
 	std::string index_path;
-	std::vector<index_doc> m_updates, m_deletes;
+	size_t m_batch_size;
+	time_duration m_batch_age;
+	std::mutex m_wlock;
+	std::map<std::string, std::shared_ptr<xap_writer>> m_writers;
 };
 
-IIndexerPlugin *make_xapian_plugin(const char *path)
+IIndexerPlugin *make_xapian_plugin(const char *path, size_t batch_size,
+    unsigned int batch_secs)
 {
-	return new(std::nothrow) ECXapianIndexer(path);
+	return new(std::nothrow) ECXapianIndexer(path, batch_size, batch_secs);
 }
 
-ECXapianIndexer::ECXapianIndexer(const char *p) :
-	index_path(p)
+ECXapianIndexer::ECXapianIndexer(const char *p, size_t batch_size,
+    unsigned int batch_secs) :
+	index_path(p), m_batch_size(batch_size),
+	m_batch_age(std::chrono::seconds(batch_secs))
 {}
 
+ECXapianIndexer::~ECXapianIndexer()
+{
+	flush(true);
+}
+
 std::string ECXapianIndexer::mkpath(const GUID &server, const GUID &store) const
 {
 	return index_path + "/" + bin2hex(sizeof(server), &server) + "-" +
@@ -118,68 +155,245 @@ std::string ECXapianIndexer::suggest(const GUID &server, const GUID &store,
 	return newrig;
 }
 
-void ECXapianIndexer::update_doc(const index_doc &doc)
+static std::string sk_term(const std::string &sourcekey)
 {
-	m_updates.push_back(doc);
+	auto xk = "XK:" + bin2hex(sourcekey);
+	std::transform(&xk[3], &xk[xk.size()], &xk[3], [](char c) { return tolower(c); });
+	return xk;
 }
 
-void ECXapianIndexer::delete_doc(const index_doc &doc)
+std::shared_ptr<xap_writer> ECXapianIndexer::writer(const std::string &path)
+{
+	std::lock_guard<std::mutex> lk(m_wlock);
+	auto &w = m_writers[path];
+	if (w == nullptr)
+		w = std::make_shared<xap_writer>();
+	return w;
+}
+
+bool ECXapianIndexer::open_locked(xap_writer &w, const std::string &path)
 {
-	m_deletes.push_back(doc);
+	w.last_use = std::chrono::steady_clock::now();
+	if (w.open)
+		return true;
+	for (unsigned int tries = 50; ; --tries) {
+		try {
+			w.db = Xapian::WritableDatabase(path, Xapian::DB_CREATE_OR_OPEN);
+			w.open = true;
+			return true;
+		} catch (const Xapian::DatabaseLockError &) {
+			/* e.g. kopano-search-xapian-compact at work */
+			if (tries == 0)
+				break;
+			usleep(100000);
+		} catch (const Xapian::Error &e) {
+			ec_log_err("Xapian could not open \"%s\": %s", path.c_str(), e.get_description().c_str());
+			return false;
+		}
+	}
+	ec_log_err("Xapian could not lock \"%s\"", path.c_str());
+	return false;
 }
 
-void ECXapianIndexer::commit(const std::string &sugg)
+/**
+ * Commit what the writer has. The completion callbacks are handed back in
+ * @run, for the caller to invoke once it has dropped the writer lock. If a
+ * change could not be written since the last commit, they are told so, and
+ * the callers' sync states are not advanced past it.
+ */
+void ECXapianIndexer::commit_locked(xap_writer &w, const std::string &path,
+    std::vector<std::function<void()>> &run)
 {
-	if (m_updates.empty() && m_deletes.empty())
-		return;
 	auto t0 = std::chrono::steady_clock::now();
-	auto updates = std::move(m_updates);
-	auto deletes = std::move(m_deletes);
-	Xapian::WritableDatabase db;
-	try {
-		/* we assume here that all data is from the same store */
-		const index_doc &doc = updates.size() > 0 ? *updates.begin() : *deletes.begin();
-		db = Xapian::WritableDatabase(mkpath(doc.serverid, doc.storeid), Xapian::DB_CREATE_OR_OPEN);
-	} catch (Xapian::DatabaseError &) {
-		ec_log_err("Xapian could not open database");
-		return;
+	if (w.open && !w.broken && w.pending > 0) {
+		try {
+			w.db.commit();
+		} catch (const Xapian::Error &e) {
+			ec_log_err("Xapian commit on \"%s\" failed: %s", path.c_str(), e.get_description().c_str());
+			w.broken = true;
+		}
 	}
+	bool ok = !w.broken;
+	for (auto &f : w.done)
+		run.emplace_back(std::bind(std::move(f), ok));
+	w.done.clear();
+	if (w.broken) {
+		try {
+			w.db.close();
+		} catch (const Xapian::Error &) {
+		}
+		w.open = w.broken = false;
+	}
+	if (w.pending > 0)
+		ec_log_debug("Commit took %.2f seconds (%zu items)",
+			dur2dbl(decltype(t0)::clock::now() - t0), w.ndocs);
+	w.pending = w.ndocs = 0;
+	w.since = {};
+}
+
+void ECXapianIndexer::note_locked(xap_writer &w, size_t bytes,
+    std::vector<std::function<void()>> &run, const std::string &path)
+{
+	if (w.pending == 0)
+		w.since = std::chrono::steady_clock::now();
+	w.pending += bytes;
+	++w.ndocs;
+	/* Xapian's in-memory postings take about eight times the text size. */
+	if (8 * w.pending >= m_batch_size)
+		commit_locked(w, path, run);
+}
+
+void ECXapianIndexer::update_doc(const index_doc &doc, bool spelling)
+{
+	/*
+	 * Term generation runs in the caller's thread; only the write into
+	 * the store's database is serialized.
+	 */
+	Xapian::Document xdoc;
 	Xapian::TermGenerator tg;
-	tg.set_database(db);
-	if (!sugg.empty())
-		tg.set_flags(tg.FLAG_SPELLING);
-	for (const auto &doc : updates) {
-		Xapian::Document xdoc;
-		tg.set_document(xdoc);
-		for (const auto &p : doc.items) {
-			if (p.first.compare(0, 4, "mapi") != 0)
-				continue;
-			auto v = p.second;
-			std::replace(v.begin(), v.end(), '_', ' ');
-			/* Add to full-text. Needed for spelling dictionary? */
-			tg.index_text_without_positions(v);
-			tg.index_text_without_positions(v, 1, "XM" + p.first.substr(0, 4) + ":");
+	tg.set_document(xdoc);
+	size_t bytes = 0;
+	for (const auto &p : doc.items) {
+		if (p.first.compare(0, 4, "mapi") != 0)
+			continue;
+		auto v = p.second;
+		std::replace(v.begin(), v.end(), '_', ' ');
+		/* Add to full-text. Needed for spelling dictionary? */
+		tg.index_text_without_positions(v);
+		tg.index_text_without_positions(v, 1, "XM" + p.first.substr(4) + ":");
+		bytes += v.size();
+	}
+	xdoc.add_value(0, stringify(doc.docid));
+	auto xk = sk_term(doc.sourcekey);
+	xdoc.add_term(xk);
+	xdoc.add_term("XF:" + stringify(doc.folderid));
+	xdoc.set_data(doc.data);
+
+	auto path = mkpath(doc.serverid, doc.storeid);
+	auto w = writer(path);
+	std::vector<std::function<void()>> run;
+	{
+		std::lock_guard<std::mutex> lk(w->lock);
+		if (!open_locked(*w, path)) {
+			/* Keep the sync state at the last change that made it */
+			w->broken = true;
+			return;
+		}
+		try {
+			/* Unprefixed terms are what TermGenerator's FLAG_SPELLING would add. */
+			if (spelling)
+				for (auto t = xdoc.termlist_begin(); t != xdoc.termlist_end(); ++t)
+					if (!isupper(static_cast<unsigned char>((*t)[0])))
+						w->db.add_spelling(*t, t.get_wdf());
+			w->db.replace_document(xk, xdoc);
+		} catch (const Xapian::Error &e) {
+			ec_log_err("Xapian could not index %s: %s", xk.c_str(), e.get_description().c_str());
+			w->broken = true;
+			return;
 		}
-		xdoc.add_value(0, stringify(doc.docid));
-		auto xk = "XK:" + bin2hex(sizeof(doc.sourcekey), &doc.sourcekey);
-		std::transform(&xk[3], &xk[xk.size()], &xk[3], [](char c) { return tolower(c); });
-		xdoc.add_term(xk);
-		xdoc.add_term("XF:" + stringify(doc.folderid));
-		xdoc.set_data(doc.data);
-		db.replace_document(std::move(xk), std::move(xdoc));
+		note_locked(*w, bytes, run, path);
 	}
-	for (const auto &doc : deletes) {
-		auto xk = "XK:" + bin2hex(sizeof(doc.sourcekey), &doc.sourcekey);
-		std::transform(&xk[3], &xk[xk.size()], &xk[3], [](char c) { return tolower(c); });
-		db.delete_document(xk);
+	for (auto &f : run)
+		f();
+}
+
+void ECXapianIndexer::delete_doc(const index_doc &doc)
+{
+	auto xk = sk_term(doc.sourcekey);
+	auto xf = "XF:" + stringify(doc.folderid);
+	auto path = mkpath(doc.serverid, doc.storeid);
+	auto w = writer(path);
+	std::vector<std::function<void()>> run;
+	{
+		std::lock_guard<std::mutex> lk(w->lock);
+		if (!open_locked(*w, path)) {
+			w->broken = true;
+			return;
+		}
+		try {
+			/*
+			 * A message moved to another folder keeps its sourcekey.
+			 * If that folder was synced first, the document is
+			 * already there and must stay.
+			 */
+			auto pl = w->db.postlist_begin(xk);
+			if (pl == w->db.postlist_end(xk))
+				return;
+			if (doc.folderid != 0) {
+				auto tl = w->db.termlist_begin(*pl);
+				tl.skip_to(xf);
+				if (tl == w->db.termlist_end(*pl) || *tl != xf)
+					return;
+			}
+			w->db.delete_document(xk);
+		} catch (const Xapian::Error &e) {
+			ec_log_err("Xapian could not delete %s: %s", xk.c_str(), e.get_description().c_str());
+			w->broken = true;
+			return;
+		}
+		note_locked(*w, xk.size(), run, path);
+	}
+	for (auto &f : run)
+		f();
+}
+
+void ECXapianIndexer::commit(const GUID &server, const GUID &store,
+    std::function<void(bool)> &&done)
+{
+	auto path = mkpath(server, store);
+	auto w = writer(path);
+	std::vector<std::function<void()>> run;
+	{
+		std::lock_guard<std::mutex> lk(w->lock);
+		w->done.emplace_back(std::move(done));
+		if (w->pending == 0 || std::chrono::steady_clock::now() - w->since >= m_batch_age)
+			commit_locked(*w, path, run);
+	}
+	for (auto &f : run)
+		f();
+}
+
+void ECXapianIndexer::flush(bool all)
+{
+	std::vector<std::pair<std::string, std::shared_ptr<xap_writer>>> list;
+	{
+		std::lock_guard<std::mutex> lk(m_wlock);
+		list.assign(m_writers.cbegin(), m_writers.cend());
+	}
+	auto now = std::chrono::steady_clock::now();
+	for (auto &e : list) {
+		auto &w = *e.second;
+		std::vector<std::function<void()>> run;
+		{
+			std::lock_guard<std::mutex> lk(w.lock);
+			if ((w.pending > 0 || !w.done.empty()) &&
+			    (all || now - w.since >= m_batch_age))
+				commit_locked(w, e.first, run);
+			/* Let go of stores that have gone quiet */
+			if (w.open && w.pending == 0 && w.done.empty() &&
+			    (all || now - w.last_use >= std::chrono::minutes(10))) {
+				w.db.close();
+				w.open = false;
+			}
+		}
+		for (auto &f : run)
+			f();
 	}
-	ec_log_debug("Commit took %.2f seconds (%zu items)",
-		dur2dbl(decltype(t0)::clock::now() - t0), updates.size());
 }
 
 void ECXapianIndexer::reindex(const GUID &server, const GUID &store)
 {
 	auto path = mkpath(server, store);
+	auto w = writer(path);
+	std::lock_guard<std::mutex> lk(w->lock);
+	if (w->open)
+		w->db.close();
+	w->open = w->broken = false;
+	w->pending = w->ndocs = 0;
+	/* What they were waiting for is about to be removed. */
+	for (auto &f : w->done)
+		f(false);
+	w->done.clear();
 	ec_log_info("Removing \"%s\"", path.c_str());
 	auto ret = HX_rrmdir(path.c_str());
 	if (ret < 0)
@@ -5,7 +5,12 @@
 #pragma once
 #include <kopano/zcdefs.h>
 #include <algorithm>
+#include <atomic>
+#include <functional>
 #include <list>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
 #include <vector>
 #include <utility>
@@ -35,14 +40,36 @@ template<> inline size_t GetCacheAdditionalSize(const std::string &s)
 	return MEMORY_USAGE_STRING(s);
 }
 
+template<typename MapType> class ECCache;
+
 class ECsCacheEntry {
 public:
+	ECsCacheEntry() = default;
+	/*
+	 * The LRU linkage belongs to the slot in the cache, not to the value,
+	 * so copying a value into an existing slot must leave it alone.
+	 */
+	ECsCacheEntry(const ECsCacheEntry &o) : ulLastAccess(o.ulLastAccess) {}
+	ECsCacheEntry &operator=(const ECsCacheEntry &o)
+	{
+		ulLastAccess = o.ulLastAccess;
+		return *this;
+	}
+
 	time_t ulLastAccess = 0;
+
+private:
+	ECsCacheEntry *m_lru_prev = nullptr, *m_lru_next = nullptr;
+	const void *m_lru_key = nullptr; /* points to the key in the map node */
+	/* Set by readers under a shared lock, consumed by the purge (CLOCK). */
+	std::atomic<bool> m_lru_ref{false};
+
+	template<typename MapType> friend class ECCache;
 };
 
 struct ECCacheStat {
 	std::string name;
-	uint64_t items, size, maxsize, req, hit;
+	uint64_t items, size, maxsize, req, hit, evict;
 };
 
 class KC_EXPORT ECCacheBase {
@@ -57,12 +84,13 @@ public:
 	KC_HIDDEN long MaxAge() const { return m_lMaxAge; }
 	KC_HIDDEN size_type HitCount() const { return m_ulCacheHit; }
 	KC_HIDDEN size_type ValidCount() const { return m_ulCacheValid; }
+	KC_HIDDEN size_type EvictCount() const { return m_ulCacheEvict; }
 
 	// Decrement the valid count. Used from ECCacheManger::GetCell.
 	KC_HIDDEN void DecrementValidCount()
 	{
 		assert(m_ulCacheValid >= 1);
-		--m_ulCacheValid;
+		m_ulCacheValid.fetch_sub(1, std::memory_order_relaxed);
 	}
 
 	// Call the provided callback with some statistics.
@@ -76,18 +104,25 @@ public:
 
 protected:
 	ECCacheBase(const std::string &strCachename, size_type ulMaxSize, long lMaxAge);
-	KC_HIDDEN void IncrementHitCount() { ++m_ulCacheHit; }
-	KC_HIDDEN void IncrementValidCount() { ++m_ulCacheValid; }
-	KC_HIDDEN void ClearCounters() { m_ulCacheHit = m_ulCacheValid = 0; }
+	/* Counters are atomic, as PeekCacheItem runs concurrently. */
+	KC_HIDDEN void IncrementHitCount() { m_ulCacheHit.fetch_add(1, std::memory_order_relaxed); }
+	KC_HIDDEN void IncrementValidCount() { m_ulCacheValid.fetch_add(1, std::memory_order_relaxed); }
+	KC_HIDDEN void IncrementEvictCount() { m_ulCacheEvict.fetch_add(1, std::memory_order_relaxed); }
+	KC_HIDDEN void ClearCounters() { m_ulCacheHit = 0; m_ulCacheValid = 0; m_ulCacheEvict = 0; }
 
 	const std::string	m_strCachename;
 
 private:
 	size_type		m_ulMaxSize;
 	const long			m_lMaxAge;
-	size_type m_ulCacheHit = 0, m_ulCacheValid = 0;
+	std::atomic<size_type> m_ulCacheHit{0}, m_ulCacheValid{0}, m_ulCacheEvict{0};
 };
 
+/*
+ * ECCache keeps its entries on an intrusive LRU list (most recently used
+ * at the head), so both purging and expiry work from the tail and never
+ * need to look at the whole map.
+ */
 template<typename MapType> class ECCache KC_FINAL : public ECCacheBase {
 public:
 	typedef typename MapType::key_type key_type;
@@ -96,11 +131,17 @@ public:
 	ECCache(const std::string &strCachename, size_type ulMaxSize, long lMaxAge)
 		: ECCacheBase(strCachename, ulMaxSize, lMaxAge)
 		, m_ulSize(0)
-	{ }
+	{
+		m_lru.m_lru_prev = m_lru.m_lru_next = &m_lru;
+	}
+
+	ECCache(const ECCache &) = delete;
+	ECCache &operator=(const ECCache &) = delete;
 
 	void ClearCache()
 	{
 		m_map.clear();
+		m_lru.m_lru_prev = m_lru.m_lru_next = &m_lru;
 		m_ulSize = 0;
 		ClearCounters();
 	}
@@ -124,6 +165,7 @@ public:
 
 		m_ulSize -= GetCacheAdditionalSize(iter->second);
 		m_ulSize -= GetCacheAdditionalSize(key);
+		lru_unlink(&iter->second);
 		m_map.erase(iter);
 		return erSuccess;
 	}
@@ -143,31 +185,50 @@ public:
 			// so we can't keep a value longer in the cache than the max age.
 			// If we have a non-aging cache, we need to update it,
 			// to see the oldest 5% to purge from the cache.
-			if (MaxAge() == 0)
+			if (MaxAge() == 0) {
 				iter->second.ulLastAccess = tNow;
+				lru_touch(&iter->second);
+			}
 			IncrementHitCount();
 			IncrementValidCount();
 			return erSuccess;
 		}
-		// Cache age of the cached item, if expired remove the item from the cache
 		/*
-		 * Because of templates, there is no guarantee
-		 * that m_map keeps iterators valid while
-		 * elements are deleted from it. Track them in
-		 * a separate delete list.
+		 * Aging caches never touch entries on lookup, so the LRU list
+		 * is ordered by ulLastAccess and all expired items sit at the
+		 * tail.
 		 */
-		std::vector<key_type> dl;
-
-		// Loop through all items and check
-		for (iter = m_map.begin(); iter != m_map.end(); ++iter)
-			if ((long)(tNow - iter->second.ulLastAccess) >= MaxAge())
-				dl.emplace_back(iter->first);
-		for (const auto &i : dl)
-			m_map.erase(i);
+		while (m_lru.m_lru_prev != &m_lru &&
+		       static_cast<long>(tNow - m_lru.m_lru_prev->ulLastAccess) >= MaxAge())
+			evict_tail();
 		IncrementHitCount();
 		return KCERR_NOT_FOUND;
 	}
 
+	/*
+	 * Lookup for callers that hold only a shared lock. The entry is
+	 * copied out and not modified, except for its reference bit, which
+	 * gives it a second chance on the next purge instead of moving it
+	 * to the LRU head. Expired entries are reported as not found and
+	 * left for the next exclusive operation to remove.
+	 */
+	ECRESULT PeekCacheItem(const key_type &key, mapped_type *value)
+	{
+		auto iter = m_map.find(key);
+		IncrementHitCount();
+		if (iter == m_map.cend())
+			return KCERR_NOT_FOUND;
+		if (MaxAge() != 0 &&
+		    static_cast<long>(GetProcessTime() - iter->second.ulLastAccess) >= MaxAge())
+			return KCERR_NOT_FOUND;
+		auto &ref = iter->second.m_lru_ref;
+		if (MaxAge() == 0 && !ref.load(std::memory_order_relaxed))
+			ref.store(true, std::memory_order_relaxed);
+		*value = iter->second;
+		IncrementValidCount();
+		return erSuccess;
+	}
+
 	ECRESULT GetCacheRange(const key_type &lower, const key_type &upper, std::list<typename MapType::value_type> *values)
 	{
 		auto iLower = m_map.lower_bound(lower);
@@ -188,6 +249,7 @@ public:
 			m_ulSize -= GetCacheAdditionalSize(result.first->second);
 			result.first->second = value;
 			result.first->second.ulLastAccess = GetProcessTime();
+			lru_touch(&result.first->second);
 			// Since there is a very small chance that we need to purge the cache, we're skipping that here.
 			return erSuccess;
 		}
@@ -195,6 +257,7 @@ public:
 		m_ulSize += GetCacheAdditionalSize(value);
 		m_ulSize += GetCacheAdditionalSize(key);
 		result.first->second.ulLastAccess = GetProcessTime();
+		lru_link(&result.first->second, &result.first->first);
 		UpdateCache(0.05F);
 		return erSuccess;
 	}
@@ -216,12 +279,14 @@ public:
 			m_ulSize -= GetCacheAdditionalSize(result.first->second);
 			result.first->second = std::move(value);
 			result.first->second.ulLastAccess = GetProcessTime();
+			lru_touch(&result.first->second);
 			return erSuccess;
 		}
 		/* New entry */
 		m_ulSize += GetCacheAdditionalSize(result.first->second);
 		m_ulSize += GetCacheAdditionalSize(key);
 		result.first->second.ulLastAccess = GetProcessTime();
+		lru_link(&result.first->second, &result.first->first);
 		UpdateCache(0.05);
 		return erSuccess;
 	}
@@ -235,34 +300,62 @@ public:
 	}
 
 private:
-	ECRESULT PurgeCache(float ratio)
+	void lru_link(ECsCacheEntry *e, const key_type *key)
 	{
-		std::vector<decltype(m_map.begin())> lstEntries;
+		e->m_lru_key = key;
+		e->m_lru_prev = &m_lru;
+		e->m_lru_next = m_lru.m_lru_next;
+		m_lru.m_lru_next->m_lru_prev = e;
+		m_lru.m_lru_next = e;
+	}
 
-		/*
-		 * Creating a list of iterators requires that .erase() is
-		 * non-invalidating, which limits ECCache<> to be used with
-		 * (unordered_)map only.
-		 */
-		for (auto i = m_map.begin(); i != m_map.end(); ++i)
-			lstEntries.emplace_back(i);
-		std::sort(lstEntries.begin(), lstEntries.end(),
-			[](const auto &i, const auto &j) { return i->second.ulLastAccess < j->second.ulLastAccess; });
-		// We now have a list of all cache items, sorted by access time, (oldest first)
+	void lru_unlink(ECsCacheEntry *e)
+	{
+		e->m_lru_prev->m_lru_next = e->m_lru_next;
+		e->m_lru_next->m_lru_prev = e->m_lru_prev;
+		e->m_lru_prev = e->m_lru_next = nullptr;
+	}
+
+	void lru_touch(ECsCacheEntry *e)
+	{
+		if (m_lru.m_lru_next == e)
+			return;
+		auto key = static_cast<const key_type *>(e->m_lru_key);
+		lru_unlink(e);
+		lru_link(e, key);
+	}
+
+	void evict_tail()
+	{
+		auto e = m_lru.m_lru_prev;
+		/* Copy the key; it lives in the node that is about to go away. */
+		key_type key = *static_cast<const key_type *>(e->m_lru_key);
+		RemoveCacheItem(key);
+		IncrementEvictCount();
+	}
+
+	ECRESULT PurgeCache(float ratio)
+	{
 		size_t shrinkto = m_map.size() - m_map.size() * ratio;
 
 		/*
-		 * Remove [ratio] % of all cache entries, and then some more
-		 * until the size constraint is met.
+		 * Remove [ratio] % of all cache entries (oldest first), and
+		 * then some more until the size constraint is met. Entries
+		 * read through PeekCacheItem since the last purge are moved
+		 * back to the head once. Aging caches must stay ordered by
+		 * ulLastAccess, so they ignore the reference bit.
 		 */
-		for (auto iterMap : lstEntries) {
-			m_ulSize -= GetCacheAdditionalSize(iterMap->second);
-			m_ulSize -= GetCacheAdditionalSize(iterMap->first);
-			m_map.erase(iterMap);
+		while (m_lru.m_lru_prev != &m_lru) {
+			auto e = m_lru.m_lru_prev;
+			if (e->m_lru_ref.exchange(false, std::memory_order_relaxed) &&
+			    MaxAge() == 0) {
+				lru_touch(e);
+				continue;
+			}
+			evict_tail();
 			if (m_map.size() <= shrinkto && Size() <= MaxSize())
 				break;
 		}
-
 		return erSuccess;
 	}
 
@@ -284,7 +377,140 @@ private:
 	}
 
 	MapType m_map;
+	ECsCacheEntry m_lru; /* list head: next is newest, prev is oldest */
 	size_type			m_ulSize;
 };
 
+/*
+ * A set of independently locked ECCache instances, with the entry's key
+ * selecting the shard. Lookups that hand out pointers into the cache
+ * (GetCacheItem) require the caller to hold the shard lock obtained from
+ * lock(key) for as long as the pointer is used; all other operations lock
+ * internally.
+ *
+ * ReadCacheItem, which requires a shared mutex type, copies the entry out
+ * under a shared lock (unless disabled with SetSharedReads), so concurrent
+ * readers of the same shard do not serialize.
+ */
+template<typename MapType, typename Mutex = std::recursive_mutex>
+class ECShardedCache KC_FINAL {
+public:
+	typedef typename MapType::key_type key_type;
+	typedef typename MapType::mapped_type mapped_type;
+	typedef ECCacheBase::size_type size_type;
+
+	ECShardedCache(const std::string &name, size_type maxsize, long maxage, unsigned int nshards = 16) :
+		m_name(name), m_nshards(std::max(nshards, 1U))
+	{
+		m_shards.reserve(m_nshards);
+		for (unsigned int i = 0; i < m_nshards; ++i)
+			m_shards.emplace_back(new shard(name + "." + std::to_string(i), maxsize / m_nshards, maxage));
+	}
+
+	std::unique_lock<Mutex> lock(const key_type &key) { return std::unique_lock<Mutex>(get_shard(key).mtx); }
+
+	/* Caller must hold lock(key). */
+	ECRESULT GetCacheItem(const key_type &key, mapped_type **value)
+	{
+		return get_shard(key).cache.GetCacheItem(key, value);
+	}
+
+	ECRESULT ReadCacheItem(const key_type &key, mapped_type *value)
+	{
+		auto &s = get_shard(key);
+		if (m_shared_reads) {
+			std::shared_lock<Mutex> l(s.mtx);
+			return s.cache.PeekCacheItem(key, value);
+		}
+		std::lock_guard<Mutex> l(s.mtx);
+		mapped_type *p;
+		auto er = s.cache.GetCacheItem(key, &p);
+		if (er == erSuccess)
+			*value = *p;
+		return er;
+	}
+
+	ECRESULT AddCacheItem(const key_type &key, mapped_type &&value)
+	{
+		auto &s = get_shard(key);
+		std::lock_guard<Mutex> l(s.mtx);
+		return s.cache.AddCacheItem(key, std::move(value));
+	}
+
+	ECRESULT RemoveCacheItem(const key_type &key)
+	{
+		auto &s = get_shard(key);
+		std::lock_guard<Mutex> l(s.mtx);
+		return s.cache.RemoveCacheItem(key);
+	}
+
+	/* Caller must hold lock(key). */
+	void AddToSize(const key_type &key, int64_t delta) { get_shard(key).cache.AddToSize(delta); }
+	void DecrementValidCount(const key_type &key) { get_shard(key).cache.DecrementValidCount(); }
+
+	void ClearCache()
+	{
+		for (auto &s : m_shards) {
+			std::lock_guard<Mutex> l(s->mtx);
+			s->cache.ClearCache();
+		}
+	}
+
+	void SetMaxSize(size_type z)
+	{
+		for (auto &s : m_shards) {
+			std::lock_guard<Mutex> l(s->mtx);
+			s->cache.SetMaxSize(z / m_nshards);
+		}
+	}
+
+	/* Only to be changed before the cache is used by multiple threads. */
+	void SetSharedReads(bool v) { m_shared_reads = v; }
+	size_type MaxSize() const { return m_shards[0]->cache.MaxSize() * m_nshards; }
+	unsigned int ShardCount() const { return m_nshards; }
+
+	/* Totals over all shards */
+	ECCacheStat get_stats() const
+	{
+		ECCacheStat t{m_name, 0, 0, 0, 0, 0, 0};
+		for (const auto &s : get_shard_stats()) {
+			t.items += s.items;
+			t.size += s.size;
+			t.maxsize += s.maxsize;
+			t.req += s.req;
+			t.hit += s.hit;
+			t.evict += s.evict;
+		}
+		return t;
+	}
+
+	std::vector<ECCacheStat> get_shard_stats() const
+	{
+		std::vector<ECCacheStat> v;
+		v.reserve(m_nshards);
+		for (const auto &s : m_shards) {
+			std::lock_guard<Mutex> l(s->mtx);
+			v.emplace_back(s->cache.get_stats());
+		}
+		return v;
+	}
+
+private:
+	struct shard {
+		shard(const std::string &n, size_type z, long age) : cache(n, z, age) {}
+		mutable Mutex mtx;
+		ECCache<MapType> cache;
+	};
+
+	shard &get_shard(const key_type &key) const
+	{
+		return *m_shards[std::hash<key_type>()(key) % m_nshards];
+	}
+
+	const std::string m_name;
+	const unsigned int m_nshards;
+	bool m_shared_reads = true;
+	std::vector<std::unique_ptr<shard>> m_shards;
+};
+
 } /* namespace */
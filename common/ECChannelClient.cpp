@@ -48,15 +48,16 @@ ECRESULT ECChannelClient::DoCmd(const std::string &strCommand, std::vector<std::
 	if (er != erSuccess)
 		return er;
 	er = m_lpChannel->HrWriteLine(strCommand);
-	if (er != erSuccess)
-		return er;
-	er = m_lpChannel->HrSelect(m_ulTimeout);
-	if (er != erSuccess)
-		return er;
+	if (er == erSuccess)
+		er = m_lpChannel->HrSelect(m_ulTimeout);
 	// @todo, should be able to read more than 4MB of results
-	er = m_lpChannel->HrReadLine(strResponse, 4*1024*1024);
-	if (er != erSuccess)
+	if (er == erSuccess)
+		er = m_lpChannel->HrReadLine(strResponse, 4*1024*1024);
+	if (er != erSuccess) {
+		/* Out of step with the peer; the next command reconnects */
+		m_lpChannel.reset();
 		return er;
+	}
 
 	lstResponse = tokenize(strResponse, m_strTokenizer);
 	if (!lstResponse.empty() && lstResponse.front() == "OK")
@@ -66,6 +67,17 @@ ECRESULT ECChannelClient::DoCmd(const std::string &strCommand, std::vector<std::
 	return erSuccess;
 }
 
+/**
+ * Check a connection that was kept open between commands. If the peer has
+ * hung up meanwhile (or sent something unasked), the channel is closed, so
+ * that the next command connects anew.
+ */
+void ECChannelClient::Revalidate()
+{
+	if (m_lpChannel != nullptr && m_lpChannel->HrSelect(0) != MAPI_E_TIMEOUT)
+		m_lpChannel.reset();
+}
+
 ECRESULT ECChannelClient::Connect()
 {
 	if (m_lpChannel)
@@ -17,6 +17,7 @@ class KC_EXPORT ECChannelClient {
 public:
 	ECChannelClient(const char *szPath, const char *szTokenizer);
 	ECRESULT DoCmd(const std::string &strCommand, std::vector<std::string> &lstResponse);
+	void Revalidate();
 
 protected:
 	ECRESULT Connect();
@@ -22,6 +22,8 @@ public:
 	ECRESULT Write(const void *lpBuf, size_type cbBuf, unsigned int ulTimeoutMs, size_type *lpcbWritten);
 	ECRESULT Read(void *lpBuf, size_type cbBuf, unsigned int ulTimeoutMs, size_type *lpcbRead);
 	ECRESULT Close(close_flags flags);
+	/* Empty and reopen, for reuse once both ends are done with it */
+	void Reset();
 	KC_HIDDEN ECRESULT Flush();
 	KC_HIDDEN bool IsClosed(unsigned int flags) const;
 	KC_HIDDEN bool IsEmpty() const { return m_storage.empty(); }
@@ -541,6 +541,13 @@ ECRESULT ECFifoBuffer::Close(close_flags flags)
 	return erSuccess;
 }
 
+void ECFifoBuffer::Reset()
+{
+	scoped_lock locker(m_hMutex);
+	m_storage.clear();
+	m_bReaderClosed = m_bWriterClosed = false;
+}
+
 /**
  * Wait for the stream to be flushed
  *
@@ -8,6 +8,7 @@
 #include <memory>
 #include <mutex>
 #include <string>
+#include <thread>
 #include <utility>
 #include <cerrno>
 #include <csignal>
@@ -30,6 +31,13 @@
 
 namespace KC {
 
+/* How long surplus idle threads stay around in work-stealing mode */
+static constexpr auto tp_linger = std::chrono::seconds(1);
+
+/* Pool and home queue of the current worker thread, if any */
+static thread_local const ECThreadPool *tl_pool;
+static thread_local size_t tl_queue;
+
 /**
  * Represents the watchdog thread. This monitors the pool and
  * acts when needed.
@@ -110,6 +118,9 @@ void *ECWatchdog::watcher(void *param)
 ECThreadPool::ECThreadPool(const std::string &pname, unsigned int spares) :
 	m_poolname(pname)
 {
+	auto nq = std::max(1U, std::thread::hardware_concurrency());
+	for (unsigned int i = 0; i < nq; ++i)
+		m_queues.emplace_back(new work_queue);
 	set_thread_count(spares);
 }
 
@@ -127,6 +138,18 @@ void ECThreadPool::enable_watchdog(bool e, std::shared_ptr<ECConfig> cfg)
 		m_watchdog = make_unique_nt<ECWatchdog>(std::move(cfg), this);
 }
 
+/**
+ * Switch between the shared FIFO list and the per-worker queues. Tasks
+ * already queued are still picked up after switching.
+ * @grow_age:	in work-stealing mode, a task that waited longer than this
+ *		causes an extra thread to be started (up to tmax)
+ */
+void ECThreadPool::enable_work_stealing(bool e, time_duration grow_age)
+{
+	m_grow_age = grow_age.count();
+	m_steal = e;
+}
+
 /**
  * Queue a task object on the threadpool instance.
  * @param[in]	lpTask			The task object to queue.
@@ -141,6 +164,29 @@ bool ECThreadPool::enqueue(ECTask *lpTask, bool bTakeOwnership,
 	STaskInfo sTaskInfo;
 	sTaskInfo.lpTask = lpTask;
 	sTaskInfo.bDelete = bTakeOwnership;
+	if (m_steal) {
+		/* Workers enqueueing follow-up work keep it on their own queue. */
+		auto &q = *m_queues[tl_pool == this ? tl_queue :
+		          m_next_queue++ % m_queues.size()];
+		/*
+		 * m_pending goes up before the push and m_idle is checked after
+		 * it; a worker about to sleep bumps m_idle before it checks
+		 * m_pending. Either side thus sees the other.
+		 */
+		++m_pending;
+		ulock_normal ql(q.mtx);
+		sTaskInfo.enq_stamp = time_point::clock::now();
+		if (enqtime != nullptr)
+			*enqtime = sTaskInfo.enq_stamp;
+		q.tasks.emplace_back(std::move(sTaskInfo));
+		ql.unlock();
+		if (m_idle > 0) {
+			ulock_normal locker(m_hMutex);
+			m_hCondition.notify_one();
+			joinTerminated(locker);
+		}
+		return true;
+	}
 	ulock_normal locker(m_hMutex);
 	sTaskInfo.enq_stamp = time_point::clock::now();
 	if (enqtime != nullptr)
@@ -154,14 +200,24 @@ bool ECThreadPool::enqueue(ECTask *lpTask, bool bTakeOwnership,
 time_duration ECThreadPool::front_item_age() const
 {
 	auto now = std::chrono::steady_clock::now();
-	scoped_lock lock(m_hMutex);
-	return m_listTasks.empty() ? time_duration(0) : now - m_listTasks.front().enq_stamp;
+	auto oldest = now;
+	ulock_normal lock(m_hMutex);
+	if (!m_listTasks.empty())
+		oldest = m_listTasks.front().enq_stamp;
+	lock.unlock();
+	if (m_pending > 0)
+		for (const auto &q : m_queues) {
+			scoped_lock ql(q->mtx);
+			if (!q->tasks.empty())
+				oldest = std::min(oldest, q->tasks.front().enq_stamp);
+		}
+	return now - oldest;
 }
 
 size_t ECThreadPool::queue_length() const
 {
 	scoped_lock lk(m_hMutex);
-	return m_listTasks.size();
+	return m_listTasks.size() + m_pending;
 }
 
 void ECThreadPool::thread_counts(size_t *active, size_t *idle) const
@@ -198,6 +254,57 @@ void ECThreadPool::add_extra_thread()
 	ulock_normal lk(m_hMutex);
 	if (m_setThreads.size() < m_threads_max)
 		create_thread_unlocked();
+	joinTerminated(lk);
+}
+
+/**
+ * Work-stealing mode sizing: start another thread when a task has been
+ * waiting for longer than the grow age and nobody is idle. Attempts are
+ * spaced by a quarter of the grow age so a backlog does not hammer the
+ * pool mutex.
+ */
+void ECThreadPool::maybe_grow(const STaskInfo &ti)
+{
+	auto now = time_point::clock::now();
+	time_duration age(m_grow_age.load());
+	if (!m_steal || m_idle > 0 || age.count() == 0 ||
+	    now - ti.enq_stamp <= age)
+		return;
+	auto last = m_last_grow.load();
+	if (now.time_since_epoch().count() - last < age.count() / 4 ||
+	    !m_last_grow.compare_exchange_strong(last, now.time_since_epoch().count()))
+		return;
+	add_extra_thread();
+}
+
+/**
+ * Pop a task from the per-worker queues: the caller's own queue first, then
+ * the others. The first round skips queues that are busy; the second does
+ * not, so that a task is not missed.
+ */
+bool ECThreadPool::steal_task(STaskInfo *lpsTaskInfo)
+{
+	auto nq = m_queues.size();
+	auto home = tl_pool == this ? tl_queue : 0;
+	for (unsigned int round = 0; round < 2; ++round) {
+		for (size_t i = 0; i < nq; ++i) {
+			auto &q = *m_queues[(home + i) % nq];
+			ulock_normal ql(q.mtx, std::defer_lock);
+			if (round == 0 && i > 0) {
+				if (!ql.try_lock())
+					continue;
+			} else {
+				ql.lock();
+			}
+			if (q.tasks.empty())
+				continue;
+			*lpsTaskInfo = std::move(q.tasks.front());
+			q.tasks.pop_front();
+			--m_pending;
+			return true;
+		}
+	}
+	return false;
 }
 
 /**
@@ -269,20 +376,28 @@ bool ECThreadPool::getNextTask(STaskInfo *lpsTaskInfo, ulock_normal &locker)
 {
 	assert(locker.owns_lock());
 	assert(lpsTaskInfo != NULL);
-	bool bTerminate = false;
+	bool bTerminate = false, lingered = false;
 
+ retry:
 	/*
 	 * If "hard" termination requests are pending, heed that right away.
 	 * Else enter the idle loop - in which "soft" termination requests are
 	 * checked for.
 	 */
-	while (!(bTerminate = m_ulTermReq > 0) && m_listTasks.empty()) {
+	++m_idle;
+	while (!(bTerminate = m_ulTermReq > 0) && m_listTasks.empty() && m_pending == 0) {
 		if (m_setThreads.size() > m_threads_spares) {
-			bTerminate = ++m_ulTermReq;
-			break;
+			if (!m_steal || lingered) {
+				bTerminate = ++m_ulTermReq;
+				break;
+			}
+			lingered = true;
+			m_hCondition.wait_for(locker, tp_linger);
+			continue;
 		}
 		m_hCondition.wait(locker);
 	}
+	--m_idle;
 
 	if (bTerminate) {
 		pthread_t self = pthread_self();
@@ -296,6 +411,15 @@ bool ECThreadPool::getNextTask(STaskInfo *lpsTaskInfo, ulock_normal &locker)
 		return false;
 	}
 
+	if (m_listTasks.empty()) {
+		locker.unlock();
+		auto ok = steal_task(lpsTaskInfo);
+		locker.lock();
+		if (ok)
+			return true;
+		/* Someone else got it first */
+		goto retry;
+	}
 	*lpsTaskInfo = m_listTasks.front();
 	m_listTasks.pop_front();
 	return true;
@@ -331,6 +455,8 @@ void* ECThreadPool::threadFunc(void *lpVoid)
 	auto worker = static_cast<ECThreadWorker *>(lpVoid);
 	auto lpPool = worker->m_pool;
 	set_thread_name(pthread_self(), (lpPool->m_poolname + "/idle").c_str());
+	tl_pool = lpPool;
+	tl_queue = lpPool->m_next_queue++ % lpPool->m_queues.size();
 	if (!worker->init())
 		return nullptr;
 
@@ -338,13 +464,20 @@ void* ECThreadPool::threadFunc(void *lpVoid)
 		STaskInfo sTaskInfo{};
 		bool bResult = false;
 
-		ulock_normal locker(lpPool->m_hMutex);
-		bResult = lpPool->getNextTask(&sTaskInfo, locker);
-		if (bResult)
+		if (lpPool->m_ulTermReq == 0 && lpPool->m_pending > 0 &&
+		    lpPool->steal_task(&sTaskInfo)) {
+			/* Fast path, without the pool mutex */
 			++lpPool->m_active;
-		locker.unlock();
-		if (!bResult)
-			break;
+		} else {
+			ulock_normal locker(lpPool->m_hMutex);
+			bResult = lpPool->getNextTask(&sTaskInfo, locker);
+			if (bResult)
+				++lpPool->m_active;
+			locker.unlock();
+			if (!bResult)
+				break;
+		}
+		lpPool->maybe_grow(sTaskInfo);
 
 		assert(sTaskInfo.lpTask != NULL);
 		sTaskInfo.lpTask->m_worker = worker;
@@ -171,6 +171,7 @@ ECCacheStat ECCacheBase::get_stats() const
 	s.maxsize = m_ulMaxSize;
 	s.req = HitCount();
 	s.hit = ValidCount();
+	s.evict = EvictCount();
 	return s;
 }
 
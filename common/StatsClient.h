@@ -40,6 +40,9 @@ enum SCName {
 	SCN_LDAP_SEARCH, SCN_LDAP_SEARCH_FAILED, SCN_LDAP_SEARCH_TIME, SCN_LDAP_SEARCH_TIME_MAX,
 	/* indexer stats */
 	SCN_INDEXER_SEARCH_ERRORS, SCN_INDEXER_SEARCH_MAX, SCN_INDEXER_SEARCH_AVG, SCN_INDEXED_SEARCHES, SCN_DATABASE_SEARCHES,
+	/* S3 attachment storage stats */
+	SCN_S3_GET, SCN_S3_GET_TIME, SCN_S3_GET_TIME_MAX, SCN_S3_PUT, SCN_S3_PUT_TIME, SCN_S3_PUT_TIME_MAX,
+	SCN_S3_FAILED, SCN_S3_CACHE_HITS, SCN_S3_CACHE_MISSES,
 
 	SCN_DAGENT_ATTACHMENT_COUNT,
 	SCN_DAGENT_AUTOACCEPT,
@@ -66,6 +69,7 @@ enum SCName {
 	SCN_DAGENT_TO_SERVER,
 	SCN_DAGENT_TO_SINGLE_RECIP,
 	SCN_DAGENT_DELIVERY_PROCESSING_TIME,
+	SCN_DAGENT_FANOUT,
 	SCN_LMTP_BAD_RECIP_ADDR,
 	SCN_LMTP_BAD_SENDER_ADDRESS,
 	SCN_LMTP_INTERNAL_ERROR,
@@ -89,6 +93,9 @@ enum SCName {
 	SCN_RULES_NRULES,
 	SCN_RULES_REPLY_AND_OOF,
 	SCN_RULES_TAG,
+	SCN_RULES_COMPILE,
+	SCN_RULES_CACHE_HIT,
+	SCN_RULES_EVAL_TIME,
 	SCN_SPOOLER_ABNORM_TERM,
 	SCN_SPOOLER_BATCH_COUNT,
 	SCN_SPOOLER_BATCH_INVOKES,
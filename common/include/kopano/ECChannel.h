@@ -46,6 +46,7 @@ public:
 	HRESULT HrSelect(int seconds);
 	KC_HIDDEN void SetIPAddress(const struct sockaddr *, size_t);
 	KC_HIDDEN const char *peer_addr() const { return peer_atxt; }
+	KC_HIDDEN int get_fd() const { return fd; }
 	int peer_is_local() const;
 	KC_HIDDEN bool UsingSsl() const { return lpSSL != nullptr; }
 	KC_HIDDEN bool sslctx() const { return lpCTX != nullptr; }
@@ -5,10 +5,12 @@
 #pragma once
 #include <atomic>
 #include <condition_variable>
+#include <deque>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <vector>
 #include <pthread.h>
 #include <list>
 #include <kopano/zcdefs.h>
@@ -32,9 +34,17 @@ class KC_EXPORT ECThreadWorker {
 };
 
 /**
- * This class represents a thread pool with a fixed amount of worker threads.
- * The amount of workers can be modified at run time, but is not automatically
- * adjusted based on the task queue length or age.
+ * This class represents a thread pool with a variable amount of worker threads.
+ * The amount of workers can be modified at run time. With the watchdog, or in
+ * work-stealing mode, it is also adjusted based on the task queue age.
+ *
+ * By default, all tasks go into one FIFO list guarded by the pool mutex. In
+ * work-stealing mode (enable_work_stealing), tasks are spread over a set of
+ * per-worker queues, each with its own lock; a worker drains its own queue
+ * first and then steals from the others, so that enqueue and dequeue do not
+ * serialize on the pool mutex. Idle threads above the spare count then linger
+ * for a while before exiting, and a worker picking up a task that has waited
+ * longer than the grow age starts another thread (up to tmax).
  */
 class KC_EXPORT ECThreadPool {
 	protected:
@@ -47,10 +57,16 @@ class KC_EXPORT ECThreadPool {
 	typedef std::map<pthread_t, std::shared_ptr<ECThreadWorker>> ThreadSet;
 	typedef std::list<STaskInfo> TaskList;
 
+	struct work_queue {
+		std::mutex mtx;
+		std::deque<STaskInfo> tasks;
+	};
+
 public:
 	ECThreadPool(const std::string &name, unsigned int spares);
 	virtual ~ECThreadPool();
 	void enable_watchdog(bool, std::shared_ptr<ECConfig> = {});
+	void enable_work_stealing(bool, time_duration grow_age = std::chrono::milliseconds(500));
 	bool enqueue(ECTask *lpTask, bool bTakeOwnership = false, time_point *enq_time = nullptr);
 	void set_thread_count(unsigned int spares, unsigned int tmax = 0, bool wait = false);
 	void add_extra_thread();
@@ -64,6 +80,8 @@ public:
 	virtual std::unique_ptr<ECThreadWorker> make_worker();
 	KC_HIDDEN size_t threadCount() const; /* unlocked variant */
 	KC_HIDDEN bool getNextTask(STaskInfo *, std::unique_lock<std::mutex> &);
+	KC_HIDDEN bool steal_task(STaskInfo *);
+	KC_HIDDEN void maybe_grow(const STaskInfo &);
 	KC_HIDDEN void joinTerminated(std::unique_lock<std::mutex> &);
 	KC_HIDDEN HRESULT create_thread_unlocked();
 	KC_HIDDEN static void *threadFunc(void *);
@@ -76,6 +94,11 @@ public:
 	mutable std::condition_variable m_hCondTaskDone;
 	std::atomic<size_t> m_active{0}, m_ulTermReq{0};
 	std::atomic<size_t> m_threads_spares{0}, m_threads_max{0};
+	/* work-stealing mode */
+	std::vector<std::unique_ptr<work_queue>> m_queues;
+	std::atomic<bool> m_steal{false};
+	std::atomic<size_t> m_pending{0}, m_idle{0}, m_next_queue{0};
+	std::atomic<time_duration::rep> m_grow_age{0}, m_last_grow{0};
 	std::unique_ptr<ECWatchdog> m_watchdog;
 
 	ECThreadPool(const ECThreadPool &) = delete;
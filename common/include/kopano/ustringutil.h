@@ -52,5 +52,6 @@ extern KC_EXPORT std::string createSortKeyDataFromUTF8(const char *s, int ncap,
 extern KC_EXPORT int compareSortKeys(const std::string &, const std::string &);
 extern KC_EXPORT std::string createSortKeyData(const char *s, int ncap, const ECLocale &);
 extern KC_EXPORT std::string createSortKeyData(const wchar_t *s, int ncap, const ECLocale &);
+extern KC_EXPORT void set_sortkey_cache_size(size_t);
 
 } /* namespace */
@@ -53,6 +53,9 @@ At some point we need to rewqrite these functions to do all the conversion on th
 #include <kopano/platform.h>
 #include <kopano/ustringutil.h>
 #include <kopano/CommonUtil.h>
+#include <atomic>
+#include <map>
+#include <unordered_map>
 #include <cassert>
 #include <clocale>
 #include <memory>
@@ -83,6 +86,104 @@ typedef std::unique_ptr<Collator> unique_ptr_Collator;
 
 namespace KC {
 
+/*
+ * Creating a Collator means a service lookup and a clone (or, the first
+ * time, parsing the locale's tailoring rules), all for collating what is
+ * mostly a short string. Each thread keeps the collators it has used, one
+ * per locale.
+ */
+static Collator *get_collator(const ECLocale &locale)
+{
+	static thread_local std::map<std::string, unique_ptr_Collator> cache;
+	auto &coll = cache[locale.getName()];
+	if (coll == nullptr) {
+		UErrorCode status = U_ZERO_ERROR;
+		coll.reset(Collator::createInstance(locale, status));
+		if (U_FAILURE(status))
+			coll.reset();
+	}
+	return coll.get();
+}
+
+/*
+ * Memo of sort keys for strings seen before (sender names, recurring
+ * subjects). Per thread, so no locking.
+ *
+ * A string is only remembered the second time it comes by (m_seen holds
+ * hashes of recent first sightings), since a memo insert costs about as much
+ * as collating a short string. Keys are collected in a current generation;
+ * once that holds half of sortkey_memo_limit bytes, it becomes the old
+ * generation and the previous old one is dropped. Hits in the old
+ * generation move to the current one, so recurring strings stay.
+ */
+static std::atomic<size_t> sortkey_memo_limit{0};
+
+namespace {
+
+class sortkey_memo final {
+	public:
+	const std::string *find(const std::string &k);
+	void add(const std::string &k, const std::string &v);
+
+	private:
+	void insert(std::string &&k, std::string &&v);
+
+	std::unordered_map<std::string, std::string> m_cur, m_old;
+	size_t m_size = 0;
+	size_t m_seen[4096]{};
+};
+
+}
+
+const std::string *sortkey_memo::find(const std::string &k)
+{
+	auto i = m_cur.find(k);
+	if (i != m_cur.cend())
+		return &i->second;
+	i = m_old.find(k);
+	if (i == m_old.cend())
+		return nullptr;
+	auto v = std::move(i->second);
+	m_old.erase(i);
+	insert(std::string(k), std::move(v));
+	return &m_cur.find(k)->second;
+}
+
+void sortkey_memo::add(const std::string &k, const std::string &v)
+{
+	auto h = std::hash<std::string>()(k);
+	auto &seen = m_seen[h % ARRAY_SIZE(m_seen)];
+	if (seen != h) {
+		seen = h;
+		return;
+	}
+	insert(std::string(k), std::string(v));
+}
+
+void sortkey_memo::insert(std::string &&k, std::string &&v)
+{
+	auto limit = sortkey_memo_limit.load(std::memory_order_relaxed) / 2;
+	auto z = k.size() + v.size() + 64; /* with some node overhead */
+	if (m_size + z > limit) {
+		m_old = std::move(m_cur);
+		m_cur.clear();
+		m_size = 0;
+		if (z > limit)
+			return;
+	}
+	m_cur.emplace(std::move(k), std::move(v));
+	m_size += z;
+}
+
+/**
+ * Set the number of bytes of sort keys each thread may remember
+ * (0 disables the memo).
+ */
+void set_sortkey_cache_size(size_t limit)
+{
+	sortkey_memo_limit = limit;
+}
+
 /**
  * ASCII version to find a case-insensitive string part in a
  * haystack.
@@ -260,7 +361,9 @@ int str_icompare(const char *s1, const char *s2, const ECLocale &locale)
 	assert(s1);
 	assert(s2);
 	UErrorCode status = U_ZERO_ERROR;
-	unique_ptr_Collator ptrCollator(Collator::createInstance(locale, status));
+	auto ptrCollator = get_collator(locale);
+	if (ptrCollator == nullptr)
+		return strcmp(s1, s2);
 
 	UnicodeString a = StringToUnicode(s1);
 	UnicodeString b = StringToUnicode(s2);
@@ -436,7 +539,9 @@ int wcs_icompare(const wchar_t *s1, const wchar_t *s2, const ECLocale &locale)
 	assert(s1);
 	assert(s2);
 	UErrorCode status = U_ZERO_ERROR;
-	unique_ptr_Collator ptrCollator(Collator::createInstance(locale, status));
+	auto ptrCollator = get_collator(locale);
+	if (ptrCollator == nullptr)
+		return wcscmp(s1, s2);
 
 	UnicodeString a = WCHARToUnicode(s1);
 	UnicodeString b = WCHARToUnicode(s2);
@@ -591,7 +696,9 @@ int u8_icompare(const char *s1, const char *s2, const ECLocale &locale)
 	assert(s1);
 	assert(s2);
 	UErrorCode status = U_ZERO_ERROR;
-	unique_ptr_Collator ptrCollator(Collator::createInstance(locale, status));
+	auto ptrCollator = get_collator(locale);
+	if (ptrCollator == nullptr)
+		return strcmp(s1, s2);
 
 	UnicodeString a = UTF8ToUnicode(s1);
 	UnicodeString b = UTF8ToUnicode(s2);
@@ -1010,7 +1117,9 @@ static CollationKey createSortKey(UnicodeString &&s, int nCap,
 
 	CollationKey key;
 	UErrorCode status = U_ZERO_ERROR;
-	unique_ptr_Collator ptrCollator(Collator::createInstance(locale, status));
+	auto ptrCollator = get_collator(locale);
+	if (ptrCollator == nullptr)
+		return key;
 	ptrCollator->getCollationKey(std::move(s), key, status); // Create a collation key for sorting
 	return key;
 }
@@ -1035,6 +1144,32 @@ static std::string createSortKeyData(UnicodeString &&s, int nCap,
 	return std::string(reinterpret_cast<const char *>(lpKeyData), cbKeyData);
 }
 
+/**
+ * Look up the sort key for the first @bytes of @s in the thread's memo, or
+ * have @make produce it and remember it. Only the part of the string that
+ * goes into the key is part of the memo key.
+ */
+template<typename F> static std::string memo_sortkey(char type, const void *s,
+    size_t bytes, int nCap, const ECLocale &locale, F &&make)
+{
+	if (sortkey_memo_limit.load(std::memory_order_relaxed) == 0)
+		return make();
+	static thread_local sortkey_memo memo;
+	static thread_local std::string key;
+	key.clear();
+	key += type;
+	key += std::to_string(nCap);
+	key += locale.getName();
+	key += '\0';
+	key.append(static_cast<const char *>(s), bytes);
+	auto v = memo.find(key);
+	if (v != nullptr)
+		return *v;
+	auto data = make();
+	memo.add(key, data);
+	return data;
+}
+
 /**
  * Create a locale independent blob that can be used to sort
  * strings fast. This is used when a string would be compared
@@ -1047,7 +1182,8 @@ static std::string createSortKeyData(UnicodeString &&s, int nCap,
 std::string createSortKeyData(const char *s, int nCap, const ECLocale &locale)
 {
 	assert(s != NULL);
-	return createSortKeyData(UnicodeString(s), nCap, locale);
+	return memo_sortkey('A', s, strlen(s), nCap, locale,
+	       [&]() { return createSortKeyData(UnicodeString(s), nCap, locale); });
 }
 
 /**
@@ -1061,7 +1197,11 @@ std::string createSortKeyData(const char *s, int nCap, const ECLocale &locale)
 std::string createSortKeyData(const wchar_t *s, int nCap, const ECLocale &locale)
 {
 	assert(s != NULL);
-	return createSortKeyData(WCHARToUnicode(s), nCap, locale);
+	size_t len = wcslen(s);
+	if (nCap > 1 && len > static_cast<size_t>(nCap))
+		len = nCap;
+	return memo_sortkey('W', s, len * sizeof(wchar_t), nCap, locale,
+	       [&]() { return createSortKeyData(WCHARToUnicode(s), nCap, locale); });
 }
 
 /**
@@ -1077,7 +1217,9 @@ std::string createSortKeyDataFromUTF8(const char *s, int nCap,
     const ECLocale &locale)
 {
 	assert(s != NULL);
-	return createSortKeyData(UTF8ToUnicode(s), nCap, locale);
+	return memo_sortkey('U', s, nCap > 1 ? u8_cappedbytes(s, nCap) : strlen(s),
+	       nCap, locale,
+	       [&]() { return createSortKeyData(UTF8ToUnicode(s), nCap, locale); });
 }
 
 /**
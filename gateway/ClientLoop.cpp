@@ -0,0 +1,327 @@
+/*
+ * SPDX-License-Identifier: AGPL-3.0-only
+ * Copyright 2016+, Kopano and its licensors
+ */
+#include <kopano/platform.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <kopano/ECLogger.h>
+#include <kopano/MAPIErrors.h>
+#include <kopano/hl.hpp>
+#include <kopano/memory.hpp>
+#include "ClientLoop.h"
+
+using namespace KC;
+using clk = std::chrono::steady_clock;
+
+/* Lines handled in a row for one client before the others get a turn */
+static constexpr unsigned int LOOP_BATCH = 16;
+
+struct ClientLoop::conn {
+	std::unique_ptr<ClientProto> client;
+	std::shared_ptr<ECChannel> channel;
+	bool ssl = false, greeted = false, registered = false;
+	/* Set by the poller when the client has been silent for too long */
+	bool timed_out = false;
+	clk::time_point last_active = clk::now();
+	/*
+	 * Whoever sets this (a worker, or the poller) owns the connection;
+	 * a connection without owner is in the epoll set.
+	 */
+	std::atomic<bool> busy{true};
+};
+
+class ClientLoop::task final : public ECTask {
+	public:
+	task(ClientLoop *l, conn *c) : m_loop(l), m_conn(c) {}
+
+	protected:
+	virtual void run() override { m_loop->serve(m_conn); }
+
+	private:
+	ClientLoop *m_loop;
+	conn *m_conn;
+};
+
+class ClientLoop::pool final : public ECThreadPool {
+	public:
+	pool() : ECThreadPool("gateway", 0) {}
+
+	protected:
+	class worker final : public ECThreadWorker {
+		public:
+		using ECThreadWorker::ECThreadWorker;
+		/* Steer the control signals to the main thread */
+		virtual bool init() override { kcsrv_blocksigs(); return true; }
+	};
+
+	virtual std::unique_ptr<ECThreadWorker> make_worker() override { return make_unique_nt<worker>(this); }
+};
+
+ClientLoop::ClientLoop(const std::string &host, unsigned int threads,
+    unsigned int max_threads) :
+	m_host(host), m_pool(new pool), m_last_expire(clk::now())
+{
+	/* Workers stuck in long commands make the pool grow */
+	m_pool->enable_work_stealing(true);
+	set_threads(threads, max_threads);
+}
+
+ClientLoop::~ClientLoop()
+{
+	stop();
+	/* Waits for the workers */
+	m_pool.reset();
+	if (m_epfd >= 0)
+		close(m_epfd);
+}
+
+void ClientLoop::set_threads(unsigned int threads, unsigned int max_threads)
+{
+	threads = std::max(threads, 1U);
+	m_pool->set_thread_count(threads, std::max(threads, max_threads));
+}
+
+size_t ClientLoop::size() const
+{
+	std::lock_guard<std::mutex> lk(m_lock);
+	return m_conns.size();
+}
+
+HRESULT ClientLoop::start()
+{
+	m_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (m_epfd < 0) {
+		ec_log_crit("epoll_create: %s", strerror(errno));
+		return MAPI_E_CALL_FAILED;
+	}
+	try {
+		m_poller = std::thread(&ClientLoop::poll_loop, this);
+	} catch (const std::system_error &e) {
+		ec_log_crit("Could not start the client poller: %s", e.what());
+		return MAPI_E_CALL_FAILED;
+	}
+	set_thread_name(m_poller.native_handle(), "net/poll");
+	return hrSuccess;
+}
+
+void ClientLoop::stop()
+{
+	m_quit = true;
+	if (m_poller.joinable())
+		m_poller.join();
+	/* Parked connections are closed from here, the others by their worker */
+	for (unsigned int i = 0; i < 100; ++i) {
+		std::vector<conn *> parked;
+		size_t total;
+		{
+			std::lock_guard<std::mutex> lk(m_lock);
+			total = m_conns.size();
+			for (auto c : m_conns) {
+				bool idle = false;
+				if (c->busy.compare_exchange_strong(idle, true))
+					parked.push_back(c);
+			}
+		}
+		for (auto c : parked)
+			drop(c, "BYE server shutting down");
+		if (parked.size() == total)
+			return;
+		if (i % 50 == 0)
+			ec_log_warn("Waiting for %zu connections to finish", total - parked.size());
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+	/* Break off the commands still going, so that the workers return */
+	std::lock_guard<std::mutex> lk(m_lock);
+	ec_log_warn("Forced shutdown with %zu connections left", m_conns.size());
+	for (auto c : m_conns)
+		shutdown(c->channel->get_fd(), SHUT_RDWR);
+}
+
+HRESULT ClientLoop::add(std::unique_ptr<ClientProto> &&client,
+    std::shared_ptr<ECChannel> &&ch, bool ssl)
+{
+	auto c = make_unique_nt<conn>();
+	if (c == nullptr)
+		return MAPI_E_NOT_ENOUGH_MEMORY;
+	c->client = std::move(client);
+	c->channel = std::move(ch);
+	c->ssl = ssl;
+	std::unique_ptr<task> t(new(std::nothrow) task(this, c.get()));
+	if (t == nullptr)
+		return MAPI_E_NOT_ENOUGH_MEMORY;
+	{
+		std::lock_guard<std::mutex> lk(m_lock);
+		m_conns.emplace(c.get());
+	}
+	/* The greeting (and TLS handshake) is done by a worker */
+	c.release();
+	m_pool->enqueue(t.release(), true);
+	return hrSuccess;
+}
+
+void ClientLoop::poll_loop()
+{
+	std::vector<struct epoll_event> events(256);
+
+	kcsrv_blocksigs();
+	while (!m_quit) {
+		auto n = epoll_wait(m_epfd, events.data(), events.size(), 1000);
+		if (n < 0 && errno != EINTR) {
+			ec_log_crit("epoll_wait: %s", strerror(errno));
+			break;
+		}
+		for (int i = 0; i < n; ++i) {
+			auto c = static_cast<conn *>(events[i].data.ptr);
+			/*
+			 * An armed connection can only still be owned by
+			 * park(), which lets go right after arming it.
+			 */
+			for (bool idle = false; !c->busy.compare_exchange_weak(idle, true); idle = false)
+				std::this_thread::yield();
+			/* EPOLLONESHOT has disarmed it until park() */
+			m_pool->enqueue(new task(this, c), true);
+		}
+		expire();
+	}
+}
+
+/**
+ * Close the connections of clients that were quiet for longer than their
+ * protocol allows (getTimeoutMinutes). The goodbye is sent from a worker,
+ * like everything else that might block.
+ */
+void ClientLoop::expire()
+{
+	auto now = clk::now();
+	if (now - m_last_expire < std::chrono::seconds(10))
+		return;
+	m_last_expire = now;
+
+	std::vector<conn *> expired;
+	std::lock_guard<std::mutex> lk(m_lock);
+	for (auto c : m_conns) {
+		bool idle = false;
+		if (!c->busy.compare_exchange_strong(idle, true))
+			continue;
+		if (now - c->last_active < std::chrono::minutes(c->client->getTimeoutMinutes())) {
+			/* Still armed; events are only collected by this thread */
+			c->busy = false;
+			continue;
+		}
+		epoll_ctl(m_epfd, EPOLL_CTL_DEL, c->channel->get_fd(), nullptr);
+		c->registered = false;
+		c->timed_out = true;
+		expired.push_back(c);
+	}
+	for (auto c : expired)
+		m_pool->enqueue(new task(this, c), true);
+}
+
+/**
+ * Runs on a worker: handles the lines the client has sent (or the
+ * greeting, or a timeout), and parks the connection again.
+ *
+ * A line that has only partly arrived is waited for, as in the threaded
+ * model; clients send their commands whole, so this is short.
+ */
+void ClientLoop::serve(conn *c)
+{
+	if (c->timed_out) {
+		// close idle first, so we don't have a race condition with the channel
+		c->client->HrCloseConnection("BYE Connection closed because of timeout");
+		ec_log_err("Connection closed because of timeout");
+		return drop(c);
+	}
+	if (!c->greeted) {
+		c->greeted = true;
+		if (c->ssl && c->channel->HrEnableTLS() != hrSuccess) {
+			ec_log_err("Unable to negotiate SSL connection with %s", c->channel->peer_addr());
+			return drop(c);
+		}
+		HRESULT hr;
+		try {
+			hr = c->client->HrSendGreeting(m_host);
+		} catch (const KMAPIError &e) {
+			hr = e.code();
+		}
+		if (hr != hrSuccess)
+			return drop(c);
+		return park(c);
+	}
+
+	std::string line;
+	bool more = false;
+	for (unsigned int n = 0; n < LOOP_BATCH; ++n) {
+		auto hr = c->channel->HrReadLine(line);
+		if (hr != hrSuccess) {
+			if (errno)
+				ec_log_err("Failed to read line: %s", strerror(errno));
+			else
+				ec_log_err("Client disconnected");
+			return drop(c);
+		}
+		if (m_quit)
+			return drop(c, "BYE server shutting down");
+		if (c->client->HrProcessLine(line) != hrSuccess)
+			return drop(c);
+		/* Anything more there already, or decrypted and buffered? */
+		more = c->channel->HrSelect(0) == hrSuccess;
+		if (!more)
+			break;
+	}
+	c->last_active = clk::now();
+	if (!more)
+		return park(c);
+	/*
+	 * Back of the queue, behind the other clients. Data already read
+	 * into the TLS buffer would not wake up epoll.
+	 */
+	m_pool->enqueue(new task(this, c), true);
+}
+
+void ClientLoop::park(conn *c)
+{
+	if (m_quit)
+		return drop(c, "BYE server shutting down");
+
+	struct epoll_event ev{};
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+	ev.data.ptr = c;
+	auto op = c->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	if (epoll_ctl(m_epfd, op, c->channel->get_fd(), &ev) != 0) {
+		auto err = errno;
+		ec_log_err("Could not wait for client %s: %s", c->channel->peer_addr(), strerror(err));
+		return drop(c);
+	}
+	c->registered = true;
+	/* From here on, c belongs to the poller (or expire/stop) */
+	c->busy = false;
+}
+
+void ClientLoop::drop(conn *c, const char *bye)
+{
+	std::unique_ptr<conn> own(c);
+
+	if (bye != nullptr)
+		c->client->HrCloseConnection(bye);
+	if (c->registered)
+		epoll_ctl(m_epfd, EPOLL_CTL_DEL, c->channel->get_fd(), nullptr);
+	ec_log_notice("Client %s connection closed", c->channel->peer_addr());
+	c->client->HrDone(false);	// HrDone does not send an error string to the client
+	std::lock_guard<std::mutex> lk(m_lock);
+	m_conns.erase(c);
+}
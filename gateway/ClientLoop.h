@@ -0,0 +1,64 @@
+/*
+ * SPDX-License-Identifier: AGPL-3.0-only
+ * Copyright 2016+, Kopano and its licensors
+ */
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <kopano/ECChannel.h>
+#include <kopano/ECThreadPool.h>
+#include "ClientProto.h"
+
+/**
+ * @ingroup gateway
+ * @{
+ */
+
+/**
+ * Serves client connections without a thread of their own (process_model
+ * = event). A connection waiting for its client, which includes one in
+ * IMAP IDLE, is only an entry in an epoll set. When the client sends
+ * something, the connection goes to a worker thread, which processes the
+ * lines that have arrived with the usual ClientProto calls and then parks
+ * the connection again.
+ */
+class ClientLoop final {
+	public:
+	ClientLoop(const std::string &host, unsigned int threads, unsigned int max_threads);
+	~ClientLoop();
+	HRESULT start();
+	/* Says goodbye to all clients and waits (a while) for the workers */
+	void stop();
+	/* Take over a newly accepted connection */
+	HRESULT add(std::unique_ptr<ClientProto> &&, std::shared_ptr<KC::ECChannel> &&, bool ssl);
+	void set_threads(unsigned int threads, unsigned int max_threads);
+	size_t size() const;
+
+	private:
+	struct conn;
+	class task;
+	class pool;
+
+	void poll_loop();
+	void serve(conn *);
+	void park(conn *);
+	void drop(conn *, const char *bye = nullptr);
+	void expire();
+
+	std::string m_host;
+	int m_epfd = -1;
+	std::atomic<bool> m_quit{false};
+	std::thread m_poller;
+	std::unique_ptr<pool> m_pool;
+	/* All connections, parked or not */
+	mutable std::mutex m_lock;
+	std::unordered_set<conn *> m_conns;
+	std::chrono::steady_clock::time_point m_last_expire;
+};
+
+/** @} */
@@ -0,0 +1,47 @@
+/*
+ * SPDX-License-Identifier: AGPL-3.0-only
+ * Copyright 2016+, Kopano and its licensors
+ */
+#include <kopano/platform.h>
+#include <string>
+#include <cerrno>
+#include <cstring>
+#include <kopano/ECLogger.h>
+#include <kopano/MAPIErrors.h>
+#include <kopano/hl.hpp>
+#include "ClientProto.h"
+
+using namespace KC;
+
+HRESULT ClientProto::HrProcessLine(const std::string &strInput)
+{
+	HRESULT hr = hrSuccess;
+
+	if (isContinue()) {
+		// we asked the client for more data, do not parse the buffer, but send it "to the previous command"
+		// that last part is currently only HrCmdAuthenticate(), so no difficulties here.
+		// also, PLAIN is the only supported auth method.
+		try {
+			HrProcessContinue(strInput);
+		} catch (const KMAPIError &e) {
+		}
+		// no matter what happens, we continue handling the connection.
+		return hrSuccess;
+	}
+	try {
+		/* Process IMAP command */
+		hr = HrProcessCommand(strInput);
+	} catch (const KMAPIError &e) {
+		hr = e.code();
+	}
+	if (hr == MAPI_E_NETWORK_ERROR) {
+		ec_log_err("HrProcessCommand threw KMAPIError: %s. (errno=%s)",
+			GetMAPIErrorMessage(hr), strerror(errno));
+		return hr;
+	}
+	if (hr == MAPI_E_END_OF_SESSION) {
+		ec_log_notice("gateway lost connection with storage server: remote side closed the connection.");
+		return hr;
+	}
+	return hrSuccess;
+}
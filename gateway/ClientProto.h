@@ -26,6 +26,8 @@ public:
 	virtual HRESULT HrProcessCommand(const std::string &strInput) = 0;
 	virtual HRESULT HrProcessContinue(const std::string &strInput) { return MAPI_E_NO_SUPPORT; }; // imap only
 	virtual HRESULT HrDone(bool bSendResponse) = 0;
+	/* Hand one line to HrProcessContinue or HrProcessCommand; failure means hang up */
+	HRESULT HrProcessLine(const std::string &strInput);
 
 protected:
 	std::string	m_strPath;
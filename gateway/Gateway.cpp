@@ -42,6 +42,7 @@
 #include "charset/localeutil.h"
 #include "POP3.h"
 #include "IMAP.h"
+#include "ClientLoop.h"
 #include <kopano/ecversion.h>
 #include "SSLUtil.h"
 #include <kopano/fileutil.hpp>
@@ -67,7 +68,7 @@ struct socks {
 };
 
 static bool quit = 0;
-static bool bThreads, g_dump_config;
+static bool bThreads, bEvents, g_dump_config;
 static std::atomic<bool> g_sighup_flag{false};
 static const char *szPath;
 static std::shared_ptr<ECLogger> g_lpLogger;
@@ -75,6 +76,7 @@ static std::shared_ptr<ECConfig> g_lpConfig;
 static std::atomic<int> nChildren{0};
 static std::string g_strHostString;
 static struct socks g_socks;
+static std::unique_ptr<ClientLoop> g_loop;
 
 static void gw_sigterm_async(int)
 {
@@ -110,6 +112,9 @@ static void gw_sighup_sync()
 	}
 	ec_log_get()->Reset();
 	ec_log_info("Log connection was reset");
+	if (g_loop != nullptr)
+		g_loop->set_threads(atoui(g_lpConfig->GetSetting("event_threads")),
+			atoui(g_lpConfig->GetSetting("event_max_threads")));
 }
 
 static void gw_sigchld_async(int)
@@ -220,33 +225,9 @@ static void *Handler(void *lpArg)
 			hr = MAPI_E_CALL_FAILED;
 			break;
 		}
-		if (client->isContinue()) {
-			// we asked the client for more data, do not parse the buffer, but send it "to the previous command"
-			// that last part is currently only HrCmdAuthenticate(), so no difficulties here.
-			// also, PLAIN is the only supported auth method.
-			try {
-				client->HrProcessContinue(inBuffer);
-			} catch (const KMAPIError &e) {
-			}
-			// no matter what happens, we continue handling the connection.
-			continue;
-		}
-
-		try {
-			/* Process IMAP command */
-			hr = client->HrProcessCommand(inBuffer);
-		} catch (const KMAPIError &e) {
-			hr = e.code();
-		}
-		if (hr == MAPI_E_NETWORK_ERROR) {
-			ec_log_err("HrProcessCommand threw KMAPIError: %s. (errno=%s)",
-				GetMAPIErrorMessage(hr), strerror(errno));
-			bQuit = true;
-		}
-		if (hr == MAPI_E_END_OF_SESSION) {
-			ec_log_notice("gateway lost connection with storage server: remote side closed the connection.");
+		hr = client->HrProcessLine(inBuffer);
+		if (hr != hrSuccess)
 			bQuit = true;
-		}
 	}
 exit:
 	ec_log_notice("Client %s thread exiting", lpChannel->peer_addr());
@@ -311,6 +292,8 @@ int main(int argc, char *argv[]) {
 		{ "run_as_group", "kopano" },
 		{ "pid_file", "/var/run/kopano/gateway.pid" },
 		{ "process_model", "thread" },
+		{"event_threads", "8", CONFIGSETTING_RELOADABLE},
+		{"event_max_threads", "64", CONFIGSETTING_RELOADABLE},
 		{"coredump_enabled", "systemdefault"},
 		{"pop3_listen", "*%lo:110"},
 		{"pop3s_listen", ""},
@@ -421,7 +404,9 @@ int main(int argc, char *argv[]) {
 		ec_log_err("Ignoring invalid path-setting!");
 	if (parseBool(g_lpConfig->GetSetting("bypass_auth")))
 		ec_log_warn("Gateway is started with bypass_auth=yes meaning username and password will not be checked.");
-	if (strcmp(g_lpConfig->GetSetting("process_model"), "thread") == 0) {
+	if (strcmp(g_lpConfig->GetSetting("process_model"), "event") == 0)
+		bEvents = true;
+	if (bEvents || strcmp(g_lpConfig->GetSetting("process_model"), "thread") == 0) {
 		bThreads = true;
 		g_lpLogger->SetLogprefix(LP_TID);
 	}
@@ -540,6 +525,19 @@ static HRESULT handler_client(size_t i)
 	if (hr != hrSuccess)
 		return hr_lerr(hr, "Unable to accept %s socket connection", method);
 
+	if (g_loop != nullptr) {
+		std::shared_ptr<ECChannel> lpChannel(std::move(lpHandlerArgs->lpChannel));
+		std::unique_ptr<ClientProto> client;
+		if (lpHandlerArgs->type == ST_POP3)
+			client.reset(new(std::nothrow) POP3(szPath, lpChannel, g_lpConfig));
+		else
+			client.reset(new(std::nothrow) IMAP(szPath, lpChannel, g_lpConfig));
+		if (client == nullptr)
+			return MAPI_E_NOT_ENOUGH_MEMORY;
+		ec_log_notice("Accepted %s connection from %s", method, lpChannel->peer_addr());
+		return g_loop->add(std::move(client), std::move(lpChannel), lpHandlerArgs->bUseSSL);
+	}
+
 	pthread_t tid;
 	ec_log_notice("Starting worker %s for %s request", model, method);
 	if (!bThreads) {
@@ -590,6 +588,12 @@ static HRESULT running_service(char **argv)
 	file_limit.rlim_max = KC_DESIRED_FILEDES;
 	if (setrlimit(RLIMIT_NOFILE, &file_limit) < 0)
 		ec_log_warn("setrlimit(RLIMIT_NOFILE, %d) failed, you will only be able to connect up to %d sockets. Either start the process as root, or increase user limits for open file descriptors", KC_DESIRED_FILEDES, getdtablesize());
+	/* Without a thread per client, descriptors run out first; take all we may */
+	if (bEvents && getrlimit(RLIMIT_NOFILE, &file_limit) == 0 &&
+	    file_limit.rlim_cur < file_limit.rlim_max) {
+		file_limit.rlim_cur = file_limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &file_limit);
+	}
 	unix_coredump_enable(g_lpConfig->GetSetting("coredump_enabled"));
 	auto hr = gw_listen(g_lpConfig.get());
 	if (hr != hrSuccess)
@@ -634,6 +638,16 @@ static HRESULT running_service(char **argv)
 			GetMAPIErrorMessage(hr), hr);
 		return hr;
 	}
+	if (bEvents) {
+		g_loop.reset(new(std::nothrow) ClientLoop(g_strHostString,
+			atoui(g_lpConfig->GetSetting("event_threads")),
+			atoui(g_lpConfig->GetSetting("event_max_threads"))));
+		if (g_loop == nullptr)
+			return MAPI_E_NOT_ENOUGH_MEMORY;
+		hr = g_loop->start();
+		if (hr != hrSuccess)
+			return hr;
+	}
 
 	// Mainloop
 	while (!quit) {
@@ -661,6 +675,10 @@ static HRESULT running_service(char **argv)
 	}
 
 	ec_log_always("POP3/IMAP Gateway will now exit");
+	if (g_loop != nullptr) {
+		g_loop->stop();
+		g_loop.reset();
+	}
 	// in forked mode, send all children the exit signal
 	if (!bThreads) {
 		signal(SIGTERM, SIG_IGN);
@@ -2107,7 +2107,12 @@ int IMAP::IdleAdviseCallback2(void *lpContext, unsigned int cNotif,
 				sMail.ulUid = lpNotif[i].info.tab.row.lpProps[IMAPID].Value.ul;
 
 			sMail.strFlags = lpIMAP->PropsToFlags(lpNotif[i].info.tab.row.lpProps, lpNotif[i].info.tab.row.cValues, true, false);
-			lpIMAP->lstFolderMailEIDs.emplace_back(sMail);
+			/*
+			 * UIDs only grow, so this is an append; the list must stay
+			 * in UID order for the lookups either way.
+			 */
+			lpIMAP->lstFolderMailEIDs.emplace(std::upper_bound(lpIMAP->lstFolderMailEIDs.begin(),
+				lpIMAP->lstFolderMailEIDs.end(), sMail), sMail);
 			lpIMAP->m_ulLastUid = std::max(lpIMAP->m_ulLastUid, sMail.ulUid);
 			++ulRecent;
 			break;
@@ -2133,13 +2138,16 @@ int IMAP::IdleAdviseCallback2(void *lpContext, unsigned int cNotif,
 			strFlags.clear();
 			if (lpNotif[i].info.tab.row.lpProps[IMAPID].ulPropTag != PR_EC_IMAP_ID)
 				break;
-			auto iterMail = std::find(lpIMAP->lstFolderMailEIDs.cbegin(), lpIMAP->lstFolderMailEIDs.cend(), lpNotif[i].info.tab.row.lpProps[IMAPID].Value.ul);
+			auto uid = lpNotif[i].info.tab.row.lpProps[IMAPID].Value.ul;
+			auto iterMail = std::lower_bound(lpIMAP->lstFolderMailEIDs.begin(), lpIMAP->lstFolderMailEIDs.end(), uid);
 			// not found probably means the client needs to sync
-			if (iterMail == lpIMAP->lstFolderMailEIDs.cend())
+			if (iterMail == lpIMAP->lstFolderMailEIDs.end() || iterMail->ulUid != uid)
 				break;
-			ulMailNr = iterMail - lpIMAP->lstFolderMailEIDs.cbegin();
+			ulMailNr = iterMail - lpIMAP->lstFolderMailEIDs.begin();
 			strFlags = lpIMAP->PropsToFlags(lpNotif[i].info.tab.row.lpProps, lpNotif[i].info.tab.row.cValues, iterMail->bRecent, false);
 			lpIMAP->HrResponse(RESP_UNTAGGED, stringify(ulMailNr+1) + " FETCH (FLAGS (" + strFlags + "))");
+			/* So that the next refresh does not announce it again */
+			iterMail->strFlags = std::move(strFlags);
 			break;
 		}
 		case TABLE_RELOAD:
@@ -2432,6 +2440,62 @@ void IMAP::HrResponse(const std::string &strResult, const std::string &strTag,
 		throw KMAPIError(hr);
 }
 
+/**
+ * Untagged FETCH response, of which some literals are copied from streams
+ * to the client in pieces, so that a big message is never held in full.
+ *
+ * @param[in] strHead Start of the response ("<id> FETCH (")
+ * @param[in] items Data items and values, to be separated by spaces
+ * @param[in] literals Literals to insert after their {size} item
+ */
+void IMAP::HrResponse(std::string &&strHead, const std::vector<std::string> &items,
+    const std::vector<fetch_literal> &literals)
+{
+	static constexpr size_t chunk = 64 * 1024;
+	std::unique_ptr<char[]> buf(new char[chunk]);
+	auto strText = RESP_UNTAGGED + std::move(strHead);
+	auto lit = literals.cbegin();
+	auto write = [&](const string_view &data) {
+		auto hr = lpChannel->HrWriteString(data);
+		if (hr != hrSuccess)
+			throw KMAPIError(hr);
+	};
+
+	for (size_t i = 0; i < items.size(); ++i) {
+		if (i > 0)
+			strText += " ";
+		strText += items[i];
+		if (lit == literals.cend() || lit->item != i)
+			continue;
+		ec_log_debug("> %s<%zu bytes>", strText.c_str(), lit->length);
+		write(strText);
+		strText.clear();
+
+		LARGE_INTEGER pos;
+		pos.QuadPart = lit->offset;
+		auto hr = lit->stream->Seek(pos, STREAM_SEEK_SET, nullptr);
+		for (size_t left = lit->length; hr == hrSuccess && left > 0; ) {
+			ULONG did = 0;
+			hr = lit->stream->Read(buf.get(), std::min(left, chunk), &did);
+			if (hr == hrSuccess && did == 0)
+				hr = MAPI_E_CORRUPT_DATA;
+			if (hr != hrSuccess)
+				break;
+			write(string_view(buf.get(), did));
+			left -= did;
+		}
+		if (hr != hrSuccess) {
+			/* The size has been announced; the client cannot be kept in step */
+			kc_perror("K-1581: Reading stored message for FETCH failed", hr);
+			throw KMAPIError(MAPI_E_NETWORK_ERROR);
+		}
+		++lit;
+	}
+	strText += ")";
+	ec_log_debug("> %s", strText.c_str());
+	write(strText + "\r\n");
+}
+
 /**
  * Remove \Deleted marked message from current selected folder. Only
  * response in case of an error.
@@ -2733,6 +2797,10 @@ bool IMAP::IsSpecialFolder(ULONG cbEntryID, ENTRYID *lpEntryID,
 /**
  * Make a list of all mails in the current selected folder.
  *
+ * On a refresh, the known mails are matched against the contents table
+ * (both are sorted on UID) with only the flag columns set; entryids and
+ * instance keys are only read for the mails that are new.
+ *
  * @param[in] bInitialLoad Create a new clean list of mails (false to append only)
  * @param[in] bResetRecent Update the value of PR_EC_IMAP_MAX_ID for this folder
  * @param[out] lpulUnseen The number of unread emails in this folder
@@ -2742,13 +2810,10 @@ bool IMAP::IsSpecialFolder(ULONG cbEntryID, ENTRYID *lpEntryID,
  */
 HRESULT IMAP::HrRefreshFolderMails(bool bInitialLoad, bool bResetRecent, unsigned int *lpulUnseen, ULONG *lpulUIDValidity) {
 	object_ptr<IMAPIFolder> folder;
-	int n = 0;
 	SMail sMail;
-	bool bNewMail = false;
 	enum { EID, IKEY, IMAPID, MFLAGS, FLAGSTATUS, MSGSTATUS, LAST_VERB, NUM_COLS };
-	std::map<unsigned int, unsigned int> mapUIDs; // Map UID -> ID
 	SPropValue sPropMax;
-	unsigned int ulMailnr = 0, ulRecent = 0, ulUnseen = 0;
+	unsigned int ulRecent = 0, ulUnseen = 0;
 	static constexpr SizedSPropTagArray(2, sPropsFolderIDs) =
 		{2, {PR_EC_IMAP_MAX_ID, PR_EC_HIERARCHYID}};
 	memory_ptr<SPropValue> lpFolderIDs;
@@ -2770,108 +2835,159 @@ HRESULT IMAP::HrRefreshFolderMails(bool bInitialLoad, bool bResetRecent, unsigne
 		{7, {PR_ENTRYID, PR_INSTANCE_KEY, PR_EC_IMAP_ID,
 		PR_MESSAGE_FLAGS, PR_FLAG_STATUS, PR_MSG_STATUS,
 		PR_LAST_VERB_EXECUTED}};
+	static constexpr SizedSPropTagArray(5, flagcols) =
+		{5, {PR_EC_IMAP_ID, PR_MESSAGE_FLAGS, PR_FLAG_STATUS,
+		PR_MSG_STATUS, PR_LAST_VERB_EXECUTED}};
 	static constexpr SizedSSortOrderSet(1, sortuid) =
 		{1, 0, 0, {{PR_EC_IMAP_ID, TABLE_SORT_ASCEND}}};
 	object_ptr<IMAPITable> table;
 	hr = folder->GetContentsTable(MAPI_DEFERRED_ERRORS, &~table);
 	if (hr != hrSuccess)
 		return kc_perror("K-2396", hr);
-	hr = table->SetColumns(cols, TBL_BATCH);
-	if (hr != hrSuccess)
-		return kc_perror("K-2387", hr);
 	hr = table->SortTable(sortuid, TBL_BATCH);
 	if (hr != hrSuccess)
 		return kc_perror("K-2388", hr);
-    // Remember UIDs if needed
-    if(!bInitialLoad)
-		for (const auto &mail : lstFolderMailEIDs)
-			mapUIDs[mail.ulUid] = n++;
 
-    if(bInitialLoad) {
-        lstFolderMailEIDs.clear();
+	/* lstFolderMailEIDs is kept in UID order, also by IDLE */
+	if (bInitialLoad) {
+		lstFolderMailEIDs.clear();
 		m_ulLastUid = 0;
-    }
+	}
+	assert(std::is_sorted(lstFolderMailEIDs.cbegin(), lstFolderMailEIDs.cend()));
 
-	auto iterMail = lstFolderMailEIDs.cbegin();
-    // Scan MAPI for new and existing messages
-	while(1) {
-		rowset_ptr lpRows;
-		hr = table->QueryRows(ROWS_PER_REQUEST_BIG, 0, &~lpRows);
+	bool bNewMail = lstFolderMailEIDs.empty();
+	unsigned int ulFirstNew = 0;
+	if (!bNewMail) {
+		// Check the known messages for flag changes and removal
+		hr = table->SetColumns(flagcols, TBL_BATCH);
 		if (hr != hrSuccess)
-			return hr;
-        if(lpRows->cRows == 0)
-            break;
+			return kc_perror("K-2387", hr);
+		std::vector<bool> keep(lstFolderMailEIDs.size());
+		size_t pos = 0;
+		while (true) {
+			rowset_ptr lpRows;
+			hr = table->QueryRows(ROWS_PER_REQUEST_BIG, 0, &~lpRows);
+			if (hr != hrSuccess)
+				return hr;
+			if (lpRows->cRows == 0)
+				break;
+			for (unsigned int i = 0; i < lpRows->cRows; ++i) {
+				const auto &row = lpRows->aRow[i];
+				if (row.lpProps[0].ulPropTag != PR_EC_IMAP_ID)
+					continue;
+				auto uid = row.lpProps[0].Value.ul;
+				while (pos < lstFolderMailEIDs.size() && lstFolderMailEIDs[pos].ulUid < uid)
+					++pos;
+				if (pos == lstFolderMailEIDs.size() || lstFolderMailEIDs[pos].ulUid != uid) {
+					// There is a new message
+					if (!bNewMail)
+						ulFirstNew = uid;
+					bNewMail = true;
+					continue;
+				}
+				auto &mail = lstFolderMailEIDs[pos];
+				auto strFlags = PropsToFlags(row.lpProps, row.cValues, mail.bRecent, false);
+				if (mail.strFlags != strFlags) {
+					// Flags have changed, notify it
+					HrResponse(RESP_UNTAGGED, stringify(pos + 1) + " FETCH (FLAGS (" + strFlags + "))");
+					mail.strFlags = std::move(strFlags);
+				}
+				keep[pos++] = true;
+			}
+		}
+
+		// The messages not seen in the table have been deleted; send
+		// the EXPUNGEs with the numbers as they shift.
+		size_t out = 0;
+		for (size_t i = 0; i < keep.size(); ++i) {
+			if (!keep[i]) {
+				HrResponse(RESP_UNTAGGED, stringify(out + 1) + " EXPUNGE");
+				continue;
+			}
+			if (out != i)
+				lstFolderMailEIDs[out] = std::move(lstFolderMailEIDs[i]);
+			++out;
+		}
+		lstFolderMailEIDs.erase(lstFolderMailEIDs.begin() + out, lstFolderMailEIDs.end());
+	}
 
-		for (ulMailnr = 0; ulMailnr < lpRows->cRows; ++ulMailnr) {
-            if (lpRows[ulMailnr].lpProps[EID].ulPropTag != PR_ENTRYID ||
-                lpRows[ulMailnr].lpProps[IKEY].ulPropTag != PR_INSTANCE_KEY ||
-                lpRows[ulMailnr].lpProps[IMAPID].ulPropTag != PR_EC_IMAP_ID)
-                continue;
-
-            auto iterUID = mapUIDs.find(lpRows[ulMailnr].lpProps[IMAPID].Value.ul);
-		    if(iterUID == mapUIDs.end()) {
-		        // There is a new message
-                sMail.sEntryID = lpRows[ulMailnr].lpProps[EID].Value.bin;
-                sMail.sInstanceKey = lpRows[ulMailnr].lpProps[IKEY].Value.bin;
-                sMail.ulUid = lpRows[ulMailnr].lpProps[IMAPID].Value.ul;
-
-                // Mark as recent if the message has a UID higher than the last highest read UID
-                // in this folder. This means that this session is the only one to see the message
-                // as recent.
-                sMail.bRecent = sMail.ulUid > ulMaxUID;
-                // Remember flags
-                sMail.strFlags = PropsToFlags(lpRows[ulMailnr].lpProps, lpRows[ulMailnr].cValues, sMail.bRecent, false);
-                // Put message on the end of our message
+	if (bNewMail) {
+		auto nKnown = lstFolderMailEIDs.size();
+		hr = table->SetColumns(cols, TBL_BATCH);
+		if (hr != hrSuccess)
+			return kc_perror("K-2387", hr);
+		if (nKnown > 0) {
+			SPropValue pv;
+			pv.ulPropTag = PR_EC_IMAP_ID;
+			pv.Value.ul = ulFirstNew;
+			memory_ptr<SRestriction> rst;
+			hr = ECPropertyRestriction(RELOP_GE, PR_EC_IMAP_ID, &pv, ECRestriction::Cheap)
+			     .CreateMAPIRestriction(&~rst, ECRestriction::Cheap);
+			if (hr != hrSuccess)
+				return hr;
+			hr = table->Restrict(rst, TBL_BATCH);
+			if (hr != hrSuccess)
+				return hr;
+			hr = table->SeekRow(BOOKMARK_BEGINNING, 0, nullptr);
+			if (hr != hrSuccess)
+				return hr;
+		}
+		size_t pos = 0;
+		while (true) {
+			rowset_ptr lpRows;
+			hr = table->QueryRows(ROWS_PER_REQUEST_BIG, 0, &~lpRows);
+			if (hr != hrSuccess)
+				return hr;
+			if (lpRows->cRows == 0)
+				break;
+			for (unsigned int i = 0; i < lpRows->cRows; ++i) {
+				const auto &row = lpRows->aRow[i];
+				if (row.lpProps[EID].ulPropTag != PR_ENTRYID ||
+				    row.lpProps[IKEY].ulPropTag != PR_INSTANCE_KEY ||
+				    row.lpProps[IMAPID].ulPropTag != PR_EC_IMAP_ID)
+					continue;
+				sMail.ulUid = row.lpProps[IMAPID].Value.ul;
+				while (pos < nKnown && lstFolderMailEIDs[pos].ulUid < sMail.ulUid)
+					++pos;
+				if (pos < nKnown && lstFolderMailEIDs[pos].ulUid == sMail.ulUid)
+					continue;
+				sMail.sEntryID = row.lpProps[EID].Value.bin;
+				sMail.sInstanceKey = row.lpProps[IKEY].Value.bin;
+				// Mark as recent if the message has a UID higher than the last highest read UID
+				// in this folder. This means that this session is the only one to see the message
+				// as recent.
+				sMail.bRecent = sMail.ulUid > ulMaxUID;
+				// Remember flags
+				sMail.strFlags = PropsToFlags(row.lpProps, row.cValues, sMail.bRecent, false);
+				// Put message on the end of our list
 				lstFolderMailEIDs.emplace_back(sMail);
 				m_ulLastUid = std::max(sMail.ulUid, m_ulLastUid);
-                bNewMail = true;
 
-                // Remember the first unseen message
+				// Remember the first unseen message
 				if (ulUnseen == 0 &&
-				    lpRows[ulMailnr].lpProps[MFLAGS].ulPropTag == PR_MESSAGE_FLAGS &&
-				    (lpRows[ulMailnr].lpProps[MFLAGS].Value.ul & MSGFLAG_READ) == 0)
-                        ulUnseen = lstFolderMailEIDs.size()-1+1; // size()-1 = last offset, mail ID = position + 1
-				continue;
-            }
-            // Check flags
-            std::string strFlags = PropsToFlags(lpRows->aRow[ulMailnr].lpProps, lpRows->aRow[ulMailnr].cValues, lstFolderMailEIDs[iterUID->second].bRecent, false);
-			if (lstFolderMailEIDs[iterUID->second].strFlags != strFlags) {
-				// Flags have changed, notify it
-				HrResponse(RESP_UNTAGGED, stringify(iterUID->second+1) + " FETCH (FLAGS (" + strFlags + "))");
-				lstFolderMailEIDs[iterUID->second].strFlags = strFlags;
+				    row.lpProps[MFLAGS].ulPropTag == PR_MESSAGE_FLAGS &&
+				    (row.lpProps[MFLAGS].Value.ul & MSGFLAG_READ) == 0)
+					ulUnseen = lstFolderMailEIDs.size(); // mail ID = position + 1
 			}
-			// We already had this message, remove it from setUIDs
-			mapUIDs.erase(iterUID);
 		}
-    }
-
-    // All messages left in mapUIDs have been deleted, so loop through the current list so we can
-    // send the correct EXPUNGE calls; At the same time, count RECENT messages.
-    ulMailnr = 0;
-    while(ulMailnr < lstFolderMailEIDs.size()) {
-        if (mapUIDs.find(lstFolderMailEIDs[ulMailnr].ulUid) != mapUIDs.cend()) {
-            HrResponse(RESP_UNTAGGED, stringify(ulMailnr+1) + " EXPUNGE");
-            lstFolderMailEIDs.erase(lstFolderMailEIDs.begin() + ulMailnr);
-            continue;
-        }
-        if (lstFolderMailEIDs[ulMailnr].bRecent)
-            ++ulRecent;
-        ++iterMail;
-        ++ulMailnr;
-    }
+		bNewMail = lstFolderMailEIDs.size() > nKnown;
+	}
 
-    if (bNewMail || bInitialLoad) {
+	for (const auto &mail : lstFolderMailEIDs)
+		if (mail.bRecent)
+			++ulRecent;
+	if (bNewMail || bInitialLoad) {
 		HrResponse(RESP_UNTAGGED, stringify(lstFolderMailEIDs.size()) + " EXISTS");
 		HrResponse(RESP_UNTAGGED, stringify(ulRecent) + " RECENT");
-    }
+	}
 
-	sort(lstFolderMailEIDs.begin(), lstFolderMailEIDs.end());
-    // Save the max UID so that other session will not see the items as \Recent
-    if(bResetRecent && ulRecent && ulMaxUID != m_ulLastUid) {
-    	sPropMax.ulPropTag = PR_EC_IMAP_MAX_ID;
-    	sPropMax.Value.ul = m_ulLastUid;
+	std::sort(lstFolderMailEIDs.begin(), lstFolderMailEIDs.end());
+	// Save the max UID so that other session will not see the items as \Recent
+	if (bResetRecent && ulRecent && ulMaxUID != m_ulLastUid) {
+		sPropMax.ulPropTag = PR_EC_IMAP_MAX_ID;
+		sPropMax.Value.ul = m_ulLastUid;
 		HrSetOneProp(folder, &sPropMax);
-    }
+	}
 	if (lpulUnseen)
 		*lpulUnseen = ulUnseen;
 	return hrSuccess;
@@ -3265,7 +3381,7 @@ HRESULT IMAP::HrPropertyFetch(std::list<ULONG> &lstMails, std::vector<std::strin
         // Fetch the row data
 		if (HrPropertyFetchRow(lpProps, cValues, strResponse, mail_idx, lpProp != nullptr, lstDataItems) != hrSuccess)
 			ec_log_warn("{?} Error fetching mail");
-		else
+		else if (!strResponse.empty())
 			HrResponse(RESP_UNTAGGED, strResponse);
 	}
 
@@ -3293,6 +3409,48 @@ HRESULT IMAP::save_generated_properties(const std::string &text, IMessage *messa
 	return hrSuccess;
 }
 
+/**
+ * Name of a FETCH data item for whole messages, as it goes in the reply.
+ */
+static std::string fetch_reply_item(std::string reply)
+{
+	// Nasty: even though the client requests .PEEK, it may not be present in the reply.
+	auto pos = reply.find(".PEEK");
+	if (pos != reply.npos)
+		reply.erase(pos, strlen(".PEEK"));
+	// Nasty: even though the client requests <12345.12345>, it may not be present in the reply.
+	pos = reply.rfind('<');
+	if (pos != reply.npos)
+		reply.erase(pos);
+	return reply;
+}
+
+/**
+ * Applies the <offset.length> suffix of a FETCH data item to a section
+ * of @size bytes.
+ *
+ * @param[out] offset requested start, for in the reply
+ * @param[out] length bytes to send from offset (0 when past the end)
+ *
+ * @return false if the item asks for the whole section
+ */
+static bool fetch_range(const std::string &item, size_t size,
+    size_t *offset, size_t *length)
+{
+	*offset = 0;
+	*length = size;
+	auto pos = item.rfind('<');
+	if (pos == item.npos)
+		return false;
+	auto range = item.substr(pos + 1, item.size() - pos - 2);
+	*offset = strtoul(range.c_str(), nullptr, 0);
+	pos = range.find('.');
+	if (pos != range.npos)
+		*length = strtoul(range.c_str() + pos + 1, nullptr, 0);
+	*length = *offset >= size ? 0 : std::min(*length, size - *offset);
+	return true;
+}
+
 /**
  * Does a FETCH based on row-data from a MAPI table. If the table data
  * is not sufficient, the PR_EC_IMAP_EMAIL property may be fetched
@@ -3301,7 +3459,8 @@ HRESULT IMAP::save_generated_properties(const std::string &text, IMessage *messa
  *
  * @param[in] lpProps Array of MAPI properties of a message
  * @param[in] cValues Number of properties in lpProps
- * @param[out] strResponse The string to send to the client
+ * @param[out] strResponse The string to send to the client, or empty when
+ *             the response went out already (because it streamed the message)
  * @param[in] ulMailnr Number of current email which we're creating a response for
  * @param[in] lstDataItems IMAP data items to add to the result string
  *
@@ -3322,10 +3481,10 @@ HRESULT IMAP::HrPropertyFetchRow(SPropValue *lpProps, unsigned int cValues,
 	sopt.alternate_boundary = const_cast<char *>("=_ZG_static");
 	sopt.ignore_missing_attachments = true;
 	sopt.use_tnef = -1;
-	unsigned int ulCount = 0;
 	std::ostringstream oss;
 	bool bSkipOpen = true;
 	std::vector<std::string> vProps;
+	std::vector<fetch_literal> literals;
 
 	// Response always starts with "<id> FETCH ("
 	snprintf(szBuffer, IMAP_RESP_MAX, "%u FETCH (", ulMailnr + 1);
@@ -3475,6 +3634,38 @@ HRESULT IMAP::HrPropertyFetchRow(SPropValue *lpProps, unsigned int cValues,
 				// data not available in table, need to regenerate.
 			}
 
+			/*
+			 * The whole message (or a range of it) as stored: send it
+			 * from the property stream in pieces, rather than
+			 * collecting it in strings first. PR_EC_IMAP_EMAIL_SIZE
+			 * only tells whether there is a stored copy; the literal
+			 * must have the size of the bytes actually sent.
+			 */
+			if (strItem.find("[]") != strItem.npos &&
+			    PCpropFindProp(lpProps, cValues, PR_EC_IMAP_EMAIL_SIZE) != nullptr &&
+			    lpMessage != nullptr && m_ulCacheUID != lstFolderMailEIDs[ulMailnr].ulUid) {
+				fetch_literal lit;
+				STATSTG st;
+				hr = lpMessage->OpenProperty(PR_EC_IMAP_EMAIL, &IID_IStream, 0, 0, &~lit.stream);
+				if (hr == hrSuccess)
+					hr = lit.stream->Stat(&st, STATFLAG_NONAME);
+				if (hr == hrSuccess) {
+					vProps.emplace_back(fetch_reply_item(item));
+					if (fetch_range(strItem, st.cbSize.QuadPart, &lit.offset, &lit.length))
+						vProps.back() += "<" + std::to_string(lit.offset) + ">";
+					if (lit.length == 0) {
+						vProps.emplace_back("NIL");
+						continue;
+					}
+					vProps.emplace_back("{" + std::to_string(lit.length) + "}\r\n");
+					lit.item = vProps.size() - 1;
+					literals.emplace_back(std::move(lit));
+					continue;
+				}
+				/* take the long way */
+				hr = hrSuccess;
+			}
+
 			strMessage.clear();
 			sopt.headers_only = strstr(strItem.c_str(), "HEADER") != NULL;
 			if (m_ulCacheUID == lstFolderMailEIDs[ulMailnr].ulUid) {
@@ -3569,17 +3760,7 @@ HRESULT IMAP::HrPropertyFetchRow(SPropValue *lpProps, unsigned int cValues,
 			 *        set the \Seen flag.
 			 */
 			if (strstr(strItem.c_str(), "[]") != NULL) {
-				// Nasty: even though the client requests .PEEK, it may not be present in the reply.
-				auto strReply = item;
-				auto ulPos = strReply.find(".PEEK");
-				if (ulPos != strReply.npos)
-					strReply.erase(ulPos, strlen(".PEEK"));
-
-				// Nasty: even though the client requests <12345.12345>, it may not be present in the reply.
-				ulPos = strReply.rfind('<');
-				if (ulPos != strReply.npos)
-					strReply.erase(ulPos);
-				vProps.emplace_back(strReply);
+				vProps.emplace_back(fetch_reply_item(item));
 				// Handle BODY[] and RFC822 (entire message)
 				strMessagePart = strMessage;
 			} else {
@@ -3600,30 +3781,10 @@ HRESULT IMAP::HrPropertyFetchRow(SPropValue *lpProps, unsigned int cValues,
 			}
 
 			// Process byte-part request ( <12345.12345> ) for BODY
-			auto ulPos = strItem.rfind('<');
-			if (ulPos != strItem.npos) {
-				strParts = strItem.substr(ulPos + 1, strItem.size() - ulPos - 2);
-
-				ulPos = strParts.find('.');
-				if (ulPos != strParts.npos) {
-					ulCount = strtoul(strParts.substr(0, ulPos).c_str(), NULL, 0);
-					ulPos = strtoul(strParts.substr(ulPos + 1).c_str(), NULL, 0);
-				} else {
-					ulCount = strtoul(strParts.c_str(), NULL, 0);
-					ulPos = strMessagePart.size();
-				}
-
-				if (ulCount > strMessagePart.size()) {
-					strMessagePart.clear();
-				} else if (ulCount + ulPos > strMessagePart.size()) {
-					strMessagePart.erase(0, ulCount);
-				} else {
-					strMessagePart.erase(0, ulCount);
-					strMessagePart.erase(ulPos);
-				}
-
-				snprintf(szBuffer, IMAP_RESP_MAX, "<%u>", ulCount);
-				vProps.back() += szBuffer;
+			size_t offset, length;
+			if (fetch_range(strItem, strMessagePart.size(), &offset, &length)) {
+				strMessagePart = length == 0 ? std::string() : strMessagePart.substr(offset, length);
+				vProps.back() += "<" + std::to_string(offset) + ">";
 			}
 
 			if (strMessagePart.empty()) {
@@ -3649,6 +3810,11 @@ HRESULT IMAP::HrPropertyFetchRow(SPropValue *lpProps, unsigned int cValues,
 	// Output flags if modified
 	if (!strFlags.empty())
 		vProps.emplace_back(std::move(strFlags));
+	if (!literals.empty()) {
+		HrResponse(std::move(strResponse), vProps, literals);
+		strResponse.clear();
+		return hr;
+	}
 	strResponse += kc_join(vProps, " ");
 	strResponse += ")";
 	return hr;
@@ -3962,6 +4128,39 @@ HRESULT IMAP::HrSeqUidSetToRestriction(const std::string &strSeqSet,
 	return hrSuccess;
 }
 
+/**
+ * Convert a sorted list of email numbers into a MAPI restriction on their
+ * UIDs. Consecutive numbers have consecutive positions in the UID-sorted
+ * mail list, so each run becomes one range, and "1:*" on a large folder
+ * stays a single comparison pair for the server.
+ *
+ * @param[in] lstMails flat list of email numbers, as from HrParseSeqSet
+ *
+ * @return restriction matching those emails (and nothing, for an empty list)
+ */
+ECOrRestriction IMAP::MailsToUidRestriction(const std::list<ULONG> &lstMails) const
+{
+	ECOrRestriction rst;
+	SPropValue sProp, sPropEnd;
+
+	sProp.ulPropTag = sPropEnd.ulPropTag = PR_EC_IMAP_ID;
+	for (auto i = lstMails.cbegin(); i != lstMails.cend(); ) {
+		auto first = *i, last = first;
+		while (++i != lstMails.cend() && *i == last + 1)
+			++last;
+		sProp.Value.ul = lstFolderMailEIDs[first].ulUid;
+		sPropEnd.Value.ul = lstFolderMailEIDs[last].ulUid;
+		if (first == last) {
+			rst += ECPropertyRestriction(RELOP_EQ, PR_EC_IMAP_ID, &sProp, ECRestriction::Full);
+			continue;
+		}
+		rst += ECAndRestriction(
+			ECPropertyRestriction(RELOP_GE, PR_EC_IMAP_ID, &sProp, ECRestriction::Full) +
+			ECPropertyRestriction(RELOP_LE, PR_EC_IMAP_ID, &sPropEnd, ECRestriction::Full));
+	}
+	return rst;
+}
+
 /**
  * Convert an IMAP sequence set to a flat list of email numbers. See
  * RFC-3501 paragraph 9 for the syntax.  This function will return the
@@ -3985,8 +4184,8 @@ HRESULT IMAP::HrParseSeqUidSet(const std::string &strSeqSet, std::list<ULONG> &l
 		if (ulPos == vSequences[i].npos) {
 			// single number
 			ulMailnr = LastOrNumber(vSequences[i].c_str(), true);
-			auto j = std::find(lstFolderMailEIDs.cbegin(), lstFolderMailEIDs.cend(), ulMailnr);
-			if (j != lstFolderMailEIDs.cend())
+			auto j = std::lower_bound(lstFolderMailEIDs.cbegin(), lstFolderMailEIDs.cend(), ulMailnr);
+			if (j != lstFolderMailEIDs.cend() && j->ulUid == ulMailnr)
 				lstMails.emplace_back(std::distance(lstFolderMailEIDs.cbegin(), j));
 			continue;
 		}
@@ -4404,8 +4603,8 @@ HRESULT IMAP::HrSearch(std::vector<std::string> &&lstSearchCriteria,
 	object_ptr<IMAPITable> lpTable;
 	enum { EID, NUM_COLS };
 	static constexpr SizedSPropTagArray(NUM_COLS, spt) = {NUM_COLS, {PR_EC_IMAP_ID}};
-	std::map<unsigned int, unsigned int> mapUIDs;
-	int n = 0;
+	static constexpr SizedSSortOrderSet(1, sortuid) =
+		{1, 0, 0, {{PR_EC_IMAP_ID, TABLE_SORT_ASCEND}}};
 
 	if (strCurrentFolder.empty() || lpSession == nullptr)
 		return MAPI_E_CALL_FAILED;
@@ -4445,9 +4644,6 @@ HRESULT IMAP::HrSearch(std::vector<std::string> &&lstSearchCriteria,
 		}
 	}
 
-	// Make a map of UID->ID
-	for (const auto &e : lstFolderMailEIDs)
-		mapUIDs[e.ulUid] = n++;
 	auto hr = HrGetCurrentFolder(lpFolder);
 	if (hr != hrSuccess)
 		return hr;
@@ -4509,14 +4705,7 @@ HRESULT IMAP::HrSearch(std::vector<std::string> &&lstSearchCriteria,
 			hr = HrParseSeqSet(strSearchCriterium, lstMails);
 			if (hr != hrSuccess)
 				return hr;
-
-			ECOrRestriction or_rst;
-			for (auto mail_idx : lstMails) {
-				pv.ulPropTag = PR_EC_IMAP_ID;
-				pv.Value.ul  = lstFolderMailEIDs[mail_idx].ulUid;
-				or_rst += ECPropertyRestriction(RELOP_EQ, pv.ulPropTag, &pv, ECRestriction::Shallow);
-			}
-			top_rst += std::move(or_rst);
+			top_rst += MailsToUidRestriction(lstMails);
 			++ulStartCriteria;
 		} else if (strSearchCriterium == "ALL" || strSearchCriterium == "NEW" || strSearchCriterium == "RECENT") {
 			// do nothing
@@ -4755,18 +4944,11 @@ HRESULT IMAP::HrSearch(std::vector<std::string> &&lstSearchCriteria,
 			top_rst += ECPropertyRestriction(RELOP_RE, pv.ulPropTag, &pv, ECRestriction::Full);
 			ulStartCriteria += 2;
 		} else if (strSearchCriterium == "UID") {
-			ECOrRestriction or_rst;
-
 			lstMails.clear();
 			hr = HrParseSeqUidSet(lstSearchCriteria[ulStartCriteria + 1], lstMails);
 			if (hr != hrSuccess)
 				return hr;
-			for (auto mail_idx : lstMails) {
-				pv.ulPropTag = PR_EC_IMAP_ID;
-				pv.Value.ul  = lstFolderMailEIDs[mail_idx].ulUid;
-				or_rst += ECPropertyRestriction(RELOP_EQ, pv.ulPropTag, &pv, ECRestriction::Shallow);
-			}
-			top_rst += std::move(or_rst);
+			top_rst += MailsToUidRestriction(lstMails);
 			ulStartCriteria += 2;
 		} else if (strSearchCriterium == "UNANSWERED") {
 			top_rst += ECOrRestriction(
@@ -4817,22 +4999,28 @@ HRESULT IMAP::HrSearch(std::vector<std::string> &&lstSearchCriteria,
 	hr = root_rst.CreateMAPIRestriction(&~classic_rst, ECRestriction::Cheap);
 	if (hr != hrSuccess)
 		return hr;
+	/*
+	 * The server evaluates the restriction and returns just the UIDs, in
+	 * order, so that they map onto the (UID-sorted) mail list in one pass.
+	 */
 	rowset_ptr lpRows;
-	hr = HrQueryAllRows(lpTable, spt, classic_rst, nullptr, 0, &~lpRows);
+	hr = HrQueryAllRows(lpTable, spt, classic_rst, sortuid, 0, &~lpRows);
 	if (hr != hrSuccess)
 		return hr;
-	if (lpRows->cRows == 0)
-		return hrSuccess;
 
+	auto iterMail = lstFolderMailEIDs.cbegin();
 	for (unsigned int ulRownr = 0; ulRownr < lpRows->cRows; ++ulRownr) {
-		auto iterUID = mapUIDs.find(lpRows->aRow[ulRownr].lpProps[0].Value.ul);
-		if (iterUID == mapUIDs.cend())
+		if (lpRows->aRow[ulRownr].lpProps[EID].ulPropTag != PR_EC_IMAP_ID)
+			continue;
+		auto uid = lpRows->aRow[ulRownr].lpProps[EID].Value.ul;
+		iterMail = std::lower_bound(iterMail, lstFolderMailEIDs.cend(), uid);
+		if (iterMail == lstFolderMailEIDs.cend())
+			break;
+		if (iterMail->ulUid != uid)
 			// Found a match for a message that is not in our message list .. skip it
 			continue;
-		lstMailnr.emplace_back(iterUID->second);
-    }
-
-	lstMailnr.sort();
+		lstMailnr.emplace_back(iterMail - lstFolderMailEIDs.cbegin());
+	}
 	return hrSuccess;
 }
 
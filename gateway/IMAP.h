@@ -17,6 +17,7 @@
 #include "ClientProto.h"
 
 namespace KC {
+class ECOrRestriction;
 class ECRestriction;
 }
 
@@ -184,6 +185,15 @@ private:
 	void HrResponse(const std::string &untag, const std::string &resp);
 	/* Tagged response with result OK, NO or BAD */
 	void HrResponse(const std::string &result, const std::string &tag, const std::string &resp);
+
+	/* A FETCH literal sent straight from a stream */
+	struct fetch_literal {
+		size_t item; /* index of its {size} in the response items */
+		KC::object_ptr<IStream> stream;
+		size_t offset, length;
+	};
+	/* Untagged FETCH response with streamed literals */
+	void HrResponse(std::string &&head, const std::vector<std::string> &items, const std::vector<fetch_literal> &);
 	static LONG IdleAdviseCallback(void *ctx, ULONG numnotif, LPNOTIFICATION);
 	static LONG IdleAdviseCallback2(void *ctx, unsigned int numnotif, NOTIFICATION *);
 
@@ -294,6 +304,7 @@ private:
 	HRESULT HrParseSeqSet(const std::string &seq, std::list<ULONG> &mails);
 	HRESULT HrParseSeqUidSet(const std::string &seq, std::list<ULONG> &mails);
 	HRESULT HrSeqUidSetToRestriction(const std::string &seq, std::unique_ptr<KC::ECRestriction> &);
+	KC::ECOrRestriction MailsToUidRestriction(const std::list<ULONG> &mails) const;
 	HRESULT HrStore(const std::list<ULONG> &mails, std::string msgdata_itemname, std::string msgdata_itemvalue, bool *do_del);
 	HRESULT HrStore_flags(const std::string &dataitemvalue, IMessage *, bool &xdelete);
 	HRESULT HrStore_pflags(IMessage *, bool &xdelete, const std::vector<std::string> &flags);
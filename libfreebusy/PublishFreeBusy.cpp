@@ -31,8 +31,7 @@ class PublishFreeBusy final {
 	PublishFreeBusy(IMAPISession *, IMsgStore *defstore, time_t start, ULONG months);
 	HRESULT HrInit();
 	HRESULT HrGetResctItems(IMAPITable **);
-	HRESULT HrProcessTable(IMAPITable *, FBBlock_1 **, ULONG *nvals);
-	HRESULT HrMergeBlocks(FBBlock_1 **, ULONG *nvals);
+	HRESULT HrProcessTable(IMAPITable *, std::vector<FBBlock_1> &);
 	HRESULT HrPublishFBblocks(const FBBlock_1 *, ULONG nvals);
 
 	private:
@@ -51,14 +50,6 @@ class PublishFreeBusy final {
 	PROPMAP_DEF_NAMED_ID(APPT_TIMEZONESTRUCT)
 };
 
-struct TSARRAY {
-	ULONG ulType, ulStatus;
-	time_t tsTime;
-};
-
-#define START_TIME 0
-#define END_TIME 1
-
 /** 
  * Publish free/busy information from the default calendar
  * 
@@ -73,8 +64,7 @@ HRESULT HrPublishDefaultCalendar(IMAPISession *lpSession, IMsgStore *lpDefStore,
     time_t tsStart, ULONG ulMonths)
 {
 	object_ptr<IMAPITable> lpTable;
-	memory_ptr<FBBlock_1> lpFBblocks;
-	ULONG cValues = 0;
+	std::vector<FBBlock_1> blocks;
 
 	ec_log_debug("current time %d", (int)tsStart);
 	auto lpFreeBusy = make_unique_nt<PublishFreeBusy>(lpSession, lpDefStore, tsStart, ulMonths);
@@ -88,25 +78,22 @@ HRESULT HrPublishDefaultCalendar(IMAPISession *lpSession, IMsgStore *lpDefStore,
 		ec_log_info("Error while finding messages for free/busy publish: %s (%x)", GetMAPIErrorMessage(hr), hr);
 		return hr;
 	}
-	hr = lpFreeBusy->HrProcessTable(lpTable, &~lpFBblocks, &cValues);
+	hr = lpFreeBusy->HrProcessTable(lpTable, blocks);
 	if(hr != hrSuccess) {
 		ec_log_info("Error while finding free/busy blocks: %s (%x)", GetMAPIErrorMessage(hr), hr);
 		return hr;
 	}
 
-	if (cValues == 0) {
+	if (blocks.empty()) {
 		ec_log_info("No messages for free/busy publish");
 		return hr;
 	}
-	hr = lpFreeBusy->HrMergeBlocks(&+lpFBblocks, &cValues);
-	if(hr != hrSuccess) {
-		ec_log_info("Error while merging free/busy blocks, %d entries: %s (%x)", cValues, GetMAPIErrorMessage(hr), hr);
-		return hr;
-	}
-	ec_log_debug("Publishing %d free/busy blocks", cValues);
-	hr = lpFreeBusy->HrPublishFBblocks(lpFBblocks, cValues);
+	ec_log_debug("Input blocks %zu", blocks.size());
+	fb_merge_blocks(blocks);
+	ec_log_debug("Publishing %zu free/busy blocks", blocks.size());
+	hr = lpFreeBusy->HrPublishFBblocks(blocks.data(), blocks.size());
 	if (hr != hrSuccess)
-		ec_log_info("Error while publishing free/busy blocks, %d entries: %s (%x)", cValues, GetMAPIErrorMessage(hr), hr);
+		ec_log_info("Error while publishing free/busy blocks, %zu entries: %s (%x)", blocks.size(), GetMAPIErrorMessage(hr), hr);
 	return hr;
 }
 
@@ -215,18 +202,17 @@ HRESULT PublishFreeBusy::HrGetResctItems(IMAPITable **lppTable)
 
 /**
  * Calculates the freebusy blocks from the rows of the table.
- * It also adds the occurrences of the recurrence in the array of blocks.
+ * It also adds the occurrences of the recurrence (within the publish
+ * period) to the blocks.
  *
  * @param[in]	lpTable			restricted mapi table containing the rows
- * @param[out]	lppfbBlocks		array of freebusy blocks
- * @param[out]	lpcValues		number of freebusy blocks in lppfbBlocks array
+ * @param[out]	blocks			freebusy blocks are appended here
  *
  * @return		MAPI Error code
  */
-HRESULT PublishFreeBusy::HrProcessTable(IMAPITable *lpTable, FBBlock_1 **lppfbBlocks, ULONG *lpcValues)
+HRESULT PublishFreeBusy::HrProcessTable(IMAPITable *lpTable, std::vector<FBBlock_1> &blocks)
 {
-	memory_ptr<OccrInfo> lpOccrInfo;
-	FBBlock_1 *lpfbBlocks = NULL;
+	std::vector<OccrInfo> occrs;
 	recurrence lpRecurrence;
 	const SizedSPropTagArray(7, proptags) =
 		{7, {PROP_APPT_STARTWHOLE, PROP_APPT_ENDWHOLE,
@@ -253,21 +239,15 @@ HRESULT PublishFreeBusy::HrProcessTable(IMAPITable *lpTable, FBBlock_1 **lppfbBl
 			if (lpRowSet[i].lpProps[3].ulPropTag != PROP_APPT_ISRECURRING ||
 			    !lpRowSet[i].lpProps[3].Value.b)
 			{
-				OccrInfo sOccrBlock;
+				FBBlock_1 block{};
 
 				if (lpRowSet[i].lpProps[0].ulPropTag == PROP_APPT_STARTWHOLE)
-					sOccrBlock.fbBlock.m_tmStart = FileTimeToRTime(lpRowSet[i].lpProps[0].Value.ft);
-				if (lpRowSet[i].lpProps[1].ulPropTag == PROP_APPT_ENDWHOLE) {
-					sOccrBlock.fbBlock.m_tmEnd = FileTimeToRTime(lpRowSet[i].lpProps[1].Value.ft);
-					sOccrBlock.tBaseDate = FileTimeToUnixTime(lpRowSet[i].lpProps[1].Value.ft);
-				}
+					block.m_tmStart = FileTimeToRTime(lpRowSet[i].lpProps[0].Value.ft);
+				if (lpRowSet[i].lpProps[1].ulPropTag == PROP_APPT_ENDWHOLE)
+					block.m_tmEnd = FileTimeToRTime(lpRowSet[i].lpProps[1].Value.ft);
 				if (lpRowSet[i].lpProps[2].ulPropTag == PROP_APPT_FBSTATUS)
-					sOccrBlock.fbBlock.m_fbstatus = (FBStatus)lpRowSet[i].lpProps[2].Value.ul;
-				hr = HrAddFBBlock(sOccrBlock, &+lpOccrInfo, lpcValues);
-				if (hr != hrSuccess) {
-					ec_log_debug("Error adding occurrence block to list: %s (%x)", GetMAPIErrorMessage(hr), hr);
-					return hr;
-				}
+					block.m_fbstatus = (FBStatus)lpRowSet[i].lpProps[2].Value.ul;
+				blocks.emplace_back(block);
 				continue;
 			}
 			if (lpRowSet[i].lpProps[4].ulPropTag != PROP_APPT_RECURRINGSTATE)
@@ -284,113 +264,71 @@ HRESULT PublishFreeBusy::HrProcessTable(IMAPITable *lpTable, FBBlock_1 **lppfbBl
 			}
 			if (lpRowSet[i].lpProps[2].ulPropTag == PROP_APPT_FBSTATUS)
 				ulFbStatus = lpRowSet[i].lpProps[2].Value.ul;
-			hr = lpRecurrence.HrGetItems(m_tsStart, m_tsEnd, ttzInfo, ulFbStatus, &+lpOccrInfo, lpcValues);
-			if (hr != hrSuccess || !lpOccrInfo) {
+			occrs.clear();
+			hr = lpRecurrence.HrGetItems(m_tsStart, m_tsEnd, ttzInfo, ulFbStatus, occrs);
+			if (hr != hrSuccess) {
 				kc_perror("Error expanding items for recurring item", hr);
 				continue;
 			}
+			for (const auto &o : occrs)
+				blocks.emplace_back(o.fbBlock);
 		}
 	}
-	
-	if (lpcValues == 0 || lpOccrInfo == nullptr)
-		return hrSuccess;
-	hr = MAPIAllocateBuffer(sizeof(FBBlock_1) * *lpcValues, reinterpret_cast<void **>(&lpfbBlocks));
-	if (hr != hrSuccess)
-		return hr;
-	for (ULONG i = 0 ; i < *lpcValues; ++i)
-		lpfbBlocks[i]  = lpOccrInfo[i].fbBlock;
-	*lppfbBlocks = lpfbBlocks;
 	return hrSuccess;
 }
 
-/** 
- * Merge overlapping free/busy blocks.
- * 
- * @param[in,out] lppfbBlocks In: generated blocks, Out: merged blocks
- * @param[in,out] lpcValues Number of blocks in lppfbBlocks
- * 
- * @return MAPI Error code
+/**
+ * Merge overlapping free/busy blocks into a sorted list of disjoint ones,
+ * each with the strongest status of the blocks covering it. A sweep over
+ * the block edges, O(n log n); adjacent pieces of the same status are
+ * joined, and free time is left out.
+ *
+ * @param[in,out] blocks In: generated blocks, Out: merged blocks
  */
-HRESULT PublishFreeBusy::HrMergeBlocks(FBBlock_1 **lppfbBlocks, ULONG *lpcValues)
+void fb_merge_blocks(std::vector<FBBlock_1> &blocks)
 {
-	ULONG cValues = *lpcValues, ulLevel = 0;
-	time_t tsLastTime = 0;
-	TSARRAY sTsitem{};
-	std::map<time_t , TSARRAY> mpTimestamps;
-	std::vector<ULONG> vctStatus;
-	std::vector<FBBlock_1> vcFBblocks;
-	ec_log_debug("Input blocks %ul", cValues);
-
-	auto lpFbBlocks = *lppfbBlocks;
-	for (ULONG i = 0; i < cValues; ++i) {
-		sTsitem.ulType = START_TIME;
-		sTsitem.ulStatus = lpFbBlocks[i].m_fbstatus;
-		sTsitem.tsTime = lpFbBlocks[i].m_tmStart;
-		auto tTemp = RTimeToUnixTime(sTsitem.tsTime);
-		// @note ctime adds \n character
-		ec_log_debug("Blocks start %s", ctime(&tTemp));
-		mpTimestamps[sTsitem.tsTime] = sTsitem;
-		sTsitem.ulType = END_TIME;
-		sTsitem.ulStatus = lpFbBlocks[i].m_fbstatus;
-		sTsitem.tsTime = lpFbBlocks[i].m_tmEnd;
-		mpTimestamps[sTsitem.tsTime] = sTsitem;
+	/* A block adds its status at its start and takes it away at its end */
+	struct edge {
+		LONG time;
+		FBStatus status;
+		bool end;
+		bool operator<(const edge &o) const { return time < o.time; }
+	};
+	std::vector<edge> edges;
+	edges.reserve(blocks.size() * 2);
+	for (const auto &b : blocks) {
+		if (b.m_tmEnd <= b.m_tmStart)
+			continue;
+		edges.push_back({b.m_tmStart, b.m_fbstatus, false});
+		edges.push_back({b.m_tmEnd, b.m_fbstatus, true});
 	}
-	
-	for (const auto &pts : mpTimestamps) {
-		FBBlock_1 fbBlockTemp;
-		sTsitem = pts.second;
+	std::sort(edges.begin(), edges.end());
 
-		switch(sTsitem.ulType)
-		{
-		case START_TIME:
-			if (ulLevel != 0 && tsLastTime != sTsitem.tsTime)
-			{
-				std::sort(vctStatus.begin(),vctStatus.end());
-				fbBlockTemp.m_tmStart = tsLastTime;
-				fbBlockTemp.m_tmEnd = sTsitem.tsTime;
-				fbBlockTemp.m_fbstatus = (enum FBStatus)(vctStatus.size()> 0 ? vctStatus.back(): 0);// sort it to get max of status
-				if(fbBlockTemp.m_fbstatus != 0)
-					vcFBblocks.emplace_back(std::move(fbBlockTemp));
-			}
-			++ulLevel;
-			vctStatus.emplace_back(sTsitem.ulStatus);
-			tsLastTime = sTsitem.tsTime;
-			break;
-		case END_TIME:
-			if(tsLastTime != sTsitem.tsTime)
-			{
-				std::sort(vctStatus.begin(),vctStatus.end());// sort it to get max of status
-				fbBlockTemp.m_tmStart = tsLastTime;
-				fbBlockTemp.m_tmEnd = sTsitem.tsTime;
-				fbBlockTemp.m_fbstatus = (enum FBStatus)(vctStatus.size()> 0 ? vctStatus.back(): 0);
-				if(fbBlockTemp.m_fbstatus != 0)
-					vcFBblocks.emplace_back(std::move(fbBlockTemp));
-			}
-			--ulLevel;
-			if(!vctStatus.empty()){
-				auto iterStatus = std::find(vctStatus.begin(), vctStatus.end(), sTsitem.ulStatus);
-				if (iterStatus != vctStatus.end())
-					vctStatus.erase(iterStatus);
+	std::map<unsigned int, unsigned int> active; /* status -> blocks */
+	std::vector<FBBlock_1> merged;
+	LONG last = 0;
+	for (size_t i = 0; i < edges.size(); ) {
+		auto now = edges[i].time;
+		if (!active.empty() && now != last && active.crbegin()->first != fbFree) {
+			auto status = static_cast<FBStatus>(active.crbegin()->first);
+			if (!merged.empty() && merged.back().m_tmEnd == last &&
+			    merged.back().m_fbstatus == status)
+				merged.back().m_tmEnd = now;
+			else
+				merged.push_back({last, now, status});
+		}
+		for (; i < edges.size() && edges[i].time == now; ++i) {
+			if (!edges[i].end) {
+				++active[edges[i].status];
+				continue;
 			}
-			tsLastTime = sTsitem.tsTime;
-			break;
+			auto a = active.find(edges[i].status);
+			if (--a->second == 0)
+				active.erase(a);
 		}
+		last = now;
 	}
-
-	// Free previously allocated memory
-	if (*lppfbBlocks != NULL)
-		MAPIFreeBuffer(*lppfbBlocks);
-	auto hr = MAPIAllocateBuffer(sizeof(FBBlock_1) * vcFBblocks.size(), reinterpret_cast<void **>(&lpFbBlocks));
-	if (hr != hrSuccess)
-		return hr;
-
-	ULONG i = 0;
-	for (const auto &vcblock : vcFBblocks)
-		lpFbBlocks[i++] = vcblock;
-	*lppfbBlocks = lpFbBlocks;
-	*lpcValues = vcFBblocks.size();
-	ec_log_debug("Output blocks %d", *lpcValues);
-	return hrSuccess;
+	blocks = std::move(merged);
 }
 
 /** 
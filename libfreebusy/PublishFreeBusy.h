@@ -4,8 +4,10 @@
  */
 #pragma once
 #include <kopano/zcdefs.h>
+#include <vector>
 #include <mapidefs.h>
 #include <ctime>
+#include "freebusy.h"
 
 struct IMAPISession;
 struct IMsgStore;
@@ -13,5 +15,6 @@ struct IMsgStore;
 namespace KC {
 
 extern KC_EXPORT HRESULT HrPublishDefaultCalendar(IMAPISession *, IMsgStore *, time_t start, unsigned int months);
+extern KC_EXPORT void fb_merge_blocks(std::vector<FBBlock_1> &);
 
 } /* namespace */
@@ -526,32 +526,4 @@ HRESULT CreateFBProp(FBStatus fbStatus, ULONG ulMonths, ULONG ulPropMonths, ULON
 	return hr;
 }
 
-/**
- * Adds a occurrence to the occurrence array
- * @param[in]		sOccrInfo		occurrence to be added to array
- * @param[in,out]	lppsOccrInfo	array to which occurrence is added
- * @param[out]		lpcValues		number of occurrences in array
- * @return			HRESULT
- */
-HRESULT HrAddFBBlock(const OccrInfo &sOccrInfo, OccrInfo **lppsOccrInfo,
-    ULONG *lpcValues)
-{
-	memory_ptr<OccrInfo> lpsNewOccrInfo;
-	OccrInfo *lpsInputOccrInfo = *lppsOccrInfo;
-	unsigned int oldval = lpcValues != nullptr ? *lpcValues : 0;
-	unsigned int ulModVal = oldval + 1;
-	auto hr = MAPIAllocateBuffer(sizeof(sOccrInfo) * ulModVal, &~lpsNewOccrInfo);
-	if (hr != hrSuccess)
-		return hr;
-	if (lpsInputOccrInfo != nullptr)
-		for (ULONG i = 0; i < oldval; ++i)
-			lpsNewOccrInfo[i] = lpsInputOccrInfo[i];
-	if (lpcValues != NULL)
-		*lpcValues = ulModVal;
-	lpsNewOccrInfo[ulModVal -1] = sOccrInfo;
-	*lppsOccrInfo = lpsNewOccrInfo.release();
-	MAPIFreeBuffer(lpsInputOccrInfo);
-	return hrSuccess;
-}
-
 } /* namespace */
@@ -945,18 +945,17 @@ ULONG recurrence::WeekDayFromTime(time_t t)
 }
 
 bool recurrence::CheckAddValidOccr(time_t tsNow, time_t tsStart, time_t tsEnd,
-    const TIMEZONE_STRUCT &ttZinfo, ULONG ulBusyStatus,
-    OccrInfo **lppOccrInfoAll, ULONG *lpcValues)
+    const TIMEZONE_STRUCT &ttZinfo, ULONG ulBusyStatus, occr_list &lst)
 {
 	ec_log_debug("Testing match: %lu ==> %s", tsNow, ctime(&tsNow));
-	if (!isOccurrenceValid(UTCToLocal(tsStart, ttZinfo), UTCToLocal(tsEnd, ttZinfo), tsNow + getStartTimeOffset())) {
+	if (!isOccurrenceValid(UTCToLocal(tsStart, ttZinfo), UTCToLocal(tsEnd, ttZinfo), tsNow + getStartTimeOffset(), lst)) {
 		ec_log_debug("Skipping match: %lu ==> %s", tsNow, ctime(&tsNow));
 		return false;
 	}
 	auto tsOccStart = LocalToUTC(tsNow + getStartTimeOffset(), ttZinfo);
 	auto tsOccEnd = LocalToUTC(tsNow + getEndTimeOffset(), ttZinfo);
 	ec_log_debug("Adding match: %lu ==> %s", tsOccStart, ctime(&tsOccStart));
-	AddValidOccr(tsOccStart, tsOccEnd, ulBusyStatus, lppOccrInfoAll, lpcValues);
+	AddValidOccr(tsOccStart, tsOccEnd, ulBusyStatus, lst.items);
 	return true;
 }
 
@@ -967,15 +966,52 @@ bool recurrence::CheckAddValidOccr(time_t tsNow, time_t tsStart, time_t tsEnd,
  * @param[in]	ttZinfo			timezone struct of the recurrence
  * @param[in]	ulBusyStatus	freebusy status of the recurrence
  * @param[in]	last	        only return last occurrence (fast)
- * @param[out]	lppOccrInfo		array of occurrences
- * @param[out]	lpcValues		number of occurrences in lppOccrInfo
+ * @param[in,out]	lppOccrInfo		array of occurrences, appended to
+ * @param[in,out]	lpcValues		number of occurrences in lppOccrInfo
  * @return		HRESULT
  */
 HRESULT recurrence::HrGetItems(time_t tsStart, time_t tsEnd,
     const TIMEZONE_STRUCT &ttZinfo, ULONG ulBusyStatus, OccrInfo **lppOccrInfo,
     ULONG *lpcValues, bool last)
 {
-	OccrInfo *lpOccrInfoAll = *lppOccrInfo;
+	std::vector<OccrInfo> occrs;
+	auto hr = HrGetItems(tsStart, tsEnd, ttZinfo, ulBusyStatus, occrs, last);
+	if (hr != hrSuccess || occrs.empty())
+		return hr;
+	unsigned int have = lpcValues != nullptr ? *lpcValues : 0;
+	memory_ptr<OccrInfo> all;
+	hr = MAPIAllocateBuffer(sizeof(OccrInfo) * (have + occrs.size()), &~all);
+	if (hr != hrSuccess)
+		return hr;
+	if (*lppOccrInfo != nullptr)
+		std::copy(*lppOccrInfo, *lppOccrInfo + have, all.get());
+	std::copy(occrs.cbegin(), occrs.cend(), all.get() + have);
+	MAPIFreeBuffer(*lppOccrInfo);
+	*lppOccrInfo = all.release();
+	if (lpcValues != nullptr)
+		*lpcValues = have + occrs.size();
+	return hrSuccess;
+}
+
+/**
+ * Calculates occurrences of a recurrence between a specified period.
+ * Patterns with a fixed step are expanded from just before @tsStart
+ * rather than from the start of the recurrence, so that long-running
+ * series cost only what falls in the period.
+ *
+ * @param[in]	tsStart			starting time of period
+ * @param[in]	tsEnd			ending time of period
+ * @param[in]	ttZinfo			timezone struct of the recurrence
+ * @param[in]	ulBusyStatus	freebusy status of the recurrence
+ * @param[out]	occrs			occurrences are appended here
+ * @param[in]	last	        only return last occurrence (fast)
+ * @return		HRESULT
+ */
+HRESULT recurrence::HrGetItems(time_t tsStart, time_t tsEnd,
+    const TIMEZONE_STRUCT &ttZinfo, ULONG ulBusyStatus,
+    std::vector<OccrInfo> &occrs, bool last)
+{
+	occr_list lst{occrs};
 	std::vector<RecurrenceState::Exception> lstExceptions;
 	RecurrenceState::Exception lpException;
 	auto tsDayStart = getStartDate();
@@ -987,6 +1023,25 @@ HRESULT recurrence::HrGetItems(time_t tsStart, time_t tsEnd,
 	ec_log_debug("DURATIION END TIME: %lu ==> %s", tsEnd, ctime(&tsEnd));
 	ec_log_debug("Rec Start TIME: %lu ==> %s", tsDayStart, ctime(&tsDayStart));
 	ec_log_debug("Rec End TIME: %lu ==> %s", tsDayEnd, ctime(&tsDayEnd));
+
+	for (auto t : getModifiedOccurrences())
+		lst.modified_days.emplace_back(StartOfDay(t));
+	auto deleted = getDeletedExceptions();
+	lst.deleted.assign(deleted.cbegin(), deleted.cend());
+	std::sort(lst.modified_days.begin(), lst.modified_days.end());
+	std::sort(lst.deleted.begin(), lst.deleted.end());
+	/*
+	 * First candidate day, in steps of @step from the recurrence start,
+	 * whose occurrence could still end up in the period; @margin covers
+	 * the time offsets within a step.
+	 */
+	auto tsWindowStart = UTCToLocal(tsStart, ttZinfo);
+	auto first_day = [&](time_t step, time_t margin) {
+		if (tsWindowStart - margin <= tsDayStart)
+			return tsDayStart;
+		return tsDayStart + (tsWindowStart - margin - tsDayStart) / step * step;
+	};
+
 	switch (getFrequency())
 	{
 	case DAILY:
@@ -997,11 +1052,11 @@ HRESULT recurrence::HrGetItems(time_t tsStart, time_t tsEnd,
                         if (last) {
 				time_t remainder = (tsDayEnd - tsDayStart) % (m_sRecState.ulPeriod * 60);
 				for (time_t tsNow = tsDayEnd - remainder; tsNow >= tsDayStart; tsNow -= m_sRecState.ulPeriod * 60)
-					if (CheckAddValidOccr(tsNow, tsStart, tsEnd, ttZinfo, ulBusyStatus, &lpOccrInfoAll, lpcValues))
+					if (CheckAddValidOccr(tsNow, tsStart, tsEnd, ttZinfo, ulBusyStatus, lst))
 						break;
                         } else {
-				for (time_t tsNow = tsDayStart; tsNow <= tsDayEnd; tsNow += m_sRecState.ulPeriod * 60)
-					CheckAddValidOccr(tsNow, tsStart, tsEnd, ttZinfo, ulBusyStatus, &lpOccrInfoAll, lpcValues);
+				for (time_t tsNow = first_day(m_sRecState.ulPeriod * 60, 2 * 86400); tsNow <= tsDayEnd; tsNow += m_sRecState.ulPeriod * 60)
+					CheckAddValidOccr(tsNow, tsStart, tsEnd, ttZinfo, ulBusyStatus, lst);
                         }
                         break;
 		}
@@ -1012,16 +1067,16 @@ HRESULT recurrence::HrGetItems(time_t tsStart, time_t tsEnd,
 				tm sTm;
 				gmtime_safe(tsNow, &sTm);
 				if (sTm.tm_wday > 0 && sTm.tm_wday < 6 &&
-				    CheckAddValidOccr(tsNow, tsStart, tsEnd, ttZinfo, ulBusyStatus, &lpOccrInfoAll, lpcValues))
+				    CheckAddValidOccr(tsNow, tsStart, tsEnd, ttZinfo, ulBusyStatus, lst))
 					break;
 			}
 			break;
 		}
-		for (time_t tsNow = tsDayStart ;tsNow <= tsDayEnd; tsNow += 60 * 1440) { //604800 = 60*60*24*7
+		for (time_t tsNow = first_day(60 * 1440, 2 * 86400); tsNow <= tsDayEnd; tsNow += 60 * 1440) { //604800 = 60*60*24*7
 			tm sTm;
 			gmtime_safe(tsNow, &sTm);
 			if (sTm.tm_wday > 0 && sTm.tm_wday < 6)
-				CheckAddValidOccr(tsNow, tsStart, tsEnd, ttZinfo, ulBusyStatus, &lpOccrInfoAll, lpcValues);
+				CheckAddValidOccr(tsNow, tsStart, tsEnd, ttZinfo, ulBusyStatus, lst);
 		}
 		break;// CASE : DAILY
 
@@ -1038,7 +1093,7 @@ HRESULT recurrence::HrGetItems(time_t tsStart, time_t tsEnd,
 					auto tsDayNow = tsNow + i * 1440 * 60; // 60 * 60 * 24 = 1440
 					ec_log_debug("Checking for weekly tsDayNow: %s", ctime(&tsDayNow));
 					if (m_sRecState.ulWeekDays & (1 << WeekDayFromTime(tsDayNow)) &&
-					    CheckAddValidOccr(tsDayNow, tsStart, tsEnd, ttZinfo, ulBusyStatus, &lpOccrInfoAll, lpcValues)) {
+					    CheckAddValidOccr(tsDayNow, tsStart, tsEnd, ttZinfo, ulBusyStatus, lst)) {
 						found = true;
 						break;
 					}
@@ -1048,13 +1103,13 @@ HRESULT recurrence::HrGetItems(time_t tsStart, time_t tsEnd,
                         }
                         break;
                 }
-		for (time_t tsNow = tsDayStart; tsNow <= tsDayEnd; tsNow += m_sRecState.ulPeriod * 604800) { //604800 = 60*60*24*7
+		for (time_t tsNow = first_day(m_sRecState.ulPeriod * 604800, 9 * 86400); tsNow <= tsDayEnd; tsNow += m_sRecState.ulPeriod * 604800) { //604800 = 60*60*24*7
 			// Loop through the whole following week to the first occurrence of the week, add each day that is specified
 			for (int i = 0; i < 7; ++i) {
 				auto tsDayNow = tsNow + i * 1440 * 60; // 60 * 60 * 24 = 1440
 				ec_log_debug("Checking for weekly tsDayNow: %s", ctime(&tsDayNow));
 				if (m_sRecState.ulWeekDays & (1 << WeekDayFromTime(tsDayNow)))
-					CheckAddValidOccr(tsDayNow, tsStart, tsEnd, ttZinfo, ulBusyStatus, &lpOccrInfoAll, lpcValues);
+					CheckAddValidOccr(tsDayNow, tsStart, tsEnd, ttZinfo, ulBusyStatus, lst);
 			}
 		}
 		break;// CASE : WEEKLY
@@ -1093,10 +1148,10 @@ HRESULT recurrence::HrGetItems(time_t tsStart, time_t tsEnd,
 				}
 			}
 
-			if(isOccurrenceValid(tsStart, tsEnd, tsDayNow + getStartTimeOffset())){
+			if(isOccurrenceValid(tsStart, tsEnd, tsDayNow + getStartTimeOffset(), lst)){
 				auto tsOccStart =  LocalToUTC(tsDayNow + getStartTimeOffset(), ttZinfo);
 				auto tsOccEnd = LocalToUTC(tsDayNow + getEndTimeOffset(), ttZinfo);
-				AddValidOccr(tsOccStart, tsOccEnd, ulBusyStatus, &lpOccrInfoAll, lpcValues);
+				AddValidOccr(tsOccStart, tsOccEnd, ulBusyStatus, lst.items);
 			}
 
 			tsNow += DaysTillMonth(tsNow, m_sRecState.ulPeriod) * 60 * 60 * 24;
@@ -1135,10 +1190,10 @@ HRESULT recurrence::HrGetItems(time_t tsStart, time_t tsEnd,
 					tsDayNow -= 7 * 24 * 60 * 60;
 			}
 
-			if(isOccurrenceValid(tsStart, tsEnd, tsDayNow + getStartTimeOffset())){
+			if(isOccurrenceValid(tsStart, tsEnd, tsDayNow + getStartTimeOffset(), lst)){
 				auto tsOccStart = LocalToUTC(tsDayNow + getStartTimeOffset(), ttZinfo);
 				auto tsOccEnd = LocalToUTC(tsDayNow + getEndTimeOffset(), ttZinfo);
-				AddValidOccr(tsOccStart, tsOccEnd, ulBusyStatus, &lpOccrInfoAll, lpcValues);
+				AddValidOccr(tsOccStart, tsOccEnd, ulBusyStatus, lst.items);
 			}
 
 			tsNow += DaysTillMonth(tsNow, m_sRecState.ulPeriod) * 60 * 60 * 24;
@@ -1147,7 +1202,6 @@ HRESULT recurrence::HrGetItems(time_t tsStart, time_t tsEnd,
 	}
 	}
 
-	HRESULT hr = hrSuccess;
 	for (lstExceptions = m_sRecState.lstExceptions; lstExceptions.size() != 0; lstExceptions.pop_back()) {
 		OccrInfo sOccrInfo;
 
@@ -1176,14 +1230,13 @@ HRESULT recurrence::HrGetItems(time_t tsStart, time_t tsEnd,
 		// Freebusy status
 		sOccrInfo.tBaseDate = RTimeToUnixTime(lpException.ulOriginalStartDate);
 		ec_log_debug("Adding exception match: %lu ==> %s", sOccrInfo.tBaseDate, ctime(&sOccrInfo.tBaseDate));
-		hr = HrAddFBBlock(sOccrInfo, &lpOccrInfoAll, lpcValues);
+		occrs.emplace_back(sOccrInfo);
 	}
-
-	*lppOccrInfo = lpOccrInfoAll;
-	return hr;
+	return hrSuccess;
 }
 
-HRESULT recurrence::AddValidOccr(time_t tsOccrStart, time_t tsOccrEnd, ULONG ulBusyStatus, OccrInfo **lpFBBlocksAll, ULONG *lpcValues)
+void recurrence::AddValidOccr(time_t tsOccrStart, time_t tsOccrEnd,
+    ULONG ulBusyStatus, std::vector<OccrInfo> &occrs)
 {
 	OccrInfo sOccrInfo;
 
@@ -1194,21 +1247,32 @@ HRESULT recurrence::AddValidOccr(time_t tsOccrStart, time_t tsOccrEnd, ULONG ulB
 	// APPT_ENDWHOLE
 	sOccrInfo.fbBlock.m_tmEnd = UnixTimeToRTime(tsOccrEnd);
 	sOccrInfo.fbBlock.m_fbstatus = (FBStatus)ulBusyStatus;
-	return HrAddFBBlock(sOccrInfo, lpFBBlocksAll, lpcValues);
+	occrs.emplace_back(sOccrInfo);
 }
 
 bool recurrence::isOccurrenceValid(time_t tsPeriodStart, time_t tsPeriodEnd,
     time_t tsNewOcc) const
 {
-	if (isException(tsNewOcc))
-		return false;
 	if (tsNewOcc < tsPeriodStart || tsNewOcc > tsPeriodEnd)
 		return false;
+	if (isException(tsNewOcc))
+		return false;
 	if (isDeletedOccurrence(tsNewOcc))
 		return false;
 	return true;
 }
 
+/* As above, with the exceptions looked up in @lst */
+bool recurrence::isOccurrenceValid(time_t tsPeriodStart, time_t tsPeriodEnd,
+    time_t tsNewOcc, const occr_list &lst) const
+{
+	if (tsNewOcc < tsPeriodStart || tsNewOcc > tsPeriodEnd)
+		return false;
+	if (std::binary_search(lst.modified_days.cbegin(), lst.modified_days.cend(), StartOfDay(tsNewOcc)))
+		return false;
+	return !std::binary_search(lst.deleted.cbegin(), lst.deleted.cend(), tsNewOcc);
+}
+
 /**
  * checks if the Occurrence is deleted.
  * @param	tsOccDate	Occurrence Unix timestamp
@@ -23,6 +23,7 @@ public:
 	HRESULT HrGetRecurrenceState(std::string &);
 	void HrGetHumanReadableString(std::string *);
 	HRESULT HrGetItems(time_t start, time_t end, const TIMEZONE_STRUCT &ttZinfo, ULONG ulBusyStatus, OccrInfo **lppFbBlock, ULONG *lpcValues, bool last = false);
+	HRESULT HrGetItems(time_t start, time_t end, const TIMEZONE_STRUCT &, unsigned int busy_status, std::vector<OccrInfo> &, bool last = false);
 	enum freq_type { DAILY, WEEKLY, MONTHLY, YEARLY };
 	enum term_type { DATE, NUMBER, NEVER };
 
@@ -81,7 +82,7 @@ public:
 	HRESULT setModifiedBusyStatus(ULONG id, ULONG status);
 	HRESULT setModifiedSubType(ULONG id, ULONG subtype);
 	HRESULT setModifiedBody(ULONG id);
-	KC_HIDDEN HRESULT AddValidOccr(time_t occr_start, time_t occr_end, unsigned int busy_status, OccrInfo **fbblocksall, unsigned int *nvals);
+	KC_HIDDEN void AddValidOccr(time_t occr_start, time_t occr_end, unsigned int busy_status, std::vector<OccrInfo> &);
 	KC_HIDDEN bool isOccurrenceValid(time_t period_start, time_t period_end, time_t new_occ) const;
 	KC_HIDDEN bool isDeletedOccurrence(time_t occ_date) const;
 	KC_HIDDEN bool isException(time_t occ_date) const;
@@ -110,8 +111,15 @@ private:
 	std::vector<std::wstring> vExceptionsSubject;
 	std::vector<std::wstring> vExceptionsLocation;
 
+	/* Output of HrGetItems, and the (sorted) occurrences it must skip */
+	struct occr_list {
+		std::vector<OccrInfo> &items;
+		std::vector<time_t> modified_days, deleted;
+	};
+
 	KC_HIDDEN unsigned int calcBits(unsigned int x) const;
-	KC_HIDDEN bool CheckAddValidOccr(time_t now, time_t start, time_t end, const TIMEZONE_STRUCT &, unsigned int busy_status, OccrInfo **occrinfoall, unsigned int *nvals);
+	KC_HIDDEN bool isOccurrenceValid(time_t period_start, time_t period_end, time_t new_occ, const occr_list &) const;
+	KC_HIDDEN bool CheckAddValidOccr(time_t now, time_t start, time_t end, const TIMEZONE_STRUCT &, unsigned int busy_status, occr_list &);
 };
 
 } /* namespace */
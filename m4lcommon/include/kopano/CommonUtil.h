@@ -66,7 +66,7 @@ extern KC_EXPORT HRESULT HrGetAddress(IAddrBook *, IMessage *, unsigned int tag_
 extern KC_EXPORT HRESULT HrGetAddress(IAddrBook *, const SPropValue *props, unsigned int nvals, unsigned int tag_eid, unsigned int tag_name, unsigned int tag_type, unsigned int tag_addr, std::wstring &name, std::wstring &type, std::wstring &addr);
 extern KC_EXPORT HRESULT HrGetAddress(IAddrBook *, const ENTRYID *eid, unsigned int eid_size, std::wstring &name, std::wstring &type, std::wstring &addr);
 extern KC_EXPORT std::string ToQuotedBase64Header(const std::wstring &);
-extern HRESULT TestRestriction(const SRestriction *cond, ULONG nvals, const SPropValue *props, const ECLocale &, ULONG level = 0);
+extern KC_EXPORT HRESULT TestRestriction(const SRestriction *cond, ULONG nvals, const SPropValue *props, const ECLocale &, ULONG level = 0);
 extern KC_EXPORT HRESULT TestRestriction(const SRestriction *cond, IMAPIProp *msg, const ECLocale &, unsigned int level = 0);
 extern KC_EXPORT HRESULT HrOpenUserMsgStore(IMAPISession *, const wchar_t *user, IMsgStore **store);
 extern KC_EXPORT HRESULT OpenLocalFBMessage(DGMessageType eDGMsgType, IMsgStore *lpMsgStore, bool bCreateIfMissing, IMessage **lppFBMessage);
@@ -190,6 +190,8 @@ class IECServiceAdmin : public virtual IECSecSvcAdm_base {
 	/* Archive store function(s) */
 	virtual HRESULT GetArchiveStoreEntryID(LPCTSTR lpszUserName, LPCTSTR lpszServerName, ULONG ulFlags, ULONG *lpcbStoreID, LPENTRYID *lppStoreID) = 0;
 	virtual HRESULT ResetFolderCount(ULONG eid_size, const ENTRYID *eid, ULONG *nupdates) = 0;
+	/* Copy a message into a folder of any store on the same server, without the data going through the client */
+	virtual HRESULT CloneMessage(ULONG eid_size, const ENTRYID *msg_eid, ULONG feid_size, const ENTRYID *folder_eid, ULONG flags, ULONG *new_size, ENTRYID **new_eid) = 0;
 };
 
 class IECSingleInstance : public virtual IUnknown {
@@ -3,6 +3,8 @@
  * Copyright 2005 - 2016 Zarafa and its licensors
  */
 #include <kopano/platform.h>
+#include <algorithm>
+#include <atomic>
 #include <exception>
 #include <list>
 #include <memory>
@@ -81,8 +83,90 @@ struct alignas(::max_align_t) mapiext_head {
 	alignas(::max_align_t) char data[];
 };
 
+/*
+ * MAPIAllocateMore carves children out of slabs owned by the root buffer.
+ * The space in the newest slab is handed out with an atomic bump of
+ * @used, so a single thread never takes a lock; only replacing a full
+ * slab does. Children too large for a slab get their own mapiext_head.
+ */
+struct alignas(::max_align_t) mapi_slab {
+	struct mapi_slab *next;
+	size_t size;
+	std::atomic<size_t> used;
+	alignas(::max_align_t) char data[];
+};
+
+static constexpr size_t MAPI_SLAB_FIRST = 1024, MAPI_SLAB_MAX = 64 * 1024;
+
+/*
+ * Slabs are big enough for malloc to hand back to the system when they are
+ * freed together, after which the next row set faults in fresh pages. So
+ * each thread keeps some freed slabs for reuse, by size (1K, 2K, ... 64K).
+ */
+namespace {
+
+class slab_cache final {
+	public:
+	~slab_cache();
+	struct mapi_slab *get(size_t size);
+	void put(struct mapi_slab *);
+
+	private:
+	static unsigned int index(size_t size);
+	static constexpr size_t limit = 1024 * 1024;
+	struct mapi_slab *m_free[7]{};
+	size_t m_bytes = 0;
+};
+
+}
+
+static thread_local slab_cache mapi_slabs;
+
+slab_cache::~slab_cache()
+{
+	for (auto p : m_free)
+		while (p != nullptr) {
+			auto q = p->next;
+			free(p);
+			p = q;
+		}
+}
+
+unsigned int slab_cache::index(size_t size)
+{
+	unsigned int i = 0;
+	for (size /= MAPI_SLAB_FIRST; size > 1; size >>= 1)
+		++i;
+	return i;
+}
+
+struct mapi_slab *slab_cache::get(size_t size)
+{
+	auto &head = m_free[index(size)];
+	auto p = head;
+	if (p != nullptr) {
+		head = p->next;
+		m_bytes -= size;
+		return p;
+	}
+	return static_cast<struct mapi_slab *>(malloc(sizeof(struct mapi_slab) + size));
+}
+
+void slab_cache::put(struct mapi_slab *p)
+{
+	if (m_bytes + p->size > limit) {
+		free(p);
+		return;
+	}
+	auto &head = m_free[index(p->size)];
+	p->next = head;
+	head = p;
+	m_bytes += p->size;
+}
+
 struct alignas(::max_align_t) mapibuf_head {
-	std::mutex mtx;
+	std::mutex mtx; /* for slab replacement and @child */
+	std::atomic<struct mapi_slab *> slab{nullptr}; /* singly-linked list, newest first */
 	struct mapiext_head *child; /* singly-linked list */
 #if MAPI_MEM_MORE_DEBUG
 	enum mapibuf_ident ident;
@@ -1843,26 +1927,63 @@ SCODE MAPIAllocateMore(ULONG cbSize, LPVOID lpObject, LPVOID *lppBuffer)
 		return MAPI_E_INVALID_PARAMETER;
 	if (!lpObject)
 		return MAPIAllocateBuffer(cbSize, lppBuffer);
-	cbSize += sizeof(struct mapiext_head);
-	auto bfr = static_cast<struct mapiext_head *>(malloc(cbSize));
-	if (bfr == nullptr) {
-		ec_log_crit("MAPIAllocateMore(): %s", strerror(errno));
-		return MAKE_MAPI_E(1);
-	}
 
 	auto head = container_of(lpObject, struct mapibuf_head, data);
 #if MAPI_MEM_MORE_DEBUG
 	if (head->ident != MAPIBUF_BASE)
 		assert("AllocateMore on something that was not allocated with MAPIAllocateBuffer!\n" == nullptr);
 #endif
-	scoped_lock lock(head->mtx);
-	bfr->child = head->child;
-	head->child = bfr;
-	*lppBuffer = bfr->data;
+	/* Every child gets its own max_align_t-aligned, nonempty piece */
+	constexpr size_t align = alignof(::max_align_t);
+	size_t want = (std::max<size_t>(cbSize, 1) + align - 1) & ~(align - 1);
+	if (want > MAPI_SLAB_MAX / 4) {
+		auto bfr = static_cast<struct mapiext_head *>(malloc(sizeof(struct mapiext_head) + cbSize));
+		if (bfr == nullptr) {
+			ec_log_crit("MAPIAllocateMore(): %s", strerror(errno));
+			return MAKE_MAPI_E(1);
+		}
+		scoped_lock lock(head->mtx);
+		bfr->child = head->child;
+		head->child = bfr;
+		*lppBuffer = bfr->data;
+		return hrSuccess;
+	}
+
+	auto slab = head->slab.load(std::memory_order_acquire);
+	while (true) {
+		if (slab != nullptr) {
+			/*
+			 * A failed bump leaves @used past the end, which is
+			 * harmless: the slab is full either way.
+			 */
+			auto off = slab->used.fetch_add(want, std::memory_order_relaxed);
+			if (off + want <= slab->size) {
+				*lppBuffer = slab->data + off;
 #if MAPI_MEM_DEBUG
-	fprintf(stderr, "Extra buffer: %p on %p\n", *lppBuffer, lpObject);
+				fprintf(stderr, "Extra buffer: %p on %p\n", *lppBuffer, lpObject);
 #endif
-	return hrSuccess;
+				return hrSuccess;
+			}
+		}
+		scoped_lock lock(head->mtx);
+		auto cur = head->slab.load(std::memory_order_acquire);
+		if (cur != slab) {
+			/* Another thread replaced it meanwhile */
+			slab = cur;
+			continue;
+		}
+		size_t size = slab == nullptr ? MAPI_SLAB_FIRST : std::min(slab->size * 2, MAPI_SLAB_MAX);
+		auto fresh = mapi_slabs.get(size);
+		if (fresh == nullptr) {
+			ec_log_crit("MAPIAllocateMore(): %s", strerror(errno));
+			return MAKE_MAPI_E(1);
+		}
+		fresh->next = slab;
+		fresh->size = size;
+		new(&fresh->used) std::atomic<size_t>(0);
+		head->slab.store(fresh, std::memory_order_release);
+		slab = fresh;
+	}
 }
 
 /**
@@ -1884,11 +2005,19 @@ ULONG MAPIFreeBuffer(LPVOID lpBuffer)
 #if MAPI_MEM_MORE_DEBUG
 	assert(head->ident == MAPIBUF_BASE);
 #endif
+	for (auto p = head->slab.load(std::memory_order_acquire); p != nullptr; ) {
+		auto q = p->next;
+#if MAPI_MEM_DEBUG
+		fprintf(stderr, "  Freeing slab: %p\n", p);
+#endif
+		mapi_slabs.put(p);
+		p = q;
+	}
 	auto p = head->child;
 	while (p != nullptr) {
 		auto q = p->child;
 #if MAPI_MEM_DEBUG
-		fprintf(stderr, "  Freeing: %p\n", i);
+		fprintf(stderr, "  Freeing: %p\n", p);
 #endif
 		free(p);
 		p = q;
@@ -2367,6 +2367,17 @@ HRESULT ECMsgStore::ResetFolderCount(ULONG cbEntryId, const ENTRYID *lpEntryId,
 	return lpTransport->HrResetFolderCount(cbEntryId, lpEntryId, lpulUpdates);
 }
 
+HRESULT ECMsgStore::CloneMessage(ULONG cbEntryId, const ENTRYID *lpEntryId,
+    ULONG cbFolderId, const ENTRYID *lpFolderId, ULONG ulFlags,
+    ULONG *lpcbNewId, ENTRYID **lppNewId)
+{
+	if (lpEntryId == nullptr || lpFolderId == nullptr ||
+	    lpcbNewId == nullptr || lppNewId == nullptr)
+		return MAPI_E_INVALID_PARAMETER;
+	return lpTransport->HrCloneMessage(cbEntryId, lpEntryId, cbFolderId,
+	       lpFolderId, ulFlags, lpcbNewId, lppNewId);
+}
+
 // This is almost the same as getting a 'normal' outgoing table, except we pass NULL as PEID for the store
 HRESULT ECMsgStore::GetMasterOutgoingTable(ULONG ulFlags, IMAPITable ** lppOutgoingTable)
 {
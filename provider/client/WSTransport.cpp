@@ -3905,3 +3905,34 @@ HRESULT WSTransport::HrResetFolderCount(ULONG cbEntryId,
  exitm:
 	return hr;
 }
+
+HRESULT WSTransport::HrCloneMessage(ULONG cbEntryId, const ENTRYID *lpEntryId,
+    ULONG cbFolderId, const ENTRYID *lpFolderId, ULONG ulFlags,
+    ULONG *lpcbNewId, ENTRYID **lppNewId)
+{
+	ECRESULT er = erSuccess;
+	entryId eidMessage, eidFolder;
+	cloneMessageResponse sResponse;
+	soap_lock_guard spg(*this);
+
+	auto hr = CopyMAPIEntryIdToSOAPEntryId(cbEntryId, lpEntryId, &eidMessage, true);
+	if (hr != hrSuccess)
+		goto exitm;
+	hr = CopyMAPIEntryIdToSOAPEntryId(cbFolderId, lpFolderId, &eidFolder, true);
+	if (hr != hrSuccess)
+		goto exitm;
+
+	START_SOAP_CALL
+	{
+		if (m_lpCmd->cloneMessage(m_ecSessionId, eidMessage, eidFolder,
+		    ulFlags, 0, &sResponse) != SOAP_OK)
+			er = KCERR_NETWORK_ERROR;
+		else
+			er = sResponse.er;
+	}
+	END_SOAP_CALL
+
+	hr = CopySOAPEntryIdToMAPIEntryId(&sResponse.sEntryId, lpcbNewId, lppNewId);
+ exitm:
+	return hr;
+}
@@ -240,6 +240,7 @@ public:
 	HRESULT HrCancelIO();
 
 	HRESULT HrResetFolderCount(unsigned int eid_size, const ENTRYID *eid, unsigned int *nupdates);
+	HRESULT HrCloneMessage(unsigned int eid_size, const ENTRYID *msg_eid, unsigned int feid_size, const ENTRYID *folder_eid, unsigned int flags, unsigned int *new_size, ENTRYID **new_eid);
 
 	std::string m_server_version;
 
@@ -161,6 +161,12 @@ ECRESULT ECSearchClient::Query(const GUID *lpServerGuid, const GUID *lpStoreGuid
 	auto strServer = bin2hex(sizeof(GUID), lpServerGuid);
 	auto strStore = bin2hex(sizeof(GUID), lpStoreGuid);
 	auto er = Scope(strServer, strStore, lstFolders);
+	if (er != erSuccess && er != KCERR_BAD_VALUE && er != KCERR_CALL_FAILED)
+		/*
+		 * A kept-open connection may have been closed by the indexer
+		 * just now; try once more on a new one.
+		 */
+		er = Scope(strServer, strStore, lstFolders);
 	if (er != erSuccess)
 		return er;
 	for (const auto &i : lstSearches)
@@ -29,7 +29,9 @@ public:
 	ECRESULT GetProperties(setindexprops_t &mapProps);
 	ECRESULT Query(const GUID *server_guid, const GUID *store_guid, const std::list<unsigned int> &folders, const std::list<SIndexedTerm> &searches, std::list<unsigned int> &matches, std::string &suggestion);
 	ECRESULT SyncRun();
-	
+	/* Called before a kept-open client is used again */
+	virtual void Revalidate() {}
+
 private:
 	virtual ECRESULT DoCmd(const std::string &command, std::vector<std::string> &response) = 0;
 	virtual ECRESULT Connect() { return erSuccess; }
@@ -55,6 +57,8 @@ class ECSearchClientNET final :
     public ECSearchClient, private ECChannelClient {
 	public:
 	ECSearchClientNET(const char *szIndexerPath, unsigned int ulTimeOut);
+	virtual void Revalidate() override { ECChannelClient::Revalidate(); }
+
 	private:
 	virtual ECRESULT DoCmd(const std::string &c, std::vector<std::string> &r) { return ECChannelClient::DoCmd(c, r); }
 	virtual ECRESULT Connect() { return ECChannelClient::Connect(); }
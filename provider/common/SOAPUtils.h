@@ -13,6 +13,7 @@
 #include <kopano/ustringutil.h>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 namespace KC {
@@ -115,6 +116,11 @@ struct SOAPINFO {
 	void *fdoneparam;
 	ECSESSIONID ulLastSessionId; // Session ID of the last processed request
 	struct request_stat st;
+	/*
+	 * Read-only file mappings that reply data points into (see
+	 * ECFileAttachment); unmapped once the reply has been sent.
+	 */
+	std::vector<std::pair<void *, size_t>> file_maps;
 };
 
 class ec_soap_deleter {
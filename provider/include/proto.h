@@ -933,6 +933,11 @@ struct ns:create_folders_response {
 	struct entryList *entryids;
 };
 
+struct ns:cloneMessageResponse {
+	unsigned int er;
+	entryId sEntryId;
+};
+
 //TableType flags for function ns__tableOpen
 #define TABLETYPE_MS				1	// MessageStore tables
 #define TABLETYPE_AB				2	// Addressbook tables
@@ -972,6 +977,7 @@ int ns__createFolder(ULONG64 ulSessionId, entryId sParentId, entryId *lpsNewEntr
 int ns__create_folders(ULONG64 session_id, entryId parent_eid, struct new_folder_set batch, struct ns:create_folders_response *response);
 int ns__deleteObjects(ULONG64 ulSessionId, unsigned int ulFlags, struct entryList *aMessages, unsigned int ulSyncId, unsigned int *result);
 int ns__copyObjects(ULONG64 ulSessionId, struct entryList *aMessages, entryId sDestFolderId, unsigned int ulFlags, unsigned int ulSyncId, unsigned int *result);
+int ns__cloneMessage(ULONG64 ulSessionId, entryId sEntryId, entryId sDestFolderId, unsigned int ulFlags, unsigned int ulSyncId, struct ns:cloneMessageResponse *lpsResponse);
 int ns__emptyFolder(ULONG64 ulSessionId, entryId sEntryId,  unsigned int ulFlags, unsigned int ulSyncId, unsigned int *result);
 int ns__deleteFolder(ULONG64 ulSessionId, entryId sEntryId, unsigned int ulFlags, unsigned int ulSyncId, unsigned int *result);
 int ns__copyFolder(ULONG64 ulSessionId, entryId sEntryId, entryId sDestFolderId, const char *lpszNewFolderName, unsigned int ulFlags, unsigned int ulSyncId, unsigned int *result);
@@ -0,0 +1,694 @@
+/*
+ * SPDX-License-Identifier: AGPL-3.0-only
+ * Copyright 2005 - 2016 Zarafa and its licensors
+ */
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+#include <kopano/platform.h>
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <string>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD_H
+#	include <zstd.h>
+#endif
+#ifdef HAVE_LZ4FRAME_H
+#	include <lz4frame.h>
+#endif
+#include <kopano/ECLogger.h>
+#include <kopano/fileutil.hpp>
+#include <kopano/scope.hpp>
+#include "ECAttachmentCodec.h"
+
+namespace KC {
+
+/* Size of the compressed-side I/O buffers */
+static constexpr size_t AT_IOBUF_SIZE = 128 * 1024;
+
+ssize_t at_codec::content_size(int fd) const
+{
+	/* Fallback: decompress and count */
+	if (lseek(fd, 0, SEEK_SET) == -1)
+		return -1;
+	auto rd = reader(fd);
+	if (rd == nullptr)
+		return -1;
+	std::unique_ptr<char[]> buf(new(std::nothrow) char[AT_IOBUF_SIZE]);
+	if (buf == nullptr)
+		return -1;
+	ssize_t total = 0;
+	while (true) {
+		auto ret = rd->read(buf.get(), AT_IOBUF_SIZE);
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+			break;
+		total += ret;
+	}
+	return total;
+}
+
+/*
+ * gzip
+ *
+ * zlib's gzFile takes ownership of the descriptor it is given, so it gets a
+ * dup of the caller's one.
+ */
+class gz_reader final : public at_codec_reader {
+	public:
+	gz_reader(gzFile fp) : m_fp(fp) {}
+	~gz_reader() { gzclose(m_fp); }
+	ssize_t read(void *, size_t) override;
+
+	private:
+	gzFile m_fp;
+};
+
+class gz_writer final : public at_codec_writer {
+	public:
+	gz_writer(gzFile fp) : m_fp(fp) {}
+	~gz_writer()
+	{
+		if (m_fp != nullptr)
+			gzclose(m_fp);
+	}
+	ssize_t write(const void *, size_t) override;
+	bool finish() override;
+
+	private:
+	gzFile m_fp;
+};
+
+class gz_codec final : public at_codec {
+	public:
+	const char *name() const override { return "gzip"; }
+	const char *suffix() const override { return ".gz"; }
+	int default_level() const override { return Z_DEFAULT_COMPRESSION; }
+	std::unique_ptr<at_codec_reader> reader(int fd) const override;
+	std::unique_ptr<at_codec_writer> writer(int, int, size_t) const override;
+	ssize_t content_size(int fd) const override;
+};
+
+static gzFile gz_dopen(int fd, const char *mode)
+{
+	auto nfd = dup(fd);
+	if (nfd < 0) {
+		ec_log_err("gzdopen: dup: %s", strerror(errno));
+		return nullptr;
+	}
+	auto fp = gzdopen(nfd, mode);
+	if (fp == nullptr) {
+		ec_log_err("gzdopen: %s", strerror(errno));
+		close(nfd);
+		return nullptr;
+	}
+#if ZLIB_VERNUM >= 0x1240
+	/* as advised by http://www.zlib.net/manual.html we use a 128KB buffer; default is only 8KB */
+	if (gzbuffer(fp, AT_IOBUF_SIZE) == -1)
+		ec_log_warn("gzbuffer failed");
+#endif
+	return fp;
+}
+
+/**
+ * @uclen:	number of uncompressed bytes that is requested
+ */
+ssize_t gz_reader::read(void *data, size_t uclen)
+{
+	ssize_t read_total = 0;
+	auto buf = static_cast<char *>(data);
+
+	if (uclen == 0)
+		/* Avoid useless churn. */
+		return 0;
+
+	while (uclen > 0) {
+		auto chunk_size = std::min(uclen, static_cast<size_t>(INT_MAX));
+		int ret = gzread(m_fp, buf, chunk_size);
+
+		/*
+		 * Save @errno now, since gzerror() code looks prone to
+		 * reset it.
+		 */
+		int saved_errno = errno, zerror;
+		const char *zerrstr = gzerror(m_fp, &zerror);
+
+		if (ret < 0 && zerror == Z_ERRNO &&
+		    (saved_errno == EINTR || saved_errno == EAGAIN))
+			/* Server delay (cf. gzread_write) */
+			continue;
+		if (ret < 0 && zerror == Z_ERRNO) {
+			ec_log_err("gzread: %s (%d): %s",
+			         zerrstr, zerror, strerror(saved_errno));
+			return ret;
+		}
+		if (ret < 0) {
+			ec_log_err("gzread: %s (%d)", zerrstr, zerror);
+			return ret;
+		}
+		if (ret == 0)
+			/*
+			 * EOF (since we already excluded chunk_size==0
+			 * requests).
+			 */
+			break;
+		buf += ret;
+		read_total += ret;
+		uclen -= ret;
+	}
+	return read_total;
+}
+
+ssize_t gz_writer::write(const void *data, size_t uclen)
+{
+	size_t wrote_total = 0;
+	auto buf = static_cast<const char *>(data);
+
+	if (uclen == 0)
+		/* Avoid useless churn. */
+		return 0;
+
+	while (uclen > 0) {
+		auto chunk_size = std::min(uclen, static_cast<size_t>(INT_MAX));
+		int ret = gzwrite(m_fp, buf, chunk_size);
+		int saved_errno = errno, zerror;
+		const char *zerrstr = gzerror(m_fp, &zerror);
+
+		if (ret < 0 && zerror == Z_ERRNO &&
+		    (saved_errno == EINTR || saved_errno == EAGAIN))
+			/*
+			 * Choosing to continue reading can delay server
+			 * shutdown... but we are in a soap handler, so
+			 * whatelse could we do.
+			 */
+			continue;
+		if (ret < 0 && zerror == Z_ERRNO) {
+			ec_log_err("gzwrite: %s (%d): %s",
+			         zerrstr, zerror, strerror(saved_errno));
+			return ret;
+		}
+		if (ret < 0) {
+			ec_log_err("gzwrite: %s (%d)", zerrstr, zerror);
+			return ret;
+		}
+		if (ret == 0)
+			/* ??? - could happen if the file is not open for write */
+			break;
+		buf += ret;
+		wrote_total += ret;
+		uclen -= ret;
+	}
+	return wrote_total;
+}
+
+bool gz_writer::finish()
+{
+	auto ret = gzclose(m_fp);
+	m_fp = nullptr;
+	if (ret != Z_OK)
+		ec_log_err("gzclose: %s", ret == Z_ERRNO ? strerror(errno) : "buffer error");
+	return ret == Z_OK;
+}
+
+std::unique_ptr<at_codec_reader> gz_codec::reader(int fd) const
+{
+	auto fp = gz_dopen(fd, "rb");
+	if (fp == nullptr)
+		return nullptr;
+	return std::make_unique<gz_reader>(fp);
+}
+
+std::unique_ptr<at_codec_writer> gz_codec::writer(int fd, int level, size_t) const
+{
+	auto fp = gz_dopen(fd, ("wb" + std::to_string(std::min(std::max(level, 1), Z_BEST_COMPRESSION))).c_str());
+	if (fp == nullptr)
+		return nullptr;
+	return std::make_unique<gz_writer>(fp);
+}
+
+/**
+ * The gzip trailer only records the size of the last member (modulo 4G), so
+ * it cannot be trusted without knowing that the file has a single member
+ * (KC-104). Inflate the first member and use its output count when it ends
+ * exactly at EOF; concatenated members or trailing data are counted through
+ * gzread, which treats them the same way the reader does.
+ */
+ssize_t gz_codec::content_size(int fd) const
+{
+	if (lseek(fd, 0, SEEK_SET) == -1)
+		return -1;
+	std::unique_ptr<char[]> ibuf(new(std::nothrow) char[AT_IOBUF_SIZE]);
+	std::unique_ptr<char[]> obuf(new(std::nothrow) char[AT_IOBUF_SIZE]);
+	if (ibuf == nullptr || obuf == nullptr)
+		return -1;
+	z_stream zs{};
+	if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK)
+		return -1;
+	auto cleanup = make_scope_success([&]() { inflateEnd(&zs); });
+	int zret = Z_OK;
+	while (zret != Z_STREAM_END) {
+		if (zs.avail_in == 0) {
+			auto ret = read_retry(fd, ibuf.get(), AT_IOBUF_SIZE);
+			if (ret < 0)
+				return -1;
+			if (ret == 0)
+				/* Truncated member */
+				return at_codec::content_size(fd);
+			zs.next_in = reinterpret_cast<Bytef *>(ibuf.get());
+			zs.avail_in = ret;
+		}
+		zs.next_out = reinterpret_cast<Bytef *>(obuf.get());
+		zs.avail_out = AT_IOBUF_SIZE;
+		zret = inflate(&zs, Z_NO_FLUSH);
+		if (zret != Z_OK && zret != Z_STREAM_END) {
+			ec_log_debug("gzip: inflate: %s, counting content size", zs.msg != nullptr ? zs.msg : "error");
+			return at_codec::content_size(fd);
+		}
+	}
+	char probe;
+	if (zs.avail_in > 0 || read_retry(fd, &probe, 1) != 0) {
+		ec_log_debug("gzip: data after first member, counting content size");
+		return at_codec::content_size(fd);
+	}
+	return zs.total_out;
+}
+
+#ifdef HAVE_ZSTD_H
+/*
+ * Zstandard
+ */
+class zstd_reader final : public at_codec_reader {
+	public:
+	zstd_reader(int fd, ZSTD_DStream *ds, std::unique_ptr<char[]> &&buf) :
+		m_fd(fd), m_ds(ds), m_buf(std::move(buf))
+	{}
+	~zstd_reader() { ZSTD_freeDStream(m_ds); }
+	ssize_t read(void *, size_t) override;
+
+	private:
+	int m_fd;
+	ZSTD_DStream *m_ds;
+	std::unique_ptr<char[]> m_buf;
+	ZSTD_inBuffer m_in{nullptr, 0, 0};
+	/* Nonzero while inside a frame; an empty file is not a valid frame either */
+	size_t m_last = 1;
+	bool m_eof = false;
+};
+
+class zstd_writer final : public at_codec_writer {
+	public:
+	zstd_writer(int fd, ZSTD_CCtx *cc, std::unique_ptr<char[]> &&buf) :
+		m_fd(fd), m_cc(cc), m_buf(std::move(buf))
+	{}
+	~zstd_writer() { ZSTD_freeCCtx(m_cc); }
+	ssize_t write(const void *, size_t) override;
+	bool finish() override;
+
+	private:
+	bool drive(ZSTD_inBuffer &, ZSTD_EndDirective);
+
+	int m_fd;
+	ZSTD_CCtx *m_cc;
+	std::unique_ptr<char[]> m_buf;
+};
+
+class zstd_codec final : public at_codec {
+	public:
+	const char *name() const override { return "zstd"; }
+	const char *suffix() const override { return ".zst"; }
+	int default_level() const override { return 3; }
+	std::unique_ptr<at_codec_reader> reader(int fd) const override;
+	std::unique_ptr<at_codec_writer> writer(int, int, size_t) const override;
+	ssize_t content_size(int fd) const override;
+};
+
+ssize_t zstd_reader::read(void *data, size_t len)
+{
+	ZSTD_outBuffer out{data, len, 0};
+	while (out.pos < out.size) {
+		if (m_in.pos == m_in.size && !m_eof) {
+			auto ret = read_retry(m_fd, m_buf.get(), AT_IOBUF_SIZE);
+			if (ret < 0) {
+				ec_log_err("zstd: read: %s", strerror(errno));
+				return -1;
+			}
+			if (ret == 0)
+				m_eof = true;
+			m_in = {m_buf.get(), static_cast<size_t>(ret), 0};
+		}
+		auto in_before = m_in.pos, out_before = out.pos;
+		auto ret = ZSTD_decompressStream(m_ds, &out, &m_in);
+		if (ZSTD_isError(ret)) {
+			ec_log_err("zstd: %s", ZSTD_getErrorName(ret));
+			return -1;
+		}
+		/*
+		 * Past the end of a frame, the return value is a hint for
+		 * the next frame's header; only a call that did something
+		 * says whether the frame was complete.
+		 */
+		if (m_in.pos != in_before || out.pos != out_before) {
+			m_last = ret;
+		} else if (m_eof) {
+			if (m_last != 0) {
+				ec_log_err("zstd: truncated frame");
+				return -1;
+			}
+			break;
+		}
+	}
+	return out.pos;
+}
+
+bool zstd_writer::drive(ZSTD_inBuffer &in, ZSTD_EndDirective mode)
+{
+	size_t rem;
+	do {
+		ZSTD_outBuffer out{m_buf.get(), AT_IOBUF_SIZE, 0};
+		rem = ZSTD_compressStream2(m_cc, &out, &in, mode);
+		if (ZSTD_isError(rem)) {
+			ec_log_err("zstd: %s", ZSTD_getErrorName(rem));
+			return false;
+		}
+		if (out.pos > 0 && write_retry(m_fd, m_buf.get(), out.pos) != static_cast<ssize_t>(out.pos)) {
+			ec_log_err("zstd: write: %s", strerror(errno));
+			return false;
+		}
+	} while (mode == ZSTD_e_end ? rem != 0 : in.pos < in.size);
+	return true;
+}
+
+ssize_t zstd_writer::write(const void *data, size_t len)
+{
+	ZSTD_inBuffer in{data, len, 0};
+	return drive(in, ZSTD_e_continue) ? static_cast<ssize_t>(len) : -1;
+}
+
+bool zstd_writer::finish()
+{
+	ZSTD_inBuffer in{nullptr, 0, 0};
+	return drive(in, ZSTD_e_end);
+}
+
+std::unique_ptr<at_codec_reader> zstd_codec::reader(int fd) const
+{
+	std::unique_ptr<char[]> buf(new(std::nothrow) char[AT_IOBUF_SIZE]);
+	auto ds = ZSTD_createDStream();
+	if (buf == nullptr || ds == nullptr) {
+		ZSTD_freeDStream(ds);
+		return nullptr;
+	}
+	ZSTD_initDStream(ds);
+	return std::make_unique<zstd_reader>(fd, ds, std::move(buf));
+}
+
+std::unique_ptr<at_codec_writer> zstd_codec::writer(int fd, int level, size_t size) const
+{
+	std::unique_ptr<char[]> buf(new(std::nothrow) char[AT_IOBUF_SIZE]);
+	auto cc = ZSTD_createCCtx();
+	if (buf == nullptr || cc == nullptr) {
+		ZSTD_freeCCtx(cc);
+		return nullptr;
+	}
+	ZSTD_CCtx_setParameter(cc, ZSTD_c_compressionLevel, level);
+	ZSTD_CCtx_setParameter(cc, ZSTD_c_checksumFlag, 1);
+	/* Put the size into the frame header, for content_size() */
+	if (size != unknown_size)
+		ZSTD_CCtx_setPledgedSrcSize(cc, size);
+	return std::make_unique<zstd_writer>(fd, cc, std::move(buf));
+}
+
+/**
+ * The frame header carries the content size, as the writer always knows it.
+ * Instances are written as a single frame.
+ */
+ssize_t zstd_codec::content_size(int fd) const
+{
+	char hdr[ZSTD_FRAMEHEADERSIZE_MAX];
+	auto ret = pread(fd, hdr, sizeof(hdr), 0);
+	if (ret < 0)
+		return -1;
+	auto size = ZSTD_getFrameContentSize(hdr, ret);
+	if (size == ZSTD_CONTENTSIZE_ERROR)
+		return -1;
+	if (size == ZSTD_CONTENTSIZE_UNKNOWN)
+		return at_codec::content_size(fd);
+	return size;
+}
+#endif /* HAVE_ZSTD_H */
+
+#ifdef HAVE_LZ4FRAME_H
+/*
+ * LZ4 (frame format)
+ */
+class lz4_reader final : public at_codec_reader {
+	public:
+	lz4_reader(int fd, LZ4F_dctx *dc, std::unique_ptr<char[]> &&buf) :
+		m_fd(fd), m_dc(dc), m_buf(std::move(buf))
+	{}
+	~lz4_reader() { LZ4F_freeDecompressionContext(m_dc); }
+	ssize_t read(void *, size_t) override;
+
+	private:
+	int m_fd;
+	LZ4F_dctx *m_dc;
+	std::unique_ptr<char[]> m_buf;
+	size_t m_inpos = 0, m_inlen = 0, m_last = 1;
+	bool m_eof = false;
+};
+
+class lz4_writer final : public at_codec_writer {
+	public:
+	lz4_writer(int fd, LZ4F_cctx *cc, const LZ4F_preferences_t &p) :
+		m_fd(fd), m_cc(cc), m_prefs(p)
+	{}
+	~lz4_writer() { LZ4F_freeCompressionContext(m_cc); }
+	bool begin();
+	ssize_t write(const void *, size_t) override;
+	bool finish() override;
+
+	private:
+	bool flush(size_t);
+
+	int m_fd;
+	LZ4F_cctx *m_cc;
+	LZ4F_preferences_t m_prefs;
+	std::unique_ptr<char[]> m_buf;
+	size_t m_bufsize = 0;
+};
+
+class lz4_codec final : public at_codec {
+	public:
+	const char *name() const override { return "lz4"; }
+	const char *suffix() const override { return ".lz4"; }
+	int default_level() const override { return 0; }
+	std::unique_ptr<at_codec_reader> reader(int fd) const override;
+	std::unique_ptr<at_codec_writer> writer(int, int, size_t) const override;
+	ssize_t content_size(int fd) const override;
+};
+
+ssize_t lz4_reader::read(void *data, size_t len)
+{
+	auto out = static_cast<char *>(data);
+	size_t pos = 0;
+	while (pos < len) {
+		if (m_inpos == m_inlen && !m_eof) {
+			auto ret = read_retry(m_fd, m_buf.get(), AT_IOBUF_SIZE);
+			if (ret < 0) {
+				ec_log_err("lz4: read: %s", strerror(errno));
+				return -1;
+			}
+			if (ret == 0)
+				m_eof = true;
+			m_inpos = 0;
+			m_inlen = ret;
+		}
+		size_t dst = len - pos, src = m_inlen - m_inpos;
+		auto ret = LZ4F_decompress(m_dc, out + pos, &dst, m_buf.get() + m_inpos, &src, nullptr);
+		if (LZ4F_isError(ret)) {
+			ec_log_err("lz4: %s", LZ4F_getErrorName(ret));
+			return -1;
+		}
+		m_inpos += src;
+		pos += dst;
+		if (src != 0 || dst != 0) {
+			m_last = ret;
+		} else if (m_eof) {
+			if (m_last != 0) {
+				ec_log_err("lz4: truncated frame");
+				return -1;
+			}
+			break;
+		}
+	}
+	return pos;
+}
+
+bool lz4_writer::flush(size_t n)
+{
+	if (LZ4F_isError(n)) {
+		ec_log_err("lz4: %s", LZ4F_getErrorName(n));
+		return false;
+	}
+	if (n > 0 && write_retry(m_fd, m_buf.get(), n) != static_cast<ssize_t>(n)) {
+		ec_log_err("lz4: write: %s", strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+bool lz4_writer::begin()
+{
+	m_bufsize = std::max(static_cast<size_t>(LZ4F_HEADER_SIZE_MAX),
+	            LZ4F_compressBound(AT_IOBUF_SIZE, &m_prefs));
+	m_buf.reset(new(std::nothrow) char[m_bufsize]);
+	if (m_buf == nullptr)
+		return false;
+	return flush(LZ4F_compressBegin(m_cc, m_buf.get(), m_bufsize, &m_prefs));
+}
+
+ssize_t lz4_writer::write(const void *data, size_t len)
+{
+	auto src = static_cast<const char *>(data);
+	for (size_t pos = 0; pos < len; ) {
+		auto chunk = std::min(len - pos, AT_IOBUF_SIZE);
+		if (!flush(LZ4F_compressUpdate(m_cc, m_buf.get(), m_bufsize, src + pos, chunk, nullptr)))
+			return -1;
+		pos += chunk;
+	}
+	return len;
+}
+
+bool lz4_writer::finish()
+{
+	return flush(LZ4F_compressEnd(m_cc, m_buf.get(), m_bufsize, nullptr));
+}
+
+std::unique_ptr<at_codec_reader> lz4_codec::reader(int fd) const
+{
+	std::unique_ptr<char[]> buf(new(std::nothrow) char[AT_IOBUF_SIZE]);
+	LZ4F_dctx *dc = nullptr;
+	if (buf == nullptr)
+		return nullptr;
+	if (LZ4F_isError(LZ4F_createDecompressionContext(&dc, LZ4F_VERSION)))
+		return nullptr;
+	return std::make_unique<lz4_reader>(fd, dc, std::move(buf));
+}
+
+std::unique_ptr<at_codec_writer> lz4_codec::writer(int fd, int level, size_t size) const
+{
+	LZ4F_cctx *cc = nullptr;
+	if (LZ4F_isError(LZ4F_createCompressionContext(&cc, LZ4F_VERSION)))
+		return nullptr;
+	LZ4F_preferences_t prefs;
+	memset(&prefs, 0, sizeof(prefs));
+	prefs.compressionLevel = level;
+	prefs.frameInfo.blockSizeID = LZ4F_max256KB;
+	prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+	/* Put the size into the frame header, for content_size() */
+	if (size != unknown_size)
+		prefs.frameInfo.contentSize = size;
+	auto wr = std::make_unique<lz4_writer>(fd, cc, prefs);
+	if (!wr->begin())
+		return nullptr;
+	return wr;
+}
+
+ssize_t lz4_codec::content_size(int fd) const
+{
+	char hdr[LZ4F_HEADER_SIZE_MAX];
+	auto ret = pread(fd, hdr, sizeof(hdr), 0);
+	if (ret < 0)
+		return -1;
+	LZ4F_dctx *dc = nullptr;
+	if (LZ4F_isError(LZ4F_createDecompressionContext(&dc, LZ4F_VERSION)))
+		return -1;
+	LZ4F_frameInfo_t fi;
+	size_t hsize = ret;
+	auto err = LZ4F_getFrameInfo(dc, &fi, hdr, &hsize);
+	LZ4F_freeDecompressionContext(dc);
+	if (LZ4F_isError(err))
+		return -1;
+	/* 0 means "not recorded"; an empty instance is not compressed anyway */
+	if (fi.contentSize == 0)
+		return at_codec::content_size(fd);
+	return fi.contentSize;
+}
+#endif /* HAVE_LZ4FRAME_H */
+
+const std::vector<const at_codec *> &at_codec_list()
+{
+	static const gz_codec gz;
+#ifdef HAVE_ZSTD_H
+	static const zstd_codec zs;
+#endif
+#ifdef HAVE_LZ4FRAME_H
+	static const lz4_codec lz;
+#endif
+	static const std::vector<const at_codec *> list = {
+		&gz,
+#ifdef HAVE_ZSTD_H
+		&zs,
+#endif
+#ifdef HAVE_LZ4FRAME_H
+		&lz,
+#endif
+	};
+	return list;
+}
+
+const at_codec *at_codec_find(const char *name)
+{
+	for (auto c : at_codec_list())
+		if (strcasecmp(c->name(), name) == 0)
+			return c;
+	return nullptr;
+}
+
+/**
+ * Parse an attachment_compression value:
+ *
+ *	"0".."9"	gzip with that level (0: off), as in older versions
+ *	"none"		off
+ *	"CODEC"		codec with its default level
+ *	"CODEC:LEVEL"	codec with given level
+ */
+bool at_codec_parse(const char *s, at_codec_spec *spec)
+{
+	*spec = at_codec_spec();
+	if (s == nullptr || *s == '\0' || strcasecmp(s, "none") == 0 ||
+	    strcasecmp(s, "no") == 0)
+		return true;
+	char *end = nullptr;
+	auto lvl = strtol(s, &end, 0);
+	if (end != s && *end == '\0') {
+		spec->legacy = true;
+		if (lvl <= 0)
+			return true;
+		spec->codec = at_codec_list()[0];
+		spec->level = std::min(lvl, static_cast<long>(Z_BEST_COMPRESSION));
+		return true;
+	}
+	std::string name(s);
+	auto colon = name.find(':');
+	if (colon != std::string::npos)
+		name.erase(colon);
+	spec->codec = at_codec_find(name.c_str());
+	if (spec->codec == nullptr) {
+		ec_log_err("attachment_compression: codec \"%s\" is not available in this build", name.c_str());
+		return false;
+	}
+	spec->level = colon != std::string::npos ? strtol(s + colon + 1, nullptr, 0) :
+	              spec->codec->default_level();
+	return true;
+}
+
+} /* namespace */
@@ -0,0 +1,71 @@
+/*
+ * SPDX-License-Identifier: AGPL-3.0-only
+ * Copyright 2005 - 2016 Zarafa and its licensors
+ */
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <sys/types.h>
+#include <kopano/zcdefs.h>
+
+namespace KC {
+
+/**
+ * Decompressing reader on an open file descriptor. The descriptor remains
+ * owned by the caller.
+ */
+class KC_EXPORT at_codec_reader {
+	public:
+	virtual ~at_codec_reader() = default;
+	/* Returns the number of bytes produced, 0 at the end, or -1 on error. */
+	virtual ssize_t read(void *, size_t) = 0;
+};
+
+/**
+ * Compressing writer on an open file descriptor. The descriptor remains owned
+ * by the caller. finish() must be called to complete the file.
+ */
+class KC_EXPORT at_codec_writer {
+	public:
+	virtual ~at_codec_writer() = default;
+	/* Returns the number of bytes consumed, or -1 on error. */
+	virtual ssize_t write(const void *, size_t) = 0;
+	virtual bool finish() = 0;
+};
+
+/**
+ * An attachment compression format. Instances stored with a codec carry its
+ * suffix in the filename, so that every instance can be read back no matter
+ * what attachment_compression is currently set to.
+ */
+class KC_EXPORT at_codec {
+	public:
+	static constexpr size_t unknown_size = SIZE_MAX;
+
+	virtual ~at_codec() = default;
+	virtual const char *name() const = 0;
+	virtual const char *suffix() const = 0;
+	virtual int default_level() const = 0;
+	virtual std::unique_ptr<at_codec_reader> reader(int fd) const = 0;
+	/* @size: uncompressed size if known ahead, for the frame header */
+	virtual std::unique_ptr<at_codec_writer> writer(int fd, int level, size_t size = unknown_size) const = 0;
+	/* Uncompressed size of the file, or -1 */
+	virtual ssize_t content_size(int fd) const;
+};
+
+struct at_codec_spec {
+	const at_codec *codec = nullptr; /* nullptr: store uncompressed */
+	int level = 0;
+	/* Old-style numeric gzip level rather than a codec name */
+	bool legacy = false;
+};
+
+/* All codecs built into this server; gzip is always first */
+extern KC_EXPORT const std::vector<const at_codec *> &at_codec_list();
+extern KC_EXPORT const at_codec *at_codec_find(const char *name);
+extern KC_EXPORT bool at_codec_parse(const char *, at_codec_spec *);
+
+} /* namespace */
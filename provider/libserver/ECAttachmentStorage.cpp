@@ -12,6 +12,7 @@
 #include <set>
 #include <string>
 #include <utility>
+#include <vector>
 #include <climits>
 #include <cstring>
 #include <mapidefs.h>
@@ -21,12 +22,15 @@
 #include <fcntl.h>
 #include <zlib.h>
 #include <ECSerializer.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <libHX/io.h>
 #include <libHX/string.h>
+#include "ECAttachmentCodec.h"
 #include "ECAttachmentStorage.h"
+#include "ECChunkStore.h"
 #include "SOAPUtils.h"
 #include <kopano/ECLogger.h>
 #include <kopano/MAPIErrors.h>
@@ -42,30 +46,6 @@ using namespace std::string_literals;
 
 namespace KC {
 
-class gz_ptr {
-	public:
-	gz_ptr(int &fd, const char *file) : m_fd(fd), m_fp(gzdopen(fd, file)) {}
-	~gz_ptr() {
-		if (m_fp != nullptr)
-			close();
-	}
-	operator gzFile() const { return m_fp; }
-	int close() {
-		if (m_fp == nullptr)
-			return Z_OK;
-		auto ret = gzclose(m_fp);
-		if (ret != Z_OK)
-			ec_log_err("gzclose: %s", ret == Z_ERRNO ? strerror(errno) : "buffer error");
-		m_fd = -1;
-		m_fp = nullptr;
-		return ret;
-	}
-
-	private:
-	int &m_fd;
-	gzFile m_fp = nullptr;
-};
-
 class ECDatabaseAttachmentConfig final : public ECAttachmentConfig {
 	public:
 	virtual ECAttachmentStorage *new_handle(ECDatabase *) override;
@@ -78,13 +58,16 @@ class ECFileAttachmentConfig : public ECAttachmentConfig {
 
 	protected:
 	std::string m_dir;
-	unsigned int m_complvl, m_l1 = 0, m_l2 = 0;
+	at_codec_spec m_codec;
+	unsigned int m_l1 = 0, m_l2 = 0;
+	/* Average chunk size for deduplicated files_v2 instances (0: off) */
+	size_t m_chunk_avg = 0;
 	bool m_sync_files;
 };
 
 class ECFileAttachment : public ECAttachmentStorage {
 	public:
-	ECFileAttachment(ECDatabase *, const std::string &basepath, unsigned int compr_lvl, unsigned int l1, unsigned int l2, bool sync);
+	ECFileAttachment(ECDatabase *, const std::string &basepath, const at_codec_spec &, unsigned int l1, unsigned int l2, bool sync);
 
 	protected:
 	virtual ~ECFileAttachment();
@@ -100,9 +83,13 @@ class ECFileAttachment : public ECAttachmentStorage {
 	virtual kd_trans Begin(ECRESULT &) override;
 	virtual ECRESULT Commit() override;
 	virtual ECRESULT Rollback() override;
-	ECRESULT load_instance_z(struct soap *, const ext_siid &instance_id, int &fd, const std::string &filename, size_t *size, unsigned char **data);
+	ECRESULT load_instance_z(struct soap *, const ext_siid &instance_id, int fd, const at_codec *, const std::string &filename, size_t *size, unsigned char **data);
 	ECRESULT load_instance_u(struct soap *, int &fd, const std::string &filename, size_t *size, unsigned char **data);
-	ECRESULT save_instance_data(const std::string &filename, int fd, unsigned int propid, size_t z, unsigned char *data, bool comp);
+	unsigned char *map_instance(struct soap *, int fd, size_t size);
+	ECRESULT load_instance_stream(const ext_siid &instance_id, int fd, const at_codec *, const std::string &filename, size_t *size, ECSerializer *);
+	ECRESULT save_instance_data(const std::string &filename, int fd, unsigned int propid, size_t z, unsigned char *data, const at_codec *);
+	std::vector<const at_codec *> instance_codecs() const;
+	int open_instance(const std::string &stem, const at_codec **, std::string *filename);
 
 	size_t attachment_size_safety_limit;
 	bool force_changes_to_disk;
@@ -113,9 +100,12 @@ class ECFileAttachment : public ECAttachmentStorage {
 	void my_readahead(int fd);
 
 	std::string m_basepath;
+	/* Codec for new instances (nullptr: uncompressed) */
+	const at_codec *m_codec;
+	int m_level;
 
 	private:
-	std::string CreateAttachmentFilename(const ext_siid &, bool compressed);
+	std::string CreateAttachmentFilename(const ext_siid &, const at_codec *);
 	ECRESULT MarkAttachmentForDeletion(const ext_siid &);
 	ECRESULT DeleteMarkedAttachment(const ext_siid &);
 	ECRESULT RestoreMarkedAttachment(const ext_siid &);
@@ -140,7 +130,7 @@ class ECFileAttachmentConfig2 final : public ECFileAttachmentConfig {
 
 class ECFileAttachment2 final : public ECFileAttachment {
 	public:
-	ECFileAttachment2(ECFileAttachmentConfig2 &, ECDatabase *, const std::string &basepath, unsigned int complvl, bool sync);
+	ECFileAttachment2(ECFileAttachmentConfig2 &, ECDatabase *, const std::string &basepath, const at_codec_spec &, bool sync);
 
 	protected:
 	virtual ECRESULT SaveAttachmentInstance(ext_siid &, ULONG propid, size_t, unsigned char *) override;
@@ -149,6 +139,8 @@ class ECFileAttachment2 final : public ECFileAttachment {
 	virtual ECRESULT DeleteAttachmentInstance(const ext_siid &, bool replace) override;
 	virtual ECRESULT LoadAttachmentInstance(struct soap *, const ext_siid &, size_t *, unsigned char **) override;
 	virtual ECRESULT LoadAttachmentInstance(const ext_siid &, size_t *, ECSerializer *) override;
+	ECRESULT load_chunked(struct soap *, const std::string &dir, size_t *, unsigned char **);
+	ECRESULT load_chunked(const std::string &dir, size_t *, ECSerializer *);
 	ECFileAttachmentConfig2 &m_config;
 };
 
@@ -162,8 +154,8 @@ static const char fa_hex[] = "0123456789abcdef";
 // chunk size for attachment blobs, must be equal or larger than MAX, MAX may never shrink below 384*1024.
 #define CHUNK_SIZE (384 * 1024)
 
-// as advised by http://www.zlib.net/manual.html we use a 128KB buffer; default is only 8KB
-#define ZLIB_BUFFER_SIZE std::max(CHUNK_SIZE, 128 * 1024)
+// uncompressed instances from this size on are handed to gsoap as a file mapping
+#define MMAP_MIN_SIZE (256 * 1024)
 
 /*
  * Locking requirements of ECAttachmentStorage:
@@ -324,14 +316,18 @@ ECRESULT ECFileAttachmentConfig::init(std::shared_ptr<ECConfig> config)
 	auto sync_files_par = config->GetSetting("attachment_files_fsync");
 	auto comp = config->GetSetting("attachment_compression");
 	m_dir = dir;
-	m_complvl = (comp == nullptr) ? 0 : strtoul(comp, nullptr, 0);
+	if (!at_codec_parse(comp, &m_codec))
+		return KCERR_INVALID_PARAMETER;
+	auto chunk = config->GetSetting("attachment_chunk_size");
+	if (chunk != nullptr)
+		m_chunk_avg = strtoull(chunk, nullptr, 0);
 	m_sync_files = sync_files_par == nullptr || strcasecmp(sync_files_par, "yes") == 0;
 	return erSuccess;
 }
 
 ECAttachmentStorage *ECFileAttachmentConfig::new_handle(ECDatabase *db)
 {
-	return new(std::nothrow) ECFileAttachment(db, m_dir, m_complvl, m_l1, m_l2, m_sync_files);
+	return new(std::nothrow) ECFileAttachment(db, m_dir, m_codec, m_l1, m_l2, m_sync_files);
 }
 
 /**
@@ -1134,10 +1130,11 @@ ECRESULT ECDatabaseAttachment::Rollback()
 
 // Attachment storage is in separate files
 ECFileAttachment::ECFileAttachment(ECDatabase *lpDatabase,
-    const std::string &basepath, unsigned int ulCompressionLevel,
+    const std::string &basepath, const at_codec_spec &spec,
     unsigned int l1, unsigned int l2, bool sync_to_disk) :
-	ECAttachmentStorage(lpDatabase, ulCompressionLevel),
-	m_basepath(basepath), m_l1(l1), m_l2(l2)
+	ECAttachmentStorage(lpDatabase, spec.codec != nullptr ? std::max(spec.level, 1) : 0),
+	m_basepath(basepath), m_codec(spec.codec), m_level(spec.level),
+	m_l1(l1), m_l2(l2)
 {
 	if (m_basepath.empty())
 		m_basepath = "/var/lib/kopano";
@@ -1163,94 +1160,41 @@ ECFileAttachment::~ECFileAttachment()
 }
 
 /**
- * @uclen:	number of uncompressed bytes that is requested
+ * Codecs that an existing instance may have been stored with, in the order
+ * to probe for them: the configured one, uncompressed, then the rest.
  */
-static ssize_t gzread_retry(gzFile fp, void *data, size_t uclen)
+std::vector<const at_codec *> ECFileAttachment::instance_codecs() const
 {
-	ssize_t read_total = 0;
-	auto buf = static_cast<char *>(data);
-
-	if (uclen == 0)
-		/* Avoid useless churn. */
-		return 0;
-
-	while (uclen > 0) {
-		auto chunk_size = std::min(uclen, static_cast<size_t>(INT_MAX));
-		int ret = gzread(fp, buf, chunk_size);
-
-		/*
-		 * Save @errno now, since gzerror() code looks prone to
-		 * reset it.
-		 */
-		int saved_errno = errno, zerror;
-		const char *zerrstr = gzerror(fp, &zerror);
-
-		if (ret < 0 && zerror == Z_ERRNO &&
-		    (saved_errno == EINTR || saved_errno == EAGAIN))
-			/* Server delay (cf. gzread_write) */
-			continue;
-		if (ret < 0 && zerror == Z_ERRNO) {
-			ec_log_err("gzread: %s (%d): %s",
-			         zerrstr, zerror, strerror(saved_errno));
-			return ret;
-		}
-		if (ret < 0) {
-			ec_log_err("gzread: %s (%d)", zerrstr, zerror);
-			return ret;
-		}
-		if (ret == 0)
-			/*
-			 * EOF (since we already excluded chunk_size==0
-			 * requests).
-			 */
-			break;
-		buf += ret;
-		read_total += ret;
-		uclen -= ret;
-	}
-	return read_total;
+	std::vector<const at_codec *> v{m_codec};
+	if (m_codec != nullptr)
+		v.push_back(nullptr);
+	for (auto c : at_codec_list())
+		if (c != m_codec)
+			v.push_back(c);
+	return v;
 }
 
-static ssize_t gzwrite_retry(gzFile fp, const void *data, size_t uclen)
+/**
+ * Open an existing instance file, whichever codec suffix it has.
+ *
+ * @stem:	filename without codec suffix
+ * @codec:	(out) codec of the file found
+ * @filename:	(out) name of the file opened (or the last one tried)
+ *
+ * Returns the fd, or -1 with errno set. ENOENT means no variant exists.
+ */
+int ECFileAttachment::open_instance(const std::string &stem,
+    const at_codec **codec, std::string *filename)
 {
-	size_t wrote_total = 0;
-	auto buf = static_cast<const char *>(data);
-
-	if (uclen == 0)
-		/* Avoid useless churn. */
-		return 0;
-
-	while (uclen > 0) {
-		auto chunk_size = std::min(uclen, static_cast<size_t>(INT_MAX));
-		int ret = gzwrite(fp, buf, chunk_size);
-		int saved_errno = errno, zerror;
-		const char *zerrstr = gzerror(fp, &zerror);
-
-		if (ret < 0 && zerror == Z_ERRNO &&
-		    (saved_errno == EINTR || saved_errno == EAGAIN))
-			/*
-			 * Choosing to continue reading can delay server
-			 * shutdown... but we are in a soap handler, so
-			 * whatelse could we do.
-			 */
-			continue;
-		if (ret < 0 && zerror == Z_ERRNO) {
-			ec_log_err("gzwrite: %s (%d): %s",
-			         zerrstr, zerror, strerror(saved_errno));
-			return ret;
-		}
-		if (ret < 0) {
-			ec_log_err("gzwrite: %s (%d)", zerrstr, zerror);
-			return ret;
-		}
-		if (ret == 0)
-			/* ??? - could happen if the file is not open for write */
-			break;
-		buf += ret;
-		wrote_total += ret;
-		uclen -= ret;
+	for (auto c : instance_codecs()) {
+		*codec = c;
+		*filename = c != nullptr ? stem + c->suffix() : stem;
+		int fd = open(filename->c_str(), O_RDONLY);
+		if (fd >= 0 || errno != ENOENT)
+			return fd;
 	}
-	return wrote_total;
+	errno = ENOENT;
+	return -1;
 }
 
 bool ECFileAttachment::VerifyInstanceSize(const ext_siid &instanceId,
@@ -1274,28 +1218,23 @@ bool ECFileAttachment::VerifyInstanceSize(const ext_siid &instanceId,
 }
 
 ECRESULT ECFileAttachment::load_instance_z(struct soap *soap,
-    const ext_siid &ulInstanceId, int &fd, const std::string &filename,
-    size_t *lpiSize, unsigned char **lppData)
+    const ext_siid &ulInstanceId, int fd, const at_codec *codec,
+    const std::string &filename, size_t *lpiSize, unsigned char **lppData)
 {
 	std::unique_ptr<unsigned char[]> temp;
-	gz_ptr gzfp(fd, "rb");
-	if (!gzfp) {
+	auto rd = codec->reader(fd);
+	if (rd == nullptr) {
 		// do not use KCERR_NOT_FOUND: the file is already open so it exists
 		// so something else is going wrong here
-		ec_log_err("ECFileAttachment::LoadAttachmentInstance(SOAP): cannot gzopen attachment \"%s\": %s", filename.c_str(), strerror(errno));
+		ec_log_err("ECFileAttachment::LoadAttachmentInstance(SOAP): cannot open %s reader on attachment \"%s\"", codec->name(), filename.c_str());
 		return KCERR_UNKNOWN;
 	}
 
-#if ZLIB_VERNUM >= 0x1240
-	if (gzbuffer(gzfp, ZLIB_BUFFER_SIZE) == -1)
-		ec_log_warn("gzbuffer failed");
-#endif
-
 	size_t memory_block_size = 0;
 
 	for (;;)
 	{
-		int ret = -1;
+		ssize_t ret = -1;
 
 		if (memory_block_size == *lpiSize) {
 			if (memory_block_size)
@@ -1314,10 +1253,10 @@ ECRESULT ECFileAttachment::load_instance_z(struct soap *soap,
 			temp.reset(new_temp);
 		}
 
-		ret = gzread_retry(gzfp, &temp[*lpiSize], memory_block_size - *lpiSize);
+		ret = rd->read(&temp[*lpiSize], memory_block_size - *lpiSize);
 
 		if (ret < 0) {
-			ec_log_err("ECFileAttachment::LoadAttachmentInstance(SOAP): Error while gzreading attachment data from \"%s\"", filename.c_str());
+			ec_log_err("ECFileAttachment::LoadAttachmentInstance(SOAP): Error while decompressing (%s) attachment data from \"%s\"", codec->name(), filename.c_str());
 			//return KCERR_DATABASE_ERROR;
 			*lpiSize = 0;
 			break;
@@ -1343,6 +1282,33 @@ ECRESULT ECFileAttachment::load_instance_z(struct soap *soap,
 	return erSuccess;
 }
 
+/**
+ * Map an uncompressed instance for use as reply data, instead of copying it
+ * onto the soap heap. The pages come from the page cache, so the worker does
+ * not hold a private copy of large attachments, and the read() copy is gone.
+ * The mapping is released by kopano_end_soap_request after the reply has
+ * been sent. Instance files are never rewritten in place (only created and
+ * unlinked), so the mapping cannot shrink underneath gsoap.
+ *
+ * Returns nullptr if the caller should fall back to reading; that is also the
+ * case for soap objects that are not a client connection's, whose data
+ * outlives the request.
+ */
+unsigned char *ECFileAttachment::map_instance(struct soap *soap, int fd,
+    size_t size)
+{
+	if (soap == nullptr || soap->user == nullptr || size < MMAP_MIN_SIZE)
+		return nullptr;
+	auto addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		ec_log_debug("ECFileAttachment: mmap: %s", strerror(errno));
+		return nullptr;
+	}
+	madvise(addr, size, MADV_SEQUENTIAL);
+	soap_info(soap)->file_maps.emplace_back(addr, size);
+	return static_cast<unsigned char *>(addr);
+}
+
 ECRESULT ECFileAttachment::load_instance_u(struct soap *soap, int &fd,
     const std::string &filename, size_t *lpiSize, unsigned char **lppData)
 {
@@ -1369,6 +1335,9 @@ ECRESULT ECFileAttachment::load_instance_u(struct soap *soap, int &fd,
 		return erSuccess;
 	}
 
+	*lppData = map_instance(soap, fd, *lpiSize);
+	if (*lppData != nullptr)
+		return erSuccess;
 	*lppData = soap_new_unsignedByte(soap, *lpiSize);
 
 	/* Uncompressed attachment */
@@ -1404,28 +1373,22 @@ ECRESULT ECFileAttachment::LoadAttachmentInstance(struct soap *soap,
     const ext_siid &ulInstanceId, size_t *lpiSize, unsigned char **lppData)
 {
 	ECRESULT er = erSuccess;
-	bool bCompressed = m_bFileCompression;
+	const at_codec *codec = nullptr;
+	std::string filename;
 
 	*lpiSize = 0;
-	auto filename = CreateAttachmentFilename(ulInstanceId, bCompressed);
-	int fd = open(filename.c_str(), O_RDONLY);
+	int fd = open_instance(CreateAttachmentFilename(ulInstanceId, nullptr), &codec, &filename);
 	if (fd < 0 && errno != ENOENT) {
 		/* Access problems */
 		ec_log_err("K-1561: cannot open attachment \"%s\": %s", filename.c_str(), strerror(errno));
 		return KCERR_NO_ACCESS;
 	} else if (fd < 0) {
-		/* Switch between compressed↔uncompressed, and try again. */
-		bCompressed = !bCompressed;
-		filename = CreateAttachmentFilename(ulInstanceId, bCompressed);
-		fd = open(filename.c_str(), O_RDONLY);
-		if (fd < 0) {
-			ec_log_err("K-1562: cannot open attachment \"%s\": %s", filename.c_str(), strerror(errno));
-			return KCERR_NOT_FOUND;
-		}
+		ec_log_err("K-1562: cannot open attachment \"%s\": %s", filename.c_str(), strerror(errno));
+		return KCERR_NOT_FOUND;
 	}
 	my_readahead(fd);
-	if (bCompressed)
-		er = load_instance_z(soap, ulInstanceId, fd, filename, lpiSize, lppData);
+	if (codec != nullptr)
+		er = load_instance_z(soap, ulInstanceId, fd, codec, filename, lpiSize, lppData);
 	else
 		er = load_instance_u(soap, fd, filename, lpiSize, lppData);
 	if (fd >= 0)
@@ -1433,6 +1396,41 @@ ECRESULT ECFileAttachment::LoadAttachmentInstance(struct soap *soap,
 	return er;
 }
 
+ECRESULT ECFileAttachment::load_instance_stream(const ext_siid &ulInstanceId,
+    int fd, const at_codec *codec, const std::string &filename,
+    size_t *lpiSize, ECSerializer *lpSink)
+{
+	char buffer[CHUNK_SIZE];
+	std::unique_ptr<at_codec_reader> rd;
+
+	if (codec != nullptr) {
+		rd = codec->reader(fd);
+		if (rd == nullptr)
+			return KCERR_UNKNOWN;
+	}
+	for (;;) {
+		ssize_t lReadNow = rd != nullptr ? rd->read(buffer, sizeof(buffer)) :
+		                   read_retry(fd, buffer, sizeof(buffer));
+		if (lReadNow < 0 && rd != nullptr) {
+			ec_log_err("ECFileAttachment::LoadAttachmentInstance(): Error while decompressing (%s) attachment data from \"%s\".", codec->name(), filename.c_str());
+			return KCERR_DATABASE_ERROR;
+		} else if (lReadNow < 0) {
+			ec_log_err("ECFileAttachment::LoadAttachmentInstance(SOAP): Error while reading attachment data from \"%s\": %s", filename.c_str(), strerror(errno));
+			return KCERR_DATABASE_ERROR;
+		}
+
+		if (lReadNow == 0)
+			break;
+
+		lpSink->Write(buffer, 1, lReadNow);
+
+		*lpiSize += lReadNow;
+	}
+	if (rd != nullptr)
+		VerifyInstanceSize(ulInstanceId, *lpiSize, filename);
+	return erSuccess;
+}
+
 /**
  * Load instance data using a serializer.
  *
@@ -1445,83 +1443,22 @@ ECRESULT ECFileAttachment::LoadAttachmentInstance(struct soap *soap,
 ECRESULT ECFileAttachment::LoadAttachmentInstance(const ext_siid &ulInstanceId,
     size_t *lpiSize, ECSerializer *lpSink)
 {
-	ECRESULT er = erSuccess;
-	bool bCompressed = false;
-	char buffer[CHUNK_SIZE];
+	const at_codec *codec = nullptr;
+	std::string filename;
 
 	*lpiSize = 0;
-	auto filename = CreateAttachmentFilename(ulInstanceId, bCompressed);
-	auto fd = open(filename.c_str(), O_RDONLY);
+	auto fd = open_instance(CreateAttachmentFilename(ulInstanceId, nullptr), &codec, &filename);
 	if (fd < 0 && errno != ENOENT) {
 		/* Access problems */
 		ec_log_err("K-1563: cannot open attachment \"%s\": %s", filename.c_str(), strerror(errno));
 		return KCERR_NO_ACCESS;
 	} else if (fd < 0) {
-		/* Not found, try gzip */
-		bCompressed = true;
-		filename = CreateAttachmentFilename(ulInstanceId, bCompressed);
-		fd = open(filename.c_str(), O_RDONLY);
-		if (fd < 0) {
-			ec_log_err("K-1564: cannot open attachment \"%s\": %s", filename.c_str(), strerror(errno));
-			return KCERR_NOT_FOUND;
-		}
+		ec_log_err("K-1564: cannot open attachment \"%s\": %s", filename.c_str(), strerror(errno));
+		return KCERR_NOT_FOUND;
 	}
 	my_readahead(fd);
-
-	if (bCompressed) {
-		/* Compressed attachment */
-		gz_ptr gzfp(fd, "rb");
-		if (!gzfp) {
-			er = KCERR_UNKNOWN;
-			goto exit;
-		}
-
-#if ZLIB_VERNUM >= 0x1240
-		if (gzbuffer(gzfp, ZLIB_BUFFER_SIZE) == -1)
-			ec_log_warn("gzbuffer failed");
-#endif
-
-		for(;;) {
-			ssize_t lReadNow = gzread_retry(gzfp, buffer, sizeof(buffer));
-			if (lReadNow < 0) {
-				ec_log_err("ECFileAttachment::LoadAttachmentInstance(): Error while gzreading attachment data from \"%s\".", filename.c_str());
-				er = KCERR_DATABASE_ERROR;
-				goto exit;
-			}
-
-			if (lReadNow == 0)
-				break;
-
-			lpSink->Write(buffer, 1, lReadNow);
-
-			*lpiSize += lReadNow;
-		}
-
-		if (er == erSuccess)
-			VerifyInstanceSize(ulInstanceId, *lpiSize, filename);
-	}
-	else {
-		for(;;) {
-			ssize_t lReadNow = read_retry(fd, buffer, sizeof(buffer));
-			if (lReadNow < 0) {
-				ec_log_err("ECFileAttachment::LoadAttachmentInstance(SOAP): Error while reading attachment data from \"%s\": %s", filename.c_str(), strerror(errno));
-				er = KCERR_DATABASE_ERROR;
-				goto exit;
-			}
-
-			if (lReadNow == 0)
-				break;
-
-			lpSink->Write(buffer, 1, lReadNow);
-
-			*lpiSize += lReadNow;
-		}
-	}
-
-exit:
-	if (fd != -1)
-		close(fd);
-
+	auto er = load_instance_stream(ulInstanceId, fd, codec, filename, lpiSize, lpSink);
+	close(fd);
 	return er;
 }
 
@@ -1606,32 +1543,32 @@ static bool EvaluateCompressibleness(const uint8_t *const lpData, const size_t i
  * @param[in] ulPropId unused, required by interface, see ECDatabaseAttachment
  * @param[in] iSize size of lpData
  * @param[in] lpData Data of property
+ * @param[in] codec compression to apply, or nullptr
  *
  * @return Kopano error code
  */
 ECRESULT ECFileAttachment::save_instance_data(const std::string &filename, int fd,
-    ULONG ulPropId, size_t iSize, unsigned char *lpData, bool compressAttachment)
+    ULONG ulPropId, size_t iSize, unsigned char *lpData, const at_codec *codec)
 {
 	ECRESULT er = erSuccess;
 
 	// no need to remove the file, just overwrite it
-	if (compressAttachment) {
-		gz_ptr gzfp(fd, ("wb" + m_CompressionLevel).c_str());
-		if (!gzfp) {
-			ec_log_err("Unable to gzopen attachment \"%s\" for writing: %s", filename.c_str(), strerror(errno));
+	if (codec != nullptr) {
+		auto wr = codec->writer(fd, m_level, iSize);
+		if (wr == nullptr) {
+			ec_log_err("Unable to open %s writer on attachment \"%s\"", codec->name(), filename.c_str());
 			er = KCERR_DATABASE_ERROR;
 			goto exit;
 		}
 
-		ssize_t iWritten = gzwrite_retry(gzfp, lpData, iSize);
+		ssize_t iWritten = wr->write(lpData, iSize);
 		if (iWritten != static_cast<ssize_t>(iSize)) {
-			ec_log_err("Unable to gzwrite %zu bytes to attachment \"%s\", returned %zd.",
-				iSize, filename.c_str(), iWritten);
+			ec_log_err("Unable to compress (%s) %zu bytes to attachment \"%s\", returned %zd.",
+				codec->name(), iSize, filename.c_str(), iWritten);
 			er = KCERR_DATABASE_ERROR;
 			goto exit;
 		}
-		auto ret = gzfp.close();
-		if (ret != Z_OK)
+		if (!wr->finish())
 			er = KCERR_DATABASE_ERROR;
 	}
 	else {
@@ -1654,14 +1591,14 @@ exit:
 ECRESULT ECFileAttachment::SaveAttachmentInstance(ext_siid &instance,
     unsigned int propid, size_t dsize, unsigned char *data)
 {
-	auto comp = EvaluateCompressibleness(data, dsize) ? m_bFileCompression && dsize > 0 : false;
-	auto filename = CreateAttachmentFilename(instance, comp);
+	auto codec = EvaluateCompressibleness(data, dsize) && dsize > 0 ? m_codec : nullptr;
+	auto filename = CreateAttachmentFilename(instance, codec);
 	int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR | S_IRGRP);
 	if (fd < 0) {
 		ec_log_err("Unable to open attachment \"%s\" for writing: %s", filename.c_str(), strerror(errno));
 		return KCERR_DATABASE_ERROR;
 	}
-	auto ret = save_instance_data(filename, fd, propid, dsize, data, comp);
+	auto ret = save_instance_data(filename, fd, propid, dsize, data, codec);
 	if (ret == erSuccess && m_bTransaction)
 		/* set in transaction before disk full check to remove empty file */
 		m_setNewAttachment.emplace(instance);
@@ -1682,9 +1619,10 @@ ECRESULT ECFileAttachment::SaveAttachmentInstance(ext_siid &ulInstanceId,
     ULONG ulPropId, size_t iSize, ECSerializer *lpSource)
 {
 	ECRESULT er = erSuccess;
-	auto filename = CreateAttachmentFilename(ulInstanceId, m_bFileCompression);
+	auto filename = CreateAttachmentFilename(ulInstanceId, m_codec);
 	unsigned char szBuffer[CHUNK_SIZE];
 	size_t iSizeLeft = iSize;
+	std::unique_ptr<at_codec_writer> wr;
 
 	int fd = open(filename.c_str(), O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
 	if (fd == -1) {
@@ -1694,101 +1632,58 @@ ECRESULT ECFileAttachment::SaveAttachmentInstance(ext_siid &ulInstanceId,
 	}
 
 	//no need to remove the file, just overwrite it
-	if (m_bFileCompression) {
-		gz_ptr gzfp(fd, ("wb" + m_CompressionLevel).c_str());
-		if (!gzfp) {
-			ec_log_err("Unable to gzdopen attachment \"%s\" for writing: %s",
-				filename.c_str(), strerror(errno));
-			er = KCERR_DATABASE_ERROR;
-			goto exit;
-		}
-
-		// file created on disk, now in transaction
-		if (m_bTransaction)
-			m_setNewAttachment.emplace(ulInstanceId);
-
-		while (iSizeLeft > 0) {
-			size_t iChunkSize = iSizeLeft < CHUNK_SIZE ? iSizeLeft : CHUNK_SIZE;
-
-			er = lpSource->Read(szBuffer, 1, iChunkSize);
-			if (er != erSuccess) {
-				ec_log_err("Problem retrieving attachment from ECSource: %s (0x%x)", GetMAPIErrorMessage(kcerr_to_mapierr(er, ~0U /* anything yielding UNKNOWN */)), er);
-				er = KCERR_DATABASE_ERROR;
-				break;
-			}
-
-			ssize_t iWritten = gzwrite_retry(gzfp, szBuffer, iChunkSize);
-			if (iWritten != static_cast<ssize_t>(iChunkSize)) {
-				ec_log_err("Unable to gzwrite %zu bytes to attachment \"%s\", returned %zd",
-					iChunkSize, filename.c_str(), iWritten);
-				er = KCERR_DATABASE_ERROR;
-				break;
-			}
-
-			iSizeLeft -= iChunkSize;
-		}
-
-		if (er == erSuccess) {
-			if (gzflush(gzfp, 0)) {
-				int saved_errno = errno, zerror;
-				const char *zstrerr = gzerror(gzfp, &zerror);
-				ec_log_err("gzflush failed: %s (%d)", zstrerr, zerror);
-				if (zerror == Z_ERRNO)
-					ec_log_err("gzflush failed: stdio says: %s", strerror(saved_errno));
-				er = KCERR_DATABASE_ERROR;
-			}
-
-			if (force_changes_to_disk && !force_buffers_to_disk(fd)) {
-				ec_log_warn("Problem syncing file \"%s\": %s", filename.c_str(), strerror(errno));
-				er = KCERR_DATABASE_ERROR;
-			}
+	if (m_codec != nullptr) {
+		/* The size is known ahead, which lets zstd/lz4 record it in the frame header. */
+		wr = m_codec->writer(fd, m_level, iSize);
+		if (wr == nullptr) {
+			ec_log_err("Unable to open %s writer on attachment \"%s\"",
+				m_codec->name(), filename.c_str());
+			close(fd);
+			return KCERR_DATABASE_ERROR;
 		}
-		auto ret = gzfp.close();
-		if (ret != Z_OK)
-			er = KCERR_DATABASE_ERROR;
-	}
-	else {
+	} else {
 		give_filesize_hint(fd, iSize);
+	}
 
-		// file created on disk, now in transaction
-		if (m_bTransaction)
-			m_setNewAttachment.emplace(ulInstanceId);
-
-		while (iSizeLeft > 0) {
-			size_t iChunkSize = iSizeLeft < CHUNK_SIZE ? iSizeLeft : CHUNK_SIZE;
-
-			er = lpSource->Read(szBuffer, 1, iChunkSize);
-			if (er != erSuccess) {
-				ec_log_err("Problem retrieving attachment from ECSource: %s (0x%x)", GetMAPIErrorMessage(kcerr_to_mapierr(er, ~0U)), er);
-				er = KCERR_DATABASE_ERROR;
-				break;
-			}
+	// file created on disk, now in transaction
+	if (m_bTransaction)
+		m_setNewAttachment.emplace(ulInstanceId);
 
-			ssize_t iWritten = write_retry(fd, szBuffer, iChunkSize);
-			if (iWritten != static_cast<ssize_t>(iChunkSize)) {
-				ec_log_err("Unable to write %zu bytes to streaming attachment: %s", iChunkSize, strerror(errno));
-				er = KCERR_DATABASE_ERROR;
-				break;
-			}
+	while (iSizeLeft > 0) {
+		size_t iChunkSize = iSizeLeft < CHUNK_SIZE ? iSizeLeft : CHUNK_SIZE;
 
-			iSizeLeft -= iChunkSize;
+		er = lpSource->Read(szBuffer, 1, iChunkSize);
+		if (er != erSuccess) {
+			ec_log_err("Problem retrieving attachment from ECSource: %s (0x%x)", GetMAPIErrorMessage(kcerr_to_mapierr(er, ~0U /* anything yielding UNKNOWN */)), er);
+			er = KCERR_DATABASE_ERROR;
+			break;
 		}
 
-		if (er == erSuccess && force_changes_to_disk && !force_buffers_to_disk(fd)) {
-			ec_log_warn("Problem syncing file \"%s\": %s", filename.c_str(), strerror(errno));
+		ssize_t iWritten = wr != nullptr ? wr->write(szBuffer, iChunkSize) :
+		                   write_retry(fd, szBuffer, iChunkSize);
+		if (iWritten != static_cast<ssize_t>(iChunkSize)) {
+			if (wr != nullptr)
+				ec_log_err("Unable to compress (%s) %zu bytes to attachment \"%s\", returned %zd",
+					m_codec->name(), iChunkSize, filename.c_str(), iWritten);
+			else
+				ec_log_err("Unable to write %zu bytes to streaming attachment: %s", iChunkSize, strerror(errno));
 			er = KCERR_DATABASE_ERROR;
+			break;
 		}
 
-		close(fd);
-		fd = -1;
+		iSizeLeft -= iChunkSize;
 	}
 
-exit:
+	if (er == erSuccess && wr != nullptr && !wr->finish())
+		er = KCERR_DATABASE_ERROR;
+	if (er == erSuccess && force_changes_to_disk && !force_buffers_to_disk(fd)) {
+		ec_log_warn("Problem syncing file \"%s\": %s", filename.c_str(), strerror(errno));
+		er = KCERR_DATABASE_ERROR;
+	}
+	wr.reset();
+	close(fd);
 	if (er == erSuccess && m_dirFd != -1 && fsync(m_dirFd) == -1)
 		ec_log_warn("Problem syncing parent directory of \"%s\": %s", filename.c_str(), strerror(errno));
-	if (fd != -1)
-		close(fd);
-
 	return er;
 }
 
@@ -1825,16 +1720,13 @@ ECRESULT ECFileAttachment::DeleteAttachmentInstances(const std::list<ext_siid> &
  */
 ECRESULT ECFileAttachment::MarkAttachmentForDeletion(const ext_siid &ulInstanceId)
 {
-	auto filename = CreateAttachmentFilename(ulInstanceId, m_bFileCompression);
-
-	if (rename(filename.c_str(), (filename + ".deleted").c_str()) == 0)
-		return erSuccess;
-
-	if (errno == ENOENT) {
-		// retry with another filename
-		filename = CreateAttachmentFilename(ulInstanceId, !m_bFileCompression);
+	for (auto c : instance_codecs()) {
+		auto filename = CreateAttachmentFilename(ulInstanceId, c);
 		if (rename(filename.c_str(), (filename + ".deleted").c_str()) == 0)
 			return erSuccess;
+		if (errno != ENOENT)
+			break;
+		// retry with another filename
 	}
 
 	// FIXME log in all errno cases
@@ -1855,14 +1747,13 @@ ECRESULT ECFileAttachment::MarkAttachmentForDeletion(const ext_siid &ulInstanceI
  */
 ECRESULT ECFileAttachment::RestoreMarkedAttachment(const ext_siid &ulInstanceId)
 {
-	auto filename = CreateAttachmentFilename(ulInstanceId, m_bFileCompression);
-	if (rename((filename + ".deleted").c_str(), filename.c_str()) == 0)
-		return erSuccess;
-	if (errno == ENOENT) {
-		// retry with another filename
-		filename = CreateAttachmentFilename(ulInstanceId, !m_bFileCompression);
+	for (auto c : instance_codecs()) {
+		auto filename = CreateAttachmentFilename(ulInstanceId, c);
 		if (rename((filename + ".deleted").c_str(), filename.c_str()) == 0)
 			return erSuccess;
+		if (errno != ENOENT)
+			break;
+		// retry with another filename
 	}
     if (errno == EACCES || errno == EPERM)
 		return KCERR_NO_ACCESS;
@@ -1881,15 +1772,14 @@ ECRESULT ECFileAttachment::RestoreMarkedAttachment(const ext_siid &ulInstanceId)
  */
 ECRESULT ECFileAttachment::DeleteMarkedAttachment(const ext_siid &ulInstanceId)
 {
-	auto filename = CreateAttachmentFilename(ulInstanceId, m_bFileCompression) + ".deleted";
-
-	if (unlink(filename.c_str()) == 0)
-		return erSuccess;
+	std::string filename;
 
-	if (errno == ENOENT) {
-		filename = CreateAttachmentFilename(ulInstanceId, !m_bFileCompression) + ".deleted";
+	for (auto c : instance_codecs()) {
+		filename = CreateAttachmentFilename(ulInstanceId, c) + ".deleted";
 		if (unlink(filename.c_str()) == 0)
 			return erSuccess;
+		if (errno != ENOENT)
+			break;
 	}
 	ec_log_err("%s unlink %s failed: %s", __PRETTY_FUNCTION__, filename.c_str(), strerror(errno));
 	if (errno == EACCES || errno == EPERM)
@@ -1912,7 +1802,6 @@ ECRESULT ECFileAttachment::DeleteMarkedAttachment(const ext_siid &ulInstanceId)
 ECRESULT ECFileAttachment::DeleteAttachmentInstance(const ext_siid &ulInstanceId, bool bReplace)
 {
 	ECRESULT er = erSuccess;
-	auto filename = CreateAttachmentFilename(ulInstanceId, m_bFileCompression);
 
 	if(m_bTransaction) {
 		if (!bReplace) {
@@ -1929,12 +1818,12 @@ ECRESULT ECFileAttachment::DeleteAttachmentInstance(const ext_siid &ulInstanceId
 		return erSuccess;
 	}
 
-	if (unlink(filename.c_str()) == 0)
-		return er;
-	if (errno == ENOENT) {
-		filename = CreateAttachmentFilename(ulInstanceId, !m_bFileCompression);
+	for (auto c : instance_codecs()) {
+		auto filename = CreateAttachmentFilename(ulInstanceId, c);
 		if (unlink(filename.c_str()) == 0)
 			return erSuccess;
+		if (errno != ENOENT)
+			break;
 	}
 	if (errno == EACCES || errno == EPERM)
 		er = KCERR_NO_ACCESS;
@@ -1949,17 +1838,18 @@ ECRESULT ECFileAttachment::DeleteAttachmentInstance(const ext_siid &ulInstanceId
  * Return a filename for an instance id
  *
  * @param[in] ulInstanceId instance id to convert to a filename
- * @param[in] bCompressed add compression marker to filename
+ * @param[in] codec add the codec's compression marker to filename
  *
  * @return Kopano error code
  */
-std::string ECFileAttachment::CreateAttachmentFilename(const ext_siid &esid, bool bCompressed)
+std::string ECFileAttachment::CreateAttachmentFilename(const ext_siid &esid,
+    const at_codec *codec)
 {
 	unsigned int l1 = esid.siid % m_l1;
 	unsigned int l2 = (esid.siid / m_l1) % m_l2;
 	auto filename = m_basepath + PATH_SEPARATOR + stringify(l1) + PATH_SEPARATOR + stringify(l2) + PATH_SEPARATOR + stringify(esid.siid);
-	if (bCompressed)
-		filename += ".gz";
+	if (codec != nullptr)
+		filename += codec->suffix();
 
 	return filename;
 }
@@ -1976,79 +1866,42 @@ std::string ECFileAttachment::CreateAttachmentFilename(const ext_siid &esid, boo
 ECRESULT ECFileAttachment::GetSizeInstance(const ext_siid &ulInstanceId,
     size_t *lpulSize, bool *lpbCompressed)
 {
-	ECRESULT er = erSuccess;
-	auto filename = CreateAttachmentFilename(ulInstanceId, m_bFileCompression);
-	bool bCompressed = m_bFileCompression;
+	const at_codec *codec = nullptr;
+	std::string filename;
 	struct stat st;
 
 	/*
-	 * We are always going to use the normal FILE handler for determining the file size,
-	 * the gzFile handler is broken since it doesn't support SEEK_END and gzseek itself
-	 * is very slow. When the attachment has been zipped, we are going to read the
-	 * last 4 bytes of the file, which contain the uncompressed filesize
-	 * (provided that there is a single gzip stream).
-	 *
-	 * For uncompressed files we use fstat() which is the fastest as the inode is already
-	 * in memory due to the earlier open().
+	 * For uncompressed files we use fstat() which is the fastest as the
+	 * inode is already in memory due to the earlier open(). Compressed
+	 * files normally record the uncompressed size in the header/trailer
+	 * (see at_codec::content_size).
 	 */
-	int fd = open(filename.c_str(), O_RDONLY);
-	if (fd == -1) {
-		filename = CreateAttachmentFilename(ulInstanceId, !m_bFileCompression);
-		bCompressed = !m_bFileCompression;
-
-		fd = open(filename.c_str(), O_RDONLY);
-	}
-
+	int fd = open_instance(CreateAttachmentFilename(ulInstanceId, nullptr), &codec, &filename);
 	if (fd == -1) {
 		ec_log_err("ECFileAttachment::GetSizeInstance(): file \"%s\" cannot be accessed: %s", filename.c_str(), strerror(errno));
 		return KCERR_NOT_FOUND;
 	}
+	auto cleanup = make_scope_success([&]() { close(fd); });
 
-	/* Uncompressed attachment */
-	if (fstat(fd, &st) == -1) {
-		ec_log_err("ECFileAttachment::GetSizeInstance(): file \"%s\" fstat failed: %s", filename.c_str(), strerror(errno));
-		// FIXME er = KCERR_DATABASE_ERROR;
-		goto exit;
-	}
-
-	if (!bCompressed) {
-		*lpulSize = st.st_size;
-	} else if (st.st_size >= 4) {
-		/* Compressed attachment */
-		// a compressed file of only 4 bytes does not exist so we could
-		// make this minimum size bigger
-		if (lseek(fd, -4, SEEK_END) == -1) {
-			ec_log_err("ECFileAttachment::GetSizeInstance(): file \"%s\" fseek (compressed file) failed: %s", filename.c_str(), strerror(errno));
-			// FIXME er = KCERR_DATABASE_ERROR;
-			goto exit;
-		}
-		// FIXME endianness
-		uint32_t atsize;
-		if (read_retry(fd, &atsize, 4) != 4) {
-			ec_log_err("ECFileAttachment::GetSizeInstance(): file \"%s\" fread failed: %s", filename.c_str(), strerror(errno));
-			// FIXME er = KCERR_DATABASE_ERROR;
-			goto exit;
-		}
-		if (st.st_size >= 40 && atsize == 0) {
-			ec_log_warn("ECFileAttachment: %s seems to be an unsupported multi-stream gzip file (KC-104).", filename.c_str());
-			//er = KCERR_DATABASE_ERROR;
-			goto exit;
+	if (codec == nullptr) {
+		if (fstat(fd, &st) == -1) {
+			ec_log_err("ECFileAttachment::GetSizeInstance(): file \"%s\" fstat failed: %s", filename.c_str(), strerror(errno));
+			// FIXME return KCERR_DATABASE_ERROR;
+			return erSuccess;
 		}
-		*lpulSize = atsize;
+		*lpulSize = st.st_size;
 	} else {
-		*lpulSize = 0;
-		ec_log_debug("ECFileAttachment::GetSizeInstance(): file \"%s\" is truncated!", filename.c_str());
-		// FIXME return some error
+		auto size = codec->content_size(fd);
+		if (size < 0) {
+			ec_log_err("ECFileAttachment::GetSizeInstance(): cannot determine size of \"%s\" (%s)", filename.c_str(), codec->name());
+			// FIXME return KCERR_DATABASE_ERROR;
+			return erSuccess;
+		}
+		*lpulSize = size;
 	}
-
 	if (lpbCompressed)
-		*lpbCompressed = bCompressed;
-
-exit:
-	if (fd != -1)
-		close(fd);
-
-	return er;
+		*lpbCompressed = codec != nullptr;
+	return erSuccess;
 }
 
 kd_trans ECFileAttachment::Begin(ECRESULT &trigger)
@@ -2137,13 +1990,18 @@ ECFileAttachmentConfig2::ECFileAttachmentConfig2(const GUID &g) :
 
 ECAttachmentStorage *ECFileAttachmentConfig2::new_handle(ECDatabase *db)
 {
-	return new(std::nothrow) ECFileAttachment2(*this, db, m_dir, m_complvl, m_sync_files);
+	return new(std::nothrow) ECFileAttachment2(*this, db, m_dir, m_codec, m_sync_files);
 }
 
 ECFileAttachment2::ECFileAttachment2(ECFileAttachmentConfig2 &acf,
-    ECDatabase *db, const std::string &basepath, unsigned int complvl,
+    ECDatabase *db, const std::string &basepath, const at_codec_spec &spec,
     bool sync) :
-	ECFileAttachment(db, basepath, complvl, 0, 0, sync), m_config(acf)
+	/*
+	 * files_v2 has always stored content uncompressed; only compress when
+	 * a codec is explicitly named rather than an old-style gzip level.
+	 */
+	ECFileAttachment(db, basepath, spec.legacy ? at_codec_spec() : spec, 0, 0, sync),
+	m_config(acf)
 {}
 
 ECRESULT ECFileAttachment2::SaveAttachmentInstance(ext_siid &instance,
@@ -2155,8 +2013,10 @@ ECRESULT ECFileAttachment2::SaveAttachmentInstance(ext_siid &instance,
 	auto hl = uas_hash_layout(m_basepath, m_config.m_server_guid, instance);
 	int retries  = 3;
 	auto cleanup = make_scope_success([&]() {
-		if (uploaded)
-			HX_rrmdir(sl.base_dir.c_str());
+		if (!uploaded)
+			return;
+		chunk_release(m_basepath, sl.base_dir);
+		HX_rrmdir(sl.base_dir.c_str());
 	});
 
 	do {
@@ -2186,18 +2046,25 @@ ECRESULT ECFileAttachment2::SaveAttachmentInstance(ext_siid &instance,
 				ec_log_err("K-1298: mkdir -p \"%s\": %s", sl.holder_dir.c_str(), GetMAPIErrorMessage(ret));
 				return KCERR_DATABASE_ERROR;
 			}
-			int fd = open(sl.content_file.c_str(), O_WRONLY | O_CREAT, S_IRWUG);
-			if (fd < 0) {
-				ec_log_err("K-1297: open \"%s\": %s", sl.content_file.c_str(), strerror(errno));
-				return KCERR_DATABASE_ERROR;
-			}
-			ret = save_instance_data(sl.content_file, fd, propid, dsize, data, false); /* closes fd */
-			if (ret != erSuccess) {
-				ec_log_err("K-1296: save_instance_data \"%s\": %s", sl.content_file.c_str(), GetMAPIErrorMessage(ret));
-				close(fd);
-				return ret;
+			if (m_config.m_chunk_avg > 0) {
+				chunk_writer cw(m_basepath, sl.base_dir, m_config.m_chunk_avg, force_changes_to_disk);
+				if (!cw.write(data, dsize) || !cw.finish())
+					return KCERR_DATABASE_ERROR;
+			} else {
+				auto codec = EvaluateCompressibleness(data, dsize) && dsize > 0 ? m_codec : nullptr;
+				auto ctf = codec != nullptr ? sl.content_file + codec->suffix() : sl.content_file;
+				int fd = open(ctf.c_str(), O_WRONLY | O_CREAT, S_IRWUG);
+				if (fd < 0) {
+					ec_log_err("K-1297: open \"%s\": %s", ctf.c_str(), strerror(errno));
+					return KCERR_DATABASE_ERROR;
+				}
+				ret = save_instance_data(ctf, fd, propid, dsize, data, codec); /* closes fd */
+				if (ret != erSuccess) {
+					ec_log_err("K-1296: save_instance_data \"%s\": %s", ctf.c_str(), GetMAPIErrorMessage(ret));
+					return ret;
+				}
 			}
-			fd = open(sl.holder_ref.c_str(), O_WRONLY | O_CREAT, S_IRWUG);
+			int fd = open(sl.holder_ref.c_str(), O_WRONLY | O_CREAT, S_IRWUG);
 			if (fd < 0) {
 				ec_log_err("K-1295: open \"%s\": %s", sl.holder_ref.c_str(), strerror(errno));
 				return KCERR_DATABASE_ERROR;
@@ -2253,51 +2120,77 @@ ECRESULT ECFileAttachment2::SaveAttachmentInstance(ext_siid &instance,
 
 	bool uploaded = true;
 	auto cleanup = make_scope_success([&]() {
-		if (uploaded)
-			HX_rrmdir(sl.base_dir.c_str());
+		if (!uploaded)
+			return;
+		chunk_release(m_basepath, sl.base_dir);
+		HX_rrmdir(sl.base_dir.c_str());
 	});
 	auto ret = CreatePath(sl.holder_dir.c_str(), S_IRWXUG);
 	if (ret != 0 && errno != EEXIST) {
 		ec_log_err("K-1291: mkdir \"%s\": %s", sl.holder_dir.c_str(), strerror(errno));
 		return KCERR_DATABASE_ERROR;
 	}
-	int fd = open(sl.content_file.c_str(), O_WRONLY | O_CREAT, S_IRWUG);
-	if (fd < 0) {
-		ec_log_err("K-1290: open \"%s\": %s", sl.content_file.c_str(), strerror(errno));
-		return KCERR_DATABASE_ERROR;
+	auto ctf = m_codec != nullptr ? sl.content_file + m_codec->suffix() : sl.content_file;
+	std::unique_ptr<chunk_writer> cw;
+	std::unique_ptr<at_codec_writer> wr;
+	int fd = -1;
+	auto fdclose = make_scope_success([&]() {
+		if (fd >= 0)
+			close(fd);
+	});
+	if (m_config.m_chunk_avg > 0) {
+		ctf = sl.base_dir + "/chunklist";
+		cw = std::make_unique<chunk_writer>(m_basepath, sl.base_dir, m_config.m_chunk_avg, force_changes_to_disk);
+	} else {
+		fd = open(ctf.c_str(), O_WRONLY | O_CREAT, S_IRWUG);
+		if (fd < 0) {
+			ec_log_err("K-1290: open \"%s\": %s", ctf.c_str(), strerror(errno));
+			return KCERR_DATABASE_ERROR;
+		}
+		if (m_codec != nullptr) {
+			wr = m_codec->writer(fd, m_level, dsize);
+			if (wr == nullptr)
+				return KCERR_DATABASE_ERROR;
+		} else {
+			give_filesize_hint(fd, dsize);
+		}
 	}
-
-	give_filesize_hint(fd, dsize);
 	while (dsize > 0) {
 		size_t chunk_size = std::min(static_cast<size_t>(CHUNK_SIZE), dsize);
 		char buffer[CHUNK_SIZE];
 		ret = src->Read(buffer, 1, chunk_size);
-		if (ret != erSuccess) {
-			close(fd);
+		if (ret != erSuccess)
 			return ret;
-		}
 		SHA256_Update(&shactx, buffer, chunk_size);
-		ssize_t did_write = write_retry(fd, buffer, chunk_size);
+		ssize_t did_write = cw != nullptr ? (cw->write(buffer, chunk_size) ? chunk_size : -1) :
+		                    wr != nullptr ? wr->write(buffer, chunk_size) :
+		                    write_retry(fd, buffer, chunk_size);
 		if (did_write != static_cast<ssize_t>(chunk_size)) {
 			ec_log_err("K-1289: Unable to write bytes to attachment \"%s\": %s.",
-				sl.content_file.c_str(), strerror(errno));
-			close(fd);
+				ctf.c_str(), strerror(errno));
 			return KCERR_DATABASE_ERROR;
 		}
 		dsize -= chunk_size;
 	}
-
-	close(fd);
+	if (cw != nullptr && !cw->finish())
+		return KCERR_DATABASE_ERROR;
+	if (wr != nullptr && !wr->finish())
+		return KCERR_DATABASE_ERROR;
+	wr.reset();
+	if (fd >= 0) {
+		close(fd);
+		fd = -1;
+	}
 	unsigned char shasum[SHA256_DIGEST_LENGTH];
 	SHA256_Final(shasum, &shactx);
 	instance.filename = uas_md_to_ident(std::string(reinterpret_cast<char *>(shasum), sizeof(shasum)));
 	hl = uas_hash_layout(m_basepath, m_config.m_server_guid, instance);
-	fd = open(sl.holder_ref.c_str(), O_WRONLY | O_CREAT, S_IRWUG);
-	if (fd < 0) {
+	int hfd = open(sl.holder_ref.c_str(), O_WRONLY | O_CREAT, S_IRWUG);
+	if (hfd < 0) {
 		ec_log_err("K-1288: open \"%s\": %s", sl.holder_ref.c_str(), strerror(errno));
 		return KCERR_DATABASE_ERROR;
 	}
-	close(fd);
+	close(hfd);
 
 	std::unique_ptr<char[], cstdlib_deleter> enclosing_dir(HX_dirname(hl.base_dir.c_str()));
 	ret = CreatePath(enclosing_dir.get());
@@ -2322,9 +2215,9 @@ ECRESULT ECFileAttachment2::SaveAttachmentInstance(ext_siid &instance,
 		if (--retries == 0)
 			break;
 
-		fd = open(hl.holder_ref.c_str(), O_WRONLY | O_CREAT | O_EXCL, S_IRWUG);
-		if (fd >= 0) {
-			close(fd);
+		hfd = open(hl.holder_ref.c_str(), O_WRONLY | O_CREAT | O_EXCL, S_IRWUG);
+		if (hfd >= 0) {
+			close(hfd);
 			break;
 		} else if (errno == EEXIST) {
 			ec_log_warn("K-1280: create %s: %s", hl.holder_ref.c_str(), strerror(errno));
@@ -2343,15 +2236,34 @@ ECRESULT ECFileAttachment2::SaveAttachmentInstance(ext_siid &instance,
 ECRESULT ECFileAttachment2::GetSizeInstance(const ext_siid &inst,
     size_t *size, bool *comp)
 {
-	auto content_file = m_basepath + "/" + inst.filename + "/content";
+	const at_codec *codec = nullptr;
+	std::string ctf;
+	int fd = open_instance(m_basepath + "/" + inst.filename + "/content", &codec, &ctf);
+	if (fd < 0 && errno == ENOENT) {
+		size_t total = 0;
+		if (!chunk_list_read(m_basepath + "/" + inst.filename, nullptr, &total))
+			return KCERR_DATABASE_ERROR;
+		if (size != nullptr)
+			*size = total;
+		if (comp != nullptr)
+			*comp = false;
+		return erSuccess;
+	} else if (fd < 0) {
+		return KCERR_DATABASE_ERROR;
+	}
+	ssize_t csize = -1;
 	struct stat sb;
-	auto ret = stat(content_file.c_str(), &sb);
-	if (ret != 0)
+	if (codec != nullptr)
+		csize = codec->content_size(fd);
+	else if (fstat(fd, &sb) == 0)
+		csize = sb.st_size;
+	close(fd);
+	if (csize < 0)
 		return KCERR_DATABASE_ERROR;
 	if (size != nullptr)
-		*size = sb.st_size;
+		*size = csize;
 	if (comp != nullptr)
-		*comp = false;
+		*comp = codec != nullptr;
 	return erSuccess;
 }
 
@@ -2375,6 +2287,7 @@ ECRESULT ECFileAttachment2::DeleteAttachmentInstance(const ext_siid &i, bool rep
 			ec_log_err("K-1288: rmdir \"%s\": %s", hl.holder_dir.c_str(), strerror(errno));
 		return erSuccess;
 	}
+	chunk_release(m_basepath, hl.base_dir);
 	HX_rrmdir(hl.base_dir.c_str());
 	return erSuccess;
 }
@@ -2383,13 +2296,21 @@ ECRESULT ECFileAttachment2::LoadAttachmentInstance(struct soap *soap,
     const ext_siid &instance, size_t *dsize, unsigned char **data)
 {
 	*dsize = 0;
-	auto ctf = m_basepath + "/" + instance.filename.c_str() + "/content";
-	int fd = open(ctf.c_str(), O_RDONLY);
+	const at_codec *codec = nullptr;
+	std::string ctf;
+	int fd = open_instance(m_basepath + "/" + instance.filename + "/content", &codec, &ctf);
+	if (fd < 0 && errno == ENOENT)
+		return load_chunked(soap, m_basepath + "/" + instance.filename, dsize, data);
 	if (fd < 0) {
 		ec_log_err("K-1286: open \"%s\": %s", ctf.c_str(), strerror(errno));
 		return KCERR_NO_ACCESS;
 	}
 	my_readahead(fd);
+	if (codec != nullptr) {
+		auto ret = load_instance_z(soap, instance, fd, codec, ctf, dsize, data);
+		close(fd);
+		return ret;
+	}
 	struct stat sb;
 	if (fstat(fd, &sb) < 0) {
 		ec_log_err("K-1285: fstat: %s", strerror(errno));
@@ -2398,6 +2319,12 @@ ECRESULT ECFileAttachment2::LoadAttachmentInstance(struct soap *soap,
 		*data  = soap_new_unsignedByte(soap, 0);
 		return KCERR_NO_ACCESS;
 	}
+	*data = map_instance(soap, fd, sb.st_size);
+	if (*data != nullptr) {
+		*dsize = sb.st_size;
+		close(fd);
+		return erSuccess;
+	}
 	*data = soap_new_unsignedByte(soap, sb.st_size);
 	auto rd = read_retry(fd, *data, sb.st_size);
 	if (rd < 0) {
@@ -2419,30 +2346,61 @@ ECRESULT ECFileAttachment2::LoadAttachmentInstance(const ext_siid &instance,
     size_t *dsize, ECSerializer *sink)
 {
 	*dsize = 0;
-	auto ctf = m_basepath + "/" + instance.filename.c_str() + "/content";
-	int fd = open(ctf.c_str(), O_RDONLY);
+	const at_codec *codec = nullptr;
+	std::string ctf;
+	int fd = open_instance(m_basepath + "/" + instance.filename + "/content", &codec, &ctf);
 	if (fd < 0 && errno == ENOENT) {
-		return KCERR_NOT_FOUND;
+		return load_chunked(m_basepath + "/" + instance.filename, dsize, sink);
 	} else if (fd < 0) {
 		/* Access problems */
 		ec_log_err("K-1286: open \"%s\": %s", ctf.c_str(), strerror(errno));
 		return KCERR_NO_ACCESS;
 	}
 	my_readahead(fd);
-	while (true) {
-		char buffer[CHUNK_SIZE];
-		ssize_t rd = read_retry(fd, buffer, sizeof(buffer));
-		if (rd < 0) {
-			ec_log_err("K-1284: read: %s", strerror(errno));
-			close(fd);
+	auto ret = load_instance_stream(instance, fd, codec, ctf, dsize, sink);
+	close(fd);
+	return ret;
+}
+
+/**
+ * Reassemble a deduplicated instance (see ECChunkStore.h) into a soap-owned
+ * buffer.
+ */
+ECRESULT ECFileAttachment2::load_chunked(struct soap *soap,
+    const std::string &dir, size_t *dsize, unsigned char **data)
+{
+	chunk_reader rd;
+	if (!rd.open(dir)) {
+		ec_log_err("K-1269: open \"%s/chunklist\": %s", dir.c_str(), strerror(errno));
+		*data = soap_new_unsignedByte(soap, 0);
+		return KCERR_NO_ACCESS;
+	}
+	*data = soap_new_unsignedByte(soap, rd.size());
+	auto ret = rd.read(*data, rd.size());
+	if (ret < 0)
+		return KCERR_NO_ACCESS;
+	*dsize = ret;
+	return erSuccess;
+}
+
+ECRESULT ECFileAttachment2::load_chunked(const std::string &dir,
+    size_t *dsize, ECSerializer *sink)
+{
+	chunk_reader rd;
+	if (!rd.open(dir))
+		return errno == ENOENT ? KCERR_NOT_FOUND : KCERR_NO_ACCESS;
+	char buffer[CHUNK_SIZE];
+	for (;;) {
+		auto ret = rd.read(buffer, sizeof(buffer));
+		if (ret < 0)
 			return KCERR_DATABASE_ERROR;
-		} else if (rd == 0) {
+		if (ret == 0)
 			break;
-		}
-		sink->Write(buffer, 1, rd);
-		*dsize += rd;
+		auto er = sink->Write(buffer, 1, ret);
+		if (er != erSuccess)
+			return er;
+		*dsize += ret;
 	}
-	close(fd);
 	return erSuccess;
 }
 
@@ -28,7 +28,7 @@ class ext_siid {
 	inline bool operator<(const ext_siid &r) const { return siid < r.siid; }
 };
 
-class ECAttachmentConfig {
+class KC_EXPORT ECAttachmentConfig {
 	public:
 	virtual ~ECAttachmentConfig() = default;
 	static ECRESULT create(const GUID &sguid, std::shared_ptr<ECConfig>, ECAttachmentConfig **);
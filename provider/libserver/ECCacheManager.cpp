@@ -96,14 +96,14 @@ ECCacheManager::ECCacheManager(std::shared_ptr<ECConfig> lpConfig,
 	m_lpDatabaseFactory(lpDatabaseFactory),
 	m_QuotaCache("quota", atoi(lpConfig->GetSetting("cache_quota_size")), atoi(lpConfig->GetSetting("cache_quota_lifetime")) * 60)
 , m_QuotaUserDefaultCache("uquota", atoi(lpConfig->GetSetting("cache_quota_size")), atoi(lpConfig->GetSetting("cache_quota_lifetime")) * 60)
-, m_ObjectsCache("obj", atoll(lpConfig->GetSetting("cache_object_size")), 0)
-, m_StoresCache("store", atoi(lpConfig->GetSetting("cache_store_size")), 0)
-, m_UserObjectCache("userid", atoi(lpConfig->GetSetting("cache_user_size")), atoi(lpConfig->GetSetting("cache_userdetails_lifetime")) * 60)
-, m_UEIdObjectCache("extern", atoi(lpConfig->GetSetting("cache_user_size")), atoi(lpConfig->GetSetting("cache_userdetails_lifetime")) * 60)
-, m_UserObjectDetailsCache("abinfo", atoi(lpConfig->GetSetting("cache_userdetails_size")), atoi(lpConfig->GetSetting("cache_userdetails_lifetime")) * 60)
-, m_AclCache("acl", atoi(lpConfig->GetSetting("cache_acl_size")), 0)
-, m_CellCache("cell", atoll(lpConfig->GetSetting("cache_cell_size")), 0)
-, m_ServerDetailsCache("server", atoi(lpConfig->GetSetting("cache_server_size")), atoi(lpConfig->GetSetting("cache_server_lifetime")) * 60)
+, m_ObjectsCache("obj", atoll(lpConfig->GetSetting("cache_object_size")), 0, atoui(lpConfig->GetSetting("cache_shards")))
+, m_StoresCache("store", atoi(lpConfig->GetSetting("cache_store_size")), 0, atoui(lpConfig->GetSetting("cache_shards")))
+, m_UserObjectCache("userid", atoi(lpConfig->GetSetting("cache_user_size")), atoi(lpConfig->GetSetting("cache_userdetails_lifetime")) * 60, atoui(lpConfig->GetSetting("cache_shards")))
+, m_UEIdObjectCache("extern", atoi(lpConfig->GetSetting("cache_user_size")), atoi(lpConfig->GetSetting("cache_userdetails_lifetime")) * 60, atoui(lpConfig->GetSetting("cache_shards")))
+, m_UserObjectDetailsCache("abinfo", atoi(lpConfig->GetSetting("cache_userdetails_size")), atoi(lpConfig->GetSetting("cache_userdetails_lifetime")) * 60, atoui(lpConfig->GetSetting("cache_shards")))
+, m_AclCache("acl", atoi(lpConfig->GetSetting("cache_acl_size")), 0, atoui(lpConfig->GetSetting("cache_shards")))
+, m_CellCache("cell", atoll(lpConfig->GetSetting("cache_cell_size")), 0, atoui(lpConfig->GetSetting("cache_shards")))
+, m_ServerDetailsCache("server", atoi(lpConfig->GetSetting("cache_server_size")), atoi(lpConfig->GetSetting("cache_server_lifetime")) * 60, atoui(lpConfig->GetSetting("cache_shards")))
 , m_PropToObjectCache("index1", atoll(lpConfig->GetSetting("cache_indexedobject_size")), 0)
 , m_ObjectToPropCache("index2", atoll(lpConfig->GetSetting("cache_indexedobject_size")), 0)
 {
@@ -147,6 +147,16 @@ ECCacheManager::ECCacheManager(std::shared_ptr<ECConfig> lpConfig,
 		ec_log_info("Setting userdetails cache size: %zu", m_UserObjectCache.MaxSize());
 	}
 
+	if (!parseBool(lpConfig->GetSetting("cache_shared_reads"))) {
+		m_ObjectsCache.SetSharedReads(false);
+		m_StoresCache.SetSharedReads(false);
+		m_UserObjectCache.SetSharedReads(false);
+		m_UEIdObjectCache.SetSharedReads(false);
+		m_UserObjectDetailsCache.SetSharedReads(false);
+		m_AclCache.SetSharedReads(false);
+		m_ServerDetailsCache.SetSharedReads(false);
+	}
+
 	/* Initial cleaning/initialization of cache */
 	PurgeCache(PURGE_CACHE_ALL);
 }
@@ -166,25 +176,17 @@ ECRESULT ECCacheManager::PurgeCache(unsigned int ulFlags)
 		m_QuotaCache.ClearCache();
 	if (ulFlags & PURGE_CACHE_QUOTADEFAULT)
 		m_QuotaUserDefaultCache.ClearCache();
-	if (ulFlags & PURGE_CACHE_ACL)
-		m_AclCache.ClearCache();
 	l_cache.unlock();
 
-	ulock_rec l_object(m_hCacheObjectMutex);
+	/* Sharded caches take their shard locks themselves */
+	if (ulFlags & PURGE_CACHE_ACL)
+		m_AclCache.ClearCache();
 	if (ulFlags & PURGE_CACHE_OBJECTS)
 		m_ObjectsCache.ClearCache();
-	l_object.unlock();
-
-	ulock_rec l_store(m_hCacheStoreMutex);
 	if (ulFlags & PURGE_CACHE_STORES)
 		m_StoresCache.ClearCache();
-	l_store.unlock();
-
-	// Cell cache mutex
-	ulock_rec l_cells(m_hCacheCellsMutex);
 	if(ulFlags & PURGE_CACHE_CELL)
 		m_CellCache.ClearCache();
-	l_cells.unlock();
 
 	// Indexed properties mutex
 	ulock_rec l_prop(m_hCacheIndPropMutex);
@@ -199,7 +201,6 @@ ECRESULT ECCacheManager::PurgeCache(unsigned int ulFlags)
 		m_setExcludedIndexProperties.clear();
 	l_xp.unlock();
 
-	l_cache.lock();
 	if (ulFlags & PURGE_CACHE_USEROBJECT)
 		m_UserObjectCache.ClearCache();
 	if (ulFlags & PURGE_CACHE_EXTERNID)
@@ -208,7 +209,6 @@ ECRESULT ECCacheManager::PurgeCache(unsigned int ulFlags)
 		m_UserObjectDetailsCache.ClearCache();
 	if (ulFlags & PURGE_CACHE_SERVER)
 		m_ServerDetailsCache.ClearCache();
-	l_cache.unlock();
 
 	using namespace std::chrono;
 	auto end = duration_cast<milliseconds>(decltype(start)::clock::now() - start);
@@ -267,24 +267,22 @@ ECRESULT ECCacheManager::I_GetObject(unsigned int ulObjId,
     unsigned int *ulParent, unsigned int *ulOwner, unsigned int *ulFlags,
     unsigned int *ulType)
 {
-	ECsObjects	*sObject;
-	scoped_rlock lock(m_hCacheObjectMutex);
-
-	auto er = m_ObjectsCache.GetCacheItem(ulObjId, &sObject);
+	ECsObjects sObject;
+	auto er = m_ObjectsCache.ReadCacheItem(ulObjId, &sObject);
 	if(er != erSuccess)
 		return er;
-	assert(sObject->ulType == MAPI_FOLDER || (sObject->ulFlags & ~(MSGFLAG_ASSOCIATED | MSGFLAG_DELETED)) == 0);
+	assert(sObject.ulType == MAPI_FOLDER || (sObject.ulFlags & ~(MSGFLAG_ASSOCIATED | MSGFLAG_DELETED)) == 0);
 	if(ulParent)
-		*ulParent = sObject->ulParent;
+		*ulParent = sObject.ulParent;
 
 	if(ulOwner)
-		*ulOwner = sObject->ulOwner;
+		*ulOwner = sObject.ulOwner;
 
 	if(ulFlags)
-		*ulFlags = sObject->ulFlags;
+		*ulFlags = sObject.ulFlags;
 
 	if(ulType)
-		*ulType = sObject->ulType;
+		*ulType = sObject.ulType;
 	return erSuccess;
 }
 
@@ -300,7 +298,6 @@ ECRESULT ECCacheManager::SetObject(unsigned int ulObjId, unsigned int ulParent,
 	sObjects.ulFlags	= ulFlags;
 	sObjects.ulType		= ulType;
 
-	scoped_rlock lock(m_hCacheObjectMutex);
 	auto er = m_ObjectsCache.AddCacheItem(ulObjId, std::move(sObjects));
 	LOG_CACHE_DEBUG("Set cache object id %d, parent %d, owner %d, flags %d, type %d", ulObjId, ulParent, ulOwner, ulFlags, ulType);
 	return er;
@@ -308,25 +305,22 @@ ECRESULT ECCacheManager::SetObject(unsigned int ulObjId, unsigned int ulParent,
 
 void ECCacheManager::I_DelObject(unsigned int ulObjId)
 {
-	scoped_rlock lock(m_hCacheObjectMutex);
 	m_ObjectsCache.RemoveCacheItem(ulObjId);
 }
 
 ECRESULT ECCacheManager::I_GetStore(unsigned int ulObjId, unsigned int *ulStore,
     GUID *lpGuid, unsigned int *lpulType)
 {
-	ECsStores	*sStores;
-	scoped_rlock lock(m_hCacheStoreMutex);
-
-	auto er = m_StoresCache.GetCacheItem(ulObjId, &sStores);
+	ECsStores sStores;
+	auto er = m_StoresCache.ReadCacheItem(ulObjId, &sStores);
 	if(er != erSuccess)
 		return er;
 	if(ulStore)
-		*ulStore = sStores->ulStore;
+		*ulStore = sStores.ulStore;
 	if (lpulType != NULL)
-		*lpulType = sStores->ulType;
+		*lpulType = sStores.ulType;
 	if(lpGuid)
-		memcpy(lpGuid, &sStores->guidStore, sizeof(GUID) );
+		memcpy(lpGuid, &sStores.guidStore, sizeof(GUID) );
 	return erSuccess;
 }
 
@@ -338,7 +332,6 @@ ECRESULT ECCacheManager::SetStore(unsigned int ulObjId, unsigned int ulStore,
 	sStores.guidStore = *lpGuid;
 	sStores.ulType = ulType;
 
-	scoped_rlock lock(m_hCacheStoreMutex);
 	auto er = m_StoresCache.AddCacheItem(ulObjId, std::move(sStores));
 	LOG_CACHE_DEBUG("Set store cache id %d, store %d, type %d, guid %s", ulObjId, ulStore, ulType, (lpGuid != nullptr ? bin2hex(sizeof(GUID), lpGuid).c_str() : "NULL"));
 	return er;
@@ -346,7 +339,6 @@ ECRESULT ECCacheManager::SetStore(unsigned int ulObjId, unsigned int ulStore,
 
 void ECCacheManager::I_DelStore(unsigned int ulObjId)
 {
-	scoped_rlock lock(m_hCacheStoreMutex);
 	m_StoresCache.RemoveCacheItem(ulObjId);
 }
 
@@ -389,10 +381,7 @@ ECRESULT ECCacheManager::GetObject(unsigned int ulObjId, unsigned int *lpulParen
 	ECDatabase	*lpDatabase = NULL;
 	unsigned int	ulParent = 0, ulOwner = 0, ulFlags = 0, ulType = 0;
 	bool bCacheResult = false;
-
-	auto er = m_lpDatabaseFactory->get_tls_db(&lpDatabase);
-	if(er != erSuccess)
-		goto exit;
+	ECRESULT er = erSuccess;
 
 	// first check the cache if the item exists
 	if (I_GetObject(ulObjId, &ulParent, &ulOwner, &ulFlags, &ulType) == erSuccess) {
@@ -409,6 +398,9 @@ ECRESULT ECCacheManager::GetObject(unsigned int ulObjId, unsigned int *lpulParen
 		goto exit;
 	}
 
+	er = m_lpDatabaseFactory->get_tls_db(&lpDatabase);
+	if(er != erSuccess)
+		goto exit;
 	strQuery = "SELECT hierarchy.parent, hierarchy.owner, hierarchy.flags, hierarchy.type FROM hierarchy WHERE hierarchy.id = " + stringify(ulObjId) + " LIMIT 1";
 	er = lpDatabase->DoSelect(strQuery, &lpDBResult);
 	if(er != erSuccess)
@@ -456,23 +448,19 @@ ECRESULT ECCacheManager::GetObjects(const std::list<sObjectTableKey> &lstObjects
 	DB_RESULT lpDBResult;
 	DB_ROW		lpDBRow = NULL;
 	ECDatabase	*lpDatabase = NULL;
-	ECsObjects sObject, *lpsObject = nullptr;
+	ECsObjects sObject;
 	std::set<sObjectTableKey> setUncached;
 
 	auto er = m_lpDatabaseFactory->get_tls_db(&lpDatabase);
 	if(er != erSuccess)
 		goto exit;
 
-    {
-        // Get everything from the cache that we can
-       scoped_rlock lock(m_hCacheObjectMutex);
-
+	// Get everything from the cache that we can
 	for (const auto &key : lstObjects)
-		if (m_ObjectsCache.GetCacheItem(key.ulObjId, &lpsObject) == erSuccess)
-			mapObjects[key] = *lpsObject;
+		if (m_ObjectsCache.ReadCacheItem(key.ulObjId, &sObject) == erSuccess)
+			mapObjects[key] = sObject;
 		else
 			setUncached.emplace(key);
-    }
     if(!setUncached.empty()) {
         // Get uncached items from SQL
 		auto strQuery = "SELECT id, parent, owner, flags, type FROM hierarchy WHERE id IN(" +
@@ -917,8 +905,6 @@ ECRESULT ECCacheManager::I_AddUserObject(unsigned int ulUserId,
 {
 	ECsUserObject sData;
 
-	scoped_rlock lock(m_hCacheMutex);
-
 	if (OBJECTCLASS_ISTYPE(ulClass)) {
 		LOG_USERCACHE_DEBUG("_Add user object. userid %d, class %d, companyid %d, externid \"%s\", signature \"%s\". error incomplete object",
 			ulUserId, ulClass, ulCompanyId, bin2txt(strExternId).c_str(), bin2txt(strSignature).c_str());
@@ -939,29 +925,26 @@ ECRESULT ECCacheManager::I_GetUserObject(unsigned int ulUserId,
     objectclass_t *lpulClass, unsigned int *lpulCompanyId,
     std::string *lpstrExternId, std::string *lpstrSignature)
 {
-	ECsUserObject	*sData;
-	scoped_rlock lock(m_hCacheMutex);
-
-	auto er = m_UserObjectCache.GetCacheItem(ulUserId, &sData);
+	ECsUserObject sData;
+	auto er = m_UserObjectCache.ReadCacheItem(ulUserId, &sData);
 	if(er != erSuccess)
 		return er;
 	if(lpulClass)
-		*lpulClass = sData->ulClass;
+		*lpulClass = sData.ulClass;
 
 	if(lpulCompanyId)
-		*lpulCompanyId = sData->ulCompanyId;
+		*lpulCompanyId = sData.ulCompanyId;
 
 	if(lpstrExternId)
-		*lpstrExternId = sData->strExternId;
+		*lpstrExternId = std::move(sData.strExternId);
 
 	if(lpstrSignature)
-		*lpstrSignature = sData->strSignature;
+		*lpstrSignature = std::move(sData.strSignature);
 	return erSuccess;
 }
 
 void ECCacheManager::I_DelUserObject(unsigned int ulUserId)
 {
-	scoped_rlock lock(m_hCacheMutex);
 	m_UserObjectCache.RemoveCacheItem(ulUserId);
 }
 
@@ -970,7 +953,6 @@ ECRESULT ECCacheManager::I_AddUserObjectDetails(unsigned int ulUserId,
 {
 	ECsUserObjectDetails sObjectDetails;
 
-	scoped_rlock lock(m_hCacheMutex);
 	LOG_USERCACHE_DEBUG("_Add user details. userid %d, %s", ulUserId, details.ToStr().c_str());
 	sObjectDetails.sDetails = details;
 	return m_UserObjectDetailsCache.AddCacheItem(ulUserId, std::move(sObjectDetails));
@@ -978,22 +960,20 @@ ECRESULT ECCacheManager::I_AddUserObjectDetails(unsigned int ulUserId,
 
 ECRESULT ECCacheManager::I_GetUserObjectDetails(unsigned int ulUserId, objectdetails_t *details)
 {
-	ECsUserObjectDetails *sObjectDetails;
-	scoped_rlock lock(m_hCacheMutex);
+	ECsUserObjectDetails sObjectDetails;
 
 	if (details == NULL)
 		return KCERR_INVALID_PARAMETER;
-	auto er = m_UserObjectDetailsCache.GetCacheItem(ulUserId, &sObjectDetails);
+	auto er = m_UserObjectDetailsCache.ReadCacheItem(ulUserId, &sObjectDetails);
 	if (er != erSuccess)
 		return er;
 
-	*details = sObjectDetails->sDetails;
+	*details = std::move(sObjectDetails.sDetails);
 	return erSuccess;
 }
 
 void ECCacheManager::I_DelUserObjectDetails(unsigned int ulUserId)
 {
-	scoped_rlock lock(m_hCacheMutex);
 	m_UserObjectDetailsCache.RemoveCacheItem(ulUserId);
 }
 
@@ -1004,8 +984,6 @@ ECRESULT ECCacheManager::I_AddUEIdObject(const std::string &strExternId,
 	ECsUEIdKey sKey;
 	ECsUEIdObject sData;
 
-	scoped_rlock lock(m_hCacheMutex);
-
 	if (OBJECTCLASS_ISTYPE(ulClass))
 		return erSuccess; // do not add incomplete data into the cache
 
@@ -1023,24 +1001,22 @@ ECRESULT ECCacheManager::I_GetUEIdObject(const std::string &strExternId,
     unsigned int *lpulUserId, std::string *lpstrSignature)
 {
 	ECsUEIdKey		sKey;
-	ECsUEIdObject	*sData;
+	ECsUEIdObject sData;
 
 	sKey.ulClass = ulClass;
 	sKey.strExternId = strExternId;
 
-	scoped_rlock lock(m_hCacheMutex);
-
-	auto er = m_UEIdObjectCache.GetCacheItem(sKey, &sData);
+	auto er = m_UEIdObjectCache.ReadCacheItem(sKey, &sData);
 	if(er != erSuccess)
 		return er;
 	if(lpulCompanyId)
-		*lpulCompanyId = sData->ulCompanyId;
+		*lpulCompanyId = sData.ulCompanyId;
 
 	if(lpulUserId)
-		*lpulUserId = sData->ulUserId;
+		*lpulUserId = sData.ulUserId;
 
 	if(lpstrSignature)
-		*lpstrSignature = sData->strSignature;
+		*lpstrSignature = std::move(sData.strSignature);
 	return erSuccess;
 }
 
@@ -1053,7 +1029,6 @@ void ECCacheManager::I_DelUEIdObject(const std::string &strExternId,
 	sKey.strExternId = strExternId;
 	sKey.ulClass = ulClass;
 
-	scoped_rlock lock(m_hCacheMutex);
 	m_UEIdObjectCache.RemoveCacheItem(sKey);
 }
 
@@ -1106,23 +1081,21 @@ ECRESULT ECCacheManager::GetACLs(unsigned int ulObjId, struct rightsArray **lppR
 
 ECRESULT ECCacheManager::I_GetACLs(unsigned int ulObjId, struct rightsArray **lppRights)
 {
-    ECsACLs *sACL;
-	scoped_rlock lock(m_hCacheMutex);
-
-	auto er = m_AclCache.GetCacheItem(ulObjId, &sACL);
+	ECsACLs sACL;
+	auto er = m_AclCache.ReadCacheItem(ulObjId, &sACL);
 	if(er != erSuccess)
 		return er;
 
 	auto lpRights = soap_new_rightsArray(nullptr);
-    if (sACL->ulACLs > 0)
+    if (sACL.ulACLs > 0)
     {
-        lpRights->__size = sACL->ulACLs;
-		lpRights->__ptr  = soap_new_rights(nullptr, sACL->ulACLs);
+        lpRights->__size = sACL.ulACLs;
+		lpRights->__ptr  = soap_new_rights(nullptr, sACL.ulACLs);
 
-        for (unsigned int i = 0; i < sACL->ulACLs; ++i) {
-            lpRights->__ptr[i].ulType = sACL->aACL[i].ulType;
-            lpRights->__ptr[i].ulRights = sACL->aACL[i].ulMask;
-            lpRights->__ptr[i].ulUserid = sACL->aACL[i].ulUserId;
+        for (unsigned int i = 0; i < sACL.ulACLs; ++i) {
+            lpRights->__ptr[i].ulType = sACL.aACL[i].ulType;
+            lpRights->__ptr[i].ulRights = sACL.aACL[i].ulMask;
+            lpRights->__ptr[i].ulUserid = sACL.aACL[i].ulUserId;
 
 			LOG_USERCACHE_DEBUG("_Get ACLs result for objectid %d: userid %d, type %d, permissions %d", ulObjId, lpRights->__ptr[i].ulUserid, lpRights->__ptr[i].ulType, lpRights->__ptr[i].ulRights);
         }
@@ -1149,13 +1122,11 @@ ECRESULT ECCacheManager::SetACLs(unsigned int ulObjId,
 			lpRights.__ptr[i].ulType, lpRights.__ptr[i].ulRights);
     }
 
-	scoped_rlock lock(m_hCacheMutex);
 	return m_AclCache.AddCacheItem(ulObjId, std::move(sACLs));
 }
 
 void ECCacheManager::I_DelACLs(unsigned int ulObjId)
 {
-	scoped_rlock lock(m_hCacheMutex);
 	LOG_USERCACHE_DEBUG("Remove ACLs for objectid %d", ulObjId);
 	m_AclCache.RemoveCacheItem(ulObjId);
 }
@@ -1214,28 +1185,36 @@ void ECCacheManager::update_extra_stats(ECStatsCollector &sc)
 		sc.set("cache_" + s.name + "_req", "Cache " + s.name + " requests", s.req);
 		/* Not quite clear about hit; looks like a counter, but is decremented sometimes */
 		sc.setg("cache_" + s.name + "_hit", "Cache " + s.name + " hits", s.hit);
+		sc.set("cache_" + s.name + "_evict", "Cache " + s.name + " evictions", s.evict);
 	};
 	ulock_rec l_cache(m_hCacheMutex);
-	f(m_AclCache.get_stats());
 	f(m_QuotaCache.get_stats());
 	f(m_QuotaUserDefaultCache.get_stats());
+	l_cache.unlock();
+
+	f(m_AclCache.get_stats());
 	f(m_UEIdObjectCache.get_stats());
 	f(m_UserObjectCache.get_stats());
 	f(m_UserObjectDetailsCache.get_stats());
 	f(m_ServerDetailsCache.get_stats());
-	l_cache.unlock();
 
-	ulock_rec l_store(m_hCacheStoreMutex);
 	f(m_StoresCache.get_stats());
-	l_store.unlock();
-
-	ulock_rec l_object(m_hCacheObjectMutex);
 	f(m_ObjectsCache.get_stats());
-	l_object.unlock();
-
-	ulock_rec l_cell(m_hCacheCellsMutex);
 	f(m_CellCache.get_stats());
-	l_cell.unlock();
+	/* Uneven shards point at a poor hash distribution or a hot object */
+	auto fs = [&](const char *name, std::vector<ECCacheStat> &&v) {
+		for (size_t i = 0; i < v.size(); ++i) {
+			auto pfx = "cache_" + std::string(name) + "_shard" + std::to_string(i);
+			auto dsc = "Cache " + v[i].name;
+			sc.setg(pfx + "_items", dsc + " items", v[i].items);
+			sc.set(pfx + "_req", dsc + " requests", v[i].req);
+			sc.setg(pfx + "_hit", dsc + " hits", v[i].hit);
+			sc.set(pfx + "_evict", dsc + " evictions", v[i].evict);
+		}
+	};
+	fs("store", m_StoresCache.get_shard_stats());
+	fs("obj", m_ObjectsCache.get_shard_stats());
+	fs("cell", m_CellCache.get_shard_stats());
 
 	ulock_rec l_prop(m_hCacheIndPropMutex);
 	f(m_PropToObjectCache.get_stats());
@@ -1254,7 +1233,7 @@ ECRESULT ECCacheManager::GetCell(const sObjectTableKey *lpsRowItem,
 {
     ECRESULT er = erSuccess;
     ECsCells *sCell;
-	scoped_rlock lock(m_hCacheCellsMutex);
+	auto lock = m_CellCache.lock(lpsRowItem->ulObjId);
 
     if (m_bCellCacheDisabled) {
         er = KCERR_NOT_FOUND;
@@ -1272,7 +1251,7 @@ ECRESULT ECCacheManager::GetCell(const sObjectTableKey *lpsRowItem,
 			// the item, so return NOT_FOUND.
 			// Or, proptaglist is complete, but propval is not in cache,
 			// and the caller did not want to know about this special case.
-			m_CellCache.DecrementValidCount();
+			m_CellCache.DecrementValidCount(lpsRowItem->ulObjId);
             er = KCERR_NOT_FOUND;
         } else {
             // Object is complete and property is not found; we know that the property does not exist
@@ -1296,7 +1275,7 @@ ECRESULT ECCacheManager::SetCell(const sObjectTableKey *lpsRowItem,
     ECRESULT er = erSuccess;
     ECsCells *sCell;
 	/* ignoring orderId for now */
-	scoped_rlock lock(m_hCacheCellsMutex);
+	auto lock = m_CellCache.lock(lpsRowItem->ulObjId);
 
 	if (m_CellCache.GetCacheItem(lpsRowItem->ulObjId, &sCell) == erSuccess) {
         long long ulSize = sCell->GetSize();
@@ -1304,7 +1283,7 @@ ECRESULT ECCacheManager::SetCell(const sObjectTableKey *lpsRowItem,
         ulSize -= sCell->GetSize();
         // ulSize is positive if the cache shrank
         //m_ulCellSize -= ulSize;
-		m_CellCache.AddToSize(-ulSize);
+		m_CellCache.AddToSize(lpsRowItem->ulObjId, -ulSize);
     } else {
         ECsCells sNewCell;
         sNewCell.AddPropVal(ulPropTag, lpSrc);
@@ -1321,7 +1300,7 @@ ECRESULT ECCacheManager::SetComplete(unsigned int ulObjId)
 {
     ECRESULT er = erSuccess;
     ECsCells *sCell;
-	scoped_rlock lock(m_hCacheCellsMutex);
+	auto lock = m_CellCache.lock(ulObjId);
 
 	if (m_CellCache.GetCacheItem(ulObjId, &sCell) == erSuccess)
 		sCell->SetComplete(true);
@@ -1338,7 +1317,7 @@ ECRESULT ECCacheManager::GetComplete(unsigned int ulObjId, bool &complete)
 {
 	ECRESULT er = erSuccess;
 	ECsCells *sCell;
-	scoped_rlock lock(m_hCacheCellsMutex);
+	auto lock = m_CellCache.lock(ulObjId);
 
 	if (m_CellCache.GetCacheItem(ulObjId, &sCell) == erSuccess)
 		complete = sCell->GetComplete();
@@ -1355,7 +1334,7 @@ ECRESULT ECCacheManager::GetPropTags(unsigned int ulObjId, std::vector<unsigned
 {
 	ECRESULT er = erSuccess;
 	ECsCells *sCell;
-	scoped_rlock lock(m_hCacheCellsMutex);
+	auto lock = m_CellCache.lock(ulObjId);
 
 	if (m_CellCache.GetCacheItem(ulObjId, &sCell) == erSuccess)
 		proptags = sCell->GetPropTags();
@@ -1372,7 +1351,7 @@ ECRESULT ECCacheManager::UpdateCell(unsigned int ulObjId, unsigned int ulPropTag
 {
     ECRESULT er = erSuccess;
     ECsCells *sCell;
-	scoped_rlock lock(m_hCacheCellsMutex);
+	auto lock = m_CellCache.lock(ulObjId);
 
 	if (m_CellCache.GetCacheItem(ulObjId, &sCell) == erSuccess)
 		sCell->UpdatePropVal(ulPropTag, lDelta);
@@ -1389,7 +1368,7 @@ ECRESULT ECCacheManager::UpdateCell(unsigned int ulObjId, unsigned int ulPropTag
 {
     ECRESULT er = erSuccess;
     ECsCells *sCell;
-	scoped_rlock lock(m_hCacheCellsMutex);
+	auto lock = m_CellCache.lock(ulObjId);
 
 	if (m_CellCache.GetCacheItem(ulObjId, &sCell) == erSuccess)
 		sCell->UpdatePropVal(ulPropTag, ulMask, ulValue);
@@ -1404,19 +1383,17 @@ ECRESULT ECCacheManager::UpdateCell(unsigned int ulObjId, unsigned int ulPropTag
 
 void ECCacheManager::I_DelCell(unsigned int ulObjId)
 {
-	scoped_rlock lock(m_hCacheCellsMutex);
 	m_CellCache.RemoveCacheItem(ulObjId);
 }
 
 ECRESULT ECCacheManager::GetServerDetails(const std::string &strServerId, serverdetails_t *lpsDetails)
 {
-	ECsServerDetails	*sEntry;
-	scoped_rlock lock(m_hCacheMutex);
-	auto er = m_ServerDetailsCache.GetCacheItem(strToLower(strServerId), &sEntry);
+	ECsServerDetails sEntry;
+	auto er = m_ServerDetailsCache.ReadCacheItem(strToLower(strServerId), &sEntry);
 	if (er != erSuccess)
 		return er;
 	if (lpsDetails)
-		*lpsDetails = sEntry->sDetails;
+		*lpsDetails = std::move(sEntry.sDetails);
 	return er;
 }
 
@@ -1425,7 +1402,6 @@ ECRESULT ECCacheManager::SetServerDetails(const std::string &strServerId, const
 	ECsServerDetails	sEntry;
 	sEntry.sDetails = sDetails;
 
-	scoped_rlock lock(m_hCacheMutex);
 	return m_ServerDetailsCache.AddCacheItem(strToLower(strServerId), std::move(sEntry));
 }
 
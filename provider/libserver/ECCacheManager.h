@@ -216,6 +216,14 @@ namespace std {
 		}
 	};
 
+	template<> struct hash<KC::ECsUEIdKey> {
+		public:
+		size_t operator()(const KC::ECsUEIdKey &value) const noexcept
+		{
+			return hash<std::string>()(value.strExternId) ^ value.ulClass;
+		}
+	};
+
 	// hash function for type ECsIndexObject
 	template<> struct hash<KC::ECsIndexObject> {
 		public:
@@ -238,7 +246,7 @@ enum {
 	KC_GETCELL_NEGATIVES = 1 << 1,
 };
 
-class ECCacheManager final {
+class KC_EXPORT ECCacheManager final {
 public:
 	ECCacheManager(std::shared_ptr<ECConfig>, ECDatabaseFactory *lpDatabase);
 	virtual ~ECCacheManager();
@@ -346,10 +354,7 @@ private:
 	ECRESULT I_AddIndexData(const ECsIndexObject &, const ECsIndexProp &);
 
 	ECDatabaseFactory*	m_lpDatabaseFactory;
-	std::recursive_mutex m_hCacheMutex; /* User, ACL, server cache */
-	std::recursive_mutex m_hCacheStoreMutex;
-	std::recursive_mutex m_hCacheObjectMutex;
-	std::recursive_mutex m_hCacheCellsMutex; /* Cell cache */
+	std::recursive_mutex m_hCacheMutex; /* Quota cache */
 	std::recursive_mutex m_hCacheIndPropMutex; /* Indexed properties cache */
 	// Quota cache, to reduce the impact of the user plugin
 	// m_mapQuota contains user and company cache, except when it's the company user default quota
@@ -357,20 +362,26 @@ private:
 	// this can't be in the same map, since the id is the same for "company" and "company user default"
 	ECCache<ECMapQuota>			m_QuotaCache;
 	ECCache<ECMapQuota>			m_QuotaUserDefaultCache;
+	/*
+	 * The other caches are sharded, each shard having its own lock (see
+	 * ECShardedCache::lock). The read-mostly ones use a shared mutex and
+	 * are read through ReadCacheItem.
+	 */
+	template<typename MapType> using rd_cache = ECShardedCache<MapType, KC::shared_mutex>;
 	// "hierarchy" table
-	ECCache<std::unordered_map<unsigned int, ECsObjects>> m_ObjectsCache;
+	rd_cache<std::unordered_map<unsigned int, ECsObjects>> m_ObjectsCache;
 	// Store cache (objid -> storeid/guid)
-	ECCache<std::unordered_map<unsigned int, ECsStores>> m_StoresCache;
+	rd_cache<std::unordered_map<unsigned int, ECsStores>> m_StoresCache;
 	// User cache
-	ECCache<std::unordered_map<unsigned int, ECsUserObject>> m_UserObjectCache; /* userid to user object */
-	ECCache<std::map<ECsUEIdKey, ECsUEIdObject>> m_UEIdObjectCache; /* user type + externid to user object */
-	ECCache<std::unordered_map<unsigned int, ECsUserObjectDetails>>	m_UserObjectDetailsCache; /* userid to user object data */
+	rd_cache<std::unordered_map<unsigned int, ECsUserObject>> m_UserObjectCache; /* userid to user object */
+	rd_cache<std::map<ECsUEIdKey, ECsUEIdObject>> m_UEIdObjectCache; /* user type + externid to user object */
+	rd_cache<std::unordered_map<unsigned int, ECsUserObjectDetails>> m_UserObjectDetailsCache; /* userid to user object data */
 	// ACL cache
-	ECCache<std::unordered_map<unsigned int, ECsACLs>> m_AclCache;
+	rd_cache<std::unordered_map<unsigned int, ECsACLs>> m_AclCache;
 	// properties and tproperties
-	ECCache<std::unordered_map<unsigned int, ECsCells>> m_CellCache;
+	ECShardedCache<std::unordered_map<unsigned int, ECsCells>> m_CellCache;
 	// Server cache
-	ECCache<std::map<std::string, ECsServerDetails>> m_ServerDetailsCache;
+	rd_cache<std::map<std::string, ECsServerDetails>> m_ServerDetailsCache;
 	// "indexedproperties" index2: {tag, data(entryid or sourcekey)} -> {objid,tag}
 	ECCache<std::unordered_map<ECsIndexProp, ECsIndexObject>> m_PropToObjectCache;
 	// "indexedproperties" index1: {objid,tag} -> {tag, data}
@@ -0,0 +1,310 @@
+/*
+ * SPDX-License-Identifier: AGPL-3.0-only
+ * Copyright 2005 - 2016 Zarafa and its licensors
+ */
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+#include <kopano/platform.h>
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <openssl/sha.h>
+#include <kopano/ECLogger.h>
+#include <kopano/fileutil.hpp>
+#include <kopano/stringutil.h>
+#include "ECChunkStore.h"
+
+namespace KC {
+
+/* Random values for the gear hash; fixed, as chunk boundaries must be stable. */
+static const std::array<uint64_t, 256> &cdc_gear()
+{
+	static const auto table = []() {
+		std::array<uint64_t, 256> t;
+		uint64_t x = 0x4b6f70616e6f4344ULL;
+		for (auto &e : t) {
+			/* splitmix64 */
+			uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+			e = z ^ (z >> 31);
+		}
+		return t;
+	}();
+	return table;
+}
+
+fastcdc::fastcdc(size_t avg)
+{
+	unsigned int bits = 8;
+	while ((static_cast<size_t>(2) << bits) <= avg && bits < 30)
+		++bits;
+	m_avg = static_cast<size_t>(1) << bits;
+	m_min = m_avg / 4;
+	m_max = m_avg * 4;
+	/*
+	 * Gear hashing shifts left, so the high bits see the most input. The
+	 * mask before the normal size has two more bits than log2(avg), the
+	 * one after it two fewer.
+	 */
+	m_mask_s = ~0ULL << (64 - (bits + 2));
+	m_mask_l = ~0ULL << (64 - (bits - 2));
+}
+
+size_t fastcdc::cut(const void *data, size_t len) const
+{
+	auto src = static_cast<const uint8_t *>(data);
+	auto &gear = cdc_gear();
+	if (len <= m_min)
+		return len;
+	if (len > m_max)
+		len = m_max;
+	size_t normal = std::min(m_avg, len), i = m_min;
+	uint64_t fp = 0;
+	for (; i < normal; ++i) {
+		fp = (fp << 1) + gear[src[i]];
+		if ((fp & m_mask_s) == 0)
+			return i + 1;
+	}
+	for (; i < len; ++i) {
+		fp = (fp << 1) + gear[src[i]];
+		if ((fp & m_mask_l) == 0)
+			return i + 1;
+	}
+	return len;
+}
+
+std::string chunk_store_path(const std::string &root, const std::string &hash)
+{
+	return root + "/chunks/" + hash.substr(0, 2) + "/" + hash.substr(2, 2) + "/" + hash;
+}
+
+chunk_writer::chunk_writer(const std::string &root, const std::string &dir,
+    size_t avg, bool sync) :
+	m_root(root), m_dir(dir), m_cdc(avg), m_sync(sync)
+{}
+
+bool chunk_writer::write(const void *data, size_t len)
+{
+	m_buf.append(static_cast<const char *>(data), len);
+	while (m_buf.size() - m_pos >= m_cdc.max_size()) {
+		auto n = m_cdc.cut(&m_buf[m_pos], m_buf.size() - m_pos);
+		if (!emit(&m_buf[m_pos], n))
+			return false;
+		m_pos += n;
+	}
+	if (m_pos > m_buf.size() / 2) {
+		m_buf.erase(0, m_pos);
+		m_pos = 0;
+	}
+	return true;
+}
+
+bool chunk_writer::finish()
+{
+	while (m_pos < m_buf.size()) {
+		auto n = m_cdc.cut(&m_buf[m_pos], m_buf.size() - m_pos);
+		if (!emit(&m_buf[m_pos], n))
+			return false;
+		m_pos += n;
+	}
+	m_buf.clear();
+	m_pos = 0;
+	auto file = m_dir + "/chunklist";
+	int fd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRWUG);
+	if (fd < 0) {
+		ec_log_err("K-1278: open \"%s\": %s", file.c_str(), strerror(errno));
+		return false;
+	}
+	auto list = "kcdc1 " + stringify_int64(m_total) + "\n" + m_list;
+	bool ok = write_retry(fd, list.c_str(), list.size()) == static_cast<ssize_t>(list.size());
+	if (!ok)
+		ec_log_err("K-1277: write \"%s\": %s", file.c_str(), strerror(errno));
+	if (ok && m_sync && !force_buffers_to_disk(fd)) {
+		ec_log_warn("Problem syncing file \"%s\": %s", file.c_str(), strerror(errno));
+		ok = false;
+	}
+	close(fd);
+	return ok;
+}
+
+bool chunk_writer::emit(const char *data, size_t len)
+{
+	unsigned char md[SHA256_DIGEST_LENGTH];
+	SHA256(reinterpret_cast<const unsigned char *>(data), len, md);
+	auto hash = bin2hex(sizeof(md), md);
+	if (m_linked.find(hash) == m_linked.end()) {
+		if (!put(hash, data, len))
+			return false;
+		m_linked.emplace(hash);
+	}
+	m_list += hash + " " + stringify_int64(len) + "\n";
+	m_total += len;
+	return true;
+}
+
+/**
+ * Link chunk @hash into the instance directory, storing it first if the
+ * store does not have it yet.
+ */
+bool chunk_writer::put(const std::string &hash, const char *data, size_t len)
+{
+	auto store = chunk_store_path(m_root, hash);
+	auto local = m_dir + "/c/" + hash;
+
+	if (!m_have_dir) {
+		auto ret = CreatePath(m_dir + "/c", S_IRWXUG);
+		if (ret != 0 && errno != EEXIST) {
+			ec_log_err("K-1276: mkdir -p \"%s/c\": %s", m_dir.c_str(), strerror(errno));
+			return false;
+		}
+		m_have_dir = true;
+	}
+	for (int retries = 3; retries > 0; --retries) {
+		if (link(store.c_str(), local.c_str()) == 0)
+			/* Already known: shared */
+			return true;
+		if (errno != ENOENT) {
+			ec_log_err("K-1275: link \"%s\": %s", local.c_str(), strerror(errno));
+			return false;
+		}
+
+		/* New chunk: write it into the instance, then publish it. */
+		int fd = ::open(local.c_str(), O_WRONLY | O_CREAT | O_EXCL, S_IRWUG);
+		if (fd < 0) {
+			ec_log_err("K-1274: open \"%s\": %s", local.c_str(), strerror(errno));
+			return false;
+		}
+		bool ok = write_retry(fd, data, len) == static_cast<ssize_t>(len);
+		if (ok && m_sync && !force_buffers_to_disk(fd))
+			ok = false;
+		close(fd);
+		if (!ok) {
+			ec_log_err("K-1273: write \"%s\": %s", local.c_str(), strerror(errno));
+			unlink(local.c_str());
+			return false;
+		}
+		auto ret = CreatePath(store.substr(0, store.rfind('/')), S_IRWXUG);
+		if (ret != 0 && errno != EEXIST)
+			/* Keep the private copy; it just will not be shared. */
+			return true;
+		if (link(local.c_str(), store.c_str()) == 0 || errno != EEXIST)
+			return true;
+		/* Someone else published the same chunk meanwhile; use theirs. */
+		unlink(local.c_str());
+	}
+	ec_log_err("K-1272: could not store chunk %s", hash.c_str());
+	return false;
+}
+
+bool chunk_list_read(const std::string &dir,
+    std::vector<std::pair<std::string, size_t>> *list, size_t *total)
+{
+	std::unique_ptr<FILE, file_deleter> fp(fopen((dir + "/chunklist").c_str(), "r"));
+	if (fp == nullptr)
+		return false;
+	char line[128];
+	unsigned long long val;
+	if (fgets(line, sizeof(line), fp.get()) == nullptr ||
+	    sscanf(line, "kcdc1 %llu", &val) != 1) {
+		errno = EINVAL;
+		return false;
+	}
+	*total = val;
+	if (list == nullptr)
+		return true;
+	list->clear();
+	char hash[SHA256_DIGEST_LENGTH * 2 + 1];
+	while (fgets(line, sizeof(line), fp.get()) != nullptr) {
+		if (sscanf(line, "%64s %llu", hash, &val) != 2) {
+			errno = EINVAL;
+			return false;
+		}
+		list->emplace_back(hash, val);
+	}
+	return true;
+}
+
+chunk_reader::~chunk_reader()
+{
+	if (m_fd >= 0)
+		close(m_fd);
+}
+
+bool chunk_reader::open(const std::string &dir)
+{
+	m_dir = dir;
+	return chunk_list_read(dir, &m_list, &m_size);
+}
+
+ssize_t chunk_reader::read(void *data, size_t len)
+{
+	auto buf = static_cast<char *>(data);
+	size_t done = 0;
+	while (done < len) {
+		if (m_left == 0) {
+			if (m_fd >= 0) {
+				close(m_fd);
+				m_fd = -1;
+			}
+			if (m_idx >= m_list.size())
+				break;
+			auto file = m_dir + "/c/" + m_list[m_idx].first;
+			m_fd = ::open(file.c_str(), O_RDONLY);
+			if (m_fd < 0) {
+				ec_log_err("K-1271: open \"%s\": %s", file.c_str(), strerror(errno));
+				return -1;
+			}
+			m_left = m_list[m_idx++].second;
+			continue;
+		}
+		auto ret = read_retry(m_fd, buf + done, std::min(len - done, m_left));
+		if (ret <= 0) {
+			ec_log_err("K-1270: short chunk in \"%s\"", m_dir.c_str());
+			return -1;
+		}
+		done += ret;
+		m_left -= ret;
+	}
+	return done;
+}
+
+void chunk_release(const std::string &root, const std::string &dir)
+{
+	/*
+	 * Go by the links rather than the chunk list, so that instances
+	 * whose write was interrupted are cleaned up as well.
+	 */
+	auto cdir = dir + "/c";
+	std::unique_ptr<DIR, int (*)(DIR *)> dh(opendir(cdir.c_str()), closedir);
+	if (dh == nullptr)
+		return;
+	struct dirent *de;
+	while ((de = readdir(dh.get())) != nullptr) {
+		if (*de->d_name == '.')
+			continue;
+		unlink((cdir + "/" + de->d_name).c_str());
+		/*
+		 * A writer linking the chunk concurrently is harmless: its
+		 * hard link keeps the data, only the store entry goes away.
+		 */
+		auto store = chunk_store_path(root, de->d_name);
+		struct stat sb;
+		if (stat(store.c_str(), &sb) == 0 && sb.st_nlink <= 1)
+			unlink(store.c_str());
+	}
+}
+
+} /* namespace */
@@ -0,0 +1,82 @@
+/*
+ * SPDX-License-Identifier: AGPL-3.0-only
+ * Copyright 2005 - 2016 Zarafa and its licensors
+ */
+#pragma once
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <sys/types.h>
+#include <kopano/zcdefs.h>
+
+namespace KC {
+
+/**
+ * FastCDC content-defined chunker (Xia et al., USENIX ATC 2016) with
+ * normalized chunking, level 2. Chunk sizes are between avg/4 and avg*4;
+ * avg is rounded down to a power of two, and at least 256.
+ */
+class KC_EXPORT fastcdc {
+	public:
+	fastcdc(size_t avg = 64 * 1024);
+	/* Length of the chunk at the start of @data, which has @len bytes. */
+	size_t cut(const void *data, size_t len) const;
+	size_t max_size() const { return m_max; }
+
+	private:
+	size_t m_min, m_avg, m_max;
+	uint64_t m_mask_s, m_mask_l;
+};
+
+/*
+ * Chunked instances (files_v2 with attachment_chunk_size):
+ *
+ * Chunks live content-addressed in <root>/chunks/XX/YY/<sha256>. An instance
+ * directory holds a hard link to each chunk it uses in "c/", and the ordered
+ * list of chunks in "chunklist". The link count of a chunk file is thus the
+ * number of instances using it plus one; chunk_release drops the store's
+ * entry when that reaches one.
+ */
+class KC_EXPORT chunk_writer final {
+	public:
+	chunk_writer(const std::string &root, const std::string &inst_dir, size_t avg, bool sync);
+	bool write(const void *, size_t);
+	/* Cuts the remainder and writes the chunk list. */
+	bool finish();
+
+	private:
+	bool emit(const char *, size_t);
+	bool put(const std::string &hash, const char *, size_t);
+
+	std::string m_root, m_dir, m_buf, m_list;
+	std::set<std::string> m_linked;
+	fastcdc m_cdc;
+	size_t m_pos = 0, m_total = 0;
+	bool m_sync, m_have_dir = false;
+};
+
+class KC_EXPORT chunk_reader final {
+	public:
+	~chunk_reader();
+	/* Returns false with errno set; ENOENT if @inst_dir is not chunked. */
+	bool open(const std::string &inst_dir);
+	size_t size() const { return m_size; }
+	/* Returns the number of bytes produced, 0 at the end, or -1 on error. */
+	ssize_t read(void *, size_t);
+
+	private:
+	std::string m_dir;
+	std::vector<std::pair<std::string, size_t>> m_list;
+	size_t m_size = 0, m_idx = 0, m_left = 0;
+	int m_fd = -1;
+};
+
+extern KC_EXPORT bool chunk_list_read(const std::string &inst_dir, std::vector<std::pair<std::string, size_t>> *, size_t *total);
+extern KC_EXPORT std::string chunk_store_path(const std::string &root, const std::string &hash);
+/* Drop @inst_dir's chunk references, and the chunks no one else uses. */
+extern KC_EXPORT void chunk_release(const std::string &root, const std::string &inst_dir);
+
+} /* namespace */
@@ -14,9 +14,11 @@
 #include <kopano/Util.h>
 #include "StatsClient.h"
 #include "ECIndexer.h"
+#include <algorithm>
 #include <chrono>
 #include <iterator>
 #include <memory>
+#include <mutex>
 #include <new>
 #include <set>
 #include <string>
@@ -275,6 +277,119 @@ static ECRESULT NormalizeGetOptimalMultiFieldSearch(
 	return NormalizeRestrictionMultiFieldSearch(lpRestrict, setExcludeProps, lpMultiSearches);
 }
 
+/* Clients kept open for the next search; more are closed after use */
+static constexpr size_t SEARCH_IDLE_MAX = 16;
+/* Cached search results (over all stores) */
+static constexpr size_t SEARCH_CACHE_MAX = 1024;
+
+std::unique_ptr<ECSearchClient> ECSearchClientPool::get(ECConfig *lpConfig)
+{
+	auto stype = lpConfig->GetSetting("search_enabled");
+	std::string type = stype != nullptr ? stype : "";
+	std::string socket = lpConfig->GetSetting("search_socket");
+	auto timeout = atoui(lpConfig->GetSetting("search_timeout"));
+	std::unique_ptr<ECSearchClient> client;
+
+	std::unique_lock<std::mutex> lk(m_lock);
+	if (type != m_type || socket != m_socket || timeout != m_timeout) {
+		/* Reloaded configuration; the idle ones are of no use anymore */
+		m_idle.clear();
+		m_type = type;
+		m_socket = socket;
+		m_timeout = timeout;
+	}
+	if (!m_idle.empty()) {
+		client = std::move(m_idle.back());
+		m_idle.pop_back();
+		lk.unlock();
+		client->Revalidate();
+		return client;
+	}
+	lk.unlock();
+	if (type == "internal")
+		client.reset(new(std::nothrow) ECSearchClientMM);
+	else if (parseBool(type.c_str()) && !socket.empty())
+		client.reset(new(std::nothrow) ECSearchClientNET(socket.c_str(), timeout));
+	return client;
+}
+
+void ECSearchClientPool::put(std::unique_ptr<ECSearchClient> &&client)
+{
+	std::lock_guard<std::mutex> lk(m_lock);
+	if (m_idle.size() < SEARCH_IDLE_MAX)
+		m_idle.emplace_back(std::move(client));
+}
+
+bool ECSearchClientPool::lookup(unsigned int ulStoreId, const std::string &key,
+    unsigned int ttl, std::list<unsigned int> &lstMatches, std::string &suggestion)
+{
+	std::lock_guard<std::mutex> lk(m_lock);
+	auto i = m_cache.find(std::make_pair(ulStoreId, key));
+	if (i == m_cache.cend()) {
+		++m_misses;
+		return false;
+	}
+	if (decltype(i->second.ts)::clock::now() - i->second.ts > std::chrono::seconds(ttl)) {
+		m_cache.erase(i);
+		++m_misses;
+		return false;
+	}
+	lstMatches = i->second.matches;
+	suggestion = i->second.suggestion;
+	++m_hits;
+	return true;
+}
+
+void ECSearchClientPool::store(unsigned int ulStoreId, std::string &&key,
+    const std::list<unsigned int> &lstMatches, const std::string &suggestion)
+{
+	std::lock_guard<std::mutex> lk(m_lock);
+	if (m_cache.size() >= SEARCH_CACHE_MAX) {
+		/* Make room by dropping the oldest entry */
+		auto old = std::min_element(m_cache.begin(), m_cache.end(),
+			[](const auto &a, const auto &b) { return a.second.ts < b.second.ts; });
+		m_cache.erase(old);
+	}
+	auto &r = m_cache[std::make_pair(ulStoreId, std::move(key))];
+	r.ts = decltype(r.ts)::clock::now();
+	r.matches = lstMatches;
+	r.suggestion = suggestion;
+}
+
+void ECSearchClientPool::invalidate(unsigned int ulStoreId)
+{
+	std::lock_guard<std::mutex> lk(m_lock);
+	if (m_cache.empty())
+		return;
+	m_cache.erase(m_cache.lower_bound(std::make_pair(ulStoreId, std::string())),
+		m_cache.lower_bound(std::make_pair(ulStoreId + 1, std::string())));
+}
+
+size_t ECSearchClientPool::cache_size() const
+{
+	std::lock_guard<std::mutex> lk(m_lock);
+	return m_cache.size();
+}
+
+size_t ECSearchClientPool::idle_clients() const
+{
+	std::lock_guard<std::mutex> lk(m_lock);
+	return m_idle.size();
+}
+
+/**
+ * Builds the cache key of an indexer query: everything that is sent to the
+ * indexer, except for the server and store.
+ */
+static std::string IndexerQueryKey(const ECListInt &lstFolders,
+    const std::list<SIndexedTerm> &lstMultiSearches)
+{
+	auto key = kc_join(lstFolders, " ", stringify);
+	for (const auto &t : lstMultiSearches)
+		key += "\n" + kc_join(t.setFields, " ", stringify) + ":" + t.strTerm;
+	return key;
+}
+
 /**
  * Try to run the restriction using the indexer instead of slow
  * database queries. Will fail if the restriction is unable to run by
@@ -284,7 +399,8 @@ static ECRESULT NormalizeGetOptimalMultiFieldSearch(
  * @param[in] lpLogger log object
  * @param[in] lpCacheManager cachemanager object
  * @param[in] guidServer current server guid
- * @param[in] ulStoreId store id to search in
+ * @param[in] guidStore store guid to search in
+ * @param[in] ulStoreId store id to search in (for the result cache)
  * @param[in] lstFolders list of folders to search in
  * @param[in] lpRestrict restriction to search against
  * @param[out] lppNewRestrict restriction that should be applied to lppIndexerResults (part of the restriction that could not be handled by the indexer).
@@ -295,9 +411,9 @@ static ECRESULT NormalizeGetOptimalMultiFieldSearch(
  */
 ECRESULT GetIndexerResults(ECDatabase *lpDatabase, ECConfig *lpConfig,
     ECCacheManager *lpCacheManager, GUID *guidServer, GUID *guidStore,
-    ECListInt &lstFolders, struct restrictTable *lpRestrict,
-    struct restrictTable **lppNewRestrict, std::list<unsigned int> &lstMatches,
-    std::string &suggestion)
+    unsigned int ulStoreId, ECListInt &lstFolders,
+    struct restrictTable *lpRestrict, struct restrictTable **lppNewRestrict,
+    std::list<unsigned int> &lstMatches, std::string &suggestion)
 {
     ECRESULT er = erSuccess;
 	std::unique_ptr<ECSearchClient> lpSearchClient;
@@ -307,6 +423,7 @@ ECRESULT GetIndexerResults(ECDatabase *lpDatabase, ECConfig *lpConfig,
 	struct restrictTable *lpOptimizedRestrict = NULL;
 	std::list<SIndexedTerm> lstMultiSearches;
 	const char* szSocket = lpConfig->GetSetting("search_socket");
+	auto pool = g_lpSessionManager->get_search_pool();
 
 	auto laters = make_scope_success([&]() {
 		soap_del_PointerTorestrictTable(&lpOptimizedRestrict);
@@ -322,16 +439,14 @@ ECRESULT GetIndexerResults(ECDatabase *lpDatabase, ECConfig *lpConfig,
 	}
 	lstMatches.clear();
 	auto stype = lpConfig->GetSetting("search_enabled");
-	if (stype != nullptr && strcmp(stype, "internal") == 0)
-		lpSearchClient.reset(new(std::nothrow) ECSearchClientMM);
-	else if (!parseBool(stype) || szSocket[0] == '\0')
+	if ((stype == nullptr || strcmp(stype, "internal") != 0) &&
+	    (!parseBool(stype) || szSocket[0] == '\0'))
 		return er = KCERR_NOT_FOUND;
-	else
-		lpSearchClient.reset(new(std::nothrow) ECSearchClientNET(szSocket, atoui(lpConfig->GetSetting("search_timeout"))));
-	if (!lpSearchClient)
-		return er = KCERR_NOT_ENOUGH_MEMORY;
 
 	if (lpCacheManager->GetExcludedIndexProperties(setExcludePropTags) != erSuccess) {
+		lpSearchClient = pool->get(lpConfig);
+		if (!lpSearchClient)
+			return er = KCERR_NOT_ENOUGH_MEMORY;
 		er = lpSearchClient->GetProperties(setExcludePropTags);
 		if (er == KCERR_NETWORK_ERROR)
 			ec_log_err("Error while connecting to search on \"%s\"", szSocket);
@@ -356,6 +471,20 @@ ECRESULT GetIndexerResults(ECDatabase *lpDatabase, ECConfig *lpConfig,
 		// be found, so bail out
 		return er = KCERR_NOT_FOUND;
 
+	auto ttl = atoui(lpConfig->GetSetting("search_cache_ttl"));
+	auto key = IndexerQueryKey(lstFolders, lstMultiSearches);
+	if (ttl > 0 && pool->lookup(ulStoreId, key, ttl, lstMatches, suggestion)) {
+		ec_log_debug("%zu indexed matches found in cache", lstMatches.size());
+		*lppNewRestrict = lpOptimizedRestrict;
+		lpOptimizedRestrict = nullptr;
+		return er;
+	}
+	if (!lpSearchClient) {
+		lpSearchClient = pool->get(lpConfig);
+		if (!lpSearchClient)
+			return er = KCERR_NOT_ENOUGH_MEMORY;
+	}
+
 	ec_log_debug("Using index, %zu index queries", lstMultiSearches.size());
 	tstart = decltype(tstart)::clock::now();
 	er = lpSearchClient->Query(guidServer, guidStore, lstFolders, lstMultiSearches, lstMatches, suggestion);
@@ -367,8 +496,12 @@ ECRESULT GetIndexerResults(ECDatabase *lpDatabase, ECConfig *lpConfig,
 		g_lpSessionManager->m_stats->inc(SCN_INDEXER_SEARCH_ERRORS);
 		ec_log_err("Error while querying search on \"%s\": %s (%x)",
 			szSocket, GetMAPIErrorMessage(kcerr_to_mapierr(er)), er);
-	} else
+	} else {
 		ec_log_debug("Indexed query results found in %u ms", static_cast<unsigned int>(llelapsedtime));
+		pool->put(std::move(lpSearchClient));
+		if (ttl > 0)
+			pool->store(ulStoreId, std::move(key), lstMatches, suggestion);
+	}
 
 	ec_log_debug("%zu indexed matches found", lstMatches.size());
 	*lppNewRestrict = lpOptimizedRestrict;
@@ -3,8 +3,15 @@
  * Copyright 2005 - 2016 Zarafa and its licensors
  */
 #pragma once
+#include <atomic>
 #include <list>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <utility>
+#include <vector>
+#include <kopano/timeutil.hpp>
 
 namespace KC {
 class ECConfig;
@@ -17,5 +24,41 @@ struct ECSearchResultArray;
 #include "soapH.h"
 
 namespace KC {
-extern ECRESULT GetIndexerResults(ECDatabase *lpDatabase, ECConfig *lpConfig, ECCacheManager *lpCacheManager, GUID *guidServer, GUID *guidStore, ECListInt &lstFolders, struct restrictTable *lpRestrict, struct restrictTable **lppNewRestrict, std::list<unsigned int> &lstIndexerResults, std::string &suggestion);
+
+/**
+ * Server-wide state for indexed searches: connections to the indexer that
+ * are kept open between searches, and the results of recent searches, so
+ * that a burst of the same search (type-ahead, search folder rebuilds) does
+ * not go to the indexer every time. Cached results of a store are dropped
+ * when a message in it changes.
+ */
+class ECSearchClientPool final {
+	public:
+	/* Take an idle client, or make one; nullptr if searching is disabled */
+	std::unique_ptr<ECSearchClient> get(ECConfig *);
+	void put(std::unique_ptr<ECSearchClient> &&);
+	bool lookup(unsigned int store_id, const std::string &key, unsigned int ttl, std::list<unsigned int> &matches, std::string &suggestion);
+	void store(unsigned int store_id, std::string &&key, const std::list<unsigned int> &matches, const std::string &suggestion);
+	void invalidate(unsigned int store_id);
+	size_t cache_size() const;
+	size_t idle_clients() const;
+
+	std::atomic<uint64_t> m_hits{0}, m_misses{0};
+
+	private:
+	struct result {
+		KC::time_point ts;
+		std::list<unsigned int> matches;
+		std::string suggestion;
+	};
+
+	mutable std::mutex m_lock;
+	/* Settings the idle clients were made with */
+	std::string m_type, m_socket;
+	unsigned int m_timeout = 0;
+	std::vector<std::unique_ptr<ECSearchClient>> m_idle;
+	std::map<std::pair<unsigned int, std::string>, result> m_cache;
+};
+
+extern ECRESULT GetIndexerResults(ECDatabase *lpDatabase, ECConfig *lpConfig, ECCacheManager *lpCacheManager, GUID *guidServer, GUID *guidStore, unsigned int ulStoreId, ECListInt &lstFolders, struct restrictTable *lpRestrict, struct restrictTable **lppNewRestrict, std::list<unsigned int> &lstIndexerResults, std::string &suggestion);
 }
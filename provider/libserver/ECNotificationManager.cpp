@@ -3,9 +3,11 @@
  * Copyright 2005 - 2016 Zarafa and its licensors
  */
 #include <kopano/platform.h>
+#include <algorithm>
 #include <chrono>
 #include <cstring>
-#include <set>
+#include <string>
+#include <utility>
 #include <pthread.h>
 #include "ECMAPI.h"
 #include "ECNotification.h"
@@ -13,6 +15,7 @@
 #include "ECSession.h"
 #include "ECSessionManager.h"
 #include "SOAPUtils.h"
+#include "StatsClient.h"
 #include "soapH.h"
 
 using namespace std::chrono_literals;
@@ -110,45 +113,57 @@ static int soapresponse(struct notifyResponse notifications, struct soap *soap)
 
 void (*kopano_notify_done)(struct soap *);
 
-ECNotificationManager::ECNotificationManager()
+constexpr unsigned int ECNotificationManager::lat_bounds[];
+
+ECNotificationManager::ECNotificationManager(unsigned int nsenders)
 {
-	auto ret = pthread_create(&m_thread, nullptr, Thread, this);
-	if (ret != 0) {
-		ec_log_err("Could not create ECNotificationManager thread: %s", strerror(ret));
-		return;
+	if (nsenders == 0)
+		nsenders = 1;
+	for (unsigned int i = 0; i < nsenders; ++i) {
+		m_senders.emplace_back(new sender);
+		auto &w = *m_senders.back();
+		w.mgr = this;
+		w.id = i;
+		auto ret = pthread_create(&w.thread, nullptr, Thread, &w);
+		if (ret != 0) {
+			ec_log_err("Could not create ECNotificationManager thread: %s", strerror(ret));
+			continue;
+		}
+		w.thread_active = true;
+		set_thread_name(w.thread, "notify_mgr/" + std::to_string(i));
 	}
-	m_thread_active = true;
-	set_thread_name(m_thread, "notify_mgr");
 }
 
 ECNotificationManager::~ECNotificationManager()
 {
-	ulock_normal l_ses(m_mutexSessions);
 	m_bExit = true;
-	m_condSessions.notify_all();
-	l_ses.unlock();
+	for (auto &w : m_senders) {
+		scoped_lock lk(w->act_mtx);
+		w->cond.notify_all();
+	}
 
 	ec_log_info("Shutdown notification manager");
-	if (m_thread_active)
-		pthread_join(m_thread, nullptr);
-
-    // Close and free any pending requests (clients will receive EOF)
-	for (const auto &p : m_mapRequests) {
-		// we can't call kopano_notify_done here, race condition on shutdown in ECSessionManager vs ECDispatcher
-		kopano_end_soap_connection(p.second.soap);
-		soap_destroy(p.second.soap);
-		soap_end(p.second.soap);
-		soap_free(p.second.soap);
-    }
+	for (auto &w : m_senders) {
+		if (w->thread_active)
+			pthread_join(w->thread, nullptr);
+		// Close and free any pending requests (clients will receive EOF)
+		for (const auto &p : w->requests) {
+			// we can't call kopano_notify_done here, race condition on shutdown in ECSessionManager vs ECDispatcher
+			kopano_end_soap_connection(p.second.soap);
+			soap_destroy(p.second.soap);
+			soap_end(p.second.soap);
+			soap_free(p.second.soap);
+		}
+	}
 }
 
 // Called by the SOAP handler
 HRESULT ECNotificationManager::AddRequest(ECSESSIONID ecSessionId, struct soap *soap)
 {
-    struct soap *lpItem = NULL;
-	ulock_normal l_req(m_mutexRequests);
-	auto iterRequest = m_mapRequests.find(ecSessionId);
-	if (iterRequest != m_mapRequests.cend()) {
+	auto &w = owner(ecSessionId);
+	ulock_normal l_req(w.mtx);
+	auto iterRequest = w.requests.find(ecSessionId);
+	if (iterRequest != w.requests.cend()) {
         // Hm. There is already a SOAP request waiting for this session id. Apparently a second SOAP connection has now
         // requested notifications. Since this should only happen if the client thinks it has lost its connection and has
         // restarted the request, we will replace the existing request with this one.
@@ -165,16 +180,16 @@ HRESULT ECNotificationManager::AddRequest(ECSESSIONID ecSessionId, struct soap *
 			soap_send_fault(iterRequest->second.soap);
 		soap_destroy(iterRequest->second.soap);
 		soap_end(iterRequest->second.soap);
-        lpItem = iterRequest->second.soap;
         // Pass the socket back to the socket manager (which will probably close it since the client should not be holding two notification sockets)
 		if (kopano_notify_done != nullptr)
-			kopano_notify_done(lpItem);
+			kopano_notify_done(iterRequest->second.soap);
     }
 
     NOTIFREQUEST req;
     req.soap = soap;
     time(&req.ulRequestTime);
-    m_mapRequests[ecSessionId] = req;
+	w.requests[ecSessionId] = req;
+	schedule(w, ecSessionId, req.ulRequestTime);
 	l_req.unlock();
     // There may already be notifications waiting for this session, so post a change on this session so that the
     // thread will attempt to get notifications on this session
@@ -185,109 +200,195 @@ HRESULT ECNotificationManager::AddRequest(ECSESSIONID ecSessionId, struct soap *
 // Called by a session when it has a notification to send
 HRESULT ECNotificationManager::NotifyChange(ECSESSIONID ecSessionId)
 {
-    // Simply mark the session in our set of active sessions
-	scoped_lock l_ses(m_mutexSessions);
-	m_setActiveSessions.emplace(ecSessionId);
-	m_condSessions.notify_all(); /* Wake up thread due to activity */
+    // Simply mark the session in the set of active sessions of its sender
+	auto &w = owner(ecSessionId);
+	scoped_lock l_ses(w.act_mtx);
+	w.active.emplace(ecSessionId, time_point::clock::now());
+	w.cond.notify_one(); /* Wake up thread due to activity */
 	return hrSuccess;
 }
 
 void * ECNotificationManager::Thread(void *lpParam)
 {
 	kcsrv_blocksigs();
-	return static_cast<ECNotificationManager *>(lpParam)->Work();
+	auto w = static_cast<sender *>(lpParam);
+	return w->mgr->Work(*w);
+}
+
+/**
+ * Put a request on the timer wheel. The request is due once it has waited
+ * for more than m_ulTimeout seconds.
+ */
+void ECNotificationManager::schedule(sender &w, ECSESSIONID ses, time_t req_time)
+{
+	auto due = req_time + m_ulTimeout + 1;
+	w.wheel[due % wheel_slots].emplace_back(ses, req_time);
+}
+
+/*
+ * Find all notification requests which have not received any data for
+ * m_ulTimeout seconds. This makes sure that the client get a response, even
+ * if there are no notifications. Since the client has a hard-coded TCP timeout
+ * of 70 seconds, we need to respond well within those 70 seconds. We therefore
+ * use a timeout value of 60 seconds here.
+ *
+ * Only the slots of the seconds elapsed since the last call are looked at.
+ * Entries of requests that were answered or replaced in the meantime are
+ * simply dropped. Must be called with w.mtx held (and not w.act_mtx).
+ */
+void ECNotificationManager::advance(sender &w, time_t now)
+{
+	if (w.wheel_last == 0 || now < w.wheel_last)
+		w.wheel_last = now - 1;
+	auto t = std::max(w.wheel_last + 1, now - static_cast<time_t>(wheel_slots) + 1);
+	auto mark = time_point::clock::now();
+	std::vector<ECSESSIONID> due;
+	for (; t <= now; ++t) {
+		auto &slot = w.wheel[t % wheel_slots];
+		std::vector<std::pair<ECSESSIONID, time_t>> keep;
+		for (const auto &e : slot) {
+			if (now - e.second <= static_cast<time_t>(m_ulTimeout)) {
+				keep.emplace_back(e);
+				continue;
+			}
+			auto i = w.requests.find(e.first);
+			if (i != w.requests.cend() && i->second.ulRequestTime == e.second)
+				due.emplace_back(e.first);
+		}
+		slot = std::move(keep);
+	}
+	w.wheel_last = now;
+	if (due.empty())
+		return;
+	// Mark the sessions as active so they will be processed in the next loop
+	scoped_lock l_act(w.act_mtx);
+	for (auto ses : due)
+		w.active.emplace(ses, mark);
 }
 
-void *ECNotificationManager::Work() {
-    ECSession *lpecSession = NULL;
-    struct notifyResponse notifications;
-    std::set<ECSESSIONID> setActiveSessions;
-    struct soap *lpItem;
-    time_t ulNow = 0;
+void *ECNotificationManager::Work(sender &w)
+{
+	std::map<ECSESSIONID, time_point> active;
 
     // Keep looping until we should exit
     while(1) {
-		ulock_normal l_ses(m_mutexSessions);
+		ulock_normal l_ses(w.act_mtx);
 		if (m_bExit)
 			break;
-		if (m_setActiveSessions.size() == 0)
-			m_condSessions.wait_for(l_ses, 1s);
-
-        // Make a copy of the session list so we can release the lock ASAP
-        setActiveSessions = m_setActiveSessions;
-        m_setActiveSessions.clear();
+		if (w.active.size() == 0)
+			w.cond.wait_for(l_ses, 1s);
+		if (m_bExit)
+			break;
+		l_ses.unlock();
+		ulock_normal l_req(w.mtx);
+		advance(w, time(nullptr));
+		l_req.unlock();
+
+        // Take the session list so we can release the lock ASAP
+		l_ses.lock();
+		active = std::move(w.active);
+		w.active.clear();
+		w.inflight = active.size();
 		l_ses.unlock();
 
         // Look at all the sessions that have signalled a change
-        for (const auto &ses : setActiveSessions) {
-            lpItem = NULL;
-			ulock_normal l_req(m_mutexRequests);
-
-            // Find the request for the session that had something to say
-            auto iterRequest = m_mapRequests.find(ses);
-            if (iterRequest != m_mapRequests.cend()) {
-                // Reset notification response to default values
-                soap_default_notifyResponse(iterRequest->second.soap, &notifications);
-                if (g_lpSessionManager->ValidateSession(iterRequest->second.soap, ses, &lpecSession) == erSuccess) {
-                    // Get the notifications from the session
-					auto er = lpecSession->GetNotifyItems(iterRequest->second.soap, &notifications);
-
-                    if(er == KCERR_NOT_FOUND) {
-                        if(time(NULL) - iterRequest->second.ulRequestTime < m_ulTimeout) {
-                            // No notifications - this means we have to wait. This can happen if the session was marked active since
-                            // the request was just made, and there may have been notifications still waiting for us
-							l_req.unlock();
-							lpecSession->unlock();
-                            continue; // Totally ignore this item == wait
-                        } else {
-                            // No notifications and we're out of time, just respond OK with 0 notifications
-                            er = erSuccess;
-							notifications.pNotificationArray = soap_new_notificationArray(iterRequest->second.soap);
-                            soap_default_notificationArray(iterRequest->second.soap, notifications.pNotificationArray);
-                        }
-                    }
-
-                    notifications.er = er;
-					lpecSession->unlock();
-                } else {
-                    // The session is dead
-                    notifications.er = KCERR_END_OF_SESSION;
-                }
-
-                // Send the SOAP data
-				if (soapresponse(notifications, iterRequest->second.soap))
-					// Handle error on the response
-					soap_send_fault(iterRequest->second.soap);
-				// Free allocated SOAP data (in GetNotifyItems())
-				soap_destroy(iterRequest->second.soap);
-				soap_end(iterRequest->second.soap);
-
-                // Since we have responded, remove the item from our request list and pass it back to the active socket list so
-                // that the next SOAP call can be handled (probably another notification request)
-                lpItem = iterRequest->second.soap;
-                m_mapRequests.erase(iterRequest);
-            } else {
-                // Nobody was listening to this session, just ignore it
-            }
-			l_req.unlock();
-			if (lpItem != nullptr && kopano_notify_done != nullptr)
-				kopano_notify_done(lpItem);
-        }
-
-        /* Find all notification requests which have not received any data for m_ulTimeout seconds. This makes sure
-         * that the client get a response, even if there are no notifications. Since the client has a hard-coded
-         * TCP timeout of 70 seconds, we need to respond well within those 70 seconds. We therefore use a timeout
-         * value of 60 seconds here.
-         */
-		ulock_normal l_req(m_mutexRequests);
-        time(&ulNow);
-        for (const auto &req : m_mapRequests)
-            if (ulNow - req.second.ulRequestTime > m_ulTimeout)
-                // Mark the session as active so it will be processed in the next loop
-                NotifyChange(req.first);
+		for (const auto &ses : active) {
+			deliver(w, ses.first, ses.second);
+			--w.inflight;
+		}
     }
-
     return NULL;
 }
 
+void ECNotificationManager::deliver(sender &w, ECSESSIONID ses,
+    const time_point &mark)
+{
+	ECSession *lpecSession = nullptr;
+	struct notifyResponse notifications;
+	ulock_normal l_req(w.mtx);
+
+	// Find the request for the session that had something to say
+	auto iterRequest = w.requests.find(ses);
+	if (iterRequest == w.requests.cend())
+		// Nobody was listening to this session, just ignore it
+		return;
+	auto soap = iterRequest->second.soap;
+	// Reset notification response to default values
+	soap_default_notifyResponse(soap, &notifications);
+	if (g_lpSessionManager->ValidateSession(soap, ses, &lpecSession) == erSuccess) {
+		// Get the notifications from the session
+		auto er = lpecSession->GetNotifyItems(soap, &notifications);
+
+		if (er == KCERR_NOT_FOUND) {
+			if (time(NULL) - iterRequest->second.ulRequestTime < m_ulTimeout) {
+				// No notifications - this means we have to wait. This can happen if the session was marked active since
+				// the request was just made, and there may have been notifications still waiting for us
+				lpecSession->unlock();
+				return; // Totally ignore this item == wait
+			}
+			// No notifications and we're out of time, just respond OK with 0 notifications
+			er = erSuccess;
+			notifications.pNotificationArray = soap_new_notificationArray(soap);
+			soap_default_notificationArray(soap, notifications.pNotificationArray);
+		}
+		notifications.er = er;
+		lpecSession->unlock();
+	} else {
+		// The session is dead
+		notifications.er = KCERR_END_OF_SESSION;
+	}
+
+	/*
+	 * Since we are responding, remove the item from our request list. The
+	 * write happens without the lock, so that a slow socket does not hold
+	 * up AddRequest/NotifyChange for the other sessions of this sender.
+	 */
+	w.requests.erase(iterRequest);
+	l_req.unlock();
+
+	// Send the SOAP data
+	if (soapresponse(notifications, soap))
+		// Handle error on the response
+		soap_send_fault(soap);
+	// Free allocated SOAP data (in GetNotifyItems())
+	soap_destroy(soap);
+	soap_end(soap);
+
+	auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(time_point::clock::now() - mark).count();
+	size_t b = 0;
+	while (b < lat_buckets - 1 && static_cast<uint64_t>(ms) >= lat_bounds[b])
+		++b;
+	++w.latency[b];
+
+	// Pass it back to the active socket list so that the next SOAP call can be handled (probably another notification request)
+	if (kopano_notify_done != nullptr)
+		kopano_notify_done(soap);
+}
+
+void ECNotificationManager::update_extra_stats(ECStatsCollector &sc)
+{
+	for (const auto &wp : m_senders) {
+		auto &w = *wp;
+		auto pfx = "notify" + std::to_string(w.id);
+		size_t waiting, backlog;
+		{
+			scoped_lock lk(w.mtx);
+			waiting = w.requests.size();
+		}
+		{
+			scoped_lock lk(w.act_mtx);
+			backlog = w.active.size();
+		}
+		sc.setg(pfx + "_waiting", "Notification requests waiting in sender " + std::to_string(w.id), waiting);
+		sc.setg(pfx + "_backlog", "Notifications pending in sender " + std::to_string(w.id), backlog + w.inflight);
+		for (size_t b = 0; b < lat_buckets; ++b) {
+			auto bound = b < lat_buckets - 1 ? std::to_string(lat_bounds[b]) + "ms" : "inf";
+			sc.set(pfx + "_lat_" + bound,
+			       "Notifications of sender " + std::to_string(w.id) +
+			       " delivered in " + (b < lat_buckets - 1 ? "under " + bound : "longer"),
+			       w.latency[b].load());
+		}
+	}
+}
+
 } /* namespace */
@@ -4,26 +4,37 @@
  */
 #pragma once
 #include <kopano/zcdefs.h>
+#include <atomic>
 #include <condition_variable>
+#include <memory>
 #include <mutex>
+#include <utility>
+#include <vector>
+#include <cstdint>
 #include <pthread.h>
 #include "ECSession.h"
 #include <kopano/ECLogger.h>
 #include <kopano/ECConfig.h>
+#include <kopano/timeutil.hpp>
 #include <map>
-#include <set>
 
 struct soap;
 
 namespace KC {
 
 /*
- * The notification manager runs in a single thread, servicing notifications to ALL clients
- * that are waiting for a notification. We simply store all waiting soap connection objects together
- * with their getNextNotify() request, and once we are signalled that something has changed for one
- * of those queues, we send the reply, and requeue the soap connection for the next request.
+ * The notification manager services notifications to ALL clients that are
+ * waiting for a notification. We simply store all waiting soap connection
+ * objects together with their getNextNotify() request, and once we are
+ * signalled that something has changed for one of those queues, we send the
+ * reply, and requeue the soap connection for the next request.
  *
  * So, basically we only handle the SOAP-reply part of the soap request.
+ *
+ * Sessions are partitioned over a number of sender threads by session ID, so
+ * that one slow client socket only holds up the sessions of its own partition.
+ * Every sender keeps a timer wheel with one-second slots to find requests that
+ * have been waiting for m_ulTimeout seconds.
  */
 
 struct NOTIFREQUEST {
@@ -33,32 +44,57 @@ struct NOTIFREQUEST {
 
 class ECNotificationManager final {
 public:
-	ECNotificationManager();
+	ECNotificationManager(unsigned int nsenders = 1);
 	~ECNotificationManager();
 
     // Called by the SOAP handler
     HRESULT AddRequest(ECSESSIONID ecSessionId, struct soap *soap);
     // Called by a session when it has a notification to send
     HRESULT NotifyChange(ECSESSIONID ecSessionId);
+	void update_extra_stats(ECStatsCollector &);
 
 private:
-    // Just a wrapper to Work()
-    static void * Thread(void *lpParam);
-    void * Work();
+	/* Upper bounds (ms) of the delivery latency histogram buckets; the last one is open */
+	static constexpr unsigned int lat_bounds[] = {1, 10, 100, 1000};
+	static constexpr size_t lat_buckets = sizeof(lat_bounds) / sizeof(lat_bounds[0]) + 1;
+	/* Must be larger than m_ulTimeout */
+	static constexpr unsigned int wheel_slots = 64;
 
-	bool m_thread_active = false, m_bExit = false;
-    pthread_t 	m_thread;
-	unsigned int m_ulTimeout = 60; /* Currently hardcoded at 60s, see comment in Work() */
+	struct sender {
+		ECNotificationManager *mgr = nullptr;
+		unsigned int id = 0;
+		pthread_t thread{};
+		bool thread_active = false;
+		/*
+		 * mtx guards requests and the wheel, and is held while the
+		 * sessions are asked for their notifications. act_mtx only
+		 * guards active, so that sessions can report activity while
+		 * holding their own locks. Order: mtx before act_mtx.
+		 */
+		std::mutex mtx, act_mtx;
+		std::condition_variable cond;
+		// All sessions of this partition that are waiting for a SOAP response to be sent (an item can be in here for up to 60 seconds)
+		std::map<ECSESSIONID, NOTIFREQUEST> requests;
+		// Sessions that have reported notification activity, with the time of the first report, but are yet to be processed
+		std::map<ECSESSIONID, time_point> active;
+		// Timer wheel: slot (deadline % wheel_slots) holds {session, request time}
+		std::vector<std::pair<ECSESSIONID, time_t>> wheel[wheel_slots];
+		time_t wheel_last = 0;
+		std::atomic<size_t> inflight{0};
+		std::atomic<uint64_t> latency[lat_buckets]{};
+	};
 
-    // A map of all sessions that are waiting for a SOAP response to be sent (an item can be in here for up to 60 seconds)
-    std::map<ECSESSIONID, NOTIFREQUEST> 	m_mapRequests;
-    // A set of all sessions that have reported notification activity, but are yet to be processed.
-    // (a session is in here for only very short periods of time, and contains only a few sessions even if the load is high)
-    std::set<ECSESSIONID> 					m_setActiveSessions;
+    // Just a wrapper to Work()
+    static void * Thread(void *lpParam);
+	void *Work(sender &);
+	void deliver(sender &, ECSESSIONID, const time_point &mark);
+	void schedule(sender &, ECSESSIONID, time_t req_time);
+	void advance(sender &, time_t now);
+	sender &owner(ECSESSIONID id) { return *m_senders[id % m_senders.size()]; }
 
-	std::mutex m_mutexRequests;
-	std::mutex m_mutexSessions;
-	std::condition_variable m_condSessions;
+	std::atomic<bool> m_bExit{false};
+	unsigned int m_ulTimeout = 60; /* Currently hardcoded at 60s, see comment in advance() */
+	std::vector<std::unique_ptr<sender>> m_senders;
 };
 
 extern KC_EXPORT void (*kopano_notify_done)(struct soap *);
@@ -14,16 +14,25 @@
 #include <new>
 #include <set>
 #include <string>
+#include <vector>
+#include <cerrno>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <zlib.h>
 #include <mapidefs.h>
 #include <mapitags.h>
 #include <kopano/MAPIErrors.h>
+#include <kopano/fileutil.hpp>
+#include <kopano/scope.hpp>
 #include <kopano/stringutil.h>
 #include "../../common/ECSerializer.h"
 #include "../common/SOAPUtils.h"
 #include "ECAttachmentStorage.h"
 #include "ECS3Attachment.h"
+#include "ECSessionManager.h"
+#include "StatsClient.h"
 #include "StreamUtil.h"
 
 using namespace std::chrono_literals;
@@ -40,49 +49,8 @@ namespace KC {
 #define now_positive() (steady_clock::now() + 600s)
 #define now_negative() (steady_clock::now() + 60s)
 
-class ECS3Attachment final : public ECAttachmentStorage {
-	public:
-	ECS3Attachment(ECS3Config &, ECDatabase *);
-
-	protected:
-	virtual ~ECS3Attachment();
-
-	/* Single Instance Attachment handlers */
-	virtual ECRESULT LoadAttachmentInstance(struct soap *, const ext_siid &, size_t *, unsigned char **) override;
-	virtual ECRESULT LoadAttachmentInstance(const ext_siid &, size_t *, ECSerializer *) override;
-	virtual ECRESULT SaveAttachmentInstance(ext_siid &, ULONG, size_t, unsigned char *) override;
-	virtual ECRESULT SaveAttachmentInstance(ext_siid &, ULONG, size_t, ECSerializer *) override;
-	virtual ECRESULT DeleteAttachmentInstances(const std::list<ext_siid> &, bool replace) override;
-	virtual ECRESULT DeleteAttachmentInstance(const ext_siid &, bool replace) override;
-	virtual ECRESULT GetSizeInstance(const ext_siid &, size_t *, bool * = nullptr) override;
-	virtual kd_trans Begin(ECRESULT &) override;
-
-	private:
-	static S3Status response_prop_cb(const S3ResponseProperties *, void *);
-	static void response_complete_cb(S3Status, const S3ErrorDetails *, void *);
-	static S3Status get_obj_cb(int, const char *, void *);
-	static int put_obj_cb(int, char *, void *);
-
-	S3Status response_prop(const S3ResponseProperties *, void *);
-	void response_complete(S3Status, const S3ErrorDetails *, void *);
-	S3Status get_obj(int, const char *, void *);
-	int put_obj(int, char *, void *);
-	std::string make_att_filename(const ext_siid &);
-	bool should_retry(unsigned int &);
-	struct s3_cd create_cd();
-	ECRESULT del_marked_att(const ext_siid &);
-	virtual ECRESULT Commit() override;
-	virtual ECRESULT Rollback() override;
-	ECRESULT s3_get(struct s3_cd &, const char *filename);
-	ECRESULT s3_put(struct s3_cd &, const char *filename);
-
-	/* Variables: */
-	ECS3Config &m_config;
-	std::set<ext_siid> m_new_att, m_marked_att;
-	bool m_transact = false;
-
-	friend class ECS3Config;
-};
+/* S3 does not accept parts smaller than this, except for the last one */
+#define S3_MIN_PART_SIZE (5 * 1024 * 1024)
 
 /* callback data */
 struct s3_cd {
@@ -90,8 +58,14 @@ struct s3_cd {
 	unsigned char *data = nullptr;
 	ECSerializer *sink = nullptr;
 	bool alloc_data = false;
-	size_t size = 0, processed = 0;
+	/* Ranged part: the response must have exactly @size bytes */
+	bool fixed_size = false;
+	size_t size = 0, processed = 0, offset = 0;
 	S3Status status = S3StatusOK;
+	/* Received data is copied here as well (disk cache), unless tee_fail */
+	int tee = -1;
+	bool tee_fail = false;
+	std::string etag, upload_id;
 };
 
 /* callback data wrapper */
@@ -102,6 +76,42 @@ struct s3_cdw {
 
 #define S3_NEGATIVE_ENTRY SIZE_MAX
 
+static void s3_stat_op(bool put, const steady_clock::time_point &start, ECRESULT ret)
+{
+	if (g_lpSessionManager == nullptr)
+		return;
+	auto &st = g_lpSessionManager->m_stats;
+	LONGLONG us = std::chrono::duration_cast<std::chrono::microseconds>(steady_clock::now() - start).count();
+	st->inc(put ? SCN_S3_PUT : SCN_S3_GET);
+	st->inc(put ? SCN_S3_PUT_TIME : SCN_S3_GET_TIME, us);
+	st->Max(put ? SCN_S3_PUT_TIME_MAX : SCN_S3_GET_TIME_MAX, us);
+	if (ret != erSuccess)
+		st->inc(SCN_S3_FAILED);
+}
+
+static void s3_stat_cache(bool hit)
+{
+	if (g_lpSessionManager != nullptr)
+		g_lpSessionManager->m_stats->inc(hit ? SCN_S3_CACHE_HITS : SCN_S3_CACHE_MISSES);
+}
+
+static ECRESULT s3_stream_fd(int fd, size_t size, ECSerializer *sink)
+{
+	std::unique_ptr<char[]> buf(new(std::nothrow) char[S3_MIN_PART_SIZE]);
+	if (buf == nullptr)
+		return KCERR_NOT_ENOUGH_MEMORY;
+	while (size > 0) {
+		auto len = std::min(size, static_cast<size_t>(S3_MIN_PART_SIZE));
+		if (read_retry(fd, buf.get(), len) != static_cast<ssize_t>(len))
+			return KCERR_DATABASE_ERROR;
+		auto ret = sink->Write(buf.get(), 1, len);
+		if (ret != erSuccess)
+			return ret;
+		size -= len;
+	}
+	return erSuccess;
+}
+
 /* This ought to be moved into ECS3Attachment, if and when that becomes a singleton. */
 
 ECRESULT ECS3Config::init(std::shared_ptr<ECConfig> cfg)
@@ -114,6 +124,9 @@ ECRESULT ECS3Config::init(std::shared_ptr<ECConfig> cfg)
 	m_region = cfg->GetSetting("attachment_s3_region");
 	m_path   = cfg->GetSetting("attachment_path");
 	m_comp   = strtol(cfg->GetSetting("attachment_compression"), nullptr, 0);
+	m_part_size = std::max(static_cast<size_t>(strtoull(cfg->GetSetting("attachment_s3_part_size"), nullptr, 0)),
+	              static_cast<size_t>(S3_MIN_PART_SIZE));
+	m_parallel = std::max(1U, atoui(cfg->GetSetting("attachment_s3_parallel")));
 
 	auto protocol = cfg->GetSetting("attachment_s3_protocol");
 	auto uri_style = cfg->GetSetting("attachment_s3_uristyle");
@@ -134,6 +147,14 @@ ECRESULT ECS3Config::init(std::shared_ptr<ECConfig> cfg)
 	m_get_conditions.ifNotModifiedSince = -1;
 	m_get_conditions.ifMatchETag = nullptr;
 	m_get_conditions.ifNotMatchETag = nullptr;
+	m_mp_init_handler.responseHandler = m_response_handler;
+	m_mp_init_handler.responseXmlCallback = &ECS3Attachment::mp_init_cb;
+	m_mp_commit_handler.responseHandler = m_response_handler;
+	m_mp_commit_handler.putObjectDataCallback = &ECS3Attachment::put_obj_cb;
+	m_mp_commit_handler.responseXmlCallback = &ECS3Attachment::mp_commit_cb;
+	/* Abort requests carry no callback data */
+	m_mp_abort_handler.responseHandler.propertiesCallback = [](const S3ResponseProperties *, void *) { return S3StatusOK; };
+	m_mp_abort_handler.responseHandler.completeCallback = [](S3Status, const S3ErrorDetails *, void *) {};
 	/*
 	 * Do a dlopen of libs3.so.4 so that the implicit pull-in of
 	 * libldap-2.4.so.2 symbols does not pollute our namespace of
@@ -162,6 +183,22 @@ ECRESULT ECS3Config::init(std::shared_ptr<ECConfig> cfg)
 	W(delete_object);
 	W(get_object);
 #undef W
+	/* Not in every libs3 build; without them, objects go in one piece. */
+#define W(n) do { \
+		DY_ ## n = reinterpret_cast<decltype(DY_ ## n)>(dlsym(m_handle, "S3_" #n)); \
+		m_multipart &= DY_ ## n != nullptr; \
+	} while (false)
+	m_multipart = true;
+	W(create_request_context);
+	W(runall_request_context);
+	W(destroy_request_context);
+	W(initiate_multipart);
+	W(upload_part);
+	W(complete_multipart_upload);
+	W(abort_multipart_upload);
+#undef W
+	if (!m_multipart)
+		ec_log_warn("S3: libs3 lacks multipart support; attachments are transferred in one piece");
 	auto status = DY_initialize("Kopano Mail", S3_INIT_ALL,
 	              cfg->GetSetting("attachment_s3_hostname"));
 	if (status != S3StatusOK) {
@@ -169,6 +206,9 @@ ECRESULT ECS3Config::init(std::shared_ptr<ECConfig> cfg)
 			DY_get_status_name(status));
 		return KCERR_NETWORK_ERROR;
 	}
+	auto cache_path = cfg->GetSetting("attachment_s3_cache_path");
+	if (cache_path != nullptr && *cache_path != '\0')
+		m_disk.init(cache_path, strtoull(cfg->GetSetting("attachment_s3_cache_size"), nullptr, 0));
 	return erSuccess;
 }
 
@@ -246,6 +286,23 @@ int ECS3Attachment::put_obj_cb(int bufferSize, char *buffer, void *cbdata)
 	return data->caller->put_obj(bufferSize, buffer, data->cbdata);
 }
 
+/**
+ * Records the upload ID of a multipart upload that S3 has just set up.
+ */
+S3Status ECS3Attachment::mp_init_cb(const char *upload_id, void *cbdata)
+{
+	auto data = static_cast<struct s3_cd *>(static_cast<struct s3_cdw *>(cbdata)->cbdata);
+	if (upload_id != nullptr)
+		data->upload_id = upload_id;
+	return S3StatusOK;
+}
+
+S3Status ECS3Attachment::mp_commit_cb(const char *location, const char *etag,
+    void *cbdata)
+{
+	return S3StatusOK;
+}
+
 /*
  * Locking requirements of ECAttachmentStorage: In the case of
  * ECAttachmentStorage locking to protect against concurrent access is futile.
@@ -311,7 +368,14 @@ S3Status ECS3Attachment::response_prop(const S3ResponseProperties *properties, v
 {
 	auto data = static_cast<struct s3_cd *>(cbdata);
 
-	if (properties->contentLength != 0) {
+	if (properties->eTag != nullptr)
+		data->etag = properties->eTag;
+	if (data->fixed_size && properties->contentLength != 0 &&
+	    properties->contentLength != data->size) {
+		ec_log_err("S3: expected a part of %zu bytes, but got %llu",
+			data->size, static_cast<unsigned long long>(properties->contentLength));
+		return S3StatusAbortedByCallback;
+	} else if (properties->contentLength != 0) {
 		data->size = properties->contentLength;
 		ec_log_debug("S3: received the response properties, content length: %zu", data->size);
 	} else {
@@ -406,6 +470,9 @@ S3Status ECS3Attachment::get_obj(int bufferSize, const char *buffer, void *cbdat
 	} else {
 		memcpy(data->data + data->processed, buffer, bufferSize);
 	}
+	if (data->tee >= 0 && !data->tee_fail &&
+	    write_retry(data->tee, buffer, bufferSize) != bufferSize)
+		data->tee_fail = true;
 	data->processed += bufferSize;
 	return S3StatusOK;
 }
@@ -478,7 +545,7 @@ ECRESULT ECS3Attachment::s3_get(struct s3_cd &cd, const char *fn)
 	if (cd.size != cd.processed)
 		ec_log_err("S3: load %s: short read %zu/%zu bytes",
 			fn, cd.processed, cd.size);
-	else if (cd.data == nullptr)
+	else if (cd.data == nullptr && cd.sink == nullptr)
 		ret = KCERR_NOT_ENOUGH_MEMORY;
 	else if (cd.status != S3StatusOK)
 		ret = KCERR_NETWORK_ERROR;
@@ -508,10 +575,38 @@ ECRESULT ECS3Attachment::s3_get(struct s3_cd &cd, const char *fn)
 ECRESULT ECS3Attachment::LoadAttachmentInstance(struct soap *soap,
     const ext_siid &ins_id, size_t *size_p, unsigned char **data_p)
 {
+	size_t size = 0;
+	int fd = m_config.m_disk.enabled() ? m_config.m_disk.open(ins_id.siid, &size) : -1;
+	if (fd >= 0) {
+		s3_stat_cache(true);
+		*data_p = soap_new_unsignedByte(soap, size);
+		auto rd = *data_p != nullptr ? read_retry(fd, *data_p, size) : -1;
+		close(fd);
+		if (rd == static_cast<ssize_t>(size)) {
+			*size_p = size;
+			return erSuccess;
+		}
+		ec_log_warn("S3: cached copy of %u is unreadable", ins_id.siid);
+		m_config.m_disk.drop(ins_id.siid);
+	} else if (m_config.m_disk.enabled()) {
+		s3_stat_cache(false);
+	}
+
 	struct s3_cd cd;
-	cd.alloc_data = true;
 	cd.soap = soap;
-	auto ret = s3_get(cd, make_att_filename(ins_id).c_str());
+	auto filename = make_att_filename(ins_id);
+	auto start = steady_clock::now();
+	ECRESULT ret;
+	if (m_config.m_multipart && GetSizeInstance(ins_id, &size) == erSuccess &&
+	    use_parts(size)) {
+		cd.size = size;
+		cd.data = soap_new_unsignedByte(soap, size);
+		ret = cd.data != nullptr ? s3_get_parts(cd, filename.c_str()) : KCERR_NOT_ENOUGH_MEMORY;
+	} else {
+		cd.alloc_data = true;
+		ret = s3_get(cd, filename.c_str());
+	}
+	s3_stat_op(false, start, ret);
 	if (ret != hrSuccess)
 		return ret;
 	*size_p = cd.size;
@@ -521,6 +616,8 @@ ECRESULT ECS3Attachment::LoadAttachmentInstance(struct soap *soap,
 	 * memory after its use.
 	 */
 	*data_p = cd.data;
+	if (m_config.m_disk.enabled())
+		m_config.m_disk.store(ins_id.siid, cd.data, cd.size);
 	/*
 	 * Make sure we clear the cd.data variable so we cannot write
 	 * to it after it is freed externally.
@@ -545,9 +642,42 @@ ECRESULT ECS3Attachment::LoadAttachmentInstance(struct soap *soap,
 ECRESULT ECS3Attachment::LoadAttachmentInstance(const ext_siid &ins_id,
     size_t *size_p, ECSerializer *sink)
 {
+	size_t size = 0;
+	int fd = m_config.m_disk.enabled() ? m_config.m_disk.open(ins_id.siid, &size) : -1;
+	if (fd >= 0) {
+		s3_stat_cache(true);
+		auto ret = s3_stream_fd(fd, size, sink);
+		close(fd);
+		if (ret == erSuccess)
+			*size_p = size;
+		return ret;
+	} else if (m_config.m_disk.enabled()) {
+		s3_stat_cache(false);
+	}
+
 	struct s3_cd cd;
 	cd.sink = sink;
-	auto ret = s3_get(cd, make_att_filename(ins_id).c_str());
+	std::string tmpname;
+	if (m_config.m_disk.enabled())
+		cd.tee = m_config.m_disk.create(ins_id.siid, &tmpname);
+	auto filename = make_att_filename(ins_id);
+	auto start = steady_clock::now();
+	ECRESULT ret;
+	if (m_config.m_multipart && GetSizeInstance(ins_id, &size) == erSuccess &&
+	    use_parts(size)) {
+		cd.size = size;
+		ret = s3_get_parts(cd, filename.c_str());
+	} else {
+		ret = s3_get(cd, filename.c_str());
+	}
+	s3_stat_op(false, start, ret);
+	if (cd.tee >= 0) {
+		close(cd.tee);
+		if (ret == erSuccess && !cd.tee_fail)
+			m_config.m_disk.commit(ins_id.siid, tmpname, cd.size);
+		else
+			unlink(tmpname.c_str());
+	}
 	if (ret == KCERR_NETWORK_ERROR)
 		/* The entire stream would abort if we return non-success. */
 		ret = erSuccess;
@@ -591,6 +721,214 @@ ECRESULT ECS3Attachment::s3_put(struct s3_cd &cd, const char *fn)
 	return KCERR_DATABASE_ERROR;
 }
 
+bool ECS3Attachment::use_parts(size_t size) const
+{
+	return m_config.m_multipart && m_config.m_parallel > 1 && size > m_config.m_part_size;
+}
+
+/**
+ * Transfer a set of parts concurrently, all in one libs3 request context:
+ * ranged GETs if @upload_id is nullptr, multipart uploads numbered from
+ * @seq otherwise. Parts that fail are retried one at a time.
+ */
+bool ECS3Attachment::run_parts(std::vector<s3_cd> &parts, const char *fn,
+    const char *upload_id, unsigned int seq)
+{
+	std::vector<s3_cdw> cw(parts.size());
+	auto issue = [&](size_t i, S3RequestContext *ctx) {
+		if (upload_id == nullptr)
+			m_config.DY_get_object(&m_config.m_bkctx, fn,
+				&m_config.m_get_conditions, parts[i].offset,
+				parts[i].size, ctx, 0, &m_config.m_get_obj_handler, &cw[i]);
+		else
+			m_config.DY_upload_part(&m_config.m_bkctx, fn, nullptr,
+				&m_config.m_put_obj_handler, seq + i, upload_id,
+				static_cast<int>(parts[i].size), ctx, 0, &cw[i]);
+	};
+
+	S3RequestContext *ctx = nullptr;
+	auto status = m_config.DY_create_request_context(&ctx);
+	if (status != S3StatusOK) {
+		ec_log_warn("S3: cannot create request context: %s", m_config.DY_get_status_name(status));
+		ctx = nullptr;
+	}
+	for (size_t i = 0; i < parts.size(); ++i) {
+		cw[i].caller = this;
+		cw[i].cbdata = &parts[i];
+		issue(i, ctx);
+	}
+	if (ctx != nullptr) {
+		status = m_config.DY_runall_request_context(ctx);
+		if (status != S3StatusOK)
+			ec_log_debug("S3: %s: request context: %s", fn, m_config.DY_get_status_name(status));
+		m_config.DY_destroy_request_context(ctx);
+	}
+
+	bool ok = true;
+	for (size_t i = 0; i < parts.size(); ++i) {
+		auto &cd = parts[i];
+		unsigned int tries = S3_RETRIES;
+		while ((cd.status != S3StatusOK || cd.processed != cd.size) &&
+		       m_config.DY_status_is_retryable(cd.status) && should_retry(tries)) {
+			ec_log_debug("S3: %s: retrying part at %zu: %s", fn, cd.offset,
+				m_config.DY_get_status_name(cd.status));
+			cd.status = S3StatusOK;
+			cd.processed = 0;
+			cd.etag.clear();
+			issue(i, nullptr);
+		}
+		if (cd.status != S3StatusOK || cd.processed != cd.size) {
+			ec_log_err("S3: %s: part at %zu failed: %s, %zu/%zu bytes", fn,
+				cd.offset, m_config.DY_get_status_name(cd.status),
+				cd.processed, cd.size);
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+/**
+ * Load an object of known size as parallel ranged GETs, at most
+ * attachment_s3_parallel at a time, into cd.data or, through a bounded set
+ * of part buffers, in order into cd.sink.
+ */
+ECRESULT ECS3Attachment::s3_get_parts(struct s3_cd &cd, const char *fn)
+{
+	auto part = m_config.m_part_size;
+	std::vector<std::unique_ptr<unsigned char[]>> pool;
+	if (cd.sink != nullptr)
+		for (unsigned int i = 0; i < m_config.m_parallel; ++i) {
+			pool.emplace_back(new(std::nothrow) unsigned char[part]);
+			if (pool.back() == nullptr)
+				return KCERR_NOT_ENOUGH_MEMORY;
+		}
+	ec_log_debug("S3: loading %s in parts of %zu bytes", fn, part);
+	cd.processed = 0;
+	while (cd.processed < cd.size) {
+		std::vector<s3_cd> win;
+		for (size_t i = 0, off = cd.processed; i < m_config.m_parallel && off < cd.size; ++i) {
+			s3_cd pc;
+			pc.offset = off;
+			pc.size = std::min(part, cd.size - off);
+			pc.data = cd.sink != nullptr ? pool[i].get() : cd.data + off;
+			pc.fixed_size = true;
+			off += pc.size;
+			win.push_back(std::move(pc));
+		}
+		if (!run_parts(win, fn, nullptr, 0)) {
+			cd.status = S3StatusErrorUnknown;
+			return KCERR_NETWORK_ERROR;
+		}
+		for (const auto &pc : win) {
+			if (cd.sink != nullptr) {
+				auto ret = cd.sink->Write(pc.data, 1, pc.size);
+				if (ret != erSuccess)
+					return ret;
+			}
+			if (cd.tee >= 0 && !cd.tee_fail &&
+			    write_retry(cd.tee, pc.data, pc.size) != static_cast<ssize_t>(pc.size))
+				cd.tee_fail = true;
+			cd.processed += pc.size;
+		}
+	}
+	cd.status = S3StatusOK;
+	return erSuccess;
+}
+
+/**
+ * Save an object as a multipart upload, with up to attachment_s3_parallel
+ * parts in flight. The parts are taken from cd.data, or read from cd.sink
+ * into a bounded set of part buffers.
+ */
+ECRESULT ECS3Attachment::s3_put_parts(struct s3_cd &cd, const char *fn)
+{
+	struct s3_cd init;
+	struct s3_cdw cwdata;
+	cwdata.caller = this;
+	cwdata.cbdata = &init;
+	unsigned int tries = S3_RETRIES;
+	do {
+		m_config.DY_initiate_multipart(&m_config.m_bkctx, fn, nullptr,
+			&m_config.m_mp_init_handler, nullptr, 0, &cwdata);
+	} while (m_config.DY_status_is_retryable(init.status) && should_retry(tries));
+	if (init.status != S3StatusOK || init.upload_id.empty()) {
+		ec_log_err("S3: save %s: cannot start multipart upload: %s",
+			fn, m_config.DY_get_status_name(init.status));
+		cd.status = init.status;
+		return KCERR_DATABASE_ERROR;
+	}
+	bool done = false;
+	auto abort_upload = make_scope_success([&]() {
+		if (!done)
+			m_config.DY_abort_multipart_upload(&m_config.m_bkctx, fn,
+				init.upload_id.c_str(), 0, &m_config.m_mp_abort_handler);
+	});
+
+	auto part = m_config.m_part_size;
+	std::vector<std::unique_ptr<unsigned char[]>> pool;
+	if (cd.sink != nullptr)
+		for (unsigned int i = 0; i < m_config.m_parallel; ++i) {
+			pool.emplace_back(new(std::nothrow) unsigned char[part]);
+			if (pool.back() == nullptr)
+				return KCERR_NOT_ENOUGH_MEMORY;
+		}
+	ec_log_debug("S3: saving %s in parts of %zu bytes", fn, part);
+	std::string xml = "<CompleteMultipartUpload>";
+	unsigned int seq = 1;
+	cd.processed = 0;
+	while (cd.processed < cd.size) {
+		std::vector<s3_cd> win;
+		for (size_t i = 0, off = cd.processed; i < m_config.m_parallel && off < cd.size; ++i) {
+			s3_cd pc;
+			pc.offset = off;
+			pc.size = std::min(part, cd.size - off);
+			if (cd.sink != nullptr) {
+				auto ret = cd.sink->Read(pool[i].get(), 1, pc.size);
+				if (ret != erSuccess) {
+					ec_log_err("S3: Unable to read from the serializer sink");
+					return ret;
+				}
+				pc.data = pool[i].get();
+			} else {
+				pc.data = cd.data + off;
+			}
+			off += pc.size;
+			win.push_back(std::move(pc));
+		}
+		if (!run_parts(win, fn, init.upload_id.c_str(), seq))
+			return KCERR_DATABASE_ERROR;
+		for (const auto &pc : win) {
+			if (pc.etag.empty()) {
+				ec_log_err("S3: save %s: no ETag for part %u", fn, seq);
+				return KCERR_DATABASE_ERROR;
+			}
+			xml += "<Part><PartNumber>" + stringify(seq++) + "</PartNumber><ETag>" +
+			       pc.etag + "</ETag></Part>";
+			cd.processed += pc.size;
+		}
+	}
+	xml += "</CompleteMultipartUpload>";
+
+	struct s3_cd commit;
+	commit.data = reinterpret_cast<unsigned char *>(&xml[0]);
+	commit.size = xml.size();
+	cwdata.cbdata = &commit;
+	tries = S3_RETRIES;
+	do {
+		commit.status = S3StatusOK;
+		commit.processed = 0;
+		m_config.DY_complete_multipart_upload(&m_config.m_bkctx, fn,
+			&m_config.m_mp_commit_handler, init.upload_id.c_str(),
+			static_cast<int>(xml.size()), nullptr, 0, &cwdata);
+	} while (m_config.DY_status_is_retryable(commit.status) && should_retry(tries));
+	cd.status = commit.status;
+	ec_log_debug("S3: save %s: %u parts: %s", fn, seq - 1, m_config.DY_get_status_name(commit.status));
+	if (commit.status != S3StatusOK)
+		return KCERR_DATABASE_ERROR;
+	done = true;
+	return erSuccess;
+}
+
 /**
  * Save a property in a new instance from a blob
  *
@@ -607,7 +945,12 @@ ECRESULT ECS3Attachment::SaveAttachmentInstance(ext_siid &ins_id,
 	struct s3_cd cd;
 	cd.data = data;
 	cd.size = size;
-	auto ret = s3_put(cd, make_att_filename(ins_id).c_str());
+	auto filename = make_att_filename(ins_id);
+	auto start = steady_clock::now();
+	m_config.m_disk.drop(ins_id.siid);
+	auto ret = use_parts(size) ? s3_put_parts(cd, filename.c_str()) :
+	           s3_put(cd, filename.c_str());
+	s3_stat_op(true, start, ret);
 	/* set in transaction before disk full check to remove empty file */
 	if (m_transact)
 		m_new_att.emplace(ins_id);
@@ -635,7 +978,12 @@ ECRESULT ECS3Attachment::SaveAttachmentInstance(ext_siid &ins_id,
 	struct s3_cd cd;
 	cd.sink = source;
 	cd.size = size;
-	auto ret = s3_put(cd, make_att_filename(ins_id).c_str());
+	auto filename = make_att_filename(ins_id);
+	auto start = steady_clock::now();
+	m_config.m_disk.drop(ins_id.siid);
+	auto ret = use_parts(size) ? s3_put_parts(cd, filename.c_str()) :
+	           s3_put(cd, filename.c_str());
+	s3_stat_op(true, start, ret);
 	/* set in transaction before disk full check to remove empty file */
 	if (m_transact)
 		m_new_att.emplace(ins_id);
@@ -700,6 +1048,7 @@ ECRESULT ECS3Attachment::del_marked_att(const ext_siid &ins_id)
 	ec_log_debug("S3: delete %s: %s", fn, m_config.DY_get_status_name(cd.status));
 	if (cd.status == S3StatusOK || cd.status == S3StatusHttpErrorNotFound) {
 		/* Delete successful, or did not exist before */
+		m_config.m_disk.drop(ins_id.siid);
 		scoped_lock locker(m_config.m_cachelock);
 		m_config.m_cache[ins_id.siid] = {now_negative(), S3_NEGATIVE_ENTRY};
 	}
@@ -878,6 +1227,142 @@ ECRESULT ECS3Attachment::Rollback()
 	return error ? KCERR_DATABASE_ERROR : erSuccess;
 }
 
+void s3_disk_cache::init(const std::string &dir, size_t limit)
+{
+	auto ret = CreatePath(dir, S_IRWXU);
+	if (ret != 0 && errno != EEXIST) {
+		ec_log_err("S3: cannot create cache directory \"%s\": %s", dir.c_str(), strerror(errno));
+		return;
+	}
+	m_dir = dir;
+	m_limit = limit;
+
+	/* Pick up what a previous run left, least recently used first. */
+	std::unique_ptr<DIR, int (*)(DIR *)> dh(opendir(dir.c_str()), closedir);
+	if (dh == nullptr)
+		return;
+	std::vector<std::pair<time_t, std::pair<unsigned int, size_t>>> found;
+	struct dirent *de;
+	while ((de = readdir(dh.get())) != nullptr) {
+		if (*de->d_name == '.')
+			continue;
+		auto file = m_dir + "/" + de->d_name;
+		char *end;
+		auto siid = strtoul(de->d_name, &end, 10);
+		struct stat sb;
+		if (*end != '\0') {
+			/* Leftover of an interrupted fill */
+			unlink(file.c_str());
+			continue;
+		}
+		if (stat(file.c_str(), &sb) == 0 && S_ISREG(sb.st_mode))
+			found.emplace_back(sb.st_atime, std::make_pair(siid, sb.st_size));
+	}
+	std::sort(found.begin(), found.end());
+	for (const auto &f : found)
+		account(f.second.first, f.second.second);
+	ec_log_info("S3: disk cache \"%s\": %zu objects, %zu of %zu bytes",
+		m_dir.c_str(), m_index.size(), m_used, m_limit);
+}
+
+std::string s3_disk_cache::path(unsigned int siid) const
+{
+	return m_dir + "/" + stringify(siid);
+}
+
+/* Enter (or refresh) @siid as most recently used, and evict to fit. */
+void s3_disk_cache::account(unsigned int siid, size_t size)
+{
+	auto i = m_index.find(siid);
+	if (i != m_index.end()) {
+		m_used -= i->second.second;
+		m_lru.erase(i->second.first);
+		m_index.erase(i);
+	}
+	m_lru.push_front(siid);
+	m_index.emplace(siid, std::make_pair(m_lru.begin(), size));
+	m_used += size;
+	while (m_used > m_limit && !m_lru.empty()) {
+		auto victim = m_lru.back();
+		auto v = m_index.find(victim);
+		m_used -= v->second.second;
+		m_index.erase(v);
+		m_lru.pop_back();
+		unlink(path(victim).c_str());
+	}
+}
+
+int s3_disk_cache::open(unsigned int siid, size_t *size)
+{
+	std::lock_guard<std::mutex> lk(m_lock);
+	auto i = m_index.find(siid);
+	if (i == m_index.end())
+		return -1;
+	int fd = ::open(path(siid).c_str(), O_RDONLY);
+	if (fd < 0) {
+		m_used -= i->second.second;
+		m_lru.erase(i->second.first);
+		m_index.erase(i);
+		return -1;
+	}
+	*size = i->second.second;
+	m_lru.splice(m_lru.begin(), m_lru, i->second.first);
+	return fd;
+}
+
+int s3_disk_cache::create(unsigned int siid, std::string *tmpname)
+{
+	*tmpname = path(siid) + "." + stringify(getpid()) + "." + stringify(kc_threadid());
+	int fd = ::open(tmpname->c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd < 0)
+		ec_log_warn("S3: cannot create \"%s\": %s", tmpname->c_str(), strerror(errno));
+	return fd;
+}
+
+void s3_disk_cache::commit(unsigned int siid, const std::string &tmpname, size_t size)
+{
+	if (size > m_limit) {
+		unlink(tmpname.c_str());
+		return;
+	}
+	std::lock_guard<std::mutex> lk(m_lock);
+	if (rename(tmpname.c_str(), path(siid).c_str()) != 0) {
+		unlink(tmpname.c_str());
+		return;
+	}
+	account(siid, size);
+}
+
+void s3_disk_cache::store(unsigned int siid, const void *data, size_t size)
+{
+	if (size > m_limit)
+		return;
+	std::string tmpname;
+	int fd = create(siid, &tmpname);
+	if (fd < 0)
+		return;
+	bool ok = write_retry(fd, data, size) == static_cast<ssize_t>(size);
+	close(fd);
+	if (ok)
+		commit(siid, tmpname, size);
+	else
+		unlink(tmpname.c_str());
+}
+
+void s3_disk_cache::drop(unsigned int siid)
+{
+	if (!enabled())
+		return;
+	std::lock_guard<std::mutex> lk(m_lock);
+	auto i = m_index.find(siid);
+	if (i == m_index.end())
+		return;
+	m_used -= i->second.second;
+	m_lru.erase(i->second.first);
+	m_index.erase(i);
+	unlink(path(siid).c_str());
+}
+
 } /* namespace */
 
 #endif /* LIBS3_H */
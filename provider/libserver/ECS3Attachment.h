@@ -4,10 +4,15 @@
 #endif
 #ifdef HAVE_LIBS3_H
 #include <kopano/platform.h>
+#include <list>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <set>
 #include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 #include <libs3.h>
 #include <kopano/timeutil.hpp>
 #include "ECAttachmentStorage.h"
@@ -21,6 +26,34 @@ struct s3_cache_entry {
 	size_t size;
 };
 
+/**
+ * Local read-through cache of S3 objects (attachment_s3_cache_path). Objects
+ * are kept as one file per instance and evicted least-recently-used first
+ * once attachment_s3_cache_size is exceeded.
+ */
+class s3_disk_cache final {
+	public:
+	void init(const std::string &dir, size_t limit);
+	bool enabled() const { return !m_dir.empty(); }
+	/* Returns an open descriptor and the object's size, or -1 */
+	int open(unsigned int siid, size_t *size);
+	/* Temporary file to fill and then hand to commit(), or -1 */
+	int create(unsigned int siid, std::string *tmpname);
+	void commit(unsigned int siid, const std::string &tmpname, size_t size);
+	void store(unsigned int siid, const void *data, size_t size);
+	void drop(unsigned int siid);
+
+	private:
+	void account(unsigned int siid, size_t size);
+	std::string path(unsigned int siid) const;
+
+	std::string m_dir;
+	size_t m_limit = 0, m_used = 0;
+	std::mutex m_lock;
+	std::list<unsigned int> m_lru; /* most recently used first */
+	std::unordered_map<unsigned int, std::pair<std::list<unsigned int>::iterator, size_t>> m_index;
+};
+
 class ECS3Attachment;
 
 class ECS3Config final : public ECAttachmentConfig {
@@ -32,6 +65,9 @@ class ECS3Config final : public ECAttachmentConfig {
 	private:
 	std::string m_akid, m_sakey, m_bkname, m_region, m_path;
 	unsigned int m_comp;
+	/* Objects larger than one part are transferred in parallel parts */
+	size_t m_part_size = 0;
+	unsigned int m_parallel = 1;
 
 	void *m_handle = nullptr;
 #define W(n) decltype(S3_ ## n) *DY_ ## n;
@@ -43,7 +79,16 @@ class ECS3Config final : public ECAttachmentConfig {
 	W(head_object)
 	W(delete_object)
 	W(get_object)
+	W(create_request_context)
+	W(runall_request_context)
+	W(destroy_request_context)
+	W(initiate_multipart)
+	W(upload_part)
+	W(complete_multipart_upload)
+	W(abort_multipart_upload)
 #undef W
+	/* Request contexts and multipart calls are all available */
+	bool m_multipart = false;
 
 	S3BucketContext m_bkctx{};
 	/*
@@ -54,12 +99,71 @@ class ECS3Config final : public ECAttachmentConfig {
 	S3PutObjectHandler m_put_obj_handler{};
 	S3GetObjectHandler m_get_obj_handler{};
 	S3GetConditions m_get_conditions{};
+	S3MultipartInitialHandler m_mp_init_handler{};
+	S3MultipartCommitHandler m_mp_commit_handler{};
+	S3AbortMultipartUploadHandler m_mp_abort_handler{};
 	std::mutex m_cachelock;
 	std::map<ULONG, s3_cache_entry> m_cache;
+	s3_disk_cache m_disk;
 
 	friend class ECS3Attachment;
 };
 
+struct s3_cd;
+
+class KC_EXPORT_DYCAST ECS3Attachment final : public ECAttachmentStorage {
+	public:
+	ECS3Attachment(ECS3Config &, ECDatabase *);
+
+	/*
+	 * Single Instance Attachment handlers. Public so that tests/s3bench
+	 * can drive them against an S3 stand-in without a database.
+	 */
+	virtual ECRESULT LoadAttachmentInstance(struct soap *, const ext_siid &, size_t *, unsigned char **) override;
+	virtual ECRESULT LoadAttachmentInstance(const ext_siid &, size_t *, ECSerializer *) override;
+	virtual ECRESULT SaveAttachmentInstance(ext_siid &, ULONG, size_t, unsigned char *) override;
+	virtual ECRESULT SaveAttachmentInstance(ext_siid &, ULONG, size_t, ECSerializer *) override;
+	virtual ECRESULT DeleteAttachmentInstances(const std::list<ext_siid> &, bool replace) override;
+	virtual ECRESULT DeleteAttachmentInstance(const ext_siid &, bool replace) override;
+	virtual ECRESULT GetSizeInstance(const ext_siid &, size_t *, bool * = nullptr) override;
+	virtual kd_trans Begin(ECRESULT &) override;
+
+	protected:
+	virtual ~ECS3Attachment();
+
+	private:
+	static S3Status response_prop_cb(const S3ResponseProperties *, void *);
+	static void response_complete_cb(S3Status, const S3ErrorDetails *, void *);
+	static S3Status get_obj_cb(int, const char *, void *);
+	static int put_obj_cb(int, char *, void *);
+	static S3Status mp_init_cb(const char *, void *);
+	static S3Status mp_commit_cb(const char *, const char *, void *);
+
+	S3Status response_prop(const S3ResponseProperties *, void *);
+	void response_complete(S3Status, const S3ErrorDetails *, void *);
+	S3Status get_obj(int, const char *, void *);
+	int put_obj(int, char *, void *);
+	std::string make_att_filename(const ext_siid &);
+	bool should_retry(unsigned int &);
+	struct s3_cd create_cd();
+	ECRESULT del_marked_att(const ext_siid &);
+	virtual ECRESULT Commit() override;
+	virtual ECRESULT Rollback() override;
+	ECRESULT s3_get(struct s3_cd &, const char *filename);
+	ECRESULT s3_put(struct s3_cd &, const char *filename);
+	ECRESULT s3_get_parts(struct s3_cd &, const char *filename);
+	ECRESULT s3_put_parts(struct s3_cd &, const char *filename);
+	bool run_parts(std::vector<s3_cd> &, const char *filename, const char *upload_id, unsigned int first_seq);
+	bool use_parts(size_t size) const;
+
+	/* Variables: */
+	ECS3Config &m_config;
+	std::set<ext_siid> m_new_att, m_marked_att;
+	bool m_transact = false;
+
+	friend class ECS3Config;
+};
+
 } /* namespace */
 
 #endif /* LIBS3_H */
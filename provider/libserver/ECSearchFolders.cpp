@@ -42,31 +42,40 @@ class THREADINFO final : public ECTask {
     ECSearchFolders *lpSearchFolders;
 };
 
+class ECSearchFolders::store_task final : public ECTask {
+	public:
+	store_task(ECSearchFolders *sf, unsigned int store_id) :
+		m_sf(sf), m_store_id(store_id)
+	{}
+
+	protected:
+	virtual void run() override { m_sf->ProcessStoreEvents(m_store_id); }
+
+	private:
+	ECSearchFolders *m_sf;
+	unsigned int m_store_id;
+};
+
 ECSearchFolders::ECSearchFolders(ECSessionManager *lpSessionManager,
     ECDatabaseFactory *lpFactory) :
 	m_lpDatabaseFactory(lpFactory), m_lpSessionManager(lpSessionManager),
-	m_pool("sfp", atoui(lpSessionManager->GetConfig()->GetSetting("threads")))
-{
-	auto ret = pthread_create(&m_threadProcess, nullptr, ECSearchFolders::ProcessThread, this);
-	if (ret != 0) {
-		ec_log_err("Could not create ECSearchFolders thread: %s", strerror(ret));
-		return;
-	}
-	m_thread_active = true;
-	set_thread_name(m_threadProcess, "sf/master");
-}
+	m_pool("sfp", atoui(lpSessionManager->GetConfig()->GetSetting("threads"))),
+	m_update_pool("sfu", std::max(1U, atoui(lpSessionManager->GetConfig()->GetSetting("threads"))))
+{}
 
 ECSearchFolders::~ECSearchFolders() {
+	ulock_rec l_ev(m_mutexEvents);
+	m_bExitThread = true;
+	m_store_events.clear();
+	m_ulEvents = 0;
+	m_cond_flush.notify_all();
+	l_ev.unlock();
+	/* Let running updates finish before the folders go away */
+	m_update_pool.set_thread_count(0, 0, true);
+
 	ulock_rec l_sf(m_mutexMapSearchFolders);
 	m_mapSearchFolders.clear();
 	l_sf.unlock();
-
-	ulock_rec l_events(m_mutexEvents);
-    m_bExitThread = true;
-	m_condEvents.notify_all();
-	l_events.unlock();
-	if (m_thread_active)
-		pthread_join(m_threadProcess, nullptr);
 }
 
 // Only loads the search criteria for all search folders. Used once at boot time
@@ -266,8 +275,11 @@ void ECSearchFolders::DestroySearchFolder(std::shared_ptr<SEARCHFOLDER> &&lpFold
 	unsigned int ulFolderId = lpFolder->ulFolderId;
     // Nobody can access lpFolder now, except for us and the search thread
     // FIXME check this assumption !!!
-    // Signal the thread to exit
-    lpFolder->bThreadExit = true;
+	// Signal the thread to exit; this also waits for an update in progress
+	{
+		scoped_lock l_upd(lpFolder->mMutexUpdate);
+		lpFolder->bThreadExit = true;
+	}
 	/*
 	 * Wait for the thread to signal that lpFolder is no longer in use by
 	 * the thread The condition is used for all threads, so it may have
@@ -352,14 +364,43 @@ ECRESULT ECSearchFolders::UpdateSearchFolders(unsigned int ulStoreId, unsigned i
     ev.ulObjectId = ulObjId;
     ev.ulType = ulType;
 
+	ulock_rec l_sf(m_mutexMapSearchFolders);
+	auto iterStore = m_mapSearchFolders.find(ulStoreId);
+	if (iterStore == m_mapSearchFolders.cend() || iterStore->second.empty())
+		// No search folder could ever pick this up
+		return erSuccess;
+	l_sf.unlock();
+
 	scoped_rlock l_ev(m_mutexEvents);
-    // Add the event to the queue
-	m_lstEvents.emplace_back(std::move(ev));
-	/*
-	 * Signal a change in the queue (actually only needed for the first
-	 * event, but this wastes almost no time and is safer.
-	 */
-	m_condEvents.notify_all();
+	if (m_bExitThread)
+		return erSuccess;
+	auto &queue = m_store_events[ulStoreId];
+	auto key = std::make_pair(ulFolderId, ulObjId);
+	if (ulType == ECKeyTable::TABLE_ROW_ADD || ulType == ECKeyTable::TABLE_ROW_MODIFY) {
+		/*
+		 * The row data is only read when the event is processed, so a
+		 * change of an object that is still waiting adds nothing. An
+		 * ADD followed by a MODIFY must still be able to remove the
+		 * object from the results, so it becomes a MODIFY.
+		 */
+		auto p = queue.pending.find(key);
+		if (p != queue.pending.cend()) {
+			if (ulType == ECKeyTable::TABLE_ROW_MODIFY)
+				p->second->ulType = ulType;
+			return erSuccess;
+		}
+		queue.events.emplace_back(std::move(ev));
+		queue.pending.emplace(key, &queue.events.back());
+	} else {
+		// Later changes must not be moved in front of this one
+		queue.pending.erase(key);
+		queue.events.emplace_back(std::move(ev));
+	}
+	++m_ulEvents;
+	if (!queue.busy) {
+		queue.busy = true;
+		m_update_pool.enqueue(new store_task(this, ulStoreId), true);
+	}
 	return erSuccess;
 }
 
@@ -421,16 +462,25 @@ ECRESULT ECSearchFolders::ProcessMessageChange(unsigned int ulStoreId, unsigned
 
 	lstPrefix.emplace_back(PR_MESSAGE_FLAGS);
 	ECLocale locale = m_lpSessionManager->GetSortLocale(ulStoreId);
-	ulock_rec l_sf(m_mutexMapSearchFolders);
-
 	auto er = m_lpDatabaseFactory->get_tls_db(&lpDatabase);
     if(er != erSuccess)
 		return er;
+
+	/*
+	 * Work on a copy of the folder list, so that the workers of other
+	 * stores and the cancel/remove calls are not held up; each folder is
+	 * locked while it is updated instead.
+	 */
+	std::vector<std::shared_ptr<SEARCHFOLDER>> folders;
+	ulock_rec l_sf(m_mutexMapSearchFolders);
 	auto iterStore = m_mapSearchFolders.find(ulStoreId);
     if (iterStore == m_mapSearchFolders.cend())
         // There are no search folders in the target store. We will therefore never match any search
         // result and might as well exit now.
 		return erSuccess;
+	for (const auto &folder : iterStore->second)
+		folders.emplace_back(folder.second);
+	l_sf.unlock();
 
     // OPTIMIZATION: if a target folder == root folder of ulStoreId, and a recursive searchfolder, then
     // the following check is always TRUE
@@ -445,9 +495,13 @@ ECRESULT ECSearchFolders::ProcessMessageChange(unsigned int ulStoreId, unsigned
     // a target folder if it is a recursive search.
     // Loop through search folders for this store
 	auto cache = m_lpSessionManager->GetCacheManager();
-	for (const auto &folder : iterStore->second) {
+	for (const auto &folder : folders) {
 		ULONG ulAttempts = 4;	// Random number
-		const auto &scrit = *folder.second->lpSearchCriteria;
+		scoped_lock l_upd(folder->mMutexUpdate);
+		if (folder->bThreadExit)
+			// Cancelled or removed meanwhile
+			continue;
+		const auto &scrit = *folder->lpSearchCriteria;
 
 		do {
 			int lCount = 0; /* Number of messages added, positive means more added, negative means more discarded */
@@ -462,7 +516,7 @@ ECRESULT ECSearchFolders::ProcessMessageChange(unsigned int ulStoreId, unsigned
 			// Lock searchfolder
 			WITH_SUPPRESSED_LOGGING(lpDatabase)
 				er = lpDatabase->DoSelect("SELECT properties.val_ulong FROM properties WHERE hierarchyid = " +
-				     stringify(folder.first) + " FOR UPDATE", NULL);
+				     stringify(folder->ulFolderId) + " FOR UPDATE", NULL);
 			if (er == KCERR_DATABASE_ERROR) {
 				DB_ERROR dberr = lpDatabase->GetLastError();
 				if (dberr != DB_E_LOCK_WAIT_TIMEOUT && dberr != DB_E_LOCK_DEADLOCK) {
@@ -536,14 +590,14 @@ ECRESULT ECSearchFolders::ProcessMessageChange(unsigned int ulStoreId, unsigned
 							ulFlags = lpRowSet->__ptr[i].__ptr[0].Value.ul & MSGFLAG_READ;
 
 							// Update on-disk search folder
-							if (AddResults(folder.first, iterObjectIDs->ulObjId, ulFlags, &fInserted) == erSuccess) {
+							if (AddResults(folder->ulFolderId, iterObjectIDs->ulObjId, ulFlags, &fInserted) == erSuccess) {
 								if(fInserted) {
 									// One more match
 									++lCount;
 									if(!ulFlags)
 										++lUnreadCount;
 									// Send table notification
-									m_lpSessionManager->UpdateTables(ECKeyTable::TABLE_ROW_ADD, 0, folder.first, iterObjectIDs->ulObjId, MAPI_MESSAGE);
+									m_lpSessionManager->UpdateTables(ECKeyTable::TABLE_ROW_ADD, 0, folder->ulFolderId, iterObjectIDs->ulObjId, MAPI_MESSAGE);
 								} else {
 									// Row was modified, so flags has changed. Since the only possible values are MSGFLAG_READ or 0, we know the new flags.
 									if(ulFlags)
@@ -551,20 +605,20 @@ ECRESULT ECSearchFolders::ProcessMessageChange(unsigned int ulStoreId, unsigned
 									else
 										++lUnreadCount; // New state is unread, so old state was read, so ++unread
 									// Send table notification
-									m_lpSessionManager->UpdateTables(ECKeyTable::TABLE_ROW_MODIFY, 0, folder.first, iterObjectIDs->ulObjId, MAPI_MESSAGE);
+									m_lpSessionManager->UpdateTables(ECKeyTable::TABLE_ROW_MODIFY, 0, folder->ulFolderId, iterObjectIDs->ulObjId, MAPI_MESSAGE);
 								}
 							} else {
 								// AddResults will return an error if the call didn't do anything (record was already in the table).
 								// Even though, we should still send notifications since the row changed
-								m_lpSessionManager->UpdateTables(ECKeyTable::TABLE_ROW_MODIFY, 0, folder.first, iterObjectIDs->ulObjId, MAPI_MESSAGE);
+								m_lpSessionManager->UpdateTables(ECKeyTable::TABLE_ROW_MODIFY, 0, folder->ulFolderId, iterObjectIDs->ulObjId, MAPI_MESSAGE);
 							}
 						} else if (ulType == ECKeyTable::TABLE_ROW_MODIFY) {
 							// Only delete modified items, not new items
-							if (DeleteResults(folder.first, iterObjectIDs->ulObjId, &ulFlags) == erSuccess) {
+							if (DeleteResults(folder->ulFolderId, iterObjectIDs->ulObjId, &ulFlags) == erSuccess) {
 								--lCount;
 								if(!ulFlags)
 									--lUnreadCount; // Removed message was unread
-								m_lpSessionManager->UpdateTables(ECKeyTable::TABLE_ROW_DELETE, 0, folder.first, iterObjectIDs->ulObjId, MAPI_MESSAGE);
+								m_lpSessionManager->UpdateTables(ECKeyTable::TABLE_ROW_DELETE, 0, folder->ulFolderId, iterObjectIDs->ulObjId, MAPI_MESSAGE);
 							}
 						}
 						// Ignore errors from the updates
@@ -573,8 +627,8 @@ ECRESULT ECSearchFolders::ProcessMessageChange(unsigned int ulStoreId, unsigned
 				} else {
 					// Message was deleted anyway, update on-disk search folder and send table notification
 					for (const auto &obj_id : *lstObjectIDs)
-						if (DeleteResults(folder.first, obj_id.ulObjId, &ulFlags) == erSuccess) {
-							m_lpSessionManager->UpdateTables(ECKeyTable::TABLE_ROW_DELETE, 0, folder.first, obj_id.ulObjId, MAPI_MESSAGE);
+						if (DeleteResults(folder->ulFolderId, obj_id.ulObjId, &ulFlags) == erSuccess) {
+							m_lpSessionManager->UpdateTables(ECKeyTable::TABLE_ROW_DELETE, 0, folder->ulFolderId, obj_id.ulObjId, MAPI_MESSAGE);
 							--lCount;
 							if(!ulFlags)
 								--lUnreadCount; // Removed message was unread
@@ -588,8 +642,8 @@ ECRESULT ECSearchFolders::ProcessMessageChange(unsigned int ulStoreId, unsigned
 			} else {
 				// Not in a target folder, remove from search results
 				for (const auto &obj_id : *lstObjectIDs)
-					if (DeleteResults(folder.first, obj_id.ulObjId, &ulFlags) == erSuccess) {
-						m_lpSessionManager->UpdateTables(ECKeyTable::TABLE_ROW_DELETE, 0, folder.first, obj_id.ulObjId, MAPI_MESSAGE);
+					if (DeleteResults(folder->ulFolderId, obj_id.ulObjId, &ulFlags) == erSuccess) {
+						m_lpSessionManager->UpdateTables(ECKeyTable::TABLE_ROW_DELETE, 0, folder->ulFolderId, obj_id.ulObjId, MAPI_MESSAGE);
 						--lCount;
 						if(!ulFlags)
 							--lUnreadCount; // Removed message was unread
@@ -599,9 +653,9 @@ ECRESULT ECSearchFolders::ProcessMessageChange(unsigned int ulStoreId, unsigned
 			if(lCount || lUnreadCount) {
 				// If the searchfolder has changed, update counts and send notifications
 				WITH_SUPPRESSED_LOGGING(lpDatabase) {
-					er = UpdateFolderCount(lpDatabase, folder.first, PR_CONTENT_COUNT, lCount);
+					er = UpdateFolderCount(lpDatabase, folder->ulFolderId, PR_CONTENT_COUNT, lCount);
 					if (er == erSuccess)
-						er = UpdateFolderCount(lpDatabase, folder.first, PR_CONTENT_UNREAD, lUnreadCount);
+						er = UpdateFolderCount(lpDatabase, folder->ulFolderId, PR_CONTENT_UNREAD, lUnreadCount);
 				}
 
 				if (er == KCERR_DATABASE_ERROR) {
@@ -622,10 +676,10 @@ ECRESULT ECSearchFolders::ProcessMessageChange(unsigned int ulStoreId, unsigned
 					goto exit;
 				}
 
-				cache->Update(fnevObjectModified, folder.first);
-				m_lpSessionManager->NotificationModified(MAPI_FOLDER, folder.first);
-				if (cache->GetParent(folder.first, &ulParent) == erSuccess)
-					m_lpSessionManager->UpdateTables(ECKeyTable::TABLE_ROW_MODIFY, 0, ulParent, folder.first, MAPI_FOLDER);
+				cache->Update(fnevObjectModified, folder->ulFolderId);
+				m_lpSessionManager->NotificationModified(MAPI_FOLDER, folder->ulFolderId);
+				if (cache->GetParent(folder->ulFolderId, &ulParent) == erSuccess)
+					m_lpSessionManager->UpdateTables(ECKeyTable::TABLE_ROW_MODIFY, 0, ulParent, folder->ulFolderId, MAPI_FOLDER);
 			}
 
 			er = dtx.commit();
@@ -657,7 +711,6 @@ ECRESULT ECSearchFolders::ProcessMessageChange(unsigned int ulStoreId, unsigned
 		}
     }
  exit:
-	l_sf.unlock();
 	soap_del_PointerTopropTagArray(&lpPropTags);
     if(lpSession) {
 		lpSession->unlock();
@@ -869,7 +922,7 @@ ECRESULT ECSearchFolders::Search(unsigned int ulStoreId, unsigned int ulFolderId
 		return er;
 
 	if (GetIndexerResults(lpDatabase, m_lpSessionManager->GetConfig().get(), cache,
-	    &guidServer, &guidStore, lstFolders, lpSearchCrit->lpRestrict,
+	    &guidServer, &guidStore, ulStoreId, lstFolders, lpSearchCrit->lpRestrict,
 	    &lpAdditionalRestrict, lstIndexerResults, suggestion) == erSuccess)
 		er = search_r1(lpDatabase, lpSession, std::move(ecODStore),
 		     cache, lpAdditionalRestrict, ulStoreId, ulFolderId,
@@ -1387,70 +1440,57 @@ ECRESULT ECSearchFolders::SaveSearchCriteriaRow(ECDatabase *lpDatabase,
 void ECSearchFolders::FlushAndWait()
 {
 	ulock_rec l_ev(m_mutexEvents);
-	m_condEvents.notify_all();
-	m_cond_flush.wait(l_ev);
+	m_cond_flush.wait(l_ev, [&]() { return m_store_events.empty() || m_bExitThread; });
 	l_ev.unlock();
 }
 
 /*
- * This is the main processing thread, which processes changes from the queue. After processing it removes them from the queue and waits for
- * new events
+ * Runs on an update worker for one store at a time, so that the changes of a
+ * store are still processed in order. After processing a batch, the store
+ * goes to the back of the pool queue if it has more events, so that a busy
+ * store does not hold up the others.
  */
-void * ECSearchFolders::ProcessThread(void *lpSearchFolders)
+void ECSearchFolders::ProcessStoreEvents(unsigned int ulStoreId)
 {
-	kcsrv_blocksigs();
-	auto lpThis = static_cast<ECSearchFolders *>(lpSearchFolders);
+	std::list<EVENT> lstEvents;
 
-    while(1) {
-        // Get events to process
-		ulock_rec l_ev(lpThis->m_mutexEvents);
-		if (lpThis->m_bExitThread)
-			break;
-		if (lpThis->m_lstEvents.empty())
-			/*
-			 * No events, wait until one arrives (the mutex is
-			 * unlocked by pthread_cond_wait so people are able to
-			 * add new events). The condition also occurs when the
-			 * server is exiting.
-			 */
-			lpThis->m_condEvents.wait(l_ev);
-
-		lpThis->m_bRunning = true;
-		/*
-		 * The condition ended. Two things can have happened: there is
-		 * now at least one event waiting, or and exit has been
-		 * requested. In both cases, we simply unlock the mutex and
-		 * process any (may be 0) events currently in the queue. This
-		 * means that the caller must make sure that no new events can
-		 * be added after the m_bThreadExit flag is set to TRUE.
-		 */
-		l_ev.unlock();
-        lpThis->FlushEvents();
-		lpThis->m_bRunning = false;
-		lpThis->m_cond_flush.notify_all();
-		if (lpThis->m_bExitThread)
-			break;
-    }
-    return NULL;
+	// We do a copy-remove-process cycle here to keep the event queue locked for the least time as possible with
+	// 500 events at a time
+	ulock_rec l_ev(m_mutexEvents);
+	auto iter = m_store_events.find(ulStoreId);
+	if (m_bExitThread || iter == m_store_events.cend())
+		return;
+	auto &queue = iter->second;
+	for (int i = 0; i < 500 && !queue.events.empty(); ++i) {
+		const auto &ev = queue.events.front();
+		auto p = queue.pending.find(std::make_pair(ev.ulFolderId, ev.ulObjectId));
+		if (p != queue.pending.cend() && p->second == &ev)
+			// Too late to merge with from now on
+			queue.pending.erase(p);
+		lstEvents.splice(lstEvents.end(), queue.events, queue.events.begin());
+	}
+	m_ulEvents -= lstEvents.size();
+	l_ev.unlock();
+
+	FlushEvents(lstEvents);
+
+	l_ev.lock();
+	iter = m_store_events.find(ulStoreId);
+	if (!m_bExitThread && iter != m_store_events.cend()) {
+		if (iter->second.events.empty())
+			m_store_events.erase(iter);
+		else
+			m_update_pool.enqueue(new store_task(this, ulStoreId), true);
+	}
+	m_cond_flush.notify_all();
 }
 
-// Process all waiting events in an efficient order
-ECRESULT ECSearchFolders::FlushEvents()
+// Process a batch of events in an efficient order
+ECRESULT ECSearchFolders::FlushEvents(std::list<EVENT> &lstEvents)
 {
-    std::list<EVENT> lstEvents;
     ECObjectTableList lstObjectIDs;
     sObjectTableKey sRow;
 
-    // We do a copy-remove-process cycle here to keep the event queue locked for the least time as possible with
-    // 500 events at a time
-	ulock_rec l_ev(m_mutexEvents);
-    for (int i = 0; i < 500; ++i) {
-        // Move the first element of m_lstEvents to the head of our list.
-        if(m_lstEvents.empty())
-            break;
-        lstEvents.splice(lstEvents.end(), m_lstEvents, m_lstEvents.begin());
-    }
-	l_ev.unlock();
     // Sort the items by folder. The order of DELETE and ADDs will remain unchanged. This is important
     // because the order of the incoming ADD or DELETE is obviously important for the final result.
 	lstEvents.sort([](const EVENT &a, const EVENT &b) { return a.ulFolderId < b.ulFolderId; });
@@ -1521,8 +1561,15 @@ sSearchFolderStats ECSearchFolders::get_stats()
 	}
 	l_sf.unlock();
 
+	sStats.stores_queued = sStats.events_max = 0;
 	ulock_rec l_ev(m_mutexEvents);
-	sStats.ulEvents = m_lstEvents.size();
+	sStats.ulEvents = m_ulEvents;
+	for (const auto &q : m_store_events) {
+		if (q.second.events.empty())
+			continue;
+		++sStats.stores_queued;
+		sStats.events_max = std::max(sStats.events_max, q.second.events.size());
+	}
 	l_ev.unlock();
 	sStats.ullSize += sStats.ulEvents * sizeof(EVENT);
 	return sStats;
@@ -17,6 +17,7 @@
 #include "SOAPUtils.h"
 #include <map>
 #include <list>
+#include <utility>
 #include "cmd.hpp"
 
 namespace KC {
@@ -34,6 +35,8 @@ struct SEARCHFOLDER final {
 
 	struct searchCriteria *lpSearchCriteria = nullptr;
 	std::mutex mMutexThreadFree;
+	/* Held while message changes are applied; bThreadExit is set under it */
+	std::mutex mMutexUpdate;
 	bool bThreadFree = true, bThreadExit = false;
 	unsigned int ulStoreId, ulFolderId;
 };
@@ -48,14 +51,16 @@ typedef std::map<unsigned int, std::shared_ptr<SEARCHFOLDER>> FOLDERIDSEARCH;
 struct sSearchFolderStats {
 	ULONG ulStores, ulFolders, ulEvents;
 	ULONGLONG ullSize;
+	/* Stores with queued events, and the longest queue of one store */
+	size_t stores_queued, events_max;
 };
 
 /**
  * Searchfolder handler
  *
- * This represents a single manager of all searchfolders on the server; a single thread runs on behalf of this
- * manager to handle all object changes, and another thread can be running for each searchfolder that is rebuilding. Most of
- * the time only the single update thread is running though.
+ * This represents a single manager of all searchfolders on the server. Object changes are queued per store and
+ * handled by a pool of update workers, one store at a time per worker, so that a mass change in one store does not
+ * hold up the search folders of the others; another thread can be running for each searchfolder that is rebuilding.
  *
  * The searchfolder manager does four things:
  * - Loading all searchfolder definitions (restriction and folderlist) at startup
@@ -171,20 +176,27 @@ public:
 	KC_HIDDEN sSearchFolderStats get_stats();
 
 	/**
-	 * Kick search thread to flush events, and wait for the results.
+	 * Wait until the update workers have processed all queued events.
 	 * Only used in the test protocol.
 	 */
 	KC_HIDDEN virtual void FlushAndWait();
 
 private:
+	class store_task;
+
     /**
-     * Process all events in the queue and remove them from the queue.
+     * Process a batch of events taken from the queue of one store.
      *
-     * Events for changed objects are queued internally and only processed after being flushed here. This function
-     * groups same-type events together to increase performance because changes in the same folder can be processed
-     * more efficiently at on time
+     * This function groups same-type events together to increase performance because changes in the same folder can
+     * be processed more efficiently at one time
      */
-	KC_HIDDEN virtual ECRESULT FlushEvents();
+	KC_HIDDEN virtual ECRESULT FlushEvents(std::list<EVENT> &);
+
+	/**
+	 * Update worker entrypoint: processes one batch of the events queued for
+	 * a store, and requeues itself if more have arrived meanwhile.
+	 */
+	KC_HIDDEN void ProcessStoreEvents(unsigned int store_id);
 
     /**
      * Processes a list of message changes in a single folder that should be processed. This in turn
@@ -322,16 +334,6 @@ private:
      */
 	KC_HIDDEN virtual ECRESULT SaveSearchCriteria(unsigned int folder_id, const struct searchCriteria *);
 
-    /**
-     * Main processing thread entrypoint
-     *
-     * This thread is running throughout the lifetime of the server and polls the queue periodically to process
-     * message changes many-at-a-time.
-     *
-     * @param[in] lpSearchFolders Pointer to 'this' of search folder manager instance
-     */
-	KC_HIDDEN static void *ProcessThread(void *search_folders);
-
 	/**
 	 * Save search criteria (row) to the database
 	 *
@@ -379,16 +381,29 @@ private:
     ECSessionManager *m_lpSessionManager;
 	KC::ksrv_tpool m_pool;
 
-    // List of change events
-    std::list<EVENT> m_lstEvents;
+	/* Change events of one store, waiting for an update worker */
+	struct store_events {
+		std::list<EVENT> events;
+		/*
+		 * The newest queued ADD or MODIFY per (folder, object); a
+		 * repeated change of the object collapses into it.
+		 */
+		std::map<std::pair<unsigned int, unsigned int>, EVENT *> pending;
+		/* A worker owns (or is queued for) this store */
+		bool busy = false;
+	};
+
+	// Change events, by store id
+	std::map<unsigned int, store_events> m_store_events;
+	size_t m_ulEvents = 0;
 	std::recursive_mutex m_mutexEvents;
-	std::condition_variable_any m_condEvents, m_cond_flush;
+	std::condition_variable_any m_cond_flush;
 
-    // Change processing thread
-    pthread_t m_threadProcess;
+	// Exit request for the update workers
+	bool m_bExitThread = false;
 
-    // Exit request for processing thread
-	bool m_thread_active = false, m_bExitThread = false, m_bRunning = false;
+	// Update workers; declared last, so that they stop before the rest goes
+	KC::ksrv_tpool m_update_pool;
 
 	friend class THREADINFO;
 };
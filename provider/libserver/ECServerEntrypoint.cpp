@@ -7,6 +7,7 @@
 #include <memory>
 #include <utility>
 #include <pthread.h>
+#include <sys/mman.h>
 #include <kopano/ECLogger.h>
 #include <kopano/hl.hpp>
 #include "ECDatabase.h"
@@ -130,9 +131,21 @@ void kopano_new_soap_connection(CONNECTION_TYPE ulType, struct soap *soap)
 
 void kopano_end_soap_connection(struct soap *soap)
 {
+	kopano_end_soap_request(soap);
 	delete soap_info(soap);
 }
 
+/* Release per-request resources that had to outlive the reply */
+void kopano_end_soap_request(struct soap *soap)
+{
+	auto info = soap_info(soap);
+	if (info == nullptr)
+		return;
+	for (const auto &m : info->file_maps)
+		munmap(m.first, m.second);
+	info->file_maps.clear();
+}
+
 void kopano_new_soap_listener(CONNECTION_TYPE ulType, struct soap *soap)
 {
 	auto lpInfo = new SOAPINFO;
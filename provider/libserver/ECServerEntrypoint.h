@@ -43,6 +43,7 @@ extern KC_EXPORT ECRESULT GetDatabaseObject(std::shared_ptr<ECStatsCollector>, E
 // SOAP connection management
 extern KC_EXPORT void kopano_new_soap_connection(CONNECTION_TYPE, struct soap *);
 extern KC_EXPORT void kopano_end_soap_connection(struct soap *);
+extern KC_EXPORT void kopano_end_soap_request(struct soap *);
 extern KC_EXPORT void kopano_new_soap_listener(CONNECTION_TYPE, struct soap *);
 extern KC_EXPORT void kopano_end_soap_listener(struct soap *);
 
@@ -504,6 +504,26 @@ ECRESULT ECSession::UnlockObject(unsigned int ulObjId)
 	return er;
 }
 
+/**
+ * Remember a message made by cloneMessage, whose notifications are held
+ * back until the client saves it.
+ */
+void ECSession::AddPendingClone(unsigned int ulObjId)
+{
+	scoped_lock lock(m_hClonesLock);
+	m_setPendingClones.emplace(ulObjId);
+}
+
+/**
+ * Returns whether @ulObjId is a clone that was not announced yet, and
+ * forgets about it.
+ */
+bool ECSession::TakePendingClone(unsigned int ulObjId)
+{
+	scoped_lock lock(m_hClonesLock);
+	return m_setPendingClones.erase(ulObjId) > 0;
+}
+
 size_t ECSession::GetObjectSize()
 {
 	size_t ulSize = sizeof(*this);
@@ -514,6 +534,7 @@ size_t ECSession::GetObjectSize()
 			MEMORY_USAGE_STRING(m_strClientVersion);
 	ulSize += MEMORY_USAGE_MAP(m_mapBusyStates.size(), BusyStateMap);
 	ulSize += MEMORY_USAGE_MAP(m_mapLocks.size(), LockMap);
+	ulSize += MEMORY_USAGE_LIST(m_setPendingClones.size(), std::set<unsigned int>);
 	if (m_lpEcSecurity)
 		ulSize += m_lpEcSecurity->GetObjectSize();
 	// The Table manager size is not callculated here
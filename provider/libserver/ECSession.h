@@ -13,6 +13,7 @@
 #include <map>
 #include <memory>
 #include <mutex>
+#include <set>
 #include <string>
 #include <ctime>
 #include <pthread.h>
@@ -135,6 +136,8 @@ public:
 	KC_HIDDEN ECRESULT GetObjectFromEntryId(const entryId *, unsigned int *obj_id, unsigned int *eid_flags = nullptr);
 	KC_HIDDEN ECRESULT LockObject(unsigned int obj_id);
 	KC_HIDDEN ECRESULT UnlockObject(unsigned int obj_id);
+	KC_HIDDEN void AddPendingClone(unsigned int obj_id);
+	KC_HIDDEN bool TakePendingClone(unsigned int obj_id);
 
 	/* for ECStatsSessionTable */
 	KC_HIDDEN void AddBusyState(pthread_t, const char *state, const request_stat &);
@@ -163,6 +166,9 @@ private:
 	typedef std::map<unsigned int, ECObjectLock>	LockMap;
 	std::mutex m_hLocksLock;
 	LockMap			m_mapLocks;
+	/* Messages from cloneMessage that were not announced yet */
+	std::mutex m_hClonesLock;
+	std::set<unsigned int> m_setPendingClones;
 	std::unique_ptr<ECSecurity> m_lpEcSecurity;
 	std::unique_ptr<ECUserManagement> m_lpUserManagement;
 	std::unique_ptr<ECTableManager> m_lpTableManager;
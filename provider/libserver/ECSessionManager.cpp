@@ -3,6 +3,7 @@
  * Copyright 2005 - 2016 Zarafa and its licensors
  */
 #include <kopano/platform.h>
+#include <algorithm>
 #include <chrono>
 #include <cstring>
 #include <list>
@@ -33,6 +34,7 @@
 #include "SSLUtil.h"
 #include "kcore.hpp"
 #include "ECICS.h"
+#include "ECIndexer.h"
 #include <edkmdb.h>
 #include "StorageUtil.h"
 
@@ -57,6 +59,7 @@ ECSessionManager::ECSessionManager(std::shared_ptr<ECConfig> cfg,
 	m_lpPluginFactory(new ECPluginFactory(m_lpConfig, m_stats, bHostedKopano, bDistributedKopano)),
 	m_lpDatabaseFactory(new ECDatabaseFactory(m_lpConfig, m_stats)),
 	m_lpSearchFolders(new ECSearchFolders(this, m_lpDatabaseFactory.get())),
+	m_search_pool(new ECSearchClientPool),
 	m_lpECCacheManager(new ECCacheManager(m_lpConfig, m_lpDatabaseFactory.get())),
 	m_lpTPropsPurge(new ECTPropsPurge(m_lpConfig, m_lpDatabaseFactory.get())),
 	m_ptrLockManager(std::make_shared<ECLockManager>())
@@ -73,7 +76,7 @@ ECSessionManager::ECSessionManager(std::shared_ptr<ECConfig> cfg,
 	        set_thread_name(m_hSessionCleanerThread, "ses_cleaner");
 	}
 
-	m_lpNotificationManager.reset(new ECNotificationManager());
+	m_lpNotificationManager.reset(new ECNotificationManager(atoui(m_lpConfig->GetSetting("notification_threads"))));
 }
 
 void ECSessionManager::shutdown()
@@ -608,6 +611,9 @@ ECRESULT ECSessionManager::AddNotification(notification *notifyItem, unsigned in
 	if ((ulFlags & MAPI_ASSOCIATED) || (notifyItem->ulEventType != fnevObjectDeleted && (ulFlags & MSGFLAG_DELETED)))
 		return hrSuccess;
 
+	// Cached indexer results of the store may no longer be right
+	m_search_pool->invalidate(ulStore);
+
 	switch (notifyItem->ulEventType) {
 	case fnevObjectMoved:
 		// Only update the item in the new folder. The system will automatically delete the item from folders that were not in the search path
@@ -959,10 +965,22 @@ void ECSessionManager::update_extra_stats()
 	s.setg("searchfld_folders", "Number of folders in use by search folders", sSearchStats.ulFolders);
 	s.setg("searchfld_events", "Number of events waiting for searchfolder updates", sSearchStats.ulEvents);
 	s.setg("searchfld_size", "Memory usage of search folders", sSearchStats.ullSize);
+	s.setg("searchfld_stores_queued", "Number of stores with events waiting for searchfolder updates", sSearchStats.stores_queued);
+	s.setg("searchfld_events_max", "Largest number of events waiting for searchfolder updates in one store", sSearchStats.events_max);
+
+	uint64_t hits = m_search_pool->m_hits, misses = m_search_pool->m_misses;
+	s.setg("index_cache_hits", "Indexed searches answered from the result cache", hits);
+	s.setg("index_cache_misses", "Indexed searches sent to the indexer", misses);
+	s.setg_dbl("index_cache_ratio", "Fraction of indexed searches answered from the result cache",
+		hits + misses > 0 ? static_cast<double>(hits) / (hits + misses) : 0);
+	s.setg("index_cache_items", "Number of cached indexed search results", m_search_pool->cache_size());
+	s.setg("index_conn_idle", "Open indexer connections waiting for a search", m_search_pool->idle_clients());
 
 	auto cm = GetCacheManager();
 	if (cm != nullptr)
 		cm->update_extra_stats(s);
+	if (m_lpNotificationManager != nullptr)
+		m_lpNotificationManager->update_extra_stats(s);
 
 	/* It's not the same as the AUTO_INCREMENT value, but good enough. */
 	ECDatabase *db = nullptr;
@@ -33,6 +33,7 @@ namespace KC {
 
 class ECConfig;
 class ECLogger;
+class ECSearchClientPool;
 class ECTPropsPurge;
 
 struct TABLESUBSCRIPTION {
@@ -190,6 +191,7 @@ public:
 	KC_HIDDEN ECLocale GetSortLocale(unsigned int store_id);
 	KC_HIDDEN ECCacheManager *GetCacheManager() const { return m_lpECCacheManager.get(); }
 	KC_HIDDEN ECSearchFolders *GetSearchFolders() const { return m_lpSearchFolders.get(); }
+	KC_HIDDEN ECSearchClientPool *get_search_pool() const { return m_search_pool.get(); }
 	KC_HIDDEN std::shared_ptr<ECConfig> GetConfig() const { return m_lpConfig; }
 	KC_HIDDEN std::shared_ptr<ECLogger> GetAudit() const { return m_lpAudit; }
 	KC_HIDDEN ECPluginFactory *GetPluginFactory() const { return m_lpPluginFactory.get(); }
@@ -241,6 +243,7 @@ protected:
 	std::unique_ptr<ECPluginFactory> m_lpPluginFactory;
 	std::unique_ptr<ECDatabaseFactory> m_lpDatabaseFactory;
 	std::unique_ptr<ECSearchFolders> m_lpSearchFolders;
+	std::unique_ptr<ECSearchClientPool> m_search_pool;
 	std::unique_ptr<ECCacheManager> m_lpECCacheManager;
 	std::unique_ptr<ECTPropsPurge> m_lpTPropsPurge;
 	std::shared_ptr<ECLockManager> m_ptrLockManager;
@@ -1092,7 +1092,7 @@ ECRESULT ECStoreObjectTable::AddRowKey(ECObjectTableList* lpRows, unsigned int *
 	auto sesmgr = lpSession->GetSessionManager();
 	if (GetIndexerResults(lpDatabase, sesmgr->GetConfig().get(),
 	    sesmgr->GetCacheManager(), &guidServer, lpODStore->lpGuid,
-	    lstFolders, lpsRestrict, &lpNewRestrict, lstIndexerResults,
+	    lpODStore->ulStoreId, lstFolders, lpsRestrict, &lpNewRestrict, lstIndexerResults,
 	    suggestion) != erSuccess) {
     	    // Cannot handle this restriction with the indexer, use 'normal' restriction code
     	    // Reasons can be:
@@ -118,6 +118,35 @@ private:
 	namestringmap_t m_mapNameStrings;
 };
 
+/*
+ * Collects the property rows of an object and its subobjects while they are
+ * deserialized, and writes them with multi-row statements no larger than
+ * max_allowed_packet. Flush() before anything reads them back.
+ */
+class PropertyBatch final {
+	public:
+	PropertyBatch(ECDatabase *);
+	ECRESULT AddProp(unsigned int objid, unsigned int parentid, const struct propVal *);
+	ECRESULT AddMVProp(unsigned int objid, unsigned int orderid, unsigned int tag, const std::string &colname, const std::string &coldata);
+	ECRESULT Flush();
+	NamedPropertyMapper &names() { return m_names; }
+
+	private:
+	struct mvquery {
+		std::string query;
+		unsigned int rows = 0;
+	};
+	ECRESULT FlushMV(mvquery &);
+
+	ECDatabase *m_lpDatabase;
+	unsigned int m_ulMaxQuery;
+	/* Named properties are resolved once per stream, not per subobject */
+	NamedPropertyMapper m_names;
+	std::string m_strProps;
+	/* mvproperties statements, by value column */
+	std::map<std::string, mvquery> m_mapMVProps;
+};
+
 ECStreamSerializer::ECStreamSerializer(IStream *lpBuffer)
 {
 	SetBuffer(lpBuffer);
@@ -356,6 +385,80 @@ ECRESULT NamedPropertyMapper::GetId(const GUID &guid, const std::string &strName
 	return erSuccess;
 }
 
+PropertyBatch::PropertyBatch(ECDatabase *lpDatabase) :
+	m_lpDatabase(lpDatabase), m_ulMaxQuery(lpDatabase->GetMaxAllowedPacket()),
+	m_names(lpDatabase)
+{}
+
+ECRESULT PropertyBatch::AddProp(unsigned int ulObjId, unsigned int ulParentId,
+    const struct propVal *lpsPropval)
+{
+	auto er = WriteSingleProp(m_lpDatabase, ulObjId, ulParentId, lpsPropval, false, m_ulMaxQuery, m_strProps);
+	if (er != KCERR_TOO_BIG)
+		return er;
+	er = m_lpDatabase->DoInsert(m_strProps);
+	if (er != erSuccess)
+		return er;
+	m_strProps.clear();
+	return WriteSingleProp(m_lpDatabase, ulObjId, ulParentId, lpsPropval, false, m_ulMaxQuery, m_strProps);
+}
+
+ECRESULT PropertyBatch::AddMVProp(unsigned int ulObjId, unsigned int ulOrderId,
+    unsigned int ulPropTag, const std::string &strColName,
+    const std::string &strColData)
+{
+	auto strRow = "(" + stringify(ulObjId) + "," + stringify(ulOrderId) + "," +
+	              stringify(PROP_ID(ulPropTag)) + "," + stringify(PROP_TYPE(ulPropTag)) + "," +
+	              strColData + ")";
+	auto &mv = m_mapMVProps[strColName];
+	if (!mv.query.empty() && mv.query.size() + strRow.size() + 1 > m_ulMaxQuery) {
+		auto er = FlushMV(mv);
+		if (er != erSuccess)
+			return er;
+	}
+	if (mv.query.empty())
+		mv.query = "REPLACE INTO mvproperties(hierarchyid,orderid,tag,type," + strColName + ") VALUES";
+	else
+		mv.query += ",";
+	mv.query += strRow;
+	++mv.rows;
+	return erSuccess;
+}
+
+ECRESULT PropertyBatch::FlushMV(mvquery &mv)
+{
+	unsigned int ulAffected = 0;
+	auto er = m_lpDatabase->DoInsert(mv.query, nullptr, &ulAffected);
+	if (er != erSuccess)
+		return er;
+	/* A replaced row counts twice, and none are expected */
+	if (ulAffected != mv.rows) {
+		ec_log_err("DeserializeProps(): Unexpected affected row count");
+		return KCERR_DATABASE_ERROR;
+	}
+	mv.query.clear();
+	mv.rows = 0;
+	return erSuccess;
+}
+
+ECRESULT PropertyBatch::Flush()
+{
+	if (!m_strProps.empty()) {
+		auto er = m_lpDatabase->DoInsert(m_strProps);
+		if (er != erSuccess)
+			return er;
+		m_strProps.clear();
+	}
+	for (auto &p : m_mapMVProps) {
+		if (p.second.query.empty())
+			continue;
+		auto er = FlushMV(p.second);
+		if (er != erSuccess)
+			return er;
+	}
+	return erSuccess;
+}
+
 // Utility Functions
 static ECRESULT GetValidatedPropType(DB_ROW, unsigned int *type);
 
@@ -1284,17 +1387,16 @@ static ECRESULT DeserializeProps(ECSession *lpecSession, ECDatabase *lpDatabase,
     ECAttachmentStorage *lpAttachmentStorage, const StreamCaps *lpStreamCaps,
     unsigned int ulObjId, unsigned int ulObjType, unsigned int ulStoreId,
     GUID *lpsGuid, bool bNewItem, ECSerializer *lpSource,
-    struct propValArray **lppPropValArray)
+    struct propValArray **lppPropValArray, PropertyBatch &batch)
 {
 	ECRESULT		er = erSuccess;
 	unsigned int ulCount = 0, ulFlags = 0, ulParentId = 0, ulOwner = 0;
-	unsigned int ulParentType = 0, ulAffected = 0, ulLen = 0;
+	unsigned int ulParentType = 0, ulLen = 0;
 	gsoap_size_t nMVItems = 0;
 	propVal			*lpsPropval = NULL;
 	struct soap		*soap = NULL;
 	struct propValArray *lpPropValArray = NULL;
-	NamedPropertyMapper namedPropertyMapper(lpDatabase);
-	std::string strQuery, strInsertQuery, strColData, strColName;
+	std::string strQuery, strColData, strColName;
 	SOURCEKEY		sSourceKey;
 	DB_RESULT lpDBResult;
 	DB_ROW			lpDBRow = NULL;
@@ -1329,12 +1431,13 @@ static ECRESULT DeserializeProps(ECSession *lpecSession, ECDatabase *lpDatabase,
 		lpPropValArray->__size = 0;
 	}
 
+	// We'll (ab)use a soap structure as a memory pool, emptied for each property.
+	soap = soap_new();
 	for (unsigned i = 0; i < ulCount; ++i) {
-		// We'll (ab)use a soap structure as a memory pool.
-		assert(soap == NULL);
-		soap = soap_new();
+		soap_destroy(soap);
+		soap_end(soap);
 
-		er = DeserializePropVal(soap, lpStreamCaps, namedPropertyMapper, &lpsPropval, lpSource);
+		er = DeserializePropVal(soap, lpStreamCaps, batch.names(), &lpsPropval, lpSource);
 		if (er != erSuccess)
 			goto exit;
 		auto iterInserted = setInserted.find(lpsPropval->ulPropTag);
@@ -1389,29 +1492,16 @@ static ECRESULT DeserializeProps(ECSession *lpecSession, ECDatabase *lpDatabase,
 					er = erSuccess;
 					goto next_property;
 				}
-				strQuery = "REPLACE INTO mvproperties(hierarchyid,orderid,tag,type," + strColName + ") VALUES(" + stringify(ulObjId) + "," + stringify(j) + "," + stringify(PROP_ID(lpsPropval->ulPropTag)) + "," + stringify(PROP_TYPE(lpsPropval->ulPropTag)) + "," + strColData + ")";
-				er = lpDatabase->DoInsert(strQuery, NULL, &ulAffected);
+				er = batch.AddMVProp(ulObjId, j, lpsPropval->ulPropTag, strColName, strColData);
 				if (er != erSuccess)
 					goto exit;
-				if (ulAffected != 1) {
-					er = KCERR_DATABASE_ERROR;
-					ec_log_err("DeserializeProps(): Unexpected affected row count");
-					goto exit;
-				}
 			}
 			// Cache the written value
 			sObjectTableKey key(ulObjId, 0);
 			gcache->SetCell(&key, lpsPropval->ulPropTag, lpsPropval);
 		} else {
 			// Write the property to the database
-			er = WriteSingleProp(lpDatabase, ulObjId, ulParentId, lpsPropval, false, lpDatabase->GetMaxAllowedPacket(), strInsertQuery);
-			if (er == KCERR_TOO_BIG) {
-				er = lpDatabase->DoInsert(strInsertQuery);
-				if (er == erSuccess) {
-					strInsertQuery.clear();
-					er = WriteSingleProp(lpDatabase, ulObjId, ulParentId, lpsPropval, false, lpDatabase->GetMaxAllowedPacket(), strInsertQuery);
-				}
-			}
+			er = batch.AddProp(ulObjId, ulParentId, lpsPropval);
 			if (er != erSuccess)
 				goto exit;
 			// Write the property to the table properties if needed (only on objects in folders (folders, messages), and if the property is being tracked here.
@@ -1422,17 +1512,9 @@ static ECRESULT DeserializeProps(ECSession *lpecSession, ECDatabase *lpDatabase,
 
 		setInserted.emplace(lpsPropval->ulPropTag);
 next_property:
-		soap_destroy(soap);
-		soap_end(soap);
-		soap_free(soap);
-		soap = NULL;
+		;
 	}
 
-	if (!strInsertQuery.empty()) {
-		er = lpDatabase->DoInsert(strInsertQuery);
-		if (er != erSuccess)
-			goto exit;
-	}
 	if(ulParentType == MAPI_FOLDER && ulParentId != CACHE_NO_PARENT) {
 		// Instead of writing directly to tproperties, save a delayed write request (flushed on table open).
 		er = ECTPropsPurge::AddDeferredUpdateNoPurge(lpDatabase, ulParentId, 0, ulObjId);
@@ -1482,11 +1564,11 @@ exit:
 	return er;
 }
 
-ECRESULT DeserializeObject(ECSession *lpecSession, ECDatabase *lpDatabase,
+static ECRESULT DeserializeObject(ECSession *lpecSession, ECDatabase *lpDatabase,
     ECAttachmentStorage *lpAttachmentStorage, const StreamCaps *lpStreamCaps,
     unsigned int ulObjId, unsigned int ulStoreId, GUID *lpsGuid, bool bNewItem,
     unsigned long long ullIMAP, ECSerializer *lpSource,
-    struct propValArray **lppPropValArray)
+    struct propValArray **lppPropValArray, PropertyBatch &batch)
 {
 	ECRESULT		er = erSuccess;
 	unsigned int ulStreamVersion = 0, ulObjType = 0, ulRealObjType = 0;
@@ -1523,7 +1605,7 @@ ECRESULT DeserializeObject(ECSession *lpecSession, ECDatabase *lpDatabase,
 		lpStreamCaps = &g_StreamCaps[ulStreamVersion];
 	}
 
-	er = DeserializeProps(lpecSession, lpDatabase, lpAttachmentStorage, lpStreamCaps, ulObjId, ulObjType, ulStoreId, lpsGuid, bNewItem, lpSource, lppPropValArray ? &lpPropValArray : NULL);
+	er = DeserializeProps(lpecSession, lpDatabase, lpAttachmentStorage, lpStreamCaps, ulObjId, ulObjType, ulStoreId, lpsGuid, bNewItem, lpSource, lppPropValArray ? &lpPropValArray : NULL, batch);
 	if (er != erSuccess)
 		goto exit;
 
@@ -1539,6 +1621,13 @@ ECRESULT DeserializeObject(ECSession *lpecSession, ECDatabase *lpDatabase,
 		sProp.ulPropTag = PR_EC_IMAP_ID;
 		sProp.Value.ul = (unsigned int)ullIMAP;
 		sProp.__union = SOAP_UNION_propValData_ul;
+		/*
+		 * A plain INSERT, which fails rather than overwrite an IMAP ID
+		 * that is already there; so the props must be in first.
+		 */
+		er = batch.Flush();
+		if (er != erSuccess)
+			goto exit;
 		std::string strQuery;
 		WriteSingleProp(lpDatabase, ulObjId, 0, &sProp, false, 0, strQuery, false);
 		er = lpDatabase->DoInsert(strQuery);
@@ -1573,10 +1662,17 @@ ECRESULT DeserializeObject(ECSession *lpecSession, ECDatabase *lpDatabase,
 			er = CreateObject(lpecSession, lpDatabase, ulObjId, ulObjType, ulSubObjType, 0, &ulSubObjId);
 			if (er != erSuccess)
 				goto exit;
-			er = DeserializeObject(lpecSession, lpDatabase, lpAttachmentStorage, lpStreamCaps, ulSubObjId, ulStoreId, lpsGuid, bNewItem, 0, lpSource, NULL);
+			er = DeserializeObject(lpecSession, lpDatabase, lpAttachmentStorage, lpStreamCaps, ulSubObjId, ulStoreId, lpsGuid, bNewItem, 0, lpSource, nullptr, batch);
 			if (er != erSuccess)
 				goto exit;
 		}
+		/*
+		 * The rows of this object and its recipients go out together;
+		 * the updates below, and the size calculation, need them.
+		 */
+		er = batch.Flush();
+		if (er != erSuccess)
+			goto exit;
 
 		if (ulRealObjType == MAPI_MESSAGE) {
 			// We have to generate/update PR_HASATTACH
@@ -1637,6 +1733,23 @@ exit:
 	return er;
 }
 
+ECRESULT DeserializeObject(ECSession *lpecSession, ECDatabase *lpDatabase,
+    ECAttachmentStorage *lpAttachmentStorage, const StreamCaps *lpStreamCaps,
+    unsigned int ulObjId, unsigned int ulStoreId, GUID *lpsGuid, bool bNewItem,
+    unsigned long long ullIMAP, ECSerializer *lpSource,
+    struct propValArray **lppPropValArray)
+{
+	if (lpDatabase == nullptr)
+		return KCERR_DATABASE_ERROR;
+	PropertyBatch batch(lpDatabase);
+	auto er = DeserializeObject(lpecSession, lpDatabase, lpAttachmentStorage,
+	          lpStreamCaps, ulObjId, ulStoreId, lpsGuid, bNewItem, ullIMAP,
+	          lpSource, lppPropValArray, batch);
+	if (er != erSuccess)
+		return er;
+	return batch.Flush();
+}
+
 static ECRESULT GetValidatedPropType(DB_ROW lpRow, unsigned int *lpulType)
 {
 	ECRESULT er = KCERR_DATABASE_ERROR;
@@ -87,7 +87,7 @@ class ECFifoSerializer final : public ECSerializer {
 	public:
 	enum eMode { serialize, deserialize };
 
-	ECFifoSerializer(ECFifoBuffer *lpBuffer, eMode mode);
+	ECFifoSerializer(ECFifoBuffer *lpBuffer, eMode mode, unsigned int timeout = STR_DEF_TIMEOUT);
 	virtual ~ECFifoSerializer();
 	virtual ECRESULT SetBuffer(void *) override;
 	virtual ECRESULT Write(const void *ptr, size_t size, size_t nmemb) override;
@@ -99,6 +99,7 @@ class ECFifoSerializer final : public ECSerializer {
 	private:
 	ECFifoBuffer *m_lpBuffer;
 	eMode m_mode;
+	unsigned int m_timeout; /* ms, 0 for none */
 	ULONG m_ulRead = 0, m_ulWritten = 0;
 };
 
@@ -302,8 +303,9 @@ std::unique_ptr<ECThreadWorker> ksrv_tpool::make_worker()
 	return make_unique_nt<ksrv_worker>(this);
 }
 
-ECFifoSerializer::ECFifoSerializer(ECFifoBuffer *lpBuffer, eMode mode) :
-	m_mode(mode)
+ECFifoSerializer::ECFifoSerializer(ECFifoBuffer *lpBuffer, eMode mode,
+    unsigned int timeout) :
+	m_mode(mode), m_timeout(timeout)
 {
 	SetBuffer(lpBuffer);
 }
@@ -338,24 +340,24 @@ ECRESULT ECFifoSerializer::Write(const void *ptr, size_t size, size_t nmemb)
 
 	switch (size) {
 	case 1:
-		er = m_lpBuffer->Write(ptr, nmemb, STR_DEF_TIMEOUT, NULL);
+		er = m_lpBuffer->Write(ptr, nmemb, m_timeout, NULL);
 		break;
 	case 2:
 		for (size_t x = 0; x < nmemb && er == erSuccess; ++x) {
 			tmp.s = htons(static_cast<const short *>(ptr)[x]);
-			er = m_lpBuffer->Write(&tmp, size, STR_DEF_TIMEOUT, nullptr);
+			er = m_lpBuffer->Write(&tmp, size, m_timeout, nullptr);
 		}
 		break;
 	case 4:
 		for (size_t x = 0; x < nmemb && er == erSuccess; ++x) {
 			tmp.i = htonl(static_cast<const int *>(ptr)[x]);
-			er = m_lpBuffer->Write(&tmp, size, STR_DEF_TIMEOUT, nullptr);
+			er = m_lpBuffer->Write(&tmp, size, m_timeout, nullptr);
 		}
 		break;
 	case 8:
 		for (size_t x = 0; x < nmemb && er == erSuccess; ++x) {
 			tmp.ll = cpu_to_be64(static_cast<const uint64_t *>(ptr)[x]);
-			er = m_lpBuffer->Write(&tmp, size, STR_DEF_TIMEOUT, nullptr);
+			er = m_lpBuffer->Write(&tmp, size, m_timeout, nullptr);
 		}
 		break;
 	default:
@@ -374,7 +376,7 @@ ECRESULT ECFifoSerializer::Read(void *ptr, size_t size, size_t nmemb)
 		return KCERR_NO_SUPPORT;
 	if (ptr == nullptr)
 		return KCERR_INVALID_PARAMETER;
-	auto er = m_lpBuffer->Read(ptr, size * nmemb, STR_DEF_TIMEOUT, &cbRead);
+	auto er = m_lpBuffer->Read(ptr, size * nmemb, m_timeout, &cbRead);
 	if (er != erSuccess)
 		return er;
 	m_ulRead += cbRead;
@@ -429,7 +431,7 @@ ECRESULT ECFifoSerializer::Flush()
 	char buf[16384];
 
 	while (true) {
-		er = m_lpBuffer->Read(buf, sizeof(buf), STR_DEF_TIMEOUT, &cbRead);
+		er = m_lpBuffer->Read(buf, sizeof(buf), m_timeout, &cbRead);
 		if (er != erSuccess)
 			return er;
 		m_ulRead += cbRead;
@@ -2571,7 +2573,24 @@ SOAP_ENTRY_START(saveObject, lpsLoadObjectResponse->er,
 	// 7. notification
 	// Only Notify on MAPI_MESSAGE, MAPI_FOLDER and MAPI_STORE
 	// but don't notify if parent object is a store and object type is attachment or message
-	CreateNotifications(ulObjId, ulObjType, ulParentObjId, ulGrandParent, fNewItem, &lpsSaveObj->modProps, pvCommitTime);
+	if (!fNewItem && ulObjType == MAPI_MESSAGE &&
+	    lpecSession->TakePendingClone(ulObjId)) {
+		/*
+		 * First save of a message from cloneMessage, which did not
+		 * announce it. The folder counts already include it.
+		 */
+		if (pvCommitTime != nullptr) {
+			sObjectTableKey key(ulParentObjId, 0);
+			g_lpSessionManager->GetCacheManager()->SetCell(&key, PR_LOCAL_COMMIT_TIME_MAX, pvCommitTime);
+		}
+		g_lpSessionManager->NotificationCreated(MAPI_MESSAGE, ulObjId, ulParentObjId);
+		g_lpSessionManager->UpdateTables(ECKeyTable::TABLE_ROW_ADD, ulObjFlags & MSGFLAG_NOTIFY_FLAGS, ulParentObjId, ulObjId, MAPI_MESSAGE);
+		g_lpSessionManager->NotificationModified(MAPI_FOLDER, ulParentObjId, 0, true);
+		if (ulGrandParent)
+			g_lpSessionManager->UpdateTables(ECKeyTable::TABLE_ROW_MODIFY, 0, ulGrandParent, ulParentObjId, MAPI_FOLDER);
+	} else {
+		CreateNotifications(ulObjId, ulObjType, ulParentObjId, ulGrandParent, fNewItem, &lpsSaveObj->modProps, pvCommitTime);
+	}
 	lpsLoadObjectResponse->sSaveObject = sReturnObject;
 	g_lpSessionManager->m_stats->inc(SCN_DATABASE_MWOPS);
 }
@@ -6456,6 +6475,8 @@ static ECRESULT MoveObjects(ECSession *lpSession, ECDatabase *lpDatabase,
  * @param[in] bDoNotification true if you want to send object notifications.
  * @param[in] bDoTableNotification true if you want to send table notifications.
  * @param[in] ulSyncId Client sync identify.
+ * @param[out] lpulNewObjId Object id of the copy (optional).
+ * @param[in] ulOwner Owner of the copy; 0 means the session user.
  *
  * @FIXME It is possible to send notifications before a commit, this can give issues with the cache!
  * 			This function should be refactored
@@ -6463,7 +6484,8 @@ static ECRESULT MoveObjects(ECSession *lpSession, ECDatabase *lpDatabase,
 static ECRESULT CopyObject(ECSession *lpecSession,
     ECAttachmentStorage *lpAttachmentStorage, unsigned int ulObjId,
     unsigned int ulDestFolderId, bool bIsRoot, bool bDoNotification,
-    bool bDoTableNotification, unsigned int ulSyncId)
+    bool bDoTableNotification, unsigned int ulSyncId,
+    unsigned int *lpulNewObjId = nullptr, unsigned int ulOwner = 0)
 {
 	ECDatabase		*lpDatabase = NULL;
 	DB_RESULT lpDBResult;
@@ -6552,7 +6574,7 @@ static ECRESULT CopyObject(ECSession *lpecSession,
 		stringify(ulDestFolderId) + ", " +
 		std::string(lpDBRow[1]) + ", " +
 		stringify(ulFlags) + "&" + stringify(MSGFLAG_ASSOCIATED) + "," +
-		stringify(lpecSession->GetSecurity()->GetUserId()) + ") ";
+		stringify(ulOwner != 0 ? ulOwner : lpecSession->GetSecurity()->GetUserId()) + ") ";
 	er = lpDatabase->DoInsert(strQuery, &ulNewObjectId);
 	if (er != erSuccess)
 		return er_lerrf(er, "Failed inserting entry in hierarchy table");
@@ -6603,7 +6625,7 @@ static ECRESULT CopyObject(ECSession *lpecSession,
 	while ((lpDBRow = lpDBResult.fetch_row()) != nullptr) {
 		if(lpDBRow[0] == NULL)
 			continue; // FIXME: Skip, give an error/warning ?
-		er = CopyObject(lpecSession, lpAttachmentStorage, atoui(lpDBRow[0]), ulNewObjectId, false, false, false, ulSyncId);
+		er = CopyObject(lpecSession, lpAttachmentStorage, atoui(lpDBRow[0]), ulNewObjectId, false, false, false, ulSyncId, nullptr, ulOwner);
 		if (er != erSuccess && er != KCERR_NOT_FOUND)
 			return er_lerrf(er, "CopyObject(%s) failed", lpDBRow[0]);
 		else
@@ -6697,6 +6719,8 @@ static ECRESULT CopyObject(ECSession *lpecSession,
 		}
 	}
 
+	if (lpulNewObjId != nullptr)
+		*lpulNewObjId = ulNewObjectId;
 	g_lpSessionManager->GetCacheManager()->Update(fnevObjectModified, ulDestFolderId);
 	if (!bDoNotification)
 		return erSuccess;
@@ -6964,6 +6988,68 @@ SOAP_ENTRY_START(copyObjects, *result, struct entryList *aMessages,
 }
 SOAP_ENTRY_END()
 
+/**
+ * Copy one message into a folder, which may be in another store on this
+ * server, and return the entryid of the copy. Unlike a client-side copy,
+ * nothing is sent over the wire, and the large properties and
+ * attachments of the copy share their instances with the original.
+ * kopano-dagent uses this to hand the same message to many recipients.
+ */
+SOAP_ENTRY_START(cloneMessage, lpsResponse->er, const entryId &sEntryId,
+    const entryId &sDestFolderId, unsigned int ulFlags, unsigned int ulSyncId,
+    struct cloneMessageResponse *lpsResponse)
+{
+	unsigned int ulObjId = 0, ulDestFolderId = 0, ulNewObjId = 0;
+	unsigned int ulDestType = 0;
+	std::set<EntryId> setEntryIds;
+	USE_DATABASE_NORESULT();
+
+	if (ulFlags != 0)
+		return KCERR_INVALID_PARAMETER;
+	setEntryIds.emplace(sEntryId);
+	setEntryIds.emplace(sDestFolderId);
+	kd_trans dtx;
+	er = BeginLockFolders(lpDatabase, setEntryIds, LOCK_EXCLUSIVE, dtx, er);
+	if (er != erSuccess)
+		return er_lerrf(er, "Failed locking folders");
+	auto cleanup = make_scope_success([&]() { dtx.commit(); });
+	er = lpecSession->GetObjectFromEntryId(&sEntryId, &ulObjId);
+	if (er != erSuccess)
+		return er;
+	er = lpecSession->GetObjectFromEntryId(&sDestFolderId, &ulDestFolderId);
+	if (er != erSuccess)
+		return er;
+	auto gcache = g_lpSessionManager->GetCacheManager();
+	er = gcache->GetObject(ulDestFolderId, nullptr, nullptr, nullptr, &ulDestType);
+	if (er != erSuccess)
+		return er;
+	if (ulDestType != MAPI_FOLDER)
+		return KCERR_INVALID_TYPE;
+	er = lpecSession->GetSecurity()->CheckPermission(ulDestFolderId, ecSecurityCreate);
+	if (er != erSuccess)
+		return er;
+	/*
+	 * Reading the original is checked by CopyObject, as is the quota.
+	 * The copy belongs to the owner of the target folder, not to the
+	 * (admin) session that made it, like a message created there.
+	 *
+	 * The caller still changes the copy before saving it, so nothing is
+	 * announced yet: saveObject sends the notifications of a new message
+	 * once the client saves the clone.
+	 */
+	er = CopyObject(lpecSession, nullptr, ulObjId, ulDestFolderId, true,
+	     false, false, ulSyncId, &ulNewObjId,
+	     lpecSession->GetSecurity()->GetUserId(ulDestFolderId));
+	if (er != erSuccess)
+		return er;
+	er = WriteLocalCommitTimeMax(nullptr, lpDatabase, ulDestFolderId, nullptr);
+	if (er != erSuccess)
+		return er_lerrf(er, "WriteLocalCommitTimeMax failed");
+	lpecSession->AddPendingClone(ulNewObjId);
+	return gcache->GetEntryIdFromObject(ulNewObjId, soap, 0, &lpsResponse->sEntryId);
+}
+SOAP_ENTRY_END()
+
 SOAP_ENTRY_START(copyFolder, *result, const entryId &sEntryId,
     const entryId &sDestFolderId, const char *lpszNewFolderName,
     unsigned int ulFlags, unsigned int ulSyncId, unsigned int *result)
@@ -8425,6 +8511,19 @@ struct MTOMSessionInfo {
 	std::lock_guard<ECSession> holder;
 	/* These are only tracked for cleanup at session exit */
 	MTOMStreamInfo *lpCurrentWriteStream = nullptr, *lpCurrentReadStream = nullptr;
+	/*
+	 * Export: the streams in response order, and how many of them have
+	 * been handed to the pool. Up to @window streams are serialized ahead,
+	 * each by its own worker into its own FIFO. With @parallel, the worker
+	 * that gets hold of @shared_busy uses lpSharedDatabase (with
+	 * lpAttachmentStorage), the others their own connection.
+	 */
+	std::vector<MTOMStreamInfo *> streams;
+	size_t next_stream = 0, window = 1;
+	bool parallel = false;
+	std::atomic<bool> shared_busy{false};
+	/* FIFOs of finished streams, for the next ones */
+	std::vector<std::unique_ptr<ECFifoBuffer>> spare_fifos;
 };
 
 struct MTOMStreamInfo {
@@ -8437,23 +8536,76 @@ struct MTOMStreamInfo {
 	task_type 		*lpTask;
 	struct propValArray *lpPropValArray;
 	MTOMSessionInfo *lpSessionInfo;
+	unsigned int ulIndex; /* position in MTOMSessionInfo::streams */
 };
 
 static ECRESULT SerializeObject(void *arg)
 {
 	auto lpStreamInfo = static_cast<MTOMStreamInfo *>(arg);
 	assert(lpStreamInfo != NULL);
-	lpStreamInfo->lpSessionInfo->lpSharedDatabase->ThreadInit();
-
-	ECFifoSerializer lpSink(lpStreamInfo->lpFifoBuffer, ECFifoSerializer::serialize);
-	auto er = SerializeMessage(lpStreamInfo->lpSessionInfo->lpecSession,
-	     lpStreamInfo->lpSessionInfo->lpSharedDatabase.get(),
-	     lpStreamInfo->lpSessionInfo->lpAttachmentStorage.get(), nullptr,
-	     lpStreamInfo->ulObjectId, MAPI_MESSAGE, lpStreamInfo->ulStoreId,
-	     &lpStreamInfo->sGuid, lpStreamInfo->ulFlags, &lpSink, true);
-	lpStreamInfo->lpSessionInfo->lpSharedDatabase->ThreadEnd();
-	lpStreamInfo->lpSessionInfo->er = er;
-	return er;
+	auto info = lpStreamInfo->lpSessionInfo;
+	/*
+	 * The reader may still be busy with earlier streams, so wait as long
+	 * as it takes; MTOMReadClose closes the FIFO if it gives up.
+	 */
+	ECFifoSerializer lpSink(lpStreamInfo->lpFifoBuffer, ECFifoSerializer::serialize, 0);
+	bool idle = false;
+	if (!info->parallel || info->shared_busy.compare_exchange_strong(idle, true)) {
+		info->lpSharedDatabase->ThreadInit();
+		auto er = SerializeMessage(info->lpecSession, info->lpSharedDatabase.get(),
+		          info->lpAttachmentStorage.get(), nullptr,
+		          lpStreamInfo->ulObjectId, MAPI_MESSAGE, lpStreamInfo->ulStoreId,
+		          &lpStreamInfo->sGuid, lpStreamInfo->ulFlags, &lpSink, true);
+		info->lpSharedDatabase->ThreadEnd();
+		info->shared_busy = false;
+		return er;
+	}
+
+	/* ksrv_tpool workers keep their connection until they exit */
+	ECDatabase *db = nullptr;
+	auto er = g_lpSessionManager->get_db_factory()->get_tls_db(&db);
+	if (er != erSuccess)
+		return er;
+	std::unique_ptr<ECAttachmentStorage> atx(g_lpSessionManager->get_atxconfig()->new_handle(db));
+	if (atx == nullptr)
+		return KCERR_NOT_ENOUGH_MEMORY;
+	return SerializeMessage(info->lpecSession, db, atx.get(), nullptr,
+	       lpStreamInfo->ulObjectId, MAPI_MESSAGE, lpStreamInfo->ulStoreId,
+	       &lpStreamInfo->sGuid, lpStreamInfo->ulFlags, &lpSink, true);
+}
+
+/**
+ * Hand the export streams before @upto to the pool (those that are not
+ * yet), each with a FIFO to serialize into.
+ */
+static ECRESULT MTOMDispatch(MTOMSessionInfo *info, size_t upto)
+{
+	auto pool = info->lpThreadPool.get();
+	if (pool == nullptr)
+		return KCERR_NOT_FOUND;
+	upto = std::min(upto, info->streams.size());
+	for (; info->next_stream < upto; ++info->next_stream) {
+		auto si = info->streams[info->next_stream];
+		std::unique_ptr<ECFifoBuffer> fifo;
+		if (!info->spare_fifos.empty()) {
+			fifo = std::move(info->spare_fifos.back());
+			info->spare_fifos.pop_back();
+			fifo->Reset();
+		} else {
+			fifo.reset(new(std::nothrow) ECFifoBuffer);
+		}
+		std::unique_ptr<task_type> ptrTask(new(std::nothrow) task_type(SerializeObject, si));
+		if (fifo == nullptr || ptrTask == nullptr)
+			return KCERR_NOT_ENOUGH_MEMORY;
+		si->lpFifoBuffer = fifo.get();
+		if (!pool->enqueue(ptrTask.get())) {
+			si->lpFifoBuffer = nullptr;
+			return KCERR_CALL_FAILED;
+		}
+		fifo.release();
+		si->lpTask = ptrTask.release();
+	}
+	return erSuccess;
 }
 
 static void *MTOMReadOpen(struct soap *soap, void *handle, const char *id,
@@ -8461,33 +8613,24 @@ static void *MTOMReadOpen(struct soap *soap, void *handle, const char *id,
 {
 	auto lpStreamInfo = static_cast<MTOMStreamInfo *>(handle);
 	assert(lpStreamInfo != NULL);
-	if (lpStreamInfo->lpSessionInfo->er != erSuccess) {
+	auto info = lpStreamInfo->lpSessionInfo;
+	if (info->er != erSuccess) {
 		soap->error = SOAP_FATAL_ERROR;
 		return NULL;
 	}
-
-	lpStreamInfo->lpFifoBuffer = new ECFifoBuffer();
-
-	if (strncmp(id, "emcas-", 6) == 0) {
-		std::unique_ptr<task_type> ptrTask(new task_type(SerializeObject, lpStreamInfo));
-		auto pool = lpStreamInfo->lpSessionInfo->lpThreadPool.get();
-		if (pool == nullptr || !pool->enqueue(ptrTask.get())) {
-			ec_log_err("Failed to dispatch serialization task for \"%s\"", id);
-			soap->error = SOAP_FATAL_ERROR;
-			delete lpStreamInfo->lpFifoBuffer;
-			lpStreamInfo->lpFifoBuffer = NULL;
-			return NULL;
-		}
-		lpStreamInfo->lpTask = ptrTask.release();
-	} else {
+	if (strncmp(id, "emcas-", 6) != 0) {
 		ec_log_err("Got stream request for unknown ID \"%s\"", id);
 		soap->error = SOAP_FATAL_ERROR;
-		delete lpStreamInfo->lpFifoBuffer;
-		lpStreamInfo->lpFifoBuffer = NULL;
 		return NULL;
 	}
-
-	lpStreamInfo->lpSessionInfo->lpCurrentReadStream = lpStreamInfo; // Track currently opened stream info
+	/* This one, and the next ones while there is room */
+	auto er = MTOMDispatch(info, lpStreamInfo->ulIndex + info->window);
+	if (er != erSuccess || lpStreamInfo->lpTask == nullptr) {
+		ec_log_err("Failed to dispatch serialization task for \"%s\"", id);
+		soap->error = SOAP_FATAL_ERROR;
+		return NULL;
+	}
+	info->lpCurrentReadStream = lpStreamInfo; // Track currently opened stream info
 	return lpStreamInfo;
 }
 
@@ -8508,8 +8651,9 @@ static size_t MTOMRead(struct soap * /*soap*/, void *handle,
 static void MTOMReadClose(struct soap *soap, void *handle)
 {
 	auto lpStreamInfo = static_cast<MTOMStreamInfo *>(handle);
+	auto info = lpStreamInfo->lpSessionInfo;
 	assert(lpStreamInfo->lpFifoBuffer != NULL);
-	lpStreamInfo->lpSessionInfo->lpCurrentReadStream = NULL; // Cleanup done
+	info->lpCurrentReadStream = NULL; // Cleanup done
 
 	// We get here when the last call to MTOMRead returned 0 OR when
 	// an error occurred within gSOAP's bowels. In the latter case, we need
@@ -8518,11 +8662,17 @@ static void MTOMReadClose(struct soap *soap, void *handle)
 	// read this point, it is safe to just close the FIFO.
 	lpStreamInfo->lpFifoBuffer->Close(ECFifoBuffer::cfRead);
 	if (lpStreamInfo->lpTask) {
-		lpStreamInfo->lpTask->wait();	 // Todo: use result() to wait and get result
+		auto er = lpStreamInfo->lpTask->result();
+		if (er != erSuccess && info->er == erSuccess)
+			/* Keeps the next streams from being opened */
+			info->er = er;
 		delete lpStreamInfo->lpTask;
+		lpStreamInfo->lpTask = nullptr;
 	}
-	delete lpStreamInfo->lpFifoBuffer;
+	std::unique_ptr<ECFifoBuffer> fifo(lpStreamInfo->lpFifoBuffer);
 	lpStreamInfo->lpFifoBuffer = NULL;
+	if (info->spare_fifos.size() < info->window)
+		info->spare_fifos.emplace_back(std::move(fifo));
 }
 
 static void MTOMWriteClose(struct soap *soap, void *handle);
@@ -8534,9 +8684,13 @@ static void MTOMSessionDone(struct soap *soap, void *param)
 	if (lpInfo->lpCurrentWriteStream != NULL)
 	    // Apparently a write stream was opened but not closed by gSOAP by calling MTOMWriteClose. Do it now.
 	    MTOMWriteClose(soap, lpInfo->lpCurrentWriteStream);
-	else if (lpInfo->lpCurrentReadStream != NULL)
-        // Same but for MTOMReadClose()
-		MTOMReadClose(soap, lpInfo->lpCurrentReadStream);
+	/*
+	 * Same but for MTOMReadClose(), which also stops the streams that were
+	 * serialized ahead but will not be sent anymore.
+	 */
+	for (size_t i = 0; i < lpInfo->next_stream; ++i)
+		if (lpInfo->streams[i]->lpFifoBuffer != nullptr)
+			MTOMReadClose(soap, lpInfo->streams[i]);
 	delete lpInfo;
 }
 
@@ -8552,7 +8706,6 @@ SOAP_ENTRY_START(exportMessageChangesAsStream, lpsResponse->er,
 	ECObjectTableList	rows;
 	struct rowSet		*lpRowSet = NULL; // Do not free, used in response data
 	ECODStore			ecODStore;
-	std::unique_ptr<ECDatabase> lpBatchDB;
 	bool				bUseSQLMulti = parseBool(g_lpSessionManager->GetConfig()->GetSetting("enable_sql_procedures"));
 
 	// Backward compat, old clients do not send ulPropTag
@@ -8603,10 +8756,6 @@ SOAP_ENTRY_START(exportMessageChangesAsStream, lpsResponse->er,
 		return er;
 
 	auto ulDepth = atoui(lpecSession->GetSessionManager()->GetConfig()->GetSetting("embedded_attachment_limit")) + 1;
-	er = lpecSession->GetAdditionalDatabase(&unique_tie(lpBatchDB));
-	if (er != erSuccess)
-		return er;
-
 	if ((lpecSession->GetCapabilities() & KOPANO_CAP_ENHANCED_ICS) == 0)
 		return er = KCERR_NO_SUPPORT;
 	lpAttachmentStorage.reset(g_lpSessionManager->get_atxconfig()->new_handle(lpDatabase));
@@ -8616,9 +8765,19 @@ SOAP_ENTRY_START(exportMessageChangesAsStream, lpsResponse->er,
 	lpMTOMSessionInfo->lpCurrentWriteStream = NULL;
 	lpMTOMSessionInfo->lpCurrentReadStream = NULL;
 	lpMTOMSessionInfo->lpAttachmentStorage = lpAttachmentStorage;
-	lpMTOMSessionInfo->lpSharedDatabase = std::move(lpBatchDB);
 	lpMTOMSessionInfo->er = erSuccess;
-	lpMTOMSessionInfo->lpThreadPool.reset(new ksrv_tpool("mtomexport", 1));
+	/*
+	 * Messages are serialized ahead of the one being sent, each on its own
+	 * worker and database connection, except when they come from the
+	 * StreamObj results, which can only be consumed in order.
+	 */
+	unsigned int ulThreads = 1;
+	if (!bUseSQLMulti)
+		ulThreads = std::max(1U, std::min(atoui(g_lpSessionManager->GetConfig()->GetSetting("ics_export_threads")),
+		            static_cast<unsigned int>(std::max(sSourceKeyPairs.__size, 1))));
+	lpMTOMSessionInfo->parallel = ulThreads > 1;
+	lpMTOMSessionInfo->window = ulThreads;
+	lpMTOMSessionInfo->lpThreadPool.reset(new ksrv_tpool("mtomexport", ulThreads));
 	soap_info(soap)->fdone = MTOMSessionDone;
 	soap_info(soap)->fdoneparam = lpMTOMSessionInfo;
 	lpsResponse->sMsgStreams.__ptr = soap_new_messageStream(soap, sSourceKeyPairs.__size);
@@ -8678,7 +8837,10 @@ SOAP_ENTRY_START(exportMessageChangesAsStream, lpsResponse->er,
 		lpStreamInfo->ulFlags = ulFlags;
 		lpStreamInfo->lpPropValArray = NULL;
 		lpStreamInfo->lpTask = NULL;
+		lpStreamInfo->lpFifoBuffer = nullptr;
 		lpStreamInfo->lpSessionInfo = lpMTOMSessionInfo;
+		lpStreamInfo->ulIndex = ulObjCnt;
+		lpMTOMSessionInfo->streams.emplace_back(lpStreamInfo);
 		if(bUseSQLMulti)
 			strQuery += "call StreamObj(" + stringify(ulObjectId) + "," + stringify(ulDepth) + ", " + stringify(ulMode) + ");";
 
@@ -8691,6 +8853,12 @@ SOAP_ENTRY_START(exportMessageChangesAsStream, lpsResponse->er,
 		rows.emplace_back(ulObjectId, 0);
 	}
 	lpsResponse->sMsgStreams.__size = ulObjCnt;
+	if (ulObjCnt > 0) {
+		/* For StreamObj, or the workers (one of them, with parallel) */
+		er = lpecSession->GetAdditionalDatabase(&unique_tie(lpMTOMSessionInfo->lpSharedDatabase));
+		if (er != erSuccess)
+			return er;
+	}
 
     // The results of this query will be consumed by the MTOMRead function
     if(!strQuery.empty()) {
@@ -8,13 +8,16 @@
 #pragma once
 #include <list>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <utility>
+#include <vector>
 #include <kopano/ECDefs.h>
 #include <kopano/pcuser.hpp>
 #include <kopano/timeutil.hpp>
 #include "ECCache.h"
+#include "LDAPDNIndex.h"
 #include "plugin.h"
 
 using namespace KC;
@@ -28,9 +31,6 @@ namespace KC { class ECConfig; }
  */
 
 
-/* Cache type, std::string is LDAP DN string */
-typedef std::map<objectid_t, std::string> dn_cache_t;
-typedef std::list<std::string> dn_list_t;
 
 /**
  * LDAP Cache which collects DNs with the matching
@@ -40,10 +40,12 @@ class LDAPCache final {
 private:
 	/* objectid => DN */
 	std::recursive_mutex m_hMutex;
-	dn_cache_t m_lpCompanyCache; /* CONTAINER_COMPANY */
-	dn_cache_t m_lpGroupCache; /* OBJECTCLASS_DISTLIST */
-	dn_cache_t m_lpUserCache; /* OBJECTCLASS_USER */
-	dn_cache_t m_lpAddressListCache; /* CONTAINER_ADDRESSLIST */
+	dn_index_ptr m_lpCompanyCache; /* CONTAINER_COMPANY */
+	dn_index_ptr m_lpGroupCache; /* OBJECTCLASS_DISTLIST */
+	dn_index_ptr m_lpUserCache; /* OBJECTCLASS_USER */
+	dn_index_ptr m_lpAddressListCache; /* CONTAINER_ADDRESSLIST */
+
+	dn_index_ptr *slot(objectclass_t);
 
 	public:
 	/* objectid => signatures */
@@ -86,54 +88,10 @@ public:
 	 *					lpPlugin->getAllObjects() will be called to fill the cache.
 	 * @param[in]	objclass
 	 *						The objectclass for which the cache is requested
-	 * @return The cache data
-	 */
-	dn_cache_t getObjectDNCache(LDAPUserPlugin *, objectclass_t);
-
-	/**
-	 * Helper function: Search the cache for the direct parent for a DN.
-	 * If the DN has multiple parents only the parent closest to the DN will be returned.
-	 *
-	 * @param[in]	lpCache
-	 *					The cache which should be checked.
-	 * @param[in]	dn
-	 *					The DN for which the parent should be found.
-	 * @return The cache entry of the parent. Contents will be empty if no parent was found.
-	 */
-	static objectid_t getParentForDN(const dn_cache_t &, const std::string &dn);
-
-	/**
-	 * Helper function: List all DNs which are hierarchially below the given DN.
-	 *
-	 * @param[in]	lpCache
-	 *					The cache which should be checked.
-	 * @param[in]	dn
-	 *					The DN for which the children should be found
-	 * @return The list of children for the DN
-	 */
-	static dn_list_t getChildrenForDN(const dn_cache_t &, const std::string &dn);
-
-	/**
-	 * Search the cache to obtain the DN for an object based on the object id.
-	 *
-	 * @param[in]	lpCache
-	 *					The cache which should be checked.
-	 * @param[in]	externid
-	 *					The objectid which should be found in the cache
-	 * @return the DN for the object id
-	 */
-	static std::string getDNForObject(const dn_cache_t &, const objectid_t &externid);
-
-	/**
-	 * Check if the given DN is present in the DN list
-	 *
-	 * @param[in]	lpList
-	 *					The list which should be checked
-	 * @param[in]	dn
-	 *					The DN which should be found in the list
-	 * @return TRUE if the DN is found in the list
+	 * @return The cache data (never nullptr). Later updates replace the
+	 *         cache rather than modify it.
 	 */
-	static bool isDNInList(const dn_list_t &, const std::string &dn);
+	dn_index_ptr getObjectDNCache(LDAPUserPlugin *, objectclass_t);
 
 	std::pair<bool, signatures_t> get_parents(userobject_relation_t, const objectid_t &);
 	void set_parents(userobject_relation_t, const objectid_t &, const signatures_t &, ECConfig * = nullptr);
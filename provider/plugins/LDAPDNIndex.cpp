@@ -0,0 +1,120 @@
+/*
+ * SPDX-License-Identifier: AGPL-3.0-only
+ * Copyright 2016+, Kopano and its licensors
+ */
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+#include <cctype>
+#include <kopano/platform.h>
+#include "LDAPDNIndex.h"
+
+using namespace KC;
+
+/**
+ * Split a DN into its RDNs, root first, lowercased and without the
+ * surrounding whitespace, so that equal DNs give equal lists.
+ */
+std::vector<std::string> dn_index::split(const std::string &dn)
+{
+	std::vector<std::string> rdns;
+	std::string cur;
+	auto flush = [&]() {
+		auto begin = cur.find_first_not_of(" \t");
+		auto end = cur.find_last_not_of(" \t");
+		if (begin != std::string::npos)
+			rdns.emplace_back(cur.substr(begin, end - begin + 1));
+		cur.clear();
+	};
+	for (size_t i = 0; i < dn.size(); ++i) {
+		if (dn[i] == '\\' && i + 1 < dn.size()) {
+			cur += dn[i];
+			cur += tolower(static_cast<unsigned char>(dn[++i]));
+		} else if (dn[i] == ',' || dn[i] == ';') {
+			flush();
+		} else {
+			cur += tolower(static_cast<unsigned char>(dn[i]));
+		}
+	}
+	flush();
+	std::reverse(rdns.begin(), rdns.end());
+	return rdns;
+}
+
+dn_index::dn_index(dn_cache_t &&objects) : m_objects(std::move(objects))
+{
+	for (const auto &o : m_objects) {
+		auto n = &m_root;
+		for (auto &rdn : split(o.second)) {
+			auto &kid = n->kids[std::move(rdn)];
+			if (kid == nullptr)
+				kid.reset(new node);
+			n = kid.get();
+		}
+		/* For duplicate DNs, the first object (in id order) wins */
+		if (n != &m_root && n->obj == nullptr)
+			n->obj = &o;
+	}
+}
+
+const dn_index::node *dn_index::find(const std::vector<std::string> &rdns) const
+{
+	auto n = &m_root;
+	for (const auto &rdn : rdns) {
+		auto i = n->kids.find(rdn);
+		if (i == n->kids.cend())
+			return nullptr;
+		n = i->second.get();
+	}
+	return n;
+}
+
+std::string dn_index::dn(const objectid_t &id) const
+{
+	auto i = m_objects.find(id);
+	return i == m_objects.cend() ? std::string() : i->second;
+}
+
+const dn_cache_t::value_type *dn_index::ancestor(const std::string &dn, bool self) const
+{
+	auto rdns = split(dn);
+	const dn_cache_t::value_type *found = nullptr;
+	auto n = &m_root;
+	for (size_t depth = 0; depth < rdns.size(); ++depth) {
+		if (depth + 1 == rdns.size() && !self)
+			break;
+		auto i = n->kids.find(rdns[depth]);
+		if (i == n->kids.cend())
+			break;
+		n = i->second.get();
+		if (n->obj != nullptr)
+			found = n->obj;
+	}
+	return found;
+}
+
+dn_list_t dn_index::descendants(const std::string &dn) const
+{
+	dn_list_t list;
+	auto top = find(split(dn));
+	if (top == nullptr)
+		return list;
+	std::vector<const node *> todo{top};
+	while (!todo.empty()) {
+		auto n = todo.back();
+		todo.pop_back();
+		for (const auto &k : n->kids) {
+			if (k.second->obj != nullptr)
+				list.emplace_back(k.second->obj->second);
+			todo.emplace_back(k.second.get());
+		}
+	}
+	return list;
+}
+
+bool dn_index::is_below(const std::string &dn, const std::string &base)
+{
+	auto a = split(dn), b = split(base);
+	return a.size() > b.size() && std::equal(b.cbegin(), b.cend(), a.cbegin());
+}
@@ -0,0 +1,55 @@
+/*
+ * SPDX-License-Identifier: AGPL-3.0-only
+ * Copyright 2016+, Kopano and its licensors
+ */
+#pragma once
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <kopano/pcuser.hpp>
+
+/* Cache type, std::string is LDAP DN string */
+typedef std::map<KC::objectid_t, std::string> dn_cache_t;
+typedef std::list<std::string> dn_list_t;
+
+/**
+ * The DNs of one object class, indexed by their RDNs from the root down
+ * (case-insensitive), so that the closest ancestor and all descendants of
+ * a DN are found in as many steps as the DN has components. Immutable once
+ * built, and therefore shared between readers without copying or locking.
+ */
+class dn_index final {
+	public:
+	dn_index() = default;
+	dn_index(dn_cache_t &&);
+	dn_index(const dn_index &) = delete;
+	bool empty() const { return m_objects.empty(); }
+	const dn_cache_t &objects() const { return m_objects; }
+	/* DN of the object, or empty */
+	std::string dn(const KC::objectid_t &) const;
+	/*
+	 * The object with the longest DN that @dn is below of (or equal to,
+	 * with @self), or nullptr.
+	 */
+	const dn_cache_t::value_type *ancestor(const std::string &dn, bool self = false) const;
+	/* DNs of all objects below @dn */
+	dn_list_t descendants(const std::string &dn) const;
+	/* Whether @dn is strictly below @base */
+	static bool is_below(const std::string &dn, const std::string &base);
+
+	private:
+	struct node {
+		std::map<std::string, std::unique_ptr<node>> kids;
+		const dn_cache_t::value_type *obj = nullptr;
+	};
+
+	static std::vector<std::string> split(const std::string &dn);
+	const node *find(const std::vector<std::string> &rdns) const;
+
+	dn_cache_t m_objects;
+	node m_root;
+};
+
+typedef std::shared_ptr<const dn_index> dn_index_ptr;
@@ -0,0 +1,256 @@
+/*
+ * SPDX-License-Identifier: AGPL-3.0-only
+ * Copyright 2016+, Kopano and its licensors
+ */
+#include <kopano/platform.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include "StatsClient.h"
+#include "LDAPPool.h"
+
+using namespace KC;
+
+static uint64_t since_us(std::chrono::steady_clock::time_point t)
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t).count();
+}
+
+LDAPPool::LDAPPool(std::shared_ptr<ECStatsCollector> sc, size_t max) :
+	m_stats(std::move(sc)), m_max(std::max(max, static_cast<size_t>(1)))
+{}
+
+LDAPPool::~LDAPPool()
+{
+	/* All leases have ended by now; plugin instances are gone */
+	for (auto &c : m_conns)
+		if (c.ld != nullptr)
+			ldap_unbind_ext(c.ld, nullptr, nullptr);
+}
+
+void LDAPPool::set_size(size_t max)
+{
+	std::lock_guard<std::mutex> lk(m_lock);
+	m_max = std::max(max, static_cast<size_t>(1));
+	/* Surplus connections are dropped as they come back */
+	while (m_conns.size() > m_max && !m_idle.empty()) {
+		auto c = m_idle.back();
+		m_idle.pop_back();
+		ldap_unbind_ext(c->ld, nullptr, nullptr);
+		m_conns.remove_if([=](const conn &e) { return &e == c; });
+	}
+	m_cond.notify_all();
+}
+
+LDAPPool::lease LDAPPool::acquire(const connect_fn &connect)
+{
+	std::unique_lock<std::mutex> lk(m_lock);
+	if (m_idle.empty() && m_conns.size() >= m_max) {
+		++m_waits;
+		m_cond.wait(lk, [&]() { return !m_idle.empty() || m_conns.size() < m_max; });
+	}
+	if (!m_idle.empty()) {
+		auto c = m_idle.back();
+		m_idle.pop_back();
+		++m_busy;
+		return lease(this, c, connect);
+	}
+
+	/* Take the lowest free id, so that the statistics stay put */
+	unsigned int id = 0;
+	for (bool taken = true; taken; ) {
+		taken = std::any_of(m_conns.cbegin(), m_conns.cend(),
+		        [&](const conn &e) { return e.id == id; });
+		if (taken)
+			++id;
+	}
+	m_conns.emplace_back();
+	auto c = &m_conns.back();
+	c->id = id;
+	c->broken = true;
+	++m_busy;
+	lk.unlock();
+	/* Connect without holding up the others; a failure frees the slot */
+	lease l(this, c, connect);
+	l.reconnect();
+	return l;
+}
+
+void LDAPPool::release(conn *c)
+{
+	if (c->broken && c->ld != nullptr) {
+		ldap_unbind_ext(c->ld, nullptr, nullptr);
+		c->ld = nullptr;
+	}
+	std::lock_guard<std::mutex> lk(m_lock);
+	--m_busy;
+	if (c->ld == nullptr || m_conns.size() > m_max) {
+		if (c->ld != nullptr)
+			ldap_unbind_ext(c->ld, nullptr, nullptr);
+		m_conns.remove_if([=](const conn &e) { return &e == c; });
+	} else {
+		publish(*c, true);
+		m_idle.push_back(c);
+	}
+	auto sc = m_stats.lock();
+	if (sc != nullptr) {
+		sc->setg("ldap_pool_conns", "LDAP connections open", m_conns.size());
+		sc->setg("ldap_pool_busy", "LDAP connections in use", m_busy);
+		sc->set("ldap_pool_waits", "Times a thread had to wait for an LDAP connection", m_waits);
+	}
+	m_cond.notify_one();
+}
+
+void LDAPPool::publish(const conn &c, bool all)
+{
+	auto sc = m_stats.lock();
+	if (sc == nullptr)
+		return;
+	auto pfx = "ldap_c" + std::to_string(c.id);
+	auto sfx = " on LDAP connection " + std::to_string(c.id);
+	sc->setg(pfx + "_inflight", "Searches outstanding" + sfx, c.inflight);
+	if (!all)
+		return;
+	sc->set(pfx + "_search", "Searches made" + sfx, c.searches);
+	sc->set(pfx + "_fail", "Failed searches" + sfx, c.failed);
+	sc->setg(pfx + "_avg", "Average duration (µs) of searches" + sfx,
+		c.searches > 0 ? c.time_us / c.searches : 0);
+	sc->setg(pfx + "_max", "Longest duration (µs) of a search" + sfx, c.max_us);
+}
+
+LDAPPool::lease::lease(lease &&o) :
+	m_pool(o.m_pool), m_conn(o.m_conn), m_connect(std::move(o.m_connect))
+{
+	o.m_pool = nullptr;
+	o.m_conn = nullptr;
+}
+
+LDAPPool::lease &LDAPPool::lease::operator=(lease &&o)
+{
+	if (this == &o)
+		return *this;
+	reset();
+	std::swap(m_pool, o.m_pool);
+	std::swap(m_conn, o.m_conn);
+	m_connect = std::move(o.m_connect);
+	return *this;
+}
+
+void LDAPPool::lease::reset()
+{
+	if (m_conn != nullptr)
+		m_pool->release(m_conn);
+	m_pool = nullptr;
+	m_conn = nullptr;
+}
+
+void LDAPPool::lease::done(uint64_t us, unsigned int n, bool ok)
+{
+	if (m_conn == nullptr || n == 0)
+		return;
+	m_conn->searches += n;
+	if (!ok)
+		++m_conn->failed;
+	m_conn->time_us += us;
+	m_conn->max_us = std::max(m_conn->max_us, us / n);
+}
+
+void LDAPPool::lease::mark_broken()
+{
+	if (m_conn != nullptr)
+		m_conn->broken = true;
+}
+
+void LDAPPool::lease::set_inflight(unsigned int n)
+{
+	if (m_conn == nullptr || m_conn->inflight == n)
+		return;
+	m_conn->inflight = n;
+	m_pool->publish(*m_conn, false);
+}
+
+void LDAPPool::lease::reconnect()
+{
+	if (m_conn->ld != nullptr)
+		ldap_unbind_ext(m_conn->ld, nullptr, nullptr);
+	m_conn->ld = nullptr;
+	m_conn->broken = true;
+	m_conn->ld = m_connect();
+	m_conn->broken = false;
+}
+
+int LDAPPool::pipeline::run(const std::vector<search> &srch,
+    std::vector<bool> &done, const result_fn &cb)
+{
+	auto ld = m_lease.get();
+	std::map<int, size_t> sent; /* msgid => index */
+	size_t next = 0, ndone = 0;
+	int rc = LDAP_SUCCESS;
+	auto tstart = std::chrono::steady_clock::now();
+	auto abandon = [&]() {
+		for (const auto &m : sent)
+			ldap_abandon_ext(ld, m.first, nullptr, nullptr);
+		sent.clear();
+		m_lease.set_inflight(0);
+	};
+
+	try {
+		while (rc == LDAP_SUCCESS) {
+			for (; next < srch.size() && sent.size() < m_depth; ++next) {
+				if (done[next])
+					continue;
+				const auto &s = srch[next];
+				int msgid = -1;
+				rc = ldap_search_ext(ld, s.base.c_str(), s.scope,
+				     s.filter.empty() ? nullptr : s.filter.c_str(),
+				     const_cast<char **>(s.attrs), 0, nullptr, nullptr,
+				     m_timeout, 0, &msgid);
+				if (rc != LDAP_SUCCESS)
+					break;
+				sent.emplace(msgid, next);
+			}
+			m_lease.set_inflight(sent.size());
+			if (rc != LDAP_SUCCESS || sent.empty())
+				break;
+
+			LDAPMessage *raw = nullptr;
+			auto type = ldap_result(ld, LDAP_RES_ANY, LDAP_MSG_ALL, m_timeout, &raw);
+			std::unique_ptr<LDAPMessage, int (*)(LDAPMessage *)> res(raw, ldap_msgfree);
+			if (type == 0) {
+				rc = LDAP_TIMEOUT;
+				break;
+			} else if (type < 0) {
+				ldap_get_option(ld, LDAP_OPT_RESULT_CODE, &rc);
+				if (rc == LDAP_SUCCESS)
+					rc = LDAP_SERVER_DOWN;
+				break;
+			}
+			auto i = sent.find(ldap_msgid(res.get()));
+			if (i == sent.cend())
+				continue;
+			auto idx = i->second;
+			sent.erase(i);
+			auto err = ldap_result2error(ld, res.get(), 0);
+			cb(idx, err, res.get());
+			done[idx] = true;
+			++ndone;
+		}
+	} catch (...) {
+		abandon();
+		m_lease.done(since_us(tstart), ndone + 1, false);
+		throw;
+	}
+	if (rc != LDAP_SUCCESS) {
+		abandon();
+		m_lease.mark_broken();
+		m_lease.done(since_us(tstart), ndone + 1, false);
+		return rc;
+	}
+	m_lease.done(since_us(tstart), ndone);
+	return LDAP_SUCCESS;
+}
@@ -0,0 +1,119 @@
+/*
+ * SPDX-License-Identifier: AGPL-3.0-only
+ * Copyright 2016+, Kopano and its licensors
+ */
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/time.h>
+#include <ldap.h>
+
+namespace KC { class ECStatsCollector; }
+
+/**
+ * Bound LDAP connections shared by all instances of the LDAP plugin (that
+ * is, by all server threads). A thread leases a connection for as long as
+ * it needs one, and hands it back afterwards. When all connections are
+ * leased, further threads wait for one to come back.
+ */
+class LDAPPool final {
+	public:
+	typedef std::function<LDAP *()> connect_fn;
+
+	/* Only touched by the holder of the lease, or under the pool lock */
+	struct conn {
+		LDAP *ld = nullptr;
+		unsigned int id = 0, inflight = 0;
+		uint64_t searches = 0, failed = 0, time_us = 0, max_us = 0;
+		bool broken = false;
+	};
+
+	/**
+	 * Exclusive use of one connection; it goes back to the pool when the
+	 * lease ends. A connection marked broken is unbound instead.
+	 */
+	class lease final {
+		public:
+		lease() = default;
+		lease(lease &&);
+		~lease() { reset(); }
+		lease &operator=(lease &&);
+		/* The connection, or nullptr when it was lost */
+		LDAP *get() const { return m_conn != nullptr && !m_conn->broken ? m_conn->ld : nullptr; }
+		explicit operator bool() const { return m_conn != nullptr; }
+		/* Account @n finished searches that took @us together */
+		void done(uint64_t us, unsigned int n = 1, bool ok = true);
+		void set_inflight(unsigned int);
+		/* Have the connection unbound rather than reused */
+		void mark_broken();
+		/* Replace the connection by a new one; throws like connect_fn */
+		void reconnect();
+		void reset();
+
+		private:
+		lease(LDAPPool *p, conn *c, const connect_fn &f) :
+			m_pool(p), m_conn(c), m_connect(f)
+		{}
+		LDAPPool *m_pool = nullptr;
+		conn *m_conn = nullptr;
+		connect_fn m_connect;
+		friend class LDAPPool;
+	};
+
+	/**
+	 * Searches sent in one go over a leased connection, whose results are
+	 * taken in whatever order the server answers them, with at most
+	 * @depth of them outstanding at any time.
+	 */
+	class pipeline final {
+		public:
+		struct search {
+			std::string base, filter;
+			int scope;
+			const char *const *attrs;
+		};
+		/* Gets the index of the search, its result code and its entries */
+		typedef std::function<void(size_t, int, LDAPMessage *)> result_fn;
+
+		pipeline(lease &l, unsigned int depth, struct timeval *timeout) :
+			m_lease(l), m_depth(depth > 0 ? depth : 1), m_timeout(timeout)
+		{}
+		/*
+		 * Runs all searches not yet marked in @done, and marks them once
+		 * @cb has seen their result. Returns an API error code if the
+		 * connection failed along the way; the lease is then broken,
+		 * and the caller may reconnect and run the rest.
+		 */
+		int run(const std::vector<search> &, std::vector<bool> &done, const result_fn &cb);
+
+		private:
+		lease &m_lease;
+		unsigned int m_depth;
+		struct timeval *m_timeout;
+	};
+
+	LDAPPool(std::shared_ptr<KC::ECStatsCollector>, size_t max);
+	~LDAPPool();
+	/* Waits for an idle connection, or makes one with @connect */
+	lease acquire(const connect_fn &connect);
+	void set_size(size_t);
+
+	private:
+	void release(conn *);
+	void publish(const conn &, bool all);
+
+	/* Not owned: the server tears it down before unloading the plugin */
+	std::weak_ptr<KC::ECStatsCollector> m_stats;
+	std::mutex m_lock;
+	std::condition_variable m_cond;
+	std::list<conn> m_conns;
+	std::vector<conn *> m_idle;
+	size_t m_max = 1, m_busy = 0;
+	uint64_t m_waits = 0;
+};
@@ -98,12 +98,11 @@ typedef std::unique_ptr<struct berval *[], ldap_deleter> auto_free_ldap_berval;
 	auto_free_ldap_control pageControl; \
 	auto_free_ldap_controls returnedControls; \
 	int rc; \
+	/* the server keeps the paging state per connection */ \
+	conn_hold hold(*this); \
 	\
 	ldap_page_size = (ldap_page_size == 0) ? 1000 : ldap_page_size; \
 	do { \
-		if (m_ldap == NULL) \
-			/* this either returns a connection or throws an exception */ \
-			m_ldap = ConnectLDAP(nullptr, nullptr); \
 		/* set critical to 'F' to not force paging? @todo find an ldap server without support. */ \
 		rc = ldap_create_page_control(m_ldap, ldap_page_size, &sCookie, 0, &~pageControl); \
 		if (rc != LDAP_SUCCESS) \
@@ -226,6 +225,8 @@ static std::string StringEscapeSequence(const std::string &);
 static std::string StringEscapeSequence(const char *, size_t);
 
 std::unique_ptr<LDAPCache> LDAPUserPlugin::m_lpCache{std::make_unique<LDAPCache>()};
+std::shared_ptr<LDAPPool> LDAPUserPlugin::m_lpPool;
+static std::mutex ldap_pool_lock;
 
 template<typename T> static constexpr inline LONGLONG dur2us(const T &t)
 {
@@ -443,6 +444,8 @@ LDAPUserPlugin::LDAPUserPlugin(std::mutex &pluginlock,
 		{ "ldap_page_size", "1000", CONFIGSETTING_RELOADABLE }, // MaxPageSize in ADS defaults to 1000
 		{"ldap_membership_cache_size", "256k", CONFIGSETTING_SIZE},
 		{"ldap_membership_cache_lifetime", "5", 0},
+		{"ldap_pool_size", "8", CONFIGSETTING_RELOADABLE},
+		{"ldap_pipeline_depth", "32", CONFIGSETTING_RELOADABLE},
 
 		/* Aliases, they should be loaded through the propmap directive */
 		{ "0x6788001E", "", 0, CONFIGGROUP_PROPMAP },								/* PR_EC_EXCHANGE_DN */
@@ -470,9 +473,19 @@ LDAPUserPlugin::LDAPUserPlugin(std::mutex &pluginlock,
 void LDAPUserPlugin::InitPlugin(std::shared_ptr<ECStatsCollector> sc)
 {
 	m_lpStatsCollector = std::move(sc);
+	auto rc = ldap_initialize(&m_ldap, ldap_servers.front().c_str());
+	if (rc != LDAP_SUCCESS)
+		throw ldap_error("ldap_initialize: "s + ldap_err2string(rc), rc);
+	auto pool_size = atoui(m_config->GetSetting("ldap_pool_size"));
+	std::unique_lock<std::mutex> lk(ldap_pool_lock);
+	if (m_lpPool == nullptr)
+		m_lpPool = std::make_shared<LDAPPool>(m_lpStatsCollector, pool_size);
+	else
+		m_lpPool->set_size(pool_size);
+	lk.unlock();
 
 	/* FIXME encode the user and password, now it depends on which charset the config is saved in */
-	m_ldap = ConnectLDAP(nullptr, nullptr);
+	conn_hold hold(*this); /* Fail early if LDAP cannot be reached */
 	const char *ldap_server_charset = m_config->GetSetting("ldap_server_charset");
 	try {
 		m_iconv.reset(new decltype(m_iconv)::element_type("UTF-8", ldap_server_charset));
@@ -596,11 +609,32 @@ LDAP *LDAPUserPlugin::ConnectLDAP(const char *bind_dn, const char *bind_pw)
 }
 
 LDAPUserPlugin::~LDAPUserPlugin() {
-	// Disconnect from the LDAP server
-	if (m_ldap == nullptr)
+	/* Pooled connections stay open for the other plugin instances */
+	if (m_ldap != nullptr)
+		ldap_unbind_ext(m_ldap, nullptr, nullptr);
+	if (m_ldap2 == nullptr)
 		return;
 	LOG_PLUGIN_DEBUG("%s", "Disconnecting from LDAP since unloading plugin instance");
-	ldap_unbind_ext(m_ldap, nullptr, nullptr);
+	ldap_unbind_ext(m_ldap2, nullptr, nullptr);
+}
+
+LDAPUserPlugin::conn_hold::conn_hold(LDAPUserPlugin &p) : m_plugin(p)
+{
+	if (m_plugin.m_lease_depth++ > 0)
+		return;
+	try {
+		/* this either returns a connection or throws an exception */
+		m_plugin.m_lease = m_lpPool->acquire([&p]() { return p.ConnectLDAP(nullptr, nullptr); });
+	} catch (...) {
+		--m_plugin.m_lease_depth;
+		throw;
+	}
+}
+
+LDAPUserPlugin::conn_hold::~conn_hold()
+{
+	if (--m_plugin.m_lease_depth == 0)
+		m_plugin.m_lease.reset();
 }
 
 void LDAPUserPlugin::my_ldap_search_s(const char *base, int scope,
@@ -623,45 +657,41 @@ void LDAPUserPlugin::my_ldap_search_s(const char *base, int scope,
 		filter = NULL;
 	}
 	/*
-	 * When an m_ldap connection object already exists, use it to make
-	 * a query, and, if that fails for any reason, reconnect-and-retry
-	 * exactly once.
-	 * When no m_ldap connection object existed, this boils down to
-	 * one standard connect plus query.
+	 * When the leased connection is usable, use it to make a query,
+	 * and, if that fails for any reason, reconnect-and-retry exactly
+	 * once.
+	 * When the connection was lost earlier, this boils down to one
+	 * standard connect plus query.
 	 */
-	if (m_ldap != NULL)
-		result = ldap_search_ext_s(m_ldap, base, scope, filter, const_cast<char **>(attrs),
+	conn_hold hold(*this);
+	if (m_lease.get() != nullptr)
+		result = ldap_search_ext_s(m_lease.get(), base, scope, filter, const_cast<char **>(attrs),
 		         attrsonly, serverControls, nullptr, &m_timeout, 0, &~res);
 
-	if (m_ldap == NULL || LDAP_API_ERROR(result)) {
-		if (m_ldap != NULL) {
+	if (m_lease.get() == nullptr || LDAP_API_ERROR(result)) {
+		if (m_lease.get() != nullptr)
 			ec_log_err("K-1582: LDAP search error: %s. Will reconnect and retry.", ldap_err2string(result));
-			ldap_unbind_ext(m_ldap, nullptr, nullptr);
-			m_ldap = NULL;
-		}
 		/// @todo encode the user and password, now it's depended in which charset the config is saved
-		m_ldap = ConnectLDAP(nullptr, nullptr);
+		m_lease.reconnect();
 		m_lpStatsCollector->inc(SCN_LDAP_RECONNECTS);
-		result = ldap_search_ext_s(m_ldap, base, scope, filter, const_cast<char **>(attrs),
+		result = ldap_search_ext_s(m_lease.get(), base, scope, filter, const_cast<char **>(attrs),
 		          attrsonly, serverControls, nullptr, nullptr, 0, &~res);
 	}
 
+	llelapsedtime = dur2us(decltype(tstart)::clock::now() - tstart);
+	m_lease.done(llelapsedtime, 1, result == LDAP_SUCCESS);
 	if(result != LDAP_SUCCESS) {
 		ec_log_err("LDAP query in \"%s\" failed: %s (result=0x%02x, %s)", base, filter, result, ldap_err2string(result));
 
 		if(LDAP_API_ERROR(result)) {
 		    // Some kind of API error occurred (error is not from the server). Unbind the connection so any next try will re-bind
 		    // which will possibly connect to a different (failed over) server.
-			if (m_ldap != NULL) {
-				ec_log_err("Unbinding from LDAP because of continued error (%s)", ldap_err2string(result));
-				ldap_unbind_ext(m_ldap, nullptr, nullptr);
-				m_ldap = NULL;
-			}
+			ec_log_err("Unbinding from LDAP because of continued error (%s)", ldap_err2string(result));
+			m_lease.mark_broken();
 		}
 		goto exit;
 	}
 
-	llelapsedtime = dur2us(decltype(tstart)::clock::now() - tstart);
 	LOG_PLUGIN_DEBUG("ldaptiming [%luµs] (\"%s\" \"%s\" %s), results: %d", llelapsedtime, base, filter, req.c_str(), ldap_count_entries(m_ldap, res));
 	*lppres = res.release(); // deref the pointer from object
 	m_lpStatsCollector->inc(SCN_LDAP_SEARCH);
@@ -855,18 +885,18 @@ signatures_t LDAPUserPlugin::getAllObjectsByFilter(const std::string &basedn,
 	objectid_t				objectid;
 	std::string signature;
 	std::map<objectclass_t, dn_cache_t> mapDNCache;
-	dn_list_t dnFilter;
+	dn_index_ptr companies;
 	auto_free_ldap_message res;
 
 	/*
 	 * When working in multi-company mode, we need to determine if the found object
 	 * is really a member of the requested company and not turned up in the
 	 * result because he is member of a subcompany.
-	 * Create a filter by requesting all subcompanies for he given company,
-	 * and remove any returned objects which are member of these subcompanies.
+	 * Any object whose closest company (itself included) lies below the
+	 * given company belongs to a subcompany, and is skipped.
 	 */
 	if (m_bHosted && !strCompanyDN.empty())
-		dnFilter = m_lpCache->getChildrenForDN(m_lpCache->getObjectDNCache(this, CONTAINER_COMPANY), strCompanyDN);
+		companies = m_lpCache->getObjectDNCache(this, CONTAINER_COMPANY);
 
 	auto request_attrs = std::make_unique<attrArray>(15);
 	/* Needed for GetObjectIdForEntry() */
@@ -888,9 +918,11 @@ signatures_t LDAPUserPlugin::getAllObjectsByFilter(const std::string &basedn,
 			auto dn = GetLDAPEntryDN(entry);
 
 			/* Make sure the DN isn't filtered because it is located in the subcontainer */
-			if (m_bHosted && !strCompanyDN.empty() &&
-			    m_lpCache->isDNInList(dnFilter, dn))
-				continue;
+			if (companies != nullptr) {
+				auto owner = companies->ancestor(dn, true);
+				if (owner != nullptr && dn_index::is_below(owner->second, strCompanyDN))
+					continue;
+			}
 
 			FOREACH_ATTR(entry) {
 				if (modify_attr && strcasecmp(att, modify_attr) == 0)
@@ -937,7 +969,7 @@ std::string LDAPUserPlugin::getSearchBase(const objectid_t &company)
 		return lpszSearchBase;
 
 	// find company DN, and use as search_base
-	auto search_base = m_lpCache->getDNForObject(m_lpCache->getObjectDNCache(this, company.objclass), company);
+	auto search_base = m_lpCache->getObjectDNCache(this, company.objclass)->dn(company);
 	// CHECK: should not be possible to not already know the company
 	if (!search_base.empty())
 		return search_base;
@@ -1201,7 +1233,7 @@ std::string LDAPUserPlugin::objectUniqueIDtoObjectDN(const objectid_t &uniqueid,
 	 * In the rare case that the cache didn't contain the entry, check LDAP.
 	 */
 	if (cache) {
-		dn = m_lpCache->getDNForObject(lpCache, uniqueid);
+		dn = lpCache->dn(uniqueid);
 		if (!dn.empty())
 			return dn;
 	}
@@ -1246,26 +1278,98 @@ objectsignature_t LDAPUserPlugin::objectDNtoObjectSignature(objectclass_t objcla
 	return signatures.front();
 }
 
+std::map<std::string, objectsignature_t>
+LDAPUserPlugin::objectDNsToObjectSignatures(objectclass_t objclass,
+    const std::vector<std::string> &dns)
+{
+	std::map<std::string, objectsignature_t> found;
+	if (dns.empty())
+		return found;
+
+	auto request_attrs = std::make_unique<attrArray>(15);
+	/* Needed for GetObjectIdForEntry() */
+	CONFIG_TO_ATTR(request_attrs, class_attr, "ldap_object_type_attribute");
+	CONFIG_TO_ATTR(request_attrs, nonactive_attr, "ldap_nonactive_attribute");
+	CONFIG_TO_ATTR(request_attrs, resource_attr, "ldap_resource_type_attribute");
+	CONFIG_TO_ATTR(request_attrs, security_attr, "ldap_group_security_attribute");
+	CONFIG_TO_ATTR(request_attrs, user_unique_attr, "ldap_user_unique_attribute");
+	CONFIG_TO_ATTR(request_attrs, group_unique_attr, "ldap_group_unique_attribute");
+	CONFIG_TO_ATTR(request_attrs, company_unique_attr, "ldap_company_unique_attribute");
+	CONFIG_TO_ATTR(request_attrs, addresslist_unique_attr, "ldap_addresslist_unique_attribute");
+	CONFIG_TO_ATTR(request_attrs, dynamicgroup_unique_attr, "ldap_dynamicgroup_unique_attribute");
+	/* Needed for the signature */
+	CONFIG_TO_ATTR(request_attrs, modify_attr, "ldap_last_modification_attribute");
+
+	auto ldap_filter = getSearchFilter(objclass);
+	std::vector<LDAPPool::pipeline::search> searches;
+	searches.reserve(dns.size());
+	for (const auto &dn : dns)
+		searches.push_back({dn, ldap_filter, LDAP_SCOPE_BASE, request_attrs->get()});
+
+	auto cb = [&](size_t idx, int rc, LDAPMessage *res) {
+		/* The DN does not exist (anymore): drop entry */
+		if (rc != LDAP_SUCCESS && LDAP_NAME_ERROR(rc))
+			return;
+		if (rc != LDAP_SUCCESS) {
+			ec_log_err("LDAP query in \"%s\" failed: %s (result=0x%02x, %s)",
+				dns[idx].c_str(), ldap_filter.c_str(), rc, ldap_err2string(rc));
+			m_lpStatsCollector->inc(SCN_LDAP_SEARCH_FAILED);
+			throw ldap_error("ldap_search_ext: "s + ldap_err2string(rc), rc);
+		}
+		/* Not of the requested class, or ambiguous: drop entry */
+		if (ldap_count_entries(m_ldap, res) != 1)
+			return;
+		auto entry = ldap_first_entry(m_ldap, res);
+		std::string signature;
+		FOREACH_ATTR(entry) {
+			if (modify_attr && strcasecmp(att, modify_attr) == 0)
+				signature = getLDAPAttributeValue(att, entry);
+		}
+		END_FOREACH_ATTR
+		try {
+			auto objectid = GetObjectIdForEntry(entry);
+			if (!objectid.id.empty())
+				found.emplace(dns[idx], objectsignature_t(std::move(objectid), std::move(signature)));
+		} catch (const std::exception &e) {
+			ec_log_warn("Unable to get object id: %s", e.what());
+		}
+	};
+
+	auto tstart = std::chrono::steady_clock::now();
+	conn_hold hold(*this);
+	std::vector<bool> done(searches.size());
+	LDAPPool::pipeline pipe(m_lease, atoui(m_config->GetSetting("ldap_pipeline_depth")), &m_timeout);
+	auto rc = m_lease.get() != nullptr ? pipe.run(searches, done, cb) : LDAP_SERVER_DOWN;
+	if (LDAP_API_ERROR(rc)) {
+		ec_log_err("K-1582: LDAP search error: %s. Will reconnect and retry.", ldap_err2string(rc));
+		m_lease.reconnect();
+		m_lpStatsCollector->inc(SCN_LDAP_RECONNECTS);
+		rc = pipe.run(searches, done, cb);
+	}
+	if (rc != LDAP_SUCCESS) {
+		m_lpStatsCollector->inc(SCN_LDAP_SEARCH_FAILED);
+		throw ldap_error("ldap_search_ext: "s + ldap_err2string(rc), rc);
+	}
+	auto llelapsedtime = dur2us(decltype(tstart)::clock::now() - tstart);
+	LOG_PLUGIN_DEBUG("ldaptiming [%luµs] (%zu DNs \"%s\"), results: %zu", llelapsedtime, dns.size(), ldap_filter.c_str(), found.size());
+	m_lpStatsCollector->inc(SCN_LDAP_SEARCH, static_cast<LONGLONG>(dns.size()));
+	m_lpStatsCollector->inc(SCN_LDAP_SEARCH_TIME, llelapsedtime);
+	m_lpStatsCollector->Max(SCN_LDAP_SEARCH_TIME_MAX, llelapsedtime);
+	return found;
+}
+
 signatures_t
 LDAPUserPlugin::objectDNtoObjectSignatures(objectclass_t objclass,
     const std::list<std::string> &dn)
 {
 	signatures_t signatures;
+	auto found = objectDNsToObjectSignatures(objclass, std::vector<std::string>(dn.cbegin(), dn.cend()));
 
 	for (const auto &i : dn) {
-		try {
-			signatures.emplace_back(objectDNtoObjectSignature(objclass, i));
-		} catch (const objectnotfound &e) {
-			// resolve failed, drop entry
-			continue;
-		} catch (const ldap_error &e) {
-			if(LDAP_NAME_ERROR(e.GetLDAPError()))
-				continue;
-			throw;
-		} catch (const std::exception &e) {
-			// query failed, drop entry
-			continue;
-		}
+		auto sig = found.find(i);
+		// resolve failed, drop entry
+		if (sig != found.cend())
+			signatures.emplace_back(sig->second);
 	}
 	return signatures;
 }
@@ -1473,6 +1577,7 @@ objectsignature_t LDAPUserPlugin::authenticateUserBind(const std::string &userna
 		throw login_error(format("K-1584: LDAP auth for user \"%s\": %s", username.c_str(), ldap_err2string(rc)));
 	ec_log_err("K-1585: LDAP auth error: %s. Will rebind & retry.", ldap_err2string(rc));
 	ldap_unbind_ext(m_ldap2, nullptr, nullptr);
+	m_ldap2 = nullptr;
 	try {
 		m_ldap2 = ConnectLDAP(nullptr, nullptr);
 	} catch (const std::exception &e) {
@@ -1629,7 +1734,7 @@ LDAPUserPlugin::getObjectDetails(const std::list<objectid_t> &objectids)
 		return mapdetails;
 
 	bool			bCutOff = false;
-	dn_cache_t lpCompanyCache;
+	dn_index_ptr lpCompanyCache;
 	std::string ldap_filter, strDN;
 	std::list<postaction> lPostActions;
 	std::set<objectid_t> setObjectIds;
@@ -2007,8 +2112,10 @@ LDAPUserPlugin::getObjectDetails(const std::list<objectid_t> &objectids)
 		}
 		END_FOREACH_ATTR
 
-		if (m_bHosted && sObjDetails.GetClass() != CONTAINER_COMPANY)
-			sObjDetails.SetPropObject(OB_PROP_O_COMPANYID, m_lpCache->getParentForDN(lpCompanyCache, strDN));
+		if (m_bHosted && sObjDetails.GetClass() != CONTAINER_COMPANY) {
+			auto company = lpCompanyCache->ancestor(strDN);
+			sObjDetails.SetPropObject(OB_PROP_O_COMPANYID, company != nullptr ? objectid_t(company->first) : objectid_t());
+		}
 		if (!objectid.id.empty())
 			mapdetails[objectid] = sObjDetails;
 	}
@@ -2016,6 +2123,33 @@ LDAPUserPlugin::getObjectDetails(const std::list<objectid_t> &objectids)
 	}
 	END_FOREACH_LDAP_PAGING
 
+	/*
+	 * Relations given by DN take one base search per DN. Send all of them
+	 * in one go, rather than waiting for each in turn below.
+	 */
+	auto by_dn = [](const postaction &p) {
+		return p.relAttrType != nullptr && strcasecmp(p.relAttrType, LDAP_DATA_TYPE_DN) == 0;
+	};
+	std::map<objectclass_t, std::set<std::string>> dn_lookups;
+	std::map<objectclass_t, std::map<std::string, objectsignature_t>> dn_found;
+	for (const auto &p : lPostActions) {
+		if (!by_dn(p))
+			continue;
+		auto &dns = dn_lookups[p.objclass];
+		if (p.ldap_attr.empty())
+			dns.insert(p.ldap_attrs.cbegin(), p.ldap_attrs.cend());
+		else
+			dns.insert(p.ldap_attr);
+	}
+	for (const auto &l : dn_lookups) {
+		try {
+			dn_found[l.first] = objectDNsToObjectSignatures(l.first, std::vector<std::string>(l.second.cbegin(), l.second.cend()));
+		} catch (const ldap_error &e) {
+			if (!LDAP_NAME_ERROR(e.GetLDAPError()))
+				throw;
+		}
+	}
+
 	// paged loop ended, so now we can process the postactions.
 	for (const auto &p : lPostActions) {
 		auto o = mapdetails.find(p.objectid);
@@ -2024,6 +2158,7 @@ LDAPUserPlugin::getObjectDetails(const std::list<objectid_t> &objectids)
 			ec_log_crit("No object xid:\"%s\" found for postaction", bin2txt(p.objectid.id).c_str());
 			continue;
 		}
+		const auto &known = dn_found[p.objclass];
 
 		if (p.ldap_attr.empty()) {
 			// list, so use AddPropObject()
@@ -2031,7 +2166,16 @@ LDAPUserPlugin::getObjectDetails(const std::list<objectid_t> &objectids)
 			    // Currently not supported for multivalued arrays. This would require multiple calls to objectUniqueIDtoAttributeData
 			    // which is inefficient, and it is currently unused.
 				assert(p.result_attr.empty());
-				auto lstSignatures = resolveObjectsFromAttributeType(p.objclass, p.ldap_attrs, p.relAttr, p.relAttrType);
+				signatures_t lstSignatures;
+				if (by_dn(p)) {
+					for (const auto &dn : p.ldap_attrs) {
+						auto sig = known.find(dn);
+						if (sig != known.cend())
+							lstSignatures.emplace_back(sig->second);
+					}
+				} else {
+					lstSignatures = resolveObjectsFromAttributeType(p.objclass, p.ldap_attrs, p.relAttr, p.relAttrType);
+				}
 				if (lstSignatures.size() != p.ldap_attrs.size()) {
 					// try to rat out the object causing the failed ldap query
 					ec_log_err("Not all objects in relation found for object \"%s\"", o->second.GetPropString(OB_PROP_S_LOGIN).c_str());
@@ -2048,7 +2192,15 @@ LDAPUserPlugin::getObjectDetails(const std::list<objectid_t> &objectids)
 		}
 		// string, so use SetPropObject
 		try {
-			auto signature = resolveObjectFromAttributeType(p.objclass, p.ldap_attr, p.relAttr, p.relAttrType);
+			objectsignature_t signature;
+			if (by_dn(p)) {
+				auto sig = known.find(p.ldap_attr);
+				if (sig == known.cend())
+					throw objectnotfound(p.ldap_attr + " not found in LDAP");
+				signature = sig->second;
+			} else {
+				signature = resolveObjectFromAttributeType(p.objclass, p.ldap_attr, p.relAttr, p.relAttrType);
+			}
 			if (!p.result_attr.empty()) {
 			    // String type
 			    try {
@@ -2373,9 +2525,11 @@ LDAPUserPlugin::getSubObjectsForObject(userobject_relation_t relation,
 	if (ldap_member_filter.empty())
 		return members;
 	if (m_bHosted) {
-		auto lpCompanyCache = m_lpCache->getObjectDNCache(this, CONTAINER_COMPANY);
-		companyid = m_lpCache->getParentForDN(lpCompanyCache, dn);
-		companyDN = m_lpCache->getDNForObject(lpCompanyCache, companyid);
+		auto company = m_lpCache->getObjectDNCache(this, CONTAINER_COMPANY)->ancestor(dn);
+		if (company != nullptr) {
+			companyid = company->first;
+			companyDN = company->second;
+		}
 	}
 
 	// Use the filter to get all members matching the specified search filter
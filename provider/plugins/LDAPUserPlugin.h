@@ -14,6 +14,7 @@
 #include <kopano/charset/convert.h>
 #include <ldap.h>
 #include "plugin.h"
+#include "LDAPPool.h"
 
 /**
  * @defgroup userplugin_ldap LDAP userplugin
@@ -319,10 +320,29 @@ public:
 protected:
 	/**
 	 * Pointer to the LDAP state struct.
-	 * One for general searches, one for authentication.
+	 * m_ldap is never connected; it is only used to take search results
+	 * apart, since searches go over the connection leased from m_lpPool.
+	 * m_ldap2 is the connection for authentication.
 	 */
 	LDAP *m_ldap = nullptr, *m_ldap2 = nullptr;
 
+	/**
+	 * Keeps the pooled connection of this thread for a run of searches,
+	 * such as all pages of one paged search. Nested holds share it.
+	 */
+	class conn_hold final {
+		public:
+		conn_hold(LDAPUserPlugin &);
+		~conn_hold();
+
+		private:
+		LDAPUserPlugin &m_plugin;
+	};
+
+	static std::shared_ptr<LDAPPool> m_lpPool;
+	LDAPPool::lease m_lease;
+	unsigned int m_lease_depth = 0;
+
 	/**
 	 * converter FROM ldap TO kopano-server and vice-versa
 	 */
@@ -443,6 +463,19 @@ private:
 	 */
 	objectsignature_t objectDNtoObjectSignature(objectclass_t objclass, const std::string &dn);
 
+	/**
+	 * Convert DNs to object signatures, with base searches that are all
+	 * sent at once (up to ldap_pipeline_depth) over one connection.
+	 *
+	 * @param[in]	objclass
+	 *					The objectclass to which this search should be restricted.
+	 * @param[in]	dns
+	 *					The DNs to convert
+	 * @return The object signature for each DN that was found
+	 * @throw ldap_error When the LDAP query failed
+	 */
+	std::map<std::string, objectsignature_t> objectDNsToObjectSignatures(objectclass_t, const std::vector<std::string> &dns);
+
 	/**
 	 * Convert a list of DNs to a list of object signatures
 	 *
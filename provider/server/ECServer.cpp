@@ -53,6 +53,7 @@
 #include <libintl.h>
 #include <unicode/uclean.h>
 #include <kopano/fileutil.hpp>
+#include <kopano/ustringutil.h>
 #include "ECICS.h"
 #include <openssl/ssl.h>
 #ifdef HAVE_KCOIDC_H
@@ -233,6 +234,18 @@ server_stats::server_stats(std::shared_ptr<ECConfig> cfg) :
 	AddStat(SCN_INDEXED_SEARCHES, SCT_INTEGER, "search_indexed", "Number of indexed searches performed");
 	AddStat(SCN_DATABASE_SEARCHES, SCT_INTEGER, "search_database", "Number of database searches performed");
 
+#ifdef HAVE_LIBS3_H
+	AddStat(SCN_S3_GET, SCT_INTEGER, "s3_get", "Number of attachments loaded from S3");
+	AddStat(SCN_S3_GET_TIME, SCT_INTEGER, "s3_get_time", "Total duration (µs) of S3 loads");
+	AddStat(SCN_S3_GET_TIME_MAX, SCT_INTGAUGE, "s3_max_get", "Longest duration (µs) of an S3 load");
+	AddStat(SCN_S3_PUT, SCT_INTEGER, "s3_put", "Number of attachments saved to S3");
+	AddStat(SCN_S3_PUT_TIME, SCT_INTEGER, "s3_put_time", "Total duration (µs) of S3 saves");
+	AddStat(SCN_S3_PUT_TIME_MAX, SCT_INTGAUGE, "s3_max_put", "Longest duration (µs) of an S3 save");
+	AddStat(SCN_S3_FAILED, SCT_INTEGER, "s3_fail", "Number of failed S3 loads and saves");
+	AddStat(SCN_S3_CACHE_HITS, SCT_INTEGER, "s3_cache_hit", "Number of S3 loads served from attachment_s3_cache_path");
+	AddStat(SCN_S3_CACHE_MISSES, SCT_INTEGER, "s3_cache_miss", "Number of S3 loads not found in attachment_s3_cache_path");
+#endif
+
 	AddStat(SCN_SERVER_USERDB_BACKEND, SCT_STRING, "userplugin", "User backend plugin");
 	AddStat(SCN_SERVER_ATTACH_BACKEND, SCT_STRING, "attachment_storage", "Attachment backend type");
 	set(SCN_SERVER_USERDB_BACKEND, cfg->GetSetting("user_plugin"));
@@ -290,6 +303,7 @@ void sv_sighup_sync()
 		ec_log_err("Failed to reload configuration file");
 
 	g_lpSessionManager->GetPluginFactory()->SignalPlugins(SIGHUP);
+	set_sortkey_cache_size(strtoull(g_lpConfig->GetSetting("cache_sortkey_size"), nullptr, 0));
 	auto ll = g_lpConfig->GetSetting("log_level");
 	auto new_ll = ll ? strtol(ll, NULL, 0) : EC_LOGLEVEL_WARNING;
 	ec_log_get()->SetLoglevel(new_ll);
@@ -1058,9 +1072,14 @@ static int running_server(char *szName, const char *szConfig, bool exp_config,
 		{"attachment_s3_secretaccesskey", ""},
 		{"attachment_s3_bucketname", ""},
 		{"attachment_s3_region", ""},
+		{"attachment_s3_part_size", "8M", CONFIGSETTING_SIZE},
+		{"attachment_s3_parallel", "4"},
+		{"attachment_s3_cache_path", ""},
+		{"attachment_s3_cache_size", "1G", CONFIGSETTING_SIZE},
 #endif
 		{"attachment_path", "/var/lib/kopano/attachments"},
 		{ "attachment_compression",		"6" },
+		{"attachment_chunk_size", "0", CONFIGSETTING_SIZE},
 
 		// Log options
 		{"log_method", "auto", CONFIGSETTING_NONEMPTY},
@@ -1106,6 +1125,9 @@ static int running_server(char *szName, const char *szConfig, bool exp_config,
 		{ "cache_store_size",			"1M", CONFIGSETTING_SIZE },		// 1Mb, store table cache (storeid, storeguid), 40 bytes
 		{ "cache_server_size",			"1M", CONFIGSETTING_SIZE },		// 1Mb
 		{ "cache_server_lifetime",		"30" },							// 30 minutes
+		{ "cache_shards",			"16" },							// lock shards for the caches
+		{ "cache_shared_reads",			"yes" },						// lookups take shared locks
+		{ "cache_sortkey_size",			"1M", CONFIGSETTING_SIZE | CONFIGSETTING_RELOADABLE },	// per thread
 		/* Default no quotas. Note: quota values are in Mb, and thus have no size flag. */
 		{ "quota_warn",				"0", CONFIGSETTING_RELOADABLE },
 		{ "quota_soft",				"0", CONFIGSETTING_RELOADABLE },
@@ -1124,13 +1146,18 @@ static int running_server(char *szName, const char *szConfig, bool exp_config,
 		{"abtable_initially_empty", "no", CONFIGSETTING_RELOADABLE},
         { "enable_enhanced_ics",    "yes", CONFIGSETTING_RELOADABLE },			// (dis)allow enhanced ICS operations (stream and notifications)
         { "enable_sql_procedures",  "no" },			// (dis)allow SQL procedures (requires mysql config stack adjustment), not reloadable because in the middle of the streaming flip
+		{"ics_export_threads", "4", CONFIGSETTING_RELOADABLE},
 
 		{ "search_enabled",			"yes", CONFIGSETTING_RELOADABLE },
 		{ "search_socket",			"file:///var/run/kopano/search.sock", CONFIGSETTING_RELOADABLE },
 		{ "search_timeout",			"10", CONFIGSETTING_RELOADABLE },
+		{"search_cache_ttl", "30", CONFIGSETTING_RELOADABLE},
 
 		{ "threads",				"8", CONFIGSETTING_RELOADABLE },
 		{"thread_limit", "40", CONFIGSETTING_RELOADABLE},
+		{ "thread_scheduler",		"fifo", CONFIGSETTING_RELOADABLE },
+		{ "dispatcher_shards",		"1" },
+		{ "notification_threads",	"4" },
 		{ "watchdog_max_age",		"500", CONFIGSETTING_RELOADABLE },
 		{ "watchdog_frequency",		"1", CONFIGSETTING_RELOADABLE },
 
@@ -1408,6 +1435,7 @@ static int running_server(char *szName, const char *szConfig, bool exp_config,
 	er = check_database_thread_stack(lpDatabase.get());
 	if (er != erSuccess)
 		return retval;
+	set_sortkey_cache_size(strtoull(g_lpConfig->GetSetting("cache_sortkey_size"), nullptr, 0));
 	//Init the main system, now you can use the values like session manager
 	// This also starts several threads, like SessionCleaner, NotificationThread and TPropsPurge.
 	er = kopano_init(g_lpConfig, g_lpAudit, stats, hosted, distributed);
@@ -10,12 +10,15 @@
 #include <memory>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <utility>
+#include <vector>
 #include "ECThreadManager.h"
 #include <cerrno>
 #include <cmath>
 #include <cstdlib>
 #include <cstring>
+#include <fcntl.h>
 #include <poll.h>
 #include <unistd.h>
 #include <libHX/defs.h>
@@ -264,6 +267,7 @@ done:
 	// undo our soap_new2() call so the soap object is still valid after these calls
 	soap_destroy(soap);
 	soap_end(soap);
+	kopano_end_soap_request(soap);
 	// We're done processing the item, the workitem's socket is returned to the queue
 	dispatcher->NotifyDone(soap);
 }
@@ -275,6 +279,8 @@ ECDispatcher::ECDispatcher(std::shared_ptr<ECConfig> lpConfig) :
 	m_nRecvTimeout = atoi(m_lpConfig->GetSetting("server_recv_timeout"));
 	m_nReadTimeout = atoi(m_lpConfig->GetSetting("server_read_timeout"));
 	m_nSendTimeout = atoi(m_lpConfig->GetSetting("server_send_timeout"));
+	m_pool.enable_work_stealing(strcmp(m_lpConfig->GetSetting("thread_scheduler"), "steal") == 0,
+		std::chrono::milliseconds(atoui(m_lpConfig->GetSetting("watchdog_max_age"))));
 }
 
 ECDispatcher::~ECDispatcher()
@@ -340,15 +346,10 @@ void ECDispatcher::NotifyDone(struct soap *soap)
 		return;
 	}
 
-	SOAP_SOCKET socket = soap->socket;
 	ACTIVESOCKET sActive;
 	sActive.soap = soap;
 	time(&sActive.ulLastActivity);
-	ulock_normal l_sock(m_mutexSockets);
-	m_setSockets.emplace(soap->socket, sActive);
-	l_sock.unlock();
-	// Notify select restart, send socket number which is done
-	NotifyRestart(socket);
+	ReturnSocket(sActive);
 }
 
 ECRESULT ECDispatcher::DoHUP()
@@ -358,6 +359,8 @@ ECRESULT ECDispatcher::DoHUP()
 	m_nSendTimeout = atoi(m_lpConfig->GetSetting("server_send_timeout"));
 	m_pool.set_thread_count(atoui(m_lpConfig->GetSetting("threads")),
 		atoui(m_lpConfig->GetSetting("thread_limit")));
+	m_pool.enable_work_stealing(strcmp(m_lpConfig->GetSetting("thread_scheduler"), "steal") == 0,
+		std::chrono::milliseconds(atoui(m_lpConfig->GetSetting("watchdog_max_age"))));
 
 	for (auto const &p : m_setListenSockets) {
 		auto ulType = SOAP_CONNECTION_TYPE(p.second);
@@ -603,6 +606,16 @@ void ECDispatcherSelect::NotifyRestart(SOAP_SOCKET s)
 	write(m_fdRescanWrite, &s, sizeof(SOAP_SOCKET));
 }
 
+void ECDispatcherSelect::ReturnSocket(const ACTIVESOCKET &sActive)
+{
+	SOAP_SOCKET socket = sActive.soap->socket;
+	ulock_normal l_sock(m_mutexSockets);
+	m_setSockets.emplace(socket, sActive);
+	l_sock.unlock();
+	// Notify select restart, send socket number which is done
+	NotifyRestart(socket);
+}
+
 #ifdef HAVE_EPOLL_CREATE
 ECDispatcherEPoll::ECDispatcherEPoll(std::shared_ptr<ECConfig> lpConfig) :
 	ECDispatcher(std::move(lpConfig))
@@ -610,51 +623,103 @@ ECDispatcherEPoll::ECDispatcherEPoll(std::shared_ptr<ECConfig> lpConfig) :
 	m_fdMax = getdtablesize();
 	if (m_fdMax < 0)
 		throw std::runtime_error("getrlimit failed");
-	m_epFD = epoll_create(m_fdMax);
-	if (m_epFD < 0)
-		throw std::runtime_error("epoll_create failed");
+	auto nshards = std::max(1U, atoui(m_lpConfig->GetSetting("dispatcher_shards")));
+	for (unsigned int i = 0; i < nshards; ++i) {
+		m_shards.emplace_back(new shard);
+		m_shards.back()->id = i;
+		m_shards.back()->epfd = epoll_create(m_fdMax);
+		if (m_shards.back()->epfd < 0)
+			throw std::runtime_error("epoll_create failed");
+	}
 }
 
 ECDispatcherEPoll::~ECDispatcherEPoll()
 {
-	if (m_epFD >= 0)
-		close(m_epFD);
+	for (const auto &sh : m_shards)
+		if (sh->epfd >= 0)
+			close(sh->epfd);
 }
 
 ECRESULT ECDispatcherEPoll::MainLoop()
 {
-	ECRESULT er = erSuccess;
-	time_t now = 0, last = 0;
-	CONNECTION_TYPE ulType;
 	epoll_event epevent;
-	auto epevents = make_unique_nt<epoll_event[]>(m_fdMax);
-	int n;
 
-	if (epevents == nullptr)
-		return MAPI_E_NOT_ENOUGH_MEMORY;
 	// setup epoll for listen sockets
 	memset(&epevent, 0, sizeof(epoll_event));
 	epevent.events = EPOLLIN | EPOLLPRI; // wait for input and priority (?) events
+#ifdef EPOLLEXCLUSIVE
+	/* Only wake one shard per incoming connection */
+	if (m_shards.size() > 1)
+		epevent.events |= EPOLLEXCLUSIVE;
+#endif
 	for (const auto &pair : m_setListenSockets) {
+		/*
+		 * With more than one shard, a woken shard can lose the race
+		 * for the connection; it must not block in accept then.
+		 */
+		if (m_shards.size() > 1)
+			fcntl(pair.second->socket, F_SETFL, fcntl(pair.second->socket, F_GETFL) | O_NONBLOCK);
 		epevent.data.fd = pair.second->socket;
-		if (epoll_ctl(m_epFD, EPOLL_CTL_ADD, pair.second->socket, &epevent) != 0)
-			ec_log_err("epoll_ctl ADD %d: %s", epevent.data.fd, strerror(errno));
+		for (const auto &sh : m_shards)
+			if (epoll_ctl(sh->epfd, EPOLL_CTL_ADD, pair.second->socket, &epevent) != 0)
+				ec_log_err("epoll_ctl ADD %d: %s", epevent.data.fd, strerror(errno));
 	}
 
 	// This will start the threads
 	m_pool.set_thread_count(atoui(m_lpConfig->GetSetting("threads")), atoui(m_lpConfig->GetSetting("thread_limit")));
 	m_pool.enable_watchdog(true, m_lpConfig);
 	m_prio.set_thread_count(1);
+	ec_log_info("Using %zu epoll dispatcher shard(s)", m_shards.size());
+
+	/* Shard 0 runs on the calling thread */
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < m_shards.size(); ++i)
+		threads.emplace_back([this, i]() {
+			set_thread_name(pthread_self(), "dispatch/" + std::to_string(i));
+			kcsrv_blocksigs();
+			ShardLoop(*m_shards[i]);
+		});
+	ShardLoop(*m_shards[0]);
+	for (auto &t : threads)
+		t.join();
+
+	m_pool.set_thread_count(0, 0, true);
+	m_prio.set_thread_count(0, 0, true);
+
+    // Close all sockets. This will cause all that we were listening on clients to get an EOF
+	for (const auto &sh : m_shards) {
+		ulock_normal l_sock(sh->mtx);
+		for (auto &pair : sh->sockets) {
+			kopano_end_soap_connection(pair.second.soap);
+			soap_free(pair.second.soap);
+		}
+		sh->sockets.clear();
+	}
+	return erSuccess;
+}
 
+void ECDispatcherEPoll::ShardLoop(shard &sh)
+{
+	time_t now = 0, last = 0;
+	CONNECTION_TYPE ulType;
+	auto epevents = make_unique_nt<epoll_event[]>(m_fdMax);
+	int n;
+
+	if (epevents == nullptr) {
+		ec_log_crit("K-1579: dispatcher shard: out of memory");
+		ShutDown();
+		return;
+	}
 	while (!m_bExit) {
-		if (sv_sighup_flag)
+		/* Only the main shard may run the reload; the others just keep going. */
+		if (&sh == m_shards[0].get() && sv_sighup_flag)
 			sv_sighup_sync();
 		time(&now);
 
 		// find timedout sockets once per second
-		ulock_normal l_sock(m_mutexSockets);
+		ulock_normal l_sock(sh.mtx);
 		if(now > last) {
-			for (const auto &pair : m_setSockets) {
+			for (const auto &pair : sh.sockets) {
 				ulType = SOAP_CONNECTION_TYPE(pair.second.soap);
 				if (ulType != CONNECTION_TYPE_NAMED_PIPE &&
 				    ulType != CONNECTION_TYPE_NAMED_PIPE_PRIORITY &&
@@ -663,40 +728,47 @@ ECRESULT ECDispatcherEPoll::MainLoop()
 					shutdown(pair.second.soap->socket, SHUT_RDWR);
             }
             last = now;
+			ShardStats(sh);
         }
 		l_sock.unlock();
 
-		n = epoll_wait(m_epFD, epevents.get(), m_fdMax, 1000); // timeout -1 is wait indefinitely
+		n = epoll_wait(sh.epfd, epevents.get(), m_fdMax, 1000); // timeout -1 is wait indefinitely
 		auto sockev_time = time_point::clock::now();
-		l_sock.lock();
 		for (int i = 0; i < n; ++i) {
 			auto iterListenSockets = m_setListenSockets.find(epevents[i].data.fd);
 
 			if (iterListenSockets == m_setListenSockets.end()) {
 				// this is a new request from an existing client
-				auto iterSockets = m_setSockets.find(epevents[i].data.fd);
-				if (iterSockets == m_setSockets.cend())
+				l_sock.lock();
+				auto iterSockets = sh.sockets.find(epevents[i].data.fd);
+				if (iterSockets == sh.sockets.cend()) {
+					l_sock.unlock();
 					continue;
-				// remove from epfd, either close socket, or it will be reactivated later in the epfd
-				epevent.data.fd = iterSockets->second.soap->socket;
-
+				}
 				if (epevents[i].events & EPOLLHUP) {
 					kopano_end_soap_connection(iterSockets->second.soap);
 					soap_free(iterSockets->second.soap);
-					m_setSockets.erase(iterSockets);
+					sh.sockets.erase(iterSockets);
+					l_sock.unlock();
 					continue;
 				}
 				QueueItem(iterSockets->second.soap, sockev_time);
+				++sh.requests;
 				// Remove socket from listen list for now, since we're already handling data there and don't
 				// want to interfere with the thread that is now handling that socket. It will be passed back
 				// to us when the request is done.
-				m_setSockets.erase(iterSockets);
+				sh.sockets.erase(iterSockets);
+				l_sock.unlock();
 				continue;
 			}
 
 			// this was a listen socket .. accept and continue
 			ACTIVESOCKET sActive;
 			auto newsoap = soap_copy(iterListenSockets->second.get());
+			if (newsoap == nullptr) {
+				ec_log_crit("Unable to accept new connection: out of memory");
+				continue;
+			}
 			kopano_new_soap_connection(SOAP_CONNECTION_TYPE(iterListenSockets->second), newsoap);
 			// Record last activity (now)
 			time(&sActive.ulLastActivity);
@@ -710,7 +782,9 @@ ECRESULT ECDispatcherEPoll::MainLoop()
 			}
 
 			if (newsoap->socket == SOAP_INVALID_SOCKET) {
-				if (ulType == CONNECTION_TYPE_NAMED_PIPE)
+				if (m_shards.size() > 1 && (newsoap->errnum == EAGAIN || newsoap->errnum == EWOULDBLOCK))
+					/* another shard took it */;
+				else if (ulType == CONNECTION_TYPE_NAMED_PIPE)
 					ec_log_debug("epaccept(%d) on file://%s: %s", newsoap->master, m_lpConfig->GetSetting("server_pipe_name"), *soap_faultstring(newsoap));
 				else if (ulType == CONNECTION_TYPE_NAMED_PIPE_PRIORITY)
 					ec_log_debug("epaccept(%d) on file://%s: %s", newsoap->master, m_lpConfig->GetSetting("server_pipe_priority"), *soap_faultstring(newsoap));
@@ -734,28 +808,30 @@ ECRESULT ECDispatcherEPoll::MainLoop()
 			g_lpSessionManager->m_stats->inc(SCN_SERVER_CONNECTIONS);
 			// directly make worker thread active
 			sActive.soap = newsoap;
-			m_setSockets.emplace(sActive.soap->socket, sActive);
+			auto &dst = owner(newsoap->socket);
+			ulock_normal l_dst(dst.mtx);
+			dst.sockets.emplace(sActive.soap->socket, sActive);
+			l_dst.unlock();
 			epoll_event eev{};
 			eev.events = EPOLLIN | EPOLLPRI | EPOLLONESHOT;
 			eev.data.fd = newsoap->socket;
-			if (epoll_ctl(m_epFD, EPOLL_CTL_ADD, newsoap->socket, &eev) != 0)
+			if (epoll_ctl(dst.epfd, EPOLL_CTL_ADD, newsoap->socket, &eev) != 0)
 				ec_log_err("epoll_ctl ADD %d: %s", newsoap->socket, strerror(errno));
 		}
-		l_sock.unlock();
 	}
+}
 
-	m_pool.set_thread_count(0, 0, true);
-	m_prio.set_thread_count(0, 0, true);
-
-    // Close all sockets. This will cause all that we were listening on clients to get an EOF
-	ulock_normal l_sock(m_mutexSockets);
-	for (auto &pair : m_setSockets) {
-		kopano_end_soap_connection(pair.second.soap);
-		soap_free(pair.second.soap);
-    }
-	m_setSockets.clear();
-	l_sock.unlock();
-	return er;
+/**
+ * Publish the load of one shard (called with its lock held). All shards
+ * feed the same worker pools, so the thread count and queue length stay
+ * in the server-wide stats.
+ */
+void ECDispatcherEPoll::ShardStats(const shard &sh)
+{
+	auto &st = *g_lpSessionManager->m_stats;
+	auto id = std::to_string(sh.id);
+	st.setg("dispatch_shard" + id + "_idle", "Idle connections watched by dispatcher shard " + id, sh.sockets.size());
+	st.set("dispatch_shard" + id + "_req", "Requests queued by dispatcher shard " + id, sh.requests);
 }
 
 void ECDispatcherEPoll::NotifyRestart(SOAP_SOCKET s)
@@ -765,7 +841,17 @@ void ECDispatcherEPoll::NotifyRestart(SOAP_SOCKET s)
 	memset(&epevent, 0, sizeof(epoll_event));
 	epevent.events = EPOLLIN | EPOLLPRI | EPOLLONESHOT;
 	epevent.data.fd = s;
-	if (epoll_ctl(m_epFD, EPOLL_CTL_MOD, s, &epevent) != 0)
+	if (epoll_ctl(owner(s).epfd, EPOLL_CTL_MOD, s, &epevent) != 0)
 		ec_log_err("epoll_ctl MOD %d: %s", s, strerror(errno));
 }
+
+void ECDispatcherEPoll::ReturnSocket(const ACTIVESOCKET &sActive)
+{
+	SOAP_SOCKET socket = sActive.soap->socket;
+	auto &sh = owner(socket);
+	ulock_normal l_sock(sh.mtx);
+	sh.sockets.emplace(socket, sActive);
+	l_sock.unlock();
+	NotifyRestart(socket);
+}
 #endif
@@ -10,6 +10,7 @@
 #include <map>
 #include <memory>
 #include <mutex>
+#include <vector>
 #include <pthread.h>
 #include <kopano/ECConfig.h>
 #include <kopano/kcodes.h>
@@ -74,19 +75,19 @@ public:
     // Inform that a soap request was processed and is finished. This will cause the dispatcher to start listening
     // on that socket for activity again
 	void NotifyDone(struct soap *);
-	virtual void NotifyRestart(SOAP_SOCKET) = 0;
 
     // Goes into main listen loop, accepting sockets and monitoring existing accepted sockets for activity. Also closes
     // sockets which are idle for more than ulSocketTimeout
     virtual ECRESULT MainLoop() = 0;
 
 protected:
+	// Hand a socket, whose request is done, back to the monitoring loop
+	virtual void ReturnSocket(const ACTIVESOCKET &) = 0;
+
 	std::shared_ptr<KC::ECConfig> m_lpConfig;
 	KC::ksrv_tpool m_pool{"net", 0}, m_prio{"prio", 0};
-	std::map<int, ACTIVESOCKET> m_setSockets;
 	std::map<int, std::unique_ptr<struct soap, KC::ec_soap_deleter>> m_setListenSockets;
-	std::mutex m_poolcount, m_mutexSockets;
-	bool m_bExit = false;
+	std::atomic<bool> m_bExit{false};
 	// Socket settings (TCP + SSL)
 	int m_nRecvTimeout, m_nReadTimeout, m_nSendTimeout;
 };
@@ -94,24 +95,54 @@ protected:
 class ECDispatcherSelect final : public ECDispatcher {
 private:
 	int m_fdRescanRead, m_fdRescanWrite;
+	std::map<int, ACTIVESOCKET> m_setSockets;
+	std::mutex m_mutexSockets;
 
 public:
 	ECDispatcherSelect(std::shared_ptr<KC::ECConfig>);
 	virtual ECRESULT MainLoop() override;
 	void ShutDown();
-	virtual void NotifyRestart(SOAP_SOCKET) override;
+	void NotifyRestart(SOAP_SOCKET);
+
+protected:
+	virtual void ReturnSocket(const ACTIVESOCKET &) override;
 };
 
 #ifdef HAVE_EPOLL_CREATE
+/*
+ * The epoll dispatcher runs "dispatcher_shards" event loops. Every loop
+ * has its own epoll instance and its own set of client connections, so
+ * loops never contend with each other. A connection is owned by the shard
+ * selected by its fd number. All shards wait on the listen sockets
+ * (EPOLLEXCLUSIVE, so an incoming connection only wakes one of them) and
+ * hand accepted connections to the owning shard.
+ */
 class ECDispatcherEPoll final : public ECDispatcher {
 private:
-	int m_fdMax, m_epFD;
+	struct shard {
+		unsigned int id = 0;
+		int epfd = -1;
+		std::mutex mtx;
+		std::map<int, ACTIVESOCKET> sockets;
+		/* Requests handed to the worker pool by this shard */
+		uint64_t requests = 0;
+	};
+
+	shard &owner(SOAP_SOCKET s) { return *m_shards[s % m_shards.size()]; }
+	void ShardLoop(shard &);
+	void ShardStats(const shard &);
+
+	int m_fdMax;
+	std::vector<std::unique_ptr<shard>> m_shards;
 
 public:
 	ECDispatcherEPoll(std::shared_ptr<KC::ECConfig>);
     virtual ~ECDispatcherEPoll();
 	virtual ECRESULT MainLoop() override;
-	virtual void NotifyRestart(SOAP_SOCKET) override;
+	void NotifyRestart(SOAP_SOCKET);
+
+protected:
+	virtual void ReturnSocket(const ACTIVESOCKET &) override;
 };
 #endif
 
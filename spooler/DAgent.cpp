@@ -39,9 +39,12 @@
 #include <chrono>
 #include <list>
 #include <memory>
+#include <mutex>
 #include <new>
 #include <set>
 #include <string>
+#include <system_error>
+#include <thread>
 #include <utility>
 #include <vector>
 #include <climits>
@@ -105,6 +108,7 @@
 #include <kopano/ECLogger.h>
 #include "rules.h"
 #include "archive.h"
+#include "snapshot.h"
 #include "helpers/MAPIPropHelper.h"
 #include <getopt.h>
 #include <inetmapi/options.h>
@@ -1715,44 +1719,149 @@ static HRESULT HrOverrideReceivedByProps(IMessage *lpMessage,
 	return hrSuccess;
 }
 
+/* Recipient dependent properties, which are not copied along */
+static constexpr SizedSPropTagArray(13, sptaReceivedBy) = {
+	13, {
+		/* Overridden by HrOverrideRecipProps() */
+		PR_MESSAGE_RECIP_ME,
+		PR_MESSAGE_TO_ME,
+		PR_MESSAGE_CC_ME,
+		/* HrOverrideReceivedByProps() */
+		PR_RECEIVED_BY_ADDRTYPE,
+		PR_RECEIVED_BY_EMAIL_ADDRESS,
+		PR_RECEIVED_BY_ENTRYID,
+		PR_RECEIVED_BY_NAME,
+		PR_RECEIVED_BY_SEARCH_KEY,
+		/* Written by rules */
+		PR_LAST_VERB_EXECUTED,
+		PR_LAST_VERB_EXECUTION_TIME,
+		PR_ICON_INDEX,
+	}
+};
+
+/**
+ * A message delivered to an earlier recipient, which further recipients
+ * get copies of. When it was saved on the storage server being delivered
+ * to, that server makes the copies by itself, and they share the
+ * attachment data. Otherwise, copies are made with IMessage::CopyTo, or,
+ * once the message is shared between threads, from a snapshot of its
+ * contents which is read when first needed.
+ */
+class delivery_source final {
+	public:
+	delivery_source(IMessage *, bool same_server);
+	/* Entryid of the message for the server to copy, or empty */
+	std::string entryid() const { return m_clone ? m_eid : std::string(); }
+	void no_clone() { m_clone = false; }
+	/* The message itself, for as long as one thread uses it */
+	IMessage *message() const { return m_shared ? nullptr : m_msg.get(); }
+	void share() { m_shared = true; }
+	HRESULT snapshot(const msg_snapshot **);
+
+	private:
+	object_ptr<IMessage> m_msg;
+	std::string m_eid;
+	std::atomic<bool> m_clone{false};
+	bool m_shared = false;
+	std::once_flag m_snap_once;
+	HRESULT m_snap_ret = hrSuccess;
+	msg_snapshot m_snap;
+};
+
+delivery_source::delivery_source(IMessage *msg, bool same_server) :
+	m_msg(msg)
+{
+	memory_ptr<SPropValue> eid;
+
+	if (!same_server || HrGetOneProp(msg, PR_ENTRYID, &~eid) != hrSuccess)
+		return;
+	m_eid.assign(reinterpret_cast<const char *>(eid->Value.bin.lpb), eid->Value.bin.cb);
+	m_clone = true;
+}
+
+HRESULT delivery_source::snapshot(const msg_snapshot **snap)
+{
+	std::call_once(m_snap_once, [this]() {
+		m_snap_ret = m_snap.load(m_msg, sptaReceivedBy);
+		if (m_snap_ret != hrSuccess)
+			kc_perror("Unable to read delivered message", m_snap_ret);
+	});
+	*snap = &m_snap;
+	return m_snap_ret;
+}
+
+/**
+ * Have the storage server copy the source message into a folder.
+ *
+ * @param[in] lpSource the message to copy
+ * @param[in] lpStore a store on the server of both the message and the folder
+ * @param[in] lpFolder the folder to copy to
+ * @param[out] lppMessage the copy; it is stored, but only announced to
+ *                        other clients by its SaveChanges
+ *
+ * @return MAPI Error code
+ */
+static HRESULT HrCloneMessage(delivery_source &lpSource, IMsgStore *lpStore,
+    IMAPIFolder *lpFolder, IMessage **lppMessage)
+{
+	object_ptr<IECServiceAdmin> lpServiceAdmin;
+	memory_ptr<SPropValue> lpFolderId;
+	memory_ptr<ENTRYID> lpNewId;
+	unsigned int cbNewId = 0, ulType = 0;
+	auto eid = lpSource.entryid();
+
+	if (eid.empty())
+		return MAPI_E_NO_SUPPORT;
+	auto hr = lpStore->QueryInterface(IID_IECServiceAdmin, &~lpServiceAdmin);
+	if (hr != hrSuccess)
+		return hr;
+	hr = HrGetOneProp(lpFolder, PR_ENTRYID, &~lpFolderId);
+	if (hr != hrSuccess)
+		return hr;
+	hr = lpServiceAdmin->CloneMessage(eid.size(), reinterpret_cast<const ENTRYID *>(eid.data()),
+	     lpFolderId->Value.bin.cb, reinterpret_cast<const ENTRYID *>(lpFolderId->Value.bin.lpb),
+	     0, &cbNewId, &~lpNewId);
+	if (hr == MAPI_E_NO_SUPPORT || hr == MAPI_E_NETWORK_ERROR || hr == MAPI_E_NOT_FOUND) {
+		/* An older server, or the message was never saved (moved by a rule, say) */
+		hr_ldebug(hr, "Server-side copies not possible, copying through dagent");
+		lpSource.no_clone();
+	}
+	if (hr != hrSuccess)
+		return hr;
+	hr = lpFolder->OpenEntry(cbNewId, lpNewId, &IID_IMessage, MAPI_MODIFY,
+	     &ulType, reinterpret_cast<IUnknown **>(lppMessage));
+	if (hr != hrSuccess) {
+		SBinary bin = {cbNewId, reinterpret_cast<BYTE *>(lpNewId.get())};
+		ENTRYLIST lst = {1, &bin};
+		lpFolder->DeleteMessages(&lst, 0, nullptr, DELETE_HARD_DELETE);
+	}
+	return hr;
+}
+
 /**
  * Copy a delivered message to another recipient
  *
- * @param[in] lpOrigMessage The original delivered message
+ * @param[in] lpSource The original delivered message
+ * @param[in] lpStore Store on the server delivered to
  * @param[in] lpDeliverFolder The delivery folder of the new message
  * @param[in] lpRecip recipient data to use
  * @param[in] lpFallbackFolder Fallback folder in case lpDeliverFolder cannot be delivered to
- * @param[in] bFallbackDelivery lpOrigMessage is a fallback delivery message
+ * @param[in] bFallbackDelivery lpSource is a fallback delivery message
  * @param[out] lppFolder folder the new message was created in
  * @param[out] lppMessage the newly copied message
+ * @param[out] lpbCloned the new message was copied by the server, and so already exists
  *
  * @return MAPI Error code
  */
-static HRESULT HrCopyMessageForDelivery(IMessage *lpOrigMessage,
-    IMAPIFolder *lpDeliverFolder, ECRecipient *lpRecip,
+static HRESULT HrCopyMessageForDelivery(delivery_source &lpSource,
+    IMsgStore *lpStore, IMAPIFolder *lpDeliverFolder, ECRecipient *lpRecip,
     IMAPIFolder *lpFallbackFolder, bool bFallbackDelivery,
-    IMAPIFolder **lppFolder = NULL, IMessage **lppMessage = NULL)
+    IMAPIFolder **lppFolder, IMessage **lppMessage, bool *lpbCloned)
 {
 	object_ptr<IMessage> lpMessage;
 	object_ptr<IMAPIFolder> lpFolder;
-	static constexpr SizedSPropTagArray(13, sptaReceivedBy) = {
-		13, {
-			/* Overridden by HrOverrideRecipProps() */
-			PR_MESSAGE_RECIP_ME,
-			PR_MESSAGE_TO_ME,
-			PR_MESSAGE_CC_ME,
-			/* HrOverrideReceivedByProps() */
-			PR_RECEIVED_BY_ADDRTYPE,
-			PR_RECEIVED_BY_EMAIL_ADDRESS,
-			PR_RECEIVED_BY_ENTRYID,
-			PR_RECEIVED_BY_NAME,
-			PR_RECEIVED_BY_SEARCH_KEY,
-			/* Written by rules */
-			PR_LAST_VERB_EXECUTED,
-			PR_LAST_VERB_EXECUTION_TIME,
-			PR_ICON_INDEX,
-		}
-	};
+	const msg_snapshot *lpSnapshot = nullptr;
+	auto lpOrigMessage = lpSource.message();
 	static constexpr SizedSPropTagArray(12, sptaFallback) = {
 		12, {
 			/* Overridden by HrOverrideFallbackProps() */
@@ -1771,15 +1880,28 @@ static HRESULT HrCopyMessageForDelivery(IMessage *lpOrigMessage,
 		}
 	};
 
-	auto hr = HrCreateMessage(lpDeliverFolder, lpFallbackFolder, &~lpFolder, &~lpMessage);
-	if (hr != hrSuccess)
-		return kc_perrorf("HrCreateMessage failed", hr);
-
-	/* Copy message, exclude all previously set properties (Those are recipient dependent) */
-	hr = lpOrigMessage->CopyTo(0, NULL, sptaReceivedBy, 0, NULL,
-	     &IID_IMessage, lpMessage, 0, NULL);
-	if (hr != hrSuccess)
-		return kc_perrorf("CopyTo failed", hr);
+	*lpbCloned = false;
+	auto hr = HrCloneMessage(lpSource, lpStore, lpDeliverFolder, &~lpMessage);
+	if (hr == hrSuccess) {
+		*lpbCloned = true;
+		lpFolder.reset(lpDeliverFolder);
+		/* The server copied everything, including what depends on the recipient */
+		hr = lpMessage->DeleteProps(sptaReceivedBy, nullptr);
+		if (hr != hrSuccess)
+			return kc_perrorf("DeleteProps failed", hr);
+	} else {
+		hr = HrCreateMessage(lpDeliverFolder, lpFallbackFolder, &~lpFolder, &~lpMessage);
+		if (hr != hrSuccess)
+			return kc_perrorf("HrCreateMessage failed", hr);
+		/* Copy message, exclude all previously set properties (Those are recipient dependent) */
+		if (lpOrigMessage != nullptr)
+			hr = lpOrigMessage->CopyTo(0, NULL, sptaReceivedBy, 0, NULL,
+			     &IID_IMessage, lpMessage, 0, NULL);
+		else if ((hr = lpSource.snapshot(&lpSnapshot)) == hrSuccess)
+			hr = lpSnapshot->write(lpMessage);
+		if (hr != hrSuccess)
+			return kc_perrorf("CopyTo failed", hr);
+	}
 	// For a fallback, remove some more properties
 	if (bFallbackDelivery)
 		lpMessage->DeleteProps(sptaFallback, 0);
@@ -1792,10 +1914,14 @@ static HRESULT HrCopyMessageForDelivery(IMessage *lpOrigMessage,
 	hr = ptrArchiveHelper->DetachFromArchives();
 	if (hr != hrSuccess)
 		return kc_perrorf("DetachFromArchives failed", hr);
-	if (lpRecip->bHasIMAP)
-		hr = Util::HrCopyIMAPData(lpOrigMessage, lpMessage);
-	else
+	if (!lpRecip->bHasIMAP)
 		hr = Util::HrDeleteIMAPData(lpMessage); // make sure the imap data is not set for this user.
+	else if (*lpbCloned)
+		; /* already copied along */
+	else if (lpSnapshot != nullptr)
+		hr = lpSnapshot->write_imap(lpMessage);
+	else
+		hr = Util::HrCopyIMAPData(lpOrigMessage, lpMessage);
 	if (hr != hrSuccess)
 		return kc_perrorf("IMAP handling failed", hr);
 	if (lppFolder)
@@ -1990,7 +2116,7 @@ static HRESULT FindSpamMarker(const std::string &strMail,
  * @param[in] lpStore default store for lpSession (user store when not in LMTP mode, else admin store)
  * @param[in] bIsAdmin indicates that lpSession and lpStore are an admin session and store (true in LMTP mode)
  * @param[in] lpAdrBook Global Addressbook
- * @param[in] lpOrigMessage a previously delivered message, if any
+ * @param[in] lpSource a previously delivered message, if any
  * @param[in] bFallbackDelivery previously delivered message was a fallback message
  * @param[in] strMail original received rfc2822 email
  * @param[in] lpRecip recipient to deliver message to
@@ -2002,7 +2128,7 @@ static HRESULT FindSpamMarker(const std::string &strMail,
  */
 static HRESULT ProcessDeliveryToRecipient(pym_plugin_intf *lppyMapiPlugin,
     IMAPISession *lpSession, IMsgStore *lpStore, bool bIsAdmin,
-    LPADRBOOK lpAdrBook, IMessage *lpOrigMessage, bool bFallbackDelivery,
+    LPADRBOOK lpAdrBook, delivery_source *lpSource, bool bFallbackDelivery,
     const std::string &strMail, ECRecipient *lpRecip, DeliveryArgs *lpArgs,
     IMessage **lppMessage, bool *lpbFallbackDelivery)
 {
@@ -2013,8 +2139,13 @@ static HRESULT ProcessDeliveryToRecipient(pym_plugin_intf *lppyMapiPlugin,
 	ULONG ulResult = 0;
 	object_ptr<IECServiceAdmin> lpServiceAdmin;
 	memory_ptr<ECQUOTASTATUS> lpsQuotaStatus;
-	bool over_quota = false;
+	bool over_quota = false, bCloned = false, bSaved = false;
 	auto dblStart = std::chrono::steady_clock::now();
+	/* A server-side copy exists already; remove it unless it was kept */
+	auto cleanup = make_scope_success([&]() {
+		if (bCloned && !bSaved)
+			Util::HrDeleteMessage(lpSession, lpDeliveryMessage);
+	});
 
 	// single user deliver did not lookup the user
 	if (lpRecip->strSMTP.empty()) {
@@ -2031,7 +2162,7 @@ static HRESULT ProcessDeliveryToRecipient(pym_plugin_intf *lppyMapiPlugin,
 	if (hr != hrSuccess)
 		return kc_perrorf("HrGetDeliveryStoreAndFolder failed", hr);
 
-	if (!lpOrigMessage) {
+	if (lpSource == nullptr) {
 		/* No message was provided, we have to construct it personally */
 		bool bExpired = false;
 
@@ -2058,7 +2189,7 @@ static HRESULT ProcessDeliveryToRecipient(pym_plugin_intf *lppyMapiPlugin,
 		// TODO do something with ulResult
 	} else {
 		/* Copy message to prepare for new delivery */
-		hr = HrCopyMessageForDelivery(lpOrigMessage, lpTargetFolder, lpRecip, lpInbox, bFallbackDelivery, &~lpFolder, &~lpDeliveryMessage);
+		hr = HrCopyMessageForDelivery(*lpSource, lpTargetStore, lpTargetFolder, lpRecip, lpInbox, bFallbackDelivery, &~lpFolder, &~lpDeliveryMessage, &bCloned);
 		if (hr != hrSuccess)
 			return kc_perrorf("HrCopyMessageForDelivery failed", hr);
 	}
@@ -2112,7 +2243,7 @@ static HRESULT ProcessDeliveryToRecipient(pym_plugin_intf *lppyMapiPlugin,
 			// ignore other errors for rules, still want to save the delivered message
 			// Save message changes, message becomes visible for the user
 			hr = lpDeliveryMessage->SaveChanges(KEEP_OPEN_READWRITE);
-
+		bSaved = hr == hrSuccess;
 		if (hr != hrSuccess) {
 			if (hr == MAPI_E_STORE_FULL)
 				// make sure the error is printed on stderr, so this will be bounced as error by the MTA.
@@ -2199,6 +2330,131 @@ static void RespondMessageExpired(recipients_t::const_iterator iter,
 		(*iter)->wstrDeliveryStatus = "250 2.4.7 %s Delivery time expired";
 }
 
+/**
+ * Log the outcome of a delivery to a recipient, and set the LMTP
+ * response for it. An expired message (MAPI_W_CANCEL_MESSAGE) is up to
+ * the caller.
+ *
+ * @param[in] hr result of ProcessDeliveryToRecipient
+ * @param[in] lpRecip the recipient delivered to
+ * @param[in] lpMessage the delivered message, if any
+ * @param[in] size size of the rfc2822 received email
+ */
+static void ReportDeliveryStatus(HRESULT hr, ECRecipient *lpRecip,
+    IMessage *lpMessage, size_t size)
+{
+	if (hr == hrSuccess && lpMessage != nullptr) {
+		memory_ptr<SPropValue> lpMessageId, lpSubject;
+		std::wstring wMessageId;
+
+		if (HrGetOneProp(lpMessage, PR_INTERNET_MESSAGE_ID_W, &~lpMessageId) == hrSuccess)
+			wMessageId = lpMessageId->Value.lpszW;
+		HrGetFullProp(lpMessage, PR_SUBJECT_W, &~lpSubject);
+		ec_log_info("Delivered message to \"%ls\", Subject: \"%ls\", Message-Id: %ls, size %zu",
+			lpRecip->wstrUsername.c_str(),
+			(lpSubject != NULL) ? lpSubject->Value.lpszW : L"<none>",
+			wMessageId.c_str(), size);
+	}
+	if (hr == hrSuccess || hr == MAPI_E_CANCEL) {
+		// cancel already logged.
+		lpRecip->wstrDeliveryStatus = "250 2.1.5 %s Ok";
+		return;
+	}
+	hr_lerr(hr, "Unable to deliver message to \"%ls\"", lpRecip->wstrUsername.c_str());
+	/* LMTP requires different notification when Quota for user was exceeded */
+	if (hr == MAPI_E_STORE_FULL)
+		lpRecip->wstrDeliveryStatus = "552 5.2.2 %s Quota exceeded";
+	else
+		lpRecip->wstrDeliveryStatus = "450 4.2.0 %s Mailbox temporarily unavailable";
+}
+
+/**
+ * Deliver copies of an already delivered message to a list of
+ * recipients on one storage server, from several threads. Each thread
+ * opens its own admin session and store; all of them copy from the same
+ * source, so attachments stay single instanced.
+ *
+ * @param[in] src the already delivered message
+ * @param[in] bFallbackDelivery already delivered message is a fallback message
+ * @param[in] strMail the rfc2822 received email
+ * @param[in] strServer uri of the storage server to connect to
+ * @param[in] iter first recipient to deliver to
+ * @param[in] end end of the recipient list
+ * @param[in] lpAdrBook Global addressbook
+ * @param[in] lpArgs delivery options
+ * @param[in] nthreads maximum number of threads to use
+ *
+ * @return hrSuccess, or the error of a failed delivery
+ */
+static HRESULT ProcessDeliveryParallel(pym_plugin_intf *lppyMapiPlugin,
+    delivery_source &src, bool bFallbackDelivery,
+    const std::string &strMail, const std::string &strServer,
+    recipients_t::const_iterator iter, recipients_t::const_iterator end,
+    LPADRBOOK lpAdrBook, DeliveryArgs *lpArgs, unsigned int nthreads)
+{
+	const std::vector<ECRecipient *> recips(iter, end);
+	std::atomic<size_t> next{0};
+	std::atomic<HRESULT> ret{hrSuccess}, open_ret{hrSuccess};
+	std::atomic<bool> got_error{false};
+
+	auto worker = [&]() {
+		object_ptr<IMAPISession> lpSession;
+		object_ptr<IMsgStore> lpStore;
+		DeliveryArgs args(*lpArgs);
+		args.sc = lpArgs->sc;
+
+		auto hr = HrOpenECAdminSession(&~lpSession, PROJECT_VERSION,
+		          "dagent/delivery:system", strServer.c_str(),
+		          EC_PROFILE_FLAGS_NO_NOTIFICATIONS,
+		          g_lpConfig->GetSetting("sslkey_file", "", NULL),
+		          g_lpConfig->GetSetting("sslkey_pass", "", NULL));
+		if (hr == hrSuccess)
+			hr = HrOpenDefaultStore(lpSession, &~lpStore);
+		if (hr != hrSuccess) {
+			/* Leave this thread's share to the others */
+			kc_perror("Unable to open default store for system account", hr);
+			open_ret = hr;
+			return;
+		}
+		for (size_t i; (i = next++) < recips.size(); ) {
+			object_ptr<IMessage> lpMessage;
+			hr = ProcessDeliveryToRecipient(lppyMapiPlugin, lpSession,
+			     lpStore, true, lpAdrBook, &src, bFallbackDelivery, strMail, recips[i], &args,
+			     &~lpMessage, nullptr);
+			ReportDeliveryStatus(hr, recips[i], lpMessage, strMail.size());
+			if (hr != hrSuccess && hr != MAPI_E_CANCEL)
+				ret = hr;
+		}
+		if (args.got_error)
+			got_error = true;
+	};
+
+	std::vector<std::thread> threads;
+	nthreads = std::min(static_cast<size_t>(nthreads), recips.size());
+	for (unsigned int i = 1; i < nthreads; ++i) {
+		try {
+			threads.emplace_back(worker);
+		} catch (const std::system_error &e) {
+			ec_log_warn("Delivering with %u threads only: %s", i, e.what());
+			break;
+		}
+	}
+	worker();
+	for (auto &t : threads)
+		t.join();
+	lpArgs->sc->inc(SCN_DAGENT_FANOUT, static_cast<LONGLONG>(recips.size()));
+	if (got_error)
+		lpArgs->got_error = true;
+
+	/* No thread got to these, for none could reach the server */
+	for (auto i = next.load(); i < recips.size(); ++i)
+		// notify LMTP client soft error to try again later
+		recips[i]->wstrDeliveryStatus = "450 4.5.0 %s network or permissions error to storage server: " + stringify_hex(open_ret);
+	if (next.load() < recips.size())
+		return open_ret;
+	return ret;
+}
+
 /**
  * For a specific storage server, deliver the same message to a list of
  * recipients. This makes sure this message is correctly single
@@ -2207,6 +2463,12 @@ static void RespondMessageExpired(recipients_t::const_iterator iter,
  * In this function, it is mandatory to have processed all recipients
  * in the list.
  *
+ * Once the message has been delivered (or converted) for the first
+ * recipient, the remaining ones are processed in parallel, unless the
+ * Python plugin is in use or this is a commandline delivery.
+ * Under the same conditions, the server itself makes the copies of a
+ * message that was first delivered on it.
+ *
  * @param[in] lpUserSession optional session of one user the message is being delivered to (cmdline dagent, NULL on LMTP mode)
  * @param[in] lpMessage an already delivered message
  * @param[in] bFallbackDelivery already delivered message is a fallback message
@@ -2230,13 +2492,23 @@ static HRESULT ProcessDeliveryToServer(pym_plugin_intf *lppyMapiPlugin,
 	object_ptr<IMAPISession> lpSession;
 	object_ptr<IMsgStore> lpStore;
 	object_ptr<IMessage> lpOrigMessage;
+	std::unique_ptr<delivery_source> source;
 	bool bFallbackDeliveryTmp = false;
 	convert_context converter;
+	unsigned int nthreads = atoui(g_lpConfig->GetSetting("lmtp_delivery_threads"));
+	/* Python is not to be entered from several threads */
+	bool serial = lpUserSession != nullptr || nthreads < 2 ||
+	              lppyMapiPlugin->has_hooks();
 
 	lpArgs->sc->inc(SCN_DAGENT_TO_SERVER);
 	// if we already had a message, we can create a copy.
-	if (lpMessage)
+	if (lpMessage) {
 		lpMessage->QueryInterface(IID_IMessage, &~lpOrigMessage);
+		/* Saved on another server, which we cannot have clone it */
+		source.reset(new(std::nothrow) delivery_source(lpOrigMessage, false));
+		if (source == nullptr)
+			return MAPI_E_NOT_ENOUGH_MEMORY;
+	}
 
 	if (lpUserSession)
 		hr = lpUserSession->QueryInterface(IID_IMAPISession, &~lpSession);
@@ -2257,6 +2529,16 @@ static HRESULT ProcessDeliveryToServer(pym_plugin_intf *lppyMapiPlugin,
 	for (auto iter = listRecipients.cbegin(); iter != listRecipients.end(); ++iter) {
 		const auto &recip = *iter;
 		object_ptr<IMessage> lpMessageTmp;
+
+		if (!serial && source != nullptr &&
+		    std::distance(iter, listRecipients.cend()) > 1) {
+			/* The message was converted once; the rest are copies */
+			source->share();
+			hr = ProcessDeliveryParallel(lppyMapiPlugin, *source,
+			     bFallbackDelivery, strMail, strServer, iter,
+			     listRecipients.cend(), lpAdrBook, lpArgs, nthreads);
+			break;
+		}
 		/*
 		 * Normal error codes must be ignored, since we want to attempt to deliver the email to all users,
 		 * however when the error code MAPI_W_CANCEL_MESSAGE was provided, the message has expired and it is
@@ -2264,43 +2546,29 @@ static HRESULT ProcessDeliveryToServer(pym_plugin_intf *lppyMapiPlugin,
 		 * to inform the MTA we did handle the email properly.
 		 */
 		hr = ProcessDeliveryToRecipient(lppyMapiPlugin, lpSession,
-		     lpStore, lpUserSession == NULL, lpAdrBook, lpOrigMessage,
-		     bFallbackDelivery, strMail, recip, lpArgs, &~lpMessageTmp,
-		     &bFallbackDeliveryTmp);
-		if (hr == hrSuccess || hr == MAPI_E_CANCEL) {
-			if (hr == hrSuccess) {
-				memory_ptr<SPropValue> lpMessageId, lpSubject;
-				std::wstring wMessageId;
-
-				if (HrGetOneProp(lpMessageTmp, PR_INTERNET_MESSAGE_ID_W, &~lpMessageId) == hrSuccess)
-					wMessageId = lpMessageId->Value.lpszW;
-				HrGetFullProp(lpMessageTmp, PR_SUBJECT_W, &~lpSubject);
-				ec_log_info("Delivered message to \"%ls\", Subject: \"%ls\", Message-Id: %ls, size %zu",
-					recip->wstrUsername.c_str(),
-					(lpSubject != NULL) ? lpSubject->Value.lpszW : L"<none>",
-					wMessageId.c_str(), strMail.size());
-			}
-			// cancel already logged.
-			hr = hrSuccess;
-			recip->wstrDeliveryStatus = "250 2.1.5 %s Ok";
-		} else if (hr == MAPI_W_CANCEL_MESSAGE) {
+		     lpStore, lpUserSession == NULL, lpAdrBook, source.get(),
+		     bFallbackDelivery, strMail, recip, lpArgs,
+		     &~lpMessageTmp, &bFallbackDeliveryTmp);
+		if (hr == MAPI_W_CANCEL_MESSAGE) {
 			/* Loop through all remaining recipients and start responding the status to LMTP */
 			RespondMessageExpired(iter, listRecipients.cend());
 			return MAPI_W_CANCEL_MESSAGE;
-		} else {
-			hr_lerr(hr, "Unable to deliver message to \"%ls\"", recip->wstrUsername.c_str());
-			/* LMTP requires different notification when Quota for user was exceeded */
-			if (hr == MAPI_E_STORE_FULL)
-				recip->wstrDeliveryStatus = "552 5.2.2 %s Quota exceeded";
-			else
-				recip->wstrDeliveryStatus = "450 4.2.0 %s Mailbox temporarily unavailable";
 		}
+		ReportDeliveryStatus(hr, recip, lpMessageTmp, strMail.size());
+		if (hr == MAPI_E_CANCEL)
+			hr = hrSuccess;
 
 		if (lpMessageTmp) {
-			if (lpOrigMessage == NULL)
+			if (lpOrigMessage == NULL) {
 				// If we delivered the message for the first time,
 				// we keep the intermediate message to make copies of.
 				lpMessageTmp->QueryInterface(IID_IMessage, &~lpOrigMessage);
+				/* Hooks may have changed it after saving; copy through dagent then */
+				source.reset(new(std::nothrow) delivery_source(lpOrigMessage,
+				             lpUserSession == nullptr && !lppyMapiPlugin->has_hooks()));
+				if (source == nullptr)
+					return MAPI_E_NOT_ENOUGH_MEMORY;
+			}
 			bFallbackDelivery = bFallbackDeliveryTmp;
 		}
 	}
@@ -3244,6 +3512,7 @@ int main(int argc, char **argv)
 		{"coredump_enabled", "systemdefault"},
 		{"lmtp_listen", "*%lo:2003"},
 		{ "lmtp_max_threads", "20" },
+		{"lmtp_delivery_threads", "4", CONFIGSETTING_RELOADABLE},
 		{"process_model", "thread", CONFIGSETTING_NONEMPTY},
 		{"log_method", "auto", CONFIGSETTING_NONEMPTY},
 		{"log_file", ""},
@@ -3571,6 +3840,7 @@ dagent_stats::dagent_stats(std::shared_ptr<ECConfig> cfg) :
 	AddStat(SCN_DAGENT_TO_SERVER, SCT_INTEGER, "dagent_to_server", "Number of mails delivered to the server");
 	AddStat(SCN_DAGENT_TO_SINGLE_RECIP, SCT_INTEGER, "dagent_to_single_recip", "Number of mails delivered to a single recipient");
 	AddStat(SCN_DAGENT_DELIVERY_PROCESSING_TIME, SCT_INTEGER, "dagent_delivery_time", "Time taken to delivery an email in milliseconds");
+	AddStat(SCN_DAGENT_FANOUT, SCT_INTEGER, "dagent_fanout", "Recipients delivered to in parallel");
 	AddStat(SCN_LMTP_BAD_RECIP_ADDR, SCT_INTEGER, "lmtp_bad_recip_addr", "Bad RCPT commands");
 	AddStat(SCN_LMTP_BAD_SENDER_ADDRESS, SCT_INTEGER, "lmtp_bad_sender_addr", "Bad FROM commands");
 	AddStat(SCN_LMTP_INTERNAL_ERROR, SCT_INTEGER, "lmtp_internal_error", "Internal error during delivery");
@@ -3594,4 +3864,7 @@ dagent_stats::dagent_stats(std::shared_ptr<ECConfig> cfg) :
 	AddStat(SCN_RULES_NRULES, SCT_INTEGER, "rules_nrules", "Rules evaluated");
 	AddStat(SCN_RULES_REPLY_AND_OOF, SCT_INTEGER, "rules_reply_oof", "OP_REPLY/OP_REPLY_OOF actions processed");
 	AddStat(SCN_RULES_TAG, SCT_INTEGER, "rules_tag", "OP_TAG actions processed");
+	AddStat(SCN_RULES_COMPILE, SCT_INTEGER, "rules_compile", "Rules tables loaded and compiled");
+	AddStat(SCN_RULES_CACHE_HIT, SCT_INTEGER, "rules_cache_hit", "Deliveries using already compiled rules");
+	AddStat(SCN_RULES_EVAL_TIME, SCT_INTEGER, "rules_eval_time", "Time taken to test rule conditions in microseconds");
 }
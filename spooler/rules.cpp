@@ -3,11 +3,16 @@
  * Copyright 2005 - 2016 Zarafa and its licensors
  */
 #include <kopano/platform.h>
+#include <algorithm>
 #include <cerrno>
 #include <chrono>
+#include <cstdint>
 #include <cstring>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 #include "rules.h"
@@ -1157,14 +1162,148 @@ static HRESULT proc_op_act(rulexec &rei, const ACTION &action)
 	return hrSuccess;
 }
 
-// lpMessage: gets EntryID, maybe pass this and close message in DAgent.cpp
-HRESULT HrProcessRules(const std::string &recip, pym_plugin_intf *pyMapiPlugin,
-    IMAPISession *lpSession, IAddrBook *lpAdrBook, IMsgStore *lpOrigStore,
-    IMAPIFolder *lpOrigInbox, IMessage *lppMessage, StatsClient *const sc)
+namespace {
+
+/* An enabled rule, as taken from the rules table */
+struct rule_entry {
+	std::string name;
+	unsigned int state = 0;
+	const SRestriction *cond = nullptr;
+	const ACTIONS *actions = nullptr;
+	/* The condition looks into recipients or attachments */
+	bool needs_object = false;
+};
+
+/*
+ * The rules table of a store, reduced to what delivery needs: the enabled
+ * rules in sequence order, and the message properties their conditions
+ * look at, so that those can be fetched with a single GetProps.
+ */
+struct rule_program {
+	rowset_ptr rows; /* owns the conditions and actions */
+	std::vector<rule_entry> rules;
+	memory_ptr<SPropTagArray> tags;
+};
+
+/* Time spent testing a store's rules */
+struct rule_tally {
+	uint64_t evals = 0, eval_us = 0, max_us = 0;
+};
+
+struct rule_cache_entry {
+	std::string changekey;
+	std::shared_ptr<const rule_program> prog;
+	uint64_t last_use = 0;
+	rule_tally tally;
+};
+
+}
+
+/*
+ * Compiled rules by store (PR_STORE_RECORD_KEY). An entry is good for as
+ * long as the inbox keeps its PR_CHANGE_KEY: saving the rules rewrites
+ * PR_RULES_DATA on the inbox, which the server records as an ICS folder
+ * change, and that always hands out a new change key.
+ */
+static std::mutex rule_cache_lock;
+static std::unordered_map<std::string, rule_cache_entry> rule_cache;
+static uint64_t rule_cache_clock;
+static constexpr size_t RULE_CACHE_MAX = 1024;
+
+static std::shared_ptr<const rule_program>
+rule_cache_get(const std::string &store, const std::string &changekey)
+{
+	std::lock_guard<std::mutex> lk(rule_cache_lock);
+	auto i = rule_cache.find(store);
+	if (i == rule_cache.cend() || i->second.changekey != changekey)
+		return nullptr;
+	i->second.last_use = ++rule_cache_clock;
+	return i->second.prog;
+}
+
+static void rule_cache_put(const std::string &store,
+    const std::string &changekey, std::shared_ptr<const rule_program> prog)
+{
+	std::lock_guard<std::mutex> lk(rule_cache_lock);
+	if (rule_cache.size() >= RULE_CACHE_MAX && rule_cache.find(store) == rule_cache.cend())
+		rule_cache.erase(std::min_element(rule_cache.begin(), rule_cache.end(),
+			[](const auto &a, const auto &b) { return a.second.last_use < b.second.last_use; }));
+	auto &e = rule_cache[store];
+	e.changekey = changekey;
+	e.prog = std::move(prog);
+	e.last_use = ++rule_cache_clock;
+}
+
+/* Adds @us to the store's tally, and returns the new one */
+static rule_tally rule_cache_account(const std::string &store, uint64_t us)
+{
+	std::lock_guard<std::mutex> lk(rule_cache_lock);
+	auto i = rule_cache.find(store);
+	if (i == rule_cache.cend())
+		return {};
+	auto &t = i->second.tally;
+	++t.evals;
+	t.eval_us += us;
+	t.max_us = std::max(t.max_us, us);
+	return t;
+}
+
+/*
+ * Adds the tags that @cond looks at to @tags. Returns false if it also
+ * looks into subobjects, and so has to be tested against the message
+ * object rather than its properties.
+ */
+static bool rule_cond_tags(const SRestriction *cond,
+    std::set<unsigned int> &tags, unsigned int level = 0)
+{
+	/* Too deep; TestRestriction will reject it */
+	if (cond == nullptr || level > 16)
+		return false;
+	bool ok = true;
+	switch (cond->rt) {
+	case RES_AND:
+		for (unsigned int i = 0; i < cond->res.resAnd.cRes; ++i)
+			ok &= rule_cond_tags(&cond->res.resAnd.lpRes[i], tags, level + 1);
+		return ok;
+	case RES_OR:
+		for (unsigned int i = 0; i < cond->res.resOr.cRes; ++i)
+			ok &= rule_cond_tags(&cond->res.resOr.lpRes[i], tags, level + 1);
+		return ok;
+	case RES_NOT:
+		return rule_cond_tags(cond->res.resNot.lpRes, tags, level + 1);
+	case RES_COMMENT:
+		return rule_cond_tags(cond->res.resComment.lpRes, tags, level + 1);
+	case RES_CONTENT:
+		tags.emplace(cond->res.resContent.ulPropTag);
+		return true;
+	case RES_PROPERTY:
+		tags.emplace(cond->res.resProperty.ulPropTag);
+		return true;
+	case RES_COMPAREPROPS:
+		tags.emplace(cond->res.resCompareProps.ulPropTag1);
+		tags.emplace(cond->res.resCompareProps.ulPropTag2);
+		return true;
+	case RES_BITMASK:
+		tags.emplace(cond->res.resBitMask.ulPropTag);
+		return true;
+	case RES_SIZE:
+		tags.emplace(cond->res.resSize.ulPropTag);
+		return true;
+	case RES_EXIST:
+		tags.emplace(cond->res.resExist.ulPropTag);
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Reads the inbox rules table into a rule_program */
+static HRESULT rule_compile(const rulexec &rei, pym_plugin_intf *pyMapiPlugin,
+    std::shared_ptr<const rule_program> &out)
 {
 	object_ptr<IExchangeModifyTable> lpTable;
+	object_ptr<IECExchangeModifyTable> lpECModifyTable;
 	object_ptr<IMAPITable> lpView;
-	bool bOOFactive = false;
 	static constexpr SizedSPropTagArray(11, sptaRules) =
 		{11, {PR_RULE_ID, PR_RULE_IDS, PR_RULE_SEQUENCE, PR_RULE_STATE,
 		PR_RULE_USER_FLAGS, PR_RULE_CONDITION, PR_RULE_ACTIONS,
@@ -1172,43 +1311,96 @@ HRESULT HrProcessRules(const std::string &recip, pym_plugin_intf *pyMapiPlugin,
 		PR_RULE_LEVEL, PR_RULE_PROVIDER_DATA}};
 	static constexpr SizedSSortOrderSet(1, sosRules) =
 		{1, 0, 0, {{PR_RULE_SEQUENCE, TABLE_SORT_ASCEND}}};
-	std::string strRule;
-	const SRestriction *lpCondition = nullptr;
-	const ACTIONS *lpActions = nullptr;
-	memory_ptr<SPropValue> OOFProps;
-	unsigned int cValues, ulResult = 0;
-	SPropValue sForwardProps[4];
-	object_ptr<IECExchangeModifyTable> lpECModifyTable;
-	auto dblStart = std::chrono::steady_clock::now();
+	unsigned int ulResult = 0;
 
-	sc->inc(SCN_RULES_INVOKES);
-	auto hr = lpOrigInbox->OpenProperty(PR_RULES_TABLE, &IID_IExchangeModifyTable, 0, 0, &~lpTable);
-	if (hr != hrSuccess) {
-		sc->inc(SCN_RULES_INVOKES_FAIL);
+	auto hr = rei.inbox->OpenProperty(PR_RULES_TABLE, &IID_IExchangeModifyTable, 0, 0, &~lpTable);
+	if (hr != hrSuccess)
 		return hr_lerrf(hr, "OpenProperty failed");
-	}
 	hr = lpTable->QueryInterface(IID_IECExchangeModifyTable, &~lpECModifyTable);
-	if(hr != hrSuccess) {
-		sc->inc(SCN_RULES_INVOKES_FAIL);
+	if (hr != hrSuccess)
 		return hr_lerrf(hr, "QueryInterface failed");
-	}
 	hr = lpECModifyTable->DisablePushToServer();
-	if(hr != hrSuccess) {
-		sc->inc(SCN_RULES_INVOKES_FAIL);
+	if (hr != hrSuccess)
 		return hr_lerrf(hr, "DisablePushToServer failed");
-	}
-	hr = pyMapiPlugin->RulesProcessing("PreRuleProcess", lpSession, lpAdrBook, lpOrigStore, lpTable, &ulResult);
-	if(hr != hrSuccess) {
-		sc->inc(SCN_RULES_INVOKES_FAIL);
+	hr = pyMapiPlugin->RulesProcessing("PreRuleProcess", rei.session, rei.abook, rei.store, lpTable, &ulResult);
+	if (hr != hrSuccess)
 		return hr_lerrf(hr, "RulesProcessing failed");
+	//TODO do something with ulResults
+	hr = lpTable->GetTable(0, &~lpView);
+	if (hr != hrSuccess)
+		return hr_lerrf(hr, "GetTable failed");
+	auto prog = std::make_shared<rule_program>();
+	hr = HrQueryAllRows(lpView, sptaRules, nullptr, sosRules, 0, &~prog->rows);
+	if (hr != hrSuccess)
+		return hr_lerrf(hr, "QueryRows failed");
+
+	std::set<unsigned int> tags;
+	for (unsigned int i = 0; i < prog->rows->cRows; ++i) {
+		const auto &row = prog->rows[i];
+		rule_entry rule;
+		auto lpRuleName = row.cfind(CHANGE_PROP_TYPE(PR_RULE_NAME, PT_STRING8));
+		rule.name = lpRuleName != nullptr ? lpRuleName->Value.lpszA : "(no name)";
+		auto lpRuleState = row.cfind(PR_RULE_STATE);
+		if (lpRuleState == nullptr) {
+			ec_log_warn("Rule \"%s\" for \"%s\" skipped, having no PR_RULE_STATE property.", rule.name.c_str(), rei.recip);
+			continue;
+		}
+		rule.state = lpRuleState->Value.ul;
+		if (!(rule.state & ST_ENABLED)) {
+			ec_log_debug("Rule \"%s\" is disabled, skipping.", rule.name.c_str());
+			continue;
+		}
+		auto lpProp = row.cfind(PR_RULE_CONDITION);
+		if (lpProp)
+			// NOTE: object is placed in Value.lpszA, not Value.x
+			rule.cond = reinterpret_cast<const SRestriction *>(lpProp->Value.lpszA);
+		if (rule.cond == nullptr) {
+			ec_log_debug("Rule \"%s\" has no condition, skipping.", rule.name.c_str());
+			continue;
+		}
+		lpProp = row.cfind(PR_RULE_ACTIONS);
+		if (lpProp)
+			// NOTE: object is placed in Value.lpszA, not Value.x
+			rule.actions = reinterpret_cast<const ACTIONS *>(lpProp->Value.lpszA);
+		if (rule.actions == nullptr) {
+			ec_log_debug("Rule \"%s\" has no action, skipping.", rule.name.c_str());
+			continue;
+		}
+		rule.needs_object = !rule_cond_tags(rule.cond, tags);
+		prog->rules.emplace_back(std::move(rule));
 	}
+	hr = MAPIAllocateBuffer(CbNewSPropTagArray(tags.size()), &~prog->tags);
+	if (hr != hrSuccess)
+		return hr;
+	prog->tags->cValues = 0;
+	for (auto tag : tags)
+		prog->tags->aulPropTag[prog->tags->cValues++] = tag;
+	out = std::move(prog);
+	return hrSuccess;
+}
 
+// lpMessage: gets EntryID, maybe pass this and close message in DAgent.cpp
+HRESULT HrProcessRules(const std::string &recip, pym_plugin_intf *pyMapiPlugin,
+    IMAPISession *lpSession, IAddrBook *lpAdrBook, IMsgStore *lpOrigStore,
+    IMAPIFolder *lpOrigInbox, IMessage *lppMessage, StatsClient *const sc)
+{
+	bool bOOFactive = false, have_props = false;
+	memory_ptr<SPropValue> OOFProps, lpChangeKey, lpMsgProps;
+	unsigned int cValues, nMsgProps = 0;
+	SPropValue sForwardProps[4];
+	std::string strStoreKey, strChangeKey;
+	std::shared_ptr<const rule_program> prog;
+	auto loc = createLocaleFromName("");
+	uint64_t eval_us = 0;
+	auto dblStart = std::chrono::steady_clock::now();
+
+	sc->inc(SCN_RULES_INVOKES);
 	// get OOF-state for recipient-store
         struct rulexec rei = {sc, lpSession, lpOrigStore, lpOrigInbox, lpAdrBook, lppMessage, recip.c_str()};
-	static constexpr SizedSPropTagArray(3, sptaStoreProps) =
-		{3, {PR_EC_OUTOFOFFICE, PR_EC_OUTOFOFFICE_FROM,
-		PR_EC_OUTOFOFFICE_UNTIL}};
-	hr = lpOrigStore->GetProps(sptaStoreProps, 0, &cValues, &~OOFProps);
+	static constexpr SizedSPropTagArray(5, sptaStoreProps) =
+		{5, {PR_EC_OUTOFOFFICE, PR_EC_OUTOFOFFICE_FROM,
+		PR_EC_OUTOFOFFICE_UNTIL, PR_SORT_LOCALE_ID, PR_STORE_RECORD_KEY}};
+	auto hr = lpOrigStore->GetProps(sptaStoreProps, 0, &cValues, &~OOFProps);
 	if (FAILED(hr)) {
 		ec_log_err("lpOrigStore->GetProps failed: %s (%x) - OOF-state unavailable",
 			GetMAPIErrorMessage(hr), hr);
@@ -1222,106 +1414,74 @@ HRESULT HrProcessRules(const std::string &recip, pym_plugin_intf *pyMapiPlugin,
 			if (OOFProps[2].ulPropTag == PR_EC_OUTOFOFFICE_UNTIL)
 				bOOFactive &= now <= FileTimeToUnixTime(OOFProps[2].Value.ft);
 		}
+		const char *localestring = nullptr;
+		if (OOFProps[3].ulPropTag == PR_SORT_LOCALE_ID &&
+		    LCIDToLocaleId(OOFProps[3].Value.ul, &localestring) == hrSuccess)
+			loc = createLocaleFromName(localestring);
+		if (OOFProps[4].ulPropTag == PR_STORE_RECORD_KEY)
+			strStoreKey.assign(reinterpret_cast<const char *>(OOFProps[4].Value.bin.lpb), OOFProps[4].Value.bin.cb);
 	}
 
-	//TODO do something with ulResults
-	hr = lpTable->GetTable(0, &~lpView);
-	if(hr != hrSuccess) {
-		sc->inc(SCN_RULES_INVOKES_FAIL);
-		return hr_lerrf(hr, "GetTable failed");
-	}
-	hr = lpView->SetColumns(sptaRules, 0);
-	if (hr != hrSuccess) {
-		sc->inc(SCN_RULES_INVOKES_FAIL);
-		return hr_lerrf(hr, "SetColumns failed");
-	}
-	hr = lpView->SortTable(sosRules, 0);
-	if (hr != hrSuccess) {
-		sc->inc(SCN_RULES_INVOKES_FAIL);
-		return hr_lerrf(hr, "SortTable failed");
-	}
-
-	while (1) {
-		rowset_ptr lpRowSet;
-	        hr = lpView->QueryRows(1, 0, &~lpRowSet);
+	/* A plugin may rewrite the rules for each message; do not keep those */
+	if (!pyMapiPlugin->has_hooks() && !strStoreKey.empty() &&
+	    HrGetOneProp(lpOrigInbox, PR_CHANGE_KEY, &~lpChangeKey) == hrSuccess)
+		strChangeKey.assign(reinterpret_cast<const char *>(lpChangeKey->Value.bin.lpb), lpChangeKey->Value.bin.cb);
+	if (!strChangeKey.empty())
+		prog = rule_cache_get(strStoreKey, strChangeKey);
+	if (prog != nullptr) {
+		sc->inc(SCN_RULES_CACHE_HIT);
+	} else {
+		hr = rule_compile(rei, pyMapiPlugin, prog);
 		if (hr != hrSuccess) {
 			sc->inc(SCN_RULES_INVOKES_FAIL);
-			return hr_lerrf(hr, "QueryRows failed");
+			return hr;
 		}
-	        if (lpRowSet->cRows == 0)
-			break;
+		sc->inc(SCN_RULES_COMPILE);
+		if (!strChangeKey.empty())
+			rule_cache_put(strStoreKey, strChangeKey, prog);
+	}
 
-		sc->inc(SCN_RULES_NRULES, static_cast<int64_t>(lpRowSet->cRows));
-		auto lpRuleName = lpRowSet[0].cfind(CHANGE_PROP_TYPE(PR_RULE_NAME, PT_STRING8));
-		if (lpRuleName)
-			strRule = lpRuleName->Value.lpszA;
-		else
-			strRule = "(no name)";
+	/* Everything the conditions look at, in one go */
+	if (prog->tags->cValues > 0) {
+		hr = lppMessage->GetProps(prog->tags, 0, &nMsgProps, &~lpMsgProps);
+		have_props = SUCCEEDED(hr) &&
+		             !FAILED(spv_postload_large_props(lppMessage, prog->tags, nMsgProps, lpMsgProps));
+	}
+	hr = hrSuccess;
 
-		rei.name = strRule.c_str();
+	for (const auto &rule : prog->rules) {
+		rei.name = rule.name.c_str();
+		sc->inc(SCN_RULES_NRULES);
 		ec_log_debug("Processing rule \"%s\" for \"%s\"", rei.name, rei.recip);
-		auto lpRuleState = lpRowSet[0].cfind(PR_RULE_STATE);
-		if (lpRuleState == nullptr) {
-			ec_log_warn("Rule \"%s\" for \"%s\" skipped, having no PR_RULE_STATE property.", rei.name, rei.recip);
-			continue;
-		}
-		if (!(lpRuleState->Value.ul & ST_ENABLED)) {
-			ec_log_debug("Rule \"%s\" is disabled, skipping.", rei.name);
-			continue;
-		}
-		if ((lpRuleState->Value.ul & ST_ONLY_WHEN_OOF) && !bOOFactive) {
+		if ((rule.state & ST_ONLY_WHEN_OOF) && !bOOFactive) {
 			ec_log_debug("Rule \"%s\" marked for OOF, but OOF not active, skipping.", rei.name);
 			continue;
 		}
 
-		lpCondition = NULL;
-		lpActions = NULL;
-		auto lpProp = lpRowSet[0].cfind(PR_RULE_CONDITION);
-		if (lpProp)
-			// NOTE: object is placed in Value.lpszA, not Value.x
-			lpCondition = reinterpret_cast<const SRestriction *>(lpProp->Value.lpszA);
-		if (!lpCondition) {
-			ec_log_debug("Rule \"%s\" has no condition, skipping.", rei.name);
-			continue;
-		}
-		lpProp = lpRowSet[0].cfind(PR_RULE_ACTIONS);
-		if (lpProp)
-			// NOTE: object is placed in Value.lpszA, not Value.x
-			lpActions = reinterpret_cast<const ACTIONS *>(lpProp->Value.lpszA);
-		if (!lpActions) {
-			ec_log_debug("Rule \"%s\" has no action, skipping.", rei.name);
-			continue;
-		}
-
 		// test if action should be done...
-		memory_ptr<SPropValue> locprop;
-		hr = HrGetOneProp(lpOrigStore, PR_SORT_LOCALE_ID, &~locprop);
-		auto loc = createLocaleFromName("");
-		if (hr == hrSuccess) {
-			const char *localestring = nullptr;
-			hr = LCIDToLocaleId(locprop->Value.ul, &localestring);
-			if (hr == hrSuccess)
-				loc = createLocaleFromName(localestring);
-		}
-		hr = TestRestriction(lpCondition, lppMessage, loc);
-		if (hr == MAPI_E_NOT_FOUND) {
+		auto t0 = std::chrono::steady_clock::now();
+		auto ret = rule.needs_object || !have_props ?
+		           TestRestriction(rule.cond, lppMessage, loc) :
+		           TestRestriction(rule.cond, nMsgProps, lpMsgProps, loc);
+		eval_us += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count();
+		if (ret == MAPI_E_NOT_FOUND) {
 			ec_log_info("Rule \"%s\" does not match", rei.name);
 			continue;
-		} else if (hr != hrSuccess) {
-			hr_lerr(hr, "Rule \"%s\"", rei.name);
+		} else if (ret != hrSuccess) {
+			hr_lerr(ret, "Rule \"%s\"", rei.name);
 			continue;
 		}
 		ec_log_info("Rule \"%s\" matches", rei.name);
-		rei.sc->inc(SCN_RULES_NACTIONS, static_cast<int64_t>(lpActions->cActions));
+		rei.sc->inc(SCN_RULES_NACTIONS, static_cast<int64_t>(rule.actions->cActions));
 
-		for (ULONG n = 0; n < lpActions->cActions; ++n) {
-			const auto &action = lpActions->lpAction[n];
+		for (ULONG n = 0; n < rule.actions->cActions; ++n) {
+			const auto &action = rule.actions->lpAction[n];
 			hr = proc_op_act(rei, action);
 			if (FAILED(hr))
 				goto exit;
 		} // end action loop
 
-		if (lpRuleState && (lpRuleState->Value.ul & ST_EXIT_LEVEL))
+		if (rule.state & ST_EXIT_LEVEL)
 			break;
 	}
 
@@ -1344,6 +1504,19 @@ HRESULT HrProcessRules(const std::string &recip, pym_plugin_intf *pyMapiPlugin,
 	if (hr != hrSuccess)
 		rei.sc->inc(SCN_RULES_INVOKES_FAIL);
 
+	rei.sc->inc(SCN_RULES_EVAL_TIME, static_cast<int64_t>(eval_us));
+	if (!strChangeKey.empty()) {
+		auto tally = rule_cache_account(strStoreKey, eval_us);
+		if (tally.evals > 0)
+			ec_log_debug("Rules for \"%s\": %zu tested in %llu us; %llu us on average and %llu us at most over %llu deliveries",
+				rei.recip, prog->rules.size(), static_cast<unsigned long long>(eval_us),
+				static_cast<unsigned long long>(tally.eval_us / tally.evals),
+				static_cast<unsigned long long>(tally.max_us),
+				static_cast<unsigned long long>(tally.evals));
+	} else {
+		ec_log_debug("Rules for \"%s\": %zu tested in %llu us", rei.recip,
+			prog->rules.size(), static_cast<unsigned long long>(eval_us));
+	}
 	auto dblEnd = decltype(dblStart)::clock::now();
 	rei.sc->inc(SCN_RULES_TIME, std::chrono::duration_cast<std::chrono::milliseconds>(dblEnd - dblStart).count());
 	return hr;
@@ -0,0 +1,297 @@
+/*
+ * SPDX-License-Identifier: AGPL-3.0-only
+ * Copyright 2016+, Kopano and its licensors
+ */
+#include <kopano/platform.h>
+#include <algorithm>
+#include <iterator>
+#include <string>
+#include <utility>
+#include <vector>
+#include <mapiutil.h>
+#include <kopano/CommonUtil.h>
+#include <kopano/ECGuid.h>
+#include <kopano/ECTags.h>
+#include <kopano/IECInterfaces.hpp>
+#include <kopano/Util.h>
+#include <kopano/memory.hpp>
+#include "snapshot.h"
+
+using namespace KC;
+
+/* What Util::DoCopyTo leaves out, plus what is copied separately */
+static constexpr const unsigned int never_copied[] = {
+	PR_STORE_ENTRYID, PR_STORE_RECORD_KEY, PR_STORE_SUPPORT_MASK,
+	PR_MAPPING_SIGNATURE, PR_MDB_PROVIDER, PR_ACCESS_LEVEL,
+	PR_RECORD_KEY, PR_HASATTACH, PR_NORMALIZED_SUBJECT, PR_MESSAGE_SIZE,
+	PR_DISPLAY_TO, PR_DISPLAY_CC, PR_DISPLAY_BCC, PR_ACCESS,
+	PR_SUBJECT_PREFIX, PR_OBJECT_TYPE, PR_ENTRYID, PR_PARENT_ENTRYID,
+	PR_INTERNET_CONTENT, PR_ATTACH_NUM,
+	PR_EC_IMAP_EMAIL, PR_EC_IMAP_EMAIL_SIZE, PR_EC_IMAP_BODY,
+	PR_EC_IMAP_BODYSTRUCTURE,
+};
+
+static bool skip_prop(unsigned int tag, const SPropTagArray *exclude,
+    unsigned int body)
+{
+	if (PROP_TYPE(tag) == PT_ERROR || PROP_TYPE(tag) == PT_OBJECT)
+		return true;
+	auto id = PROP_ID(tag);
+	if (std::any_of(std::begin(never_copied), std::end(never_copied),
+	    [=](unsigned int t) { return PROP_ID(t) == id; }))
+		return true;
+	/* Only the original body, as CopyTo does between Kopano messages */
+	if (body != PR_NULL && Util::IsBodyProp(tag) && id != PROP_ID(body))
+		return true;
+	if (exclude == nullptr)
+		return false;
+	for (unsigned int i = 0; i < exclude->cValues; ++i)
+		if (PROP_ID(exclude->aulPropTag[i]) == id)
+			return true;
+	return false;
+}
+
+static std::string instance_id(IMAPIProp *obj)
+{
+	object_ptr<IECSingleInstance> si;
+	memory_ptr<ENTRYID> eid;
+	unsigned int size = 0;
+
+	if (obj->QueryInterface(IID_IECSingleInstance, &~si) != hrSuccess ||
+	    si->GetSingleInstanceId(&size, &~eid) != hrSuccess)
+		return {};
+	return std::string(reinterpret_cast<const char *>(eid.get()), size);
+}
+
+static void set_instance_id(IMAPIProp *obj, const std::string &id)
+{
+	object_ptr<IECSingleInstance> si;
+
+	/* Should this fail, the data is simply sent along again */
+	if (id.empty() || obj->QueryInterface(IID_IECSingleInstance, &~si) != hrSuccess)
+		return;
+	si->SetSingleInstanceId(id.size(), reinterpret_cast<const ENTRYID *>(id.data()));
+}
+
+HRESULT msg_snapshot::propset::load(IMAPIProp *obj,
+    const SPropTagArray *exclude, unsigned int body)
+{
+	memory_ptr<SPropValue> all;
+	memory_ptr<SPropTagArray> tags;
+	unsigned int n = 0;
+
+	auto hr = HrGetAllProps(obj, MAPI_UNICODE, &n, &~all);
+	if (FAILED(hr))
+		return hr;
+	/* Keep the values in place; they are allocated along with @all */
+	count = 0;
+	named.clear();
+	for (unsigned int i = 0; i < n; ++i) {
+		if (skip_prop(all[i].ulPropTag, exclude, body))
+			continue;
+		if (PROP_ID(all[i].ulPropTag) >= 0x8000)
+			named.push_back(count);
+		all[count++] = all[i];
+	}
+	props.reset(all.release());
+	if (named.empty())
+		return hrSuccess;
+
+	hr = MAPIAllocateBuffer(CbNewSPropTagArray(named.size()), &~tags);
+	if (hr != hrSuccess)
+		return hr;
+	tags->cValues = named.size();
+	for (size_t i = 0; i < named.size(); ++i)
+		tags->aulPropTag[i] = props[named[i]].ulPropTag;
+	auto tagp = tags.get();
+	unsigned int nnames = 0;
+	hr = obj->GetNamesFromIDs(&tagp, nullptr, 0, &nnames, &~names);
+	if (FAILED(hr))
+		return hr;
+	return nnames == named.size() ? hrSuccess : MAPI_E_CALL_FAILED;
+}
+
+HRESULT msg_snapshot::propset::write(IMAPIProp *obj) const
+{
+	std::vector<SPropValue> v(props.get(), props.get() + count);
+
+	if (!named.empty()) {
+		/* Named properties get the ids of the destination store */
+		std::vector<MAPINAMEID *> nm;
+		std::vector<unsigned int> idx;
+		for (size_t i = 0; i < named.size(); ++i) {
+			if (names[i] == nullptr) {
+				v[named[i]].ulPropTag = PR_NULL;
+				continue;
+			}
+			nm.push_back(names[i]);
+			idx.push_back(named[i]);
+		}
+		memory_ptr<SPropTagArray> ids;
+		if (!nm.empty()) {
+			auto hr = obj->GetIDsFromNames(nm.size(), nm.data(), MAPI_CREATE, &~ids);
+			if (FAILED(hr))
+				return hr;
+			for (size_t i = 0; i < idx.size(); ++i) {
+				auto &p = v[idx[i]];
+				p.ulPropTag = PROP_TYPE(ids->aulPropTag[i]) == PT_ERROR ? PR_NULL :
+				              CHANGE_PROP_TYPE(ids->aulPropTag[i], PROP_TYPE(p.ulPropTag));
+			}
+		}
+		v.erase(std::remove_if(v.begin(), v.end(),
+			[](const SPropValue &p) { return p.ulPropTag == PR_NULL; }), v.end());
+	}
+	if (v.empty())
+		return hrSuccess;
+	auto hr = obj->SetProps(v.size(), v.data(), nullptr);
+	return FAILED(hr) ? hr : hrSuccess;
+}
+
+HRESULT msg_snapshot::load(IMessage *msg, const SPropTagArray *exclude)
+{
+	static constexpr SizedSPropTagArray(3, sptaIMAP) =
+		{3, {PR_EC_IMAP_EMAIL_SIZE, PR_EC_IMAP_BODY, PR_EC_IMAP_BODYSTRUCTURE}};
+	object_ptr<IMAPITable> table;
+	object_ptr<IStream> stream;
+	memory_ptr<SPropTagArray> cols;
+	rowset_ptr rows;
+
+	auto hr = m_props.load(msg, exclude, Util::GetBestBody(msg, MAPI_UNICODE));
+	if (hr != hrSuccess)
+		return hr;
+	hr = msg->GetRecipientTable(MAPI_UNICODE, &~table);
+	if (hr != hrSuccess)
+		return hr;
+	hr = table->QueryColumns(TBL_ALL_COLUMNS, &~cols);
+	if (hr != hrSuccess)
+		return hr;
+	hr = table->SetColumns(cols, 0);
+	if (hr != hrSuccess)
+		return hr;
+	hr = HrQueryAllRows(table, nullptr, nullptr, nullptr, 0, &~rows);
+	if (hr != hrSuccess)
+		return hr;
+	/* ADRLIST and SRowSet are binary compatible */
+	m_recips.reset(reinterpret_cast<ADRLIST *>(rows.release()));
+	hr = load_attachments(msg);
+	if (hr != hrSuccess)
+		return hr;
+
+	/* Like Util::HrCopyIMAPData: without the stream, there is nothing to copy */
+	if (msg->OpenProperty(PR_EC_IMAP_EMAIL, &IID_IStream, 0, 0, &~stream) != hrSuccess ||
+	    Util::HrStreamToString(stream, m_imap_email) != hrSuccess)
+		return hrSuccess;
+	m_imap_instance = instance_id(msg);
+	hr = msg->GetProps(sptaIMAP, 0, &m_imap_count, &~m_imap_props);
+	if (FAILED(hr))
+		return hr;
+	m_has_imap = true;
+	return hrSuccess;
+}
+
+HRESULT msg_snapshot::load_attachments(IMessage *msg)
+{
+	static constexpr SizedSPropTagArray(2, sptaCols) = {2, {PR_ATTACH_NUM, PR_ATTACH_METHOD}};
+	object_ptr<IMAPITable> table;
+	rowset_ptr rows;
+
+	auto hr = msg->GetAttachmentTable(0, &~table);
+	if (hr != hrSuccess)
+		return hr;
+	hr = HrQueryAllRows(table, sptaCols, nullptr, nullptr, 0, &~rows);
+	if (hr != hrSuccess)
+		return hr;
+	m_attach.clear();
+	m_attach.reserve(rows.size());
+	for (unsigned int i = 0; i < rows.size(); ++i) {
+		auto num = rows[i].cfind(PR_ATTACH_NUM);
+		auto method = rows[i].cfind(PR_ATTACH_METHOD);
+		object_ptr<IAttach> at;
+		attachment a;
+
+		if (num == nullptr)
+			continue;
+		hr = msg->OpenAttach(num->Value.ul, nullptr, 0, &~at);
+		if (hr != hrSuccess)
+			return hr;
+		hr = a.props.load(at, nullptr, PR_NULL);
+		if (hr != hrSuccess)
+			return hr;
+		a.instance = instance_id(at);
+		if (method != nullptr && method->Value.ul == ATTACH_EMBEDDED_MSG) {
+			object_ptr<IMessage> sub;
+			hr = at->OpenProperty(PR_ATTACH_DATA_OBJ, &IID_IMessage, 0, 0, &~sub);
+			if (hr != hrSuccess)
+				return hr;
+			a.embedded.reset(new msg_snapshot);
+			hr = a.embedded->load(sub, nullptr);
+			if (hr != hrSuccess)
+				return hr;
+		}
+		m_attach.push_back(std::move(a));
+	}
+	return hrSuccess;
+}
+
+HRESULT msg_snapshot::write(IMessage *dst) const
+{
+	auto hr = m_props.write(dst);
+	if (hr != hrSuccess)
+		return hr;
+	if (m_recips != nullptr && m_recips->cEntries > 0) {
+		hr = dst->ModifyRecipients(MODRECIP_ADD, m_recips);
+		if (hr != hrSuccess)
+			return hr;
+	}
+	for (const auto &a : m_attach) {
+		object_ptr<IAttach> at;
+		unsigned int num = 0;
+
+		hr = dst->CreateAttach(nullptr, 0, &num, &~at);
+		if (hr != hrSuccess)
+			return hr;
+		hr = a.props.write(at);
+		if (hr != hrSuccess)
+			return hr;
+		if (a.embedded != nullptr) {
+			object_ptr<IMessage> sub;
+			hr = at->OpenProperty(PR_ATTACH_DATA_OBJ, &IID_IMessage, 0,
+			     MAPI_CREATE | MAPI_MODIFY, &~sub);
+			if (hr != hrSuccess)
+				return hr;
+			hr = a.embedded->write(sub);
+			if (hr != hrSuccess)
+				return hr;
+			hr = sub->SaveChanges(0);
+			if (hr != hrSuccess)
+				return hr;
+		}
+		set_instance_id(at, a.instance);
+		hr = at->SaveChanges(0);
+		if (hr != hrSuccess)
+			return hr;
+	}
+	return hrSuccess;
+}
+
+HRESULT msg_snapshot::write_imap(IMessage *dst) const
+{
+	object_ptr<IStream> stream;
+	ULONG written = 0;
+
+	if (!m_has_imap)
+		return hrSuccess;
+	/* Same as Util::HrCopyIMAPData; failing to write the stream is not fatal */
+	auto hr = dst->OpenProperty(PR_EC_IMAP_EMAIL, &IID_IStream,
+	          STGM_WRITE | STGM_TRANSACTED, MAPI_CREATE | MAPI_MODIFY, &~stream);
+	if (hr != hrSuccess)
+		hr = dst->OpenProperty(PR_EC_IMAP_EMAIL, &IID_IStream,
+		     STGM_WRITE, MAPI_CREATE | MAPI_MODIFY, &~stream);
+	if (hr != hrSuccess ||
+	    stream->Write(m_imap_email.data(), m_imap_email.size(), &written) != hrSuccess ||
+	    stream->Commit(0) != hrSuccess)
+		return hrSuccess;
+	set_instance_id(dst, m_imap_instance);
+	hr = dst->SetProps(m_imap_count, m_imap_props, nullptr);
+	return FAILED(hr) ? hr : hrSuccess;
+}
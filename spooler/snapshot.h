@@ -0,0 +1,54 @@
+/*
+ * SPDX-License-Identifier: AGPL-3.0-only
+ * Copyright 2016+, Kopano and its licensors
+ */
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+#include <mapidefs.h>
+#include <kopano/memory.hpp>
+
+/**
+ * The contents of a delivered message (properties, recipients, attachments
+ * and IMAP data), read once so that any number of copies can be written on
+ * the same server, from several threads at once, without going back to the
+ * source message. Attachments and the IMAP data carry their single
+ * instance ids, so that the server need not receive their data again.
+ */
+class msg_snapshot final {
+	public:
+	/* Reads @msg, leaving out the properties in @exclude */
+	HRESULT load(IMessage *msg, const SPropTagArray *exclude);
+	/* Fills @dst, which is not saved; the IMAP data is left out */
+	HRESULT write(IMessage *dst) const;
+	HRESULT write_imap(IMessage *dst) const;
+
+	private:
+	/* Properties of one object; named ones are kept by their name */
+	struct propset {
+		HRESULT load(IMAPIProp *, const SPropTagArray *exclude, unsigned int body);
+		HRESULT write(IMAPIProp *) const;
+
+		KC::memory_ptr<SPropValue> props;
+		unsigned int count = 0;
+		/* Indices into props of named properties, and their names */
+		std::vector<unsigned int> named;
+		KC::memory_ptr<MAPINAMEID *> names;
+	};
+	struct attachment {
+		propset props;
+		std::string instance;
+		std::unique_ptr<msg_snapshot> embedded;
+	};
+
+	HRESULT load_attachments(IMessage *);
+
+	propset m_props;
+	KC::adrlist_ptr m_recips;
+	std::vector<attachment> m_attach;
+	bool m_has_imap = false;
+	std::string m_imap_email, m_imap_instance;
+	KC::memory_ptr<SPropValue> m_imap_props;
+	unsigned int m_imap_count = 0;
+};
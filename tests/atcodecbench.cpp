@@ -0,0 +1,186 @@
+/* SPDX-License-Identifier: AGPL-3.0-only */
+/* Copyright 2016+, Kopano and its licensors */
+#include <kopano/platform.h>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <kopano/fileutil.hpp>
+#include "ECAttachmentCodec.h"
+/*
+ * Compresses every file of an attachment corpus with each attachment codec
+ * (as selectable with attachment_compression), reads it back, and reports
+ * throughput and ratio. The round trip is checked byte for byte, and
+ * content_size() is checked against the original size.
+ *
+ * Usage: atcodecbench [-c codec[:level]]... {file|dir}...
+ */
+
+using namespace KC;
+using clk = std::chrono::steady_clock;
+
+namespace {
+
+struct result {
+	size_t files = 0, in = 0, out = 0;
+	double ctime = 0, dtime = 0;
+	bool fail = false;
+};
+
+}
+
+static void collect(const std::string &path, std::vector<std::string> &list)
+{
+	struct stat sb;
+	if (stat(path.c_str(), &sb) != 0) {
+		fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+		return;
+	}
+	if (S_ISREG(sb.st_mode)) {
+		list.push_back(path);
+		return;
+	}
+	if (!S_ISDIR(sb.st_mode))
+		return;
+	std::unique_ptr<DIR, int (*)(DIR *)> dh(opendir(path.c_str()), closedir);
+	if (dh == nullptr)
+		return;
+	struct dirent *de;
+	while ((de = readdir(dh.get())) != nullptr)
+		if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0)
+			collect(path + "/" + de->d_name, list);
+}
+
+static bool slurp(const std::string &path, std::string &data)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat sb;
+	if (fstat(fd, &sb) != 0) {
+		close(fd);
+		return false;
+	}
+	data.resize(sb.st_size);
+	auto ret = read_retry(fd, &data[0], data.size());
+	close(fd);
+	return ret == static_cast<ssize_t>(data.size());
+}
+
+static void run(const at_codec_spec &spec, const std::vector<std::string> &files,
+    int tmpfd, result &res)
+{
+	std::string data, back;
+	for (const auto &f : files) {
+		if (!slurp(f, data))
+			continue;
+		if (ftruncate(tmpfd, 0) != 0 || lseek(tmpfd, 0, SEEK_SET) != 0) {
+			res.fail = true;
+			return;
+		}
+		auto t0 = clk::now();
+		auto wr = spec.codec->writer(tmpfd, spec.level, data.size());
+		if (wr == nullptr || wr->write(data.data(), data.size()) != static_cast<ssize_t>(data.size()) ||
+		    !wr->finish()) {
+			fprintf(stderr, "%s: %s: compression failed\n", spec.codec->name(), f.c_str());
+			res.fail = true;
+			continue;
+		}
+		wr.reset();
+		auto t1 = clk::now();
+		struct stat sb;
+		fstat(tmpfd, &sb);
+		lseek(tmpfd, 0, SEEK_SET);
+		back.resize(data.size() + 1);
+		auto rd = spec.codec->reader(tmpfd);
+		size_t got = 0;
+		while (rd != nullptr && got < back.size()) {
+			auto ret = rd->read(&back[got], back.size() - got);
+			if (ret <= 0)
+				break;
+			got += ret;
+		}
+		rd.reset();
+		auto t2 = clk::now();
+		if (got != data.size() || memcmp(back.data(), data.data(), got) != 0) {
+			fprintf(stderr, "%s: %s: round trip mismatch (%zu/%zu bytes)\n",
+			        spec.codec->name(), f.c_str(), got, data.size());
+			res.fail = true;
+		}
+		auto csize = spec.codec->content_size(tmpfd);
+		if (csize != static_cast<ssize_t>(data.size())) {
+			fprintf(stderr, "%s: %s: content_size %zd, expected %zu\n",
+			        spec.codec->name(), f.c_str(), csize, data.size());
+			res.fail = true;
+		}
+		++res.files;
+		res.in += data.size();
+		res.out += sb.st_size;
+		res.ctime += std::chrono::duration<double>(t1 - t0).count();
+		res.dtime += std::chrono::duration<double>(t2 - t1).count();
+	}
+}
+
+int main(int argc, char **argv)
+{
+	std::vector<at_codec_spec> specs;
+	std::vector<std::string> files;
+	int c;
+
+	while ((c = getopt(argc, argv, "c:")) != -1) {
+		if (c != 'c') {
+			fprintf(stderr, "Usage: atcodecbench [-c codec[:level]]... {file|dir}...\n");
+			return EXIT_FAILURE;
+		}
+		at_codec_spec spec;
+		if (!at_codec_parse(optarg, &spec) || spec.codec == nullptr) {
+			fprintf(stderr, "Unknown codec \"%s\"\n", optarg);
+			return EXIT_FAILURE;
+		}
+		specs.push_back(spec);
+	}
+	if (specs.empty())
+		for (auto codec : at_codec_list()) {
+			at_codec_spec spec;
+			spec.codec = codec;
+			spec.level = codec->default_level();
+			specs.push_back(spec);
+		}
+	for (int i = optind; i < argc; ++i)
+		collect(argv[i], files);
+	if (files.empty()) {
+		fprintf(stderr, "Usage: atcodecbench [-c codec[:level]]... {file|dir}...\n");
+		return EXIT_FAILURE;
+	}
+
+	char tmpl[] = "/tmp/atcodecbench-XXXXXX";
+	int tmpfd = mkstemp(tmpl);
+	if (tmpfd < 0) {
+		perror("mkstemp");
+		return EXIT_FAILURE;
+	}
+	unlink(tmpl);
+
+	bool fail = false;
+	printf("%-8s %6s %8s %12s %12s %7s\n", "codec", "level", "files", "comp MB/s", "decomp MB/s", "ratio");
+	for (const auto &spec : specs) {
+		result res;
+		run(spec, files, tmpfd, res);
+		fail |= res.fail;
+		printf("%-8s %6d %8zu %12.1f %12.1f %7.3f\n", spec.codec->name(),
+		       spec.level, res.files,
+		       res.ctime > 0 ? res.in / res.ctime / 1048576 : 0,
+		       res.dtime > 0 ? res.in / res.dtime / 1048576 : 0,
+		       res.in > 0 ? static_cast<double>(res.out) / res.in : 0);
+	}
+	close(tmpfd);
+	return fail ? EXIT_FAILURE : EXIT_SUCCESS;
+}
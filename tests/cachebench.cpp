@@ -0,0 +1,87 @@
+/* SPDX-License-Identifier: AGPL-3.0-only */
+/* Copyright 2016+, Kopano and its licensors */
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <mapidefs.h>
+#include <kopano/ECConfig.h>
+#include "ECCacheManager.h"
+/*
+ * Hammers ECCacheManager::GetObject from many threads over a pre-populated
+ * object cache, once with a single exclusively-locked cache (the old mode)
+ * and once with sharded, shared-read caches. All lookups are hits, so no
+ * database is needed.
+ *
+ * Usage: cachebench [threads [objects [seconds]]]
+ */
+
+using namespace KC;
+using clk = std::chrono::steady_clock;
+
+static double run(const char *shards, const char *shared, unsigned int nthr,
+    unsigned int nobj, unsigned int secs)
+{
+	const configsetting_t defaults[] = {
+		{"cache_quota_size", "1048576"},
+		{"cache_quota_lifetime", "1"},
+		{"cache_object_size", "268435456"},
+		{"cache_store_size", "1048576"},
+		{"cache_user_size", "1048576"},
+		{"cache_userdetails_size", "1048576"},
+		{"cache_userdetails_lifetime", "0"},
+		{"cache_acl_size", "1048576"},
+		{"cache_cell_size", "16777216"},
+		{"cache_server_size", "1048576"},
+		{"cache_server_lifetime", "30"},
+		{"cache_indexedobject_size", "16777216"},
+		{"cache_shards", shards},
+		{"cache_shared_reads", shared},
+		{nullptr, nullptr},
+	};
+	std::shared_ptr<ECConfig> cfg(ECConfig::Create(defaults));
+	ECCacheManager cache(cfg, nullptr);
+	for (unsigned int i = 1; i <= nobj; ++i)
+		cache.SetObject(i, 1, 1, 0, MAPI_MESSAGE);
+
+	std::atomic<bool> stop{false};
+	std::atomic<unsigned long long> total{0};
+	std::vector<std::thread> thr;
+	for (unsigned int t = 0; t < nthr; ++t)
+		thr.emplace_back([&, t]() {
+			std::minstd_rand rng(t);
+			unsigned long long n = 0;
+			unsigned int parent;
+			while (!stop.load(std::memory_order_relaxed)) {
+				if (cache.GetObject(rng() % nobj + 1, &parent, nullptr, nullptr) != erSuccess)
+					abort();
+				++n;
+			}
+			total += n;
+		});
+	auto start = clk::now();
+	std::this_thread::sleep_for(std::chrono::seconds(secs));
+	stop = true;
+	for (auto &e : thr)
+		e.join();
+	auto dt = std::chrono::duration<double>(clk::now() - start).count();
+	return total / dt;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int nthr = argc > 1 ? strtoul(argv[1], nullptr, 0) : 64;
+	unsigned int nobj = argc > 2 ? strtoul(argv[2], nullptr, 0) : 100000;
+	unsigned int secs = argc > 3 ? strtoul(argv[3], nullptr, 0) : 5;
+
+	auto old_rate = run("1", "no", nthr, nobj, secs);
+	printf("exclusive, 1 shard:    %.0f GetObject/s\n", old_rate);
+	auto new_rate = run("16", "yes", nthr, nobj, secs);
+	printf("shared, 16 shards:     %.0f GetObject/s\n", new_rate);
+	printf("speedup with %u threads: %.2fx\n", nthr, new_rate / old_rate);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,319 @@
+/* SPDX-License-Identifier: AGPL-3.0-only */
+/* Copyright 2016+, Kopano and its licensors */
+#include <kopano/platform.h>
+#include <chrono>
+#include <memory>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <openssl/sha.h>
+#include <kopano/fileutil.hpp>
+#include "ECChunkStore.h"
+/*
+ * Reports what content-defined chunking (attachment_chunk_size) saves.
+ *
+ * Corpus mode: cuts every file of an attachment corpus with each average
+ * chunk size given by -a, and compares the unique bytes against whole-file
+ * deduplication, which is what files_v2 does on its own. With -w, the corpus
+ * is also stored into a scratch chunk store below that directory, read back
+ * and verified, and the write and reassembly throughput is shown.
+ *
+ * Store mode (-s): walks an existing files_v2 attachment_path and reports
+ * logical against physical size of its chunked instances, and the
+ * reassembly read throughput.
+ *
+ * Usage: cdcreport [-a avgsize]... [-w scratchdir] {file|dir}...
+ *        cdcreport -s attachment_path
+ */
+
+using namespace KC;
+using clk = std::chrono::steady_clock;
+
+static void usage()
+{
+	fprintf(stderr, "Usage: cdcreport [-a avgsize]... [-w scratchdir] {file|dir}...\n"
+	        "       cdcreport -s attachment_path\n");
+}
+
+static void collect(const std::string &path, std::vector<std::string> &list)
+{
+	struct stat sb;
+	if (stat(path.c_str(), &sb) != 0) {
+		fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+		return;
+	}
+	if (S_ISREG(sb.st_mode)) {
+		list.push_back(path);
+		return;
+	}
+	if (!S_ISDIR(sb.st_mode))
+		return;
+	std::unique_ptr<DIR, int (*)(DIR *)> dh(opendir(path.c_str()), closedir);
+	if (dh == nullptr)
+		return;
+	struct dirent *de;
+	while ((de = readdir(dh.get())) != nullptr)
+		if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0)
+			collect(path + "/" + de->d_name, list);
+}
+
+static bool slurp(const std::string &path, std::string &data)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat sb;
+	if (fstat(fd, &sb) != 0) {
+		close(fd);
+		return false;
+	}
+	data.resize(sb.st_size);
+	auto ret = read_retry(fd, &data[0], data.size());
+	close(fd);
+	return ret == static_cast<ssize_t>(data.size());
+}
+
+static std::string sha(const void *data, size_t len)
+{
+	unsigned char md[SHA256_DIGEST_LENGTH];
+	SHA256(static_cast<const unsigned char *>(data), len, md);
+	return std::string(reinterpret_cast<char *>(md), sizeof(md));
+}
+
+static double mbps(size_t bytes, double secs)
+{
+	return secs > 0 ? bytes / secs / 1048576 : 0;
+}
+
+static bool scratch_run(const std::string &root, size_t avg,
+    const std::vector<std::string> &files)
+{
+	std::string data, back;
+	size_t in = 0;
+	double wtime = 0, rtime = 0;
+	bool fail = false;
+	unsigned int n = 0;
+
+	for (const auto &f : files) {
+		if (!slurp(f, data))
+			continue;
+		auto dir = root + "/i" + std::to_string(n++);
+		if (mkdir(dir.c_str(), S_IRWXU) != 0) {
+			fprintf(stderr, "%s: %s\n", dir.c_str(), strerror(errno));
+			return false;
+		}
+		auto t0 = clk::now();
+		chunk_writer wr(root, dir, avg, false);
+		if (!wr.write(data.data(), data.size()) || !wr.finish()) {
+			fprintf(stderr, "%s: store failed\n", f.c_str());
+			fail = true;
+			continue;
+		}
+		auto t1 = clk::now();
+		chunk_reader rd;
+		ssize_t got = -1;
+		if (rd.open(dir)) {
+			back.resize(rd.size());
+			got = rd.read(&back[0], back.size());
+		}
+		auto t2 = clk::now();
+		if (got != static_cast<ssize_t>(data.size()) || back != data) {
+			fprintf(stderr, "%s: reassembly mismatch\n", f.c_str());
+			fail = true;
+		}
+		in += data.size();
+		wtime += std::chrono::duration<double>(t1 - t0).count();
+		rtime += std::chrono::duration<double>(t2 - t1).count();
+	}
+	for (unsigned int i = 0; i < n; ++i) {
+		auto dir = root + "/i" + std::to_string(i);
+		chunk_release(root, dir);
+		unlink((dir + "/chunklist").c_str());
+		rmdir((dir + "/c").c_str());
+		rmdir(dir.c_str());
+	}
+	printf("scratch store, avg %zu: write %.1f MB/s, reassembly %.1f MB/s\n",
+	       avg, mbps(in, wtime), mbps(in, rtime));
+	return !fail;
+}
+
+static int corpus_mode(std::vector<size_t> avgs, const char *scratch,
+    const std::vector<std::string> &files)
+{
+	if (avgs.empty())
+		avgs = {16384, 65536, 262144};
+	std::string data;
+	std::set<std::string> whole;
+	size_t logical = 0, whole_u = 0;
+	std::vector<std::set<std::string>> seen(avgs.size());
+	std::vector<size_t> unique(avgs.size()), chunks(avgs.size());
+	std::vector<double> ctime(avgs.size());
+
+	for (const auto &f : files) {
+		if (!slurp(f, data))
+			continue;
+		logical += data.size();
+		if (whole.emplace(sha(data.data(), data.size())).second)
+			whole_u += data.size();
+		for (size_t i = 0; i < avgs.size(); ++i) {
+			fastcdc cdc(avgs[i]);
+			auto t0 = clk::now();
+			for (size_t pos = 0; pos < data.size(); ) {
+				auto len = cdc.cut(&data[pos], data.size() - pos);
+				++chunks[i];
+				if (seen[i].emplace(sha(&data[pos], len)).second)
+					unique[i] += len;
+				pos += len;
+			}
+			ctime[i] += std::chrono::duration<double>(clk::now() - t0).count();
+		}
+	}
+	printf("%zu files, %zu bytes\n", files.size(), logical);
+	printf("%-12s %10s %14s %8s %12s\n", "method", "chunks", "unique bytes", "saved", "cut+hash MB/s");
+	printf("%-12s %10zu %14zu %7.1f%% %12s\n", "whole-file", whole.size(), whole_u,
+	       logical > 0 ? 100.0 - 100.0 * whole_u / logical : 0, "-");
+	for (size_t i = 0; i < avgs.size(); ++i)
+		printf("cdc %-8zu %10zu %14zu %7.1f%% %12.1f\n", avgs[i], chunks[i], unique[i],
+		       logical > 0 ? 100.0 - 100.0 * unique[i] / logical : 0,
+		       mbps(logical, ctime[i]));
+	if (scratch == nullptr)
+		return EXIT_SUCCESS;
+	auto root = std::string(scratch) + "/cdcreport-" + std::to_string(getpid());
+	if (mkdir(root.c_str(), S_IRWXU) != 0) {
+		fprintf(stderr, "%s: %s\n", root.c_str(), strerror(errno));
+		return EXIT_FAILURE;
+	}
+	bool ok = scratch_run(root, avgs[0], files);
+	std::vector<std::string> left;
+	collect(root + "/chunks", left);
+	if (!left.empty()) {
+		fprintf(stderr, "%zu chunks left behind after release\n", left.size());
+		ok = false;
+	}
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void find_instances(const std::string &dir, std::vector<std::string> &list)
+{
+	std::unique_ptr<DIR, int (*)(DIR *)> dh(opendir(dir.c_str()), closedir);
+	if (dh == nullptr)
+		return;
+	struct dirent *de;
+	while ((de = readdir(dh.get())) != nullptr) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		if (strcmp(de->d_name, "chunklist") == 0) {
+			list.push_back(dir);
+			continue;
+		}
+		auto sub = dir + "/" + de->d_name;
+		struct stat sb;
+		if (lstat(sub.c_str(), &sb) == 0 && S_ISDIR(sb.st_mode))
+			find_instances(sub, list);
+	}
+}
+
+static int store_mode(const std::string &root)
+{
+	std::vector<std::string> inst, files;
+	std::unique_ptr<DIR, int (*)(DIR *)> dh(opendir(root.c_str()), closedir);
+	if (dh == nullptr) {
+		fprintf(stderr, "%s: %s\n", root.c_str(), strerror(errno));
+		return EXIT_FAILURE;
+	}
+	struct dirent *de;
+	while ((de = readdir(dh.get())) != nullptr)
+		if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0 &&
+		    strcmp(de->d_name, "chunks") != 0)
+			find_instances(root + "/" + de->d_name, inst);
+	collect(root + "/chunks", files);
+
+	size_t physical = 0, logical = 0, nchunks = 0;
+	for (const auto &f : files) {
+		struct stat sb;
+		if (stat(f.c_str(), &sb) == 0)
+			physical += sb.st_size;
+	}
+	std::vector<char> buf(1 << 20);
+	bool fail = false;
+	auto t0 = clk::now();
+	for (const auto &dir : inst) {
+		chunk_reader rd;
+		if (!rd.open(dir)) {
+			fprintf(stderr, "%s: %s\n", dir.c_str(), strerror(errno));
+			fail = true;
+			continue;
+		}
+		size_t got = 0;
+		ssize_t ret;
+		while ((ret = rd.read(buf.data(), buf.size())) > 0)
+			got += ret;
+		if (ret < 0 || got != rd.size()) {
+			fprintf(stderr, "%s: reassembled %zu of %zu bytes\n", dir.c_str(), got, rd.size());
+			fail = true;
+		}
+		logical += got;
+	}
+	auto secs = std::chrono::duration<double>(clk::now() - t0).count();
+	for (const auto &dir : inst) {
+		std::vector<std::pair<std::string, size_t>> list;
+		size_t total;
+		if (chunk_list_read(dir, &list, &total))
+			nchunks += list.size();
+	}
+	printf("%zu chunked instances, %zu chunk references, %zu stored chunks\n",
+	       inst.size(), nchunks, files.size());
+	printf("logical %zu bytes, physical %zu bytes, saved %.1f%%\n", logical, physical,
+	       logical > 0 ? 100.0 - 100.0 * physical / logical : 0);
+	printf("reassembly %.1f MB/s\n", mbps(logical, secs));
+	return fail ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+	std::vector<size_t> avgs;
+	const char *store = nullptr, *scratch = nullptr;
+	int c;
+
+	while ((c = getopt(argc, argv, "a:s:w:")) != -1) {
+		if (c == 'a') {
+			char *end;
+			auto v = strtoull(optarg, &end, 0);
+			if (*end == 'k' || *end == 'K')
+				v <<= 10;
+			else if (*end == 'm' || *end == 'M')
+				v <<= 20;
+			if (v == 0) {
+				usage();
+				return EXIT_FAILURE;
+			}
+			avgs.push_back(v);
+		} else if (c == 's') {
+			store = optarg;
+		} else if (c == 'w') {
+			scratch = optarg;
+		} else {
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+	if (store != nullptr)
+		return store_mode(store);
+	std::vector<std::string> files;
+	for (int i = optind; i < argc; ++i)
+		collect(argv[i], files);
+	if (files.empty()) {
+		usage();
+		return EXIT_FAILURE;
+	}
+	return corpus_mode(std::move(avgs), scratch, files);
+}
@@ -0,0 +1,113 @@
+/* SPDX-License-Identifier: AGPL-3.0-only */
+/* Copyright 2016+, Kopano and its licensors */
+#include <kopano/platform.h>
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <strings.h>
+#include "LDAPDNIndex.h"
+/*
+ * Builds the company DN index of a hosted setup (top-level companies with
+ * subcompanies, users spread over all of them) and resolves the closest
+ * company of every user and the subcompanies of every top-level company,
+ * once through dn_index and once with the linear suffix scan over the
+ * company list that the LDAP plugin used before.
+ *
+ * Usage: dnindexbench [companies [subcompanies [users-per-company]]]
+ */
+
+using namespace KC;
+using clk = std::chrono::steady_clock;
+
+static const std::string base = "dc=example,dc=com";
+
+/* Whether @dn is strictly below @parent, by string suffix */
+static bool suffix_below(const std::string &dn, const std::string &parent)
+{
+	if (dn.size() <= parent.size() + 1)
+		return false;
+	auto pos = dn.size() - parent.size();
+	return dn[pos-1] == ',' && strcasecmp(dn.c_str() + pos, parent.c_str()) == 0;
+}
+
+static const std::string *scan_ancestor(const dn_cache_t &m, const std::string &dn)
+{
+	const std::string *found = nullptr;
+	for (const auto &o : m)
+		if (suffix_below(dn, o.second) &&
+		    (found == nullptr || o.second.size() > found->size()))
+			found = &o.second;
+	return found;
+}
+
+static size_t scan_descendants(const dn_cache_t &m, const std::string &dn)
+{
+	size_t n = 0;
+	for (const auto &o : m)
+		if (suffix_below(o.second, dn))
+			++n;
+	return n;
+}
+
+static double secs(clk::time_point a, clk::time_point b)
+{
+	return std::chrono::duration<double>(b - a).count();
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int ncomp = argc > 1 ? strtoul(argv[1], nullptr, 0) : 1000;
+	unsigned int nsub  = argc > 2 ? strtoul(argv[2], nullptr, 0) : 4;
+	unsigned int nuser = argc > 3 ? strtoul(argv[3], nullptr, 0) : 20;
+
+	dn_cache_t companies;
+	std::vector<std::string> tops, users;
+	for (unsigned int c = 0; c < ncomp; ++c) {
+		auto top = "o=company" + std::to_string(c) + "," + base;
+		tops.emplace_back(top);
+		companies.emplace(objectid_t(top, CONTAINER_COMPANY), top);
+		for (unsigned int s = 0; s < nsub; ++s) {
+			auto sub = "o=sub" + std::to_string(s) + "," + top;
+			companies.emplace(objectid_t(sub, CONTAINER_COMPANY), sub);
+		}
+	}
+	for (const auto &o : companies)
+		for (unsigned int u = 0; u < nuser; ++u)
+			users.emplace_back("uid=user" + std::to_string(u) + "," + o.second);
+	auto mapcopy = companies;
+	printf("%zu companies, %zu users\n", companies.size(), users.size());
+
+	auto t0 = clk::now();
+	dn_index idx(std::move(companies));
+	auto t1 = clk::now();
+	size_t hits = 0;
+	for (const auto &u : users)
+		hits += idx.ancestor(u) != nullptr;
+	auto t2 = clk::now();
+	size_t kids = 0;
+	for (const auto &t : tops)
+		kids += idx.descendants(t).size();
+	auto t3 = clk::now();
+	printf("trie: build %.3f s, ancestor %.3f s (%zu found), descendants %.3f s (%zu found)\n",
+		secs(t0, t1), secs(t1, t2), hits, secs(t2, t3), kids);
+
+	t1 = clk::now();
+	size_t shits = 0;
+	for (const auto &u : users)
+		shits += scan_ancestor(mapcopy, u) != nullptr;
+	t2 = clk::now();
+	size_t skids = 0;
+	for (const auto &t : tops)
+		skids += scan_descendants(mapcopy, t);
+	t3 = clk::now();
+	printf("scan:                ancestor %.3f s (%zu found), descendants %.3f s (%zu found)\n",
+		secs(t1, t2), shits, secs(t2, t3), skids);
+	if (hits != shits || kids != skids) {
+		fprintf(stderr, "Result mismatch between trie and scan\n");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
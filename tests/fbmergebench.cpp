@@ -0,0 +1,76 @@
+/* SPDX-License-Identifier: AGPL-3.0-only */
+/* Copyright 2016+, Kopano and its licensors */
+#include <chrono>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <kopano/platform.h>
+#include <kopano/timeutil.hpp>
+#include "PublishFreeBusy.h"
+#include "recurrence.h"
+/*
+ * Builds the free/busy blocks of a synthetic heavy calendar, the way
+ * HrPublishDefaultCalendar does: a number of daily and weekly recurring
+ * meetings that started years ago, each expanded over the publish period,
+ * then merged. Reports the time spent in either step.
+ *
+ * Usage: fbmergebench [recurrences [years-ago [months]]]
+ */
+
+using namespace KC;
+using clk = std::chrono::steady_clock;
+
+int main(int argc, char **argv)
+{
+	unsigned int nrec = argc > 1 ? strtoul(argv[1], nullptr, 0) : 500;
+	unsigned int years = argc > 2 ? strtoul(argv[2], nullptr, 0) : 10;
+	unsigned int months = argc > 3 ? strtoul(argv[3], nullptr, 0) : 6;
+	auto now = time(nullptr);
+	auto first = now - years * 365 * 86400;
+	auto end = now + months * 30 * 86400;
+	TIMEZONE_STRUCT tz{};
+
+	std::vector<recurrence> recs(nrec);
+	for (unsigned int i = 0; i < nrec; ++i) {
+		auto &r = recs[i];
+		r.setFrequency(i % 3 == 0 ? recurrence::WEEKLY : recurrence::DAILY);
+		if (i % 3 == 0)
+			r.setWeekDays(0x3e); /* mon-fri */
+		r.setEndType(recurrence::NEVER);
+		r.setStartDate(first + (i % 365) * 86400);
+		/* Overlapping meetings between 08:00 and 18:00 */
+		auto start = 8 * 60 + (i * 37) % 540;
+		r.setStartTimeOffset(start);
+		r.setEndTimeOffset(start + 30 + (i % 4) * 15);
+	}
+
+	std::vector<FBBlock_1> blocks;
+	std::vector<OccrInfo> occrs;
+	auto t0 = clk::now();
+	for (unsigned int i = 0; i < nrec; ++i) {
+		occrs.clear();
+		if (recs[i].HrGetItems(now, end, tz, i % 5 == 0 ? fbTentative : fbBusy, occrs) != hrSuccess) {
+			fprintf(stderr, "expansion of recurrence %u failed\n", i);
+			return EXIT_FAILURE;
+		}
+		for (const auto &o : occrs)
+			blocks.emplace_back(o.fbBlock);
+	}
+	auto t1 = clk::now();
+	auto nblocks = blocks.size();
+	fb_merge_blocks(blocks);
+	auto t2 = clk::now();
+
+	for (size_t i = 1; i < blocks.size(); ++i)
+		if (blocks[i].m_tmStart < blocks[i-1].m_tmEnd) {
+			fprintf(stderr, "merged blocks %zu and %zu overlap\n", i - 1, i);
+			return EXIT_FAILURE;
+		}
+	printf("%u recurrences from %u years ago, %u months published\n", nrec, years, months);
+	printf("expand: %8zu occurrences in %.3f s\n", nblocks,
+	       std::chrono::duration<double>(t1 - t0).count());
+	printf("merge:  %8zu blocks in %.3f s\n", blocks.size(),
+	       std::chrono::duration<double>(t2 - t1).count());
+	return EXIT_SUCCESS;
+}
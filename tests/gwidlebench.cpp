@@ -0,0 +1,155 @@
+/* SPDX-License-Identifier: AGPL-3.0-only */
+/* Copyright 2016+, Kopano and its licensors */
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+/*
+ * Opens many IMAP connections to kopano-gateway and leaves them idle (or,
+ * with credentials, logged in and in IDLE), then reports the memory and
+ * thread count of the gateway process, to compare the process models.
+ *
+ * Usage: gwidlebench host port count gateway-pid [user password [hold-secs]]
+ */
+
+using namespace std::string_literals;
+using clk = std::chrono::steady_clock;
+
+struct proc_usage {
+	unsigned long rss_kb = 0, threads = 0;
+};
+
+static proc_usage usage_of(pid_t pid)
+{
+	proc_usage u;
+	char path[64], line[256];
+	snprintf(path, sizeof(path), "/proc/%d/status", static_cast<int>(pid));
+	auto fp = fopen(path, "r");
+	if (fp == nullptr)
+		return u;
+	while (fgets(line, sizeof(line), fp) != nullptr) {
+		if (strncmp(line, "VmRSS:", 6) == 0)
+			u.rss_kb = strtoul(line + 6, nullptr, 10);
+		else if (strncmp(line, "Threads:", 8) == 0)
+			u.threads = strtoul(line + 8, nullptr, 10);
+	}
+	fclose(fp);
+	return u;
+}
+
+/* Read until a line starting with @want, or a tagged answer, arrives */
+static bool expect(int fd, const char *want)
+{
+	std::string buf;
+	char tmp[512];
+	while (true) {
+		struct pollfd pfd = {fd, POLLIN, 0};
+		if (poll(&pfd, 1, 30000) <= 0)
+			return false;
+		auto n = read(fd, tmp, sizeof(tmp));
+		if (n <= 0)
+			return false;
+		buf.append(tmp, n);
+		size_t pos;
+		while ((pos = buf.find("\r\n")) != std::string::npos) {
+			auto line = buf.substr(0, pos);
+			buf.erase(0, pos + 2);
+			if (line.compare(0, strlen(want), want) == 0)
+				return true;
+			if (line.compare(0, 2, "b ") == 0)
+				return false;
+		}
+	}
+}
+
+static bool send_str(int fd, const std::string &s)
+{
+	return write(fd, s.data(), s.size()) == static_cast<ssize_t>(s.size());
+}
+
+static int open_client(const struct addrinfo *ai, const char *user, const char *pass)
+{
+	int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0 || !expect(fd, "* OK")) {
+		close(fd);
+		return -1;
+	}
+	if (user == nullptr)
+		return fd;
+	if (!send_str(fd, "b LOGIN \""s + user + "\" \"" + pass + "\"\r\n") ||
+	    !expect(fd, "b OK") ||
+	    !send_str(fd, "b SELECT INBOX\r\n") || !expect(fd, "b OK") ||
+	    !send_str(fd, "b IDLE\r\n") || !expect(fd, "+")) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 5) {
+		fprintf(stderr, "Usage: %s host port count gateway-pid [user password [hold-secs]]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	unsigned int count = strtoul(argv[3], nullptr, 0);
+	pid_t pid = strtoul(argv[4], nullptr, 0);
+	const char *user = argc > 6 ? argv[5] : nullptr, *pass = argc > 6 ? argv[6] : nullptr;
+	unsigned int hold = argc > 7 ? strtoul(argv[7], nullptr, 0) : 10;
+
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < count + 16) {
+		rl.rlim_cur = std::min(static_cast<rlim_t>(count + 16), rl.rlim_max);
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	struct addrinfo hints{}, *ai = nullptr;
+	hints.ai_socktype = SOCK_STREAM;
+	auto rc = getaddrinfo(argv[1], argv[2], &hints, &ai);
+	if (rc != 0) {
+		fprintf(stderr, "%s: %s\n", argv[1], gai_strerror(rc));
+		return EXIT_FAILURE;
+	}
+
+	auto before = usage_of(pid);
+	std::vector<int> fds;
+	auto t0 = clk::now();
+	for (unsigned int i = 0; i < count; ++i) {
+		auto fd = open_client(ai, user, pass);
+		if (fd < 0) {
+			fprintf(stderr, "connection %u failed: %s\n", i, strerror(errno));
+			break;
+		}
+		fds.push_back(fd);
+		if (i % 1000 == 999)
+			printf("%u connections open\n", i + 1);
+	}
+	freeaddrinfo(ai);
+	auto secs = std::chrono::duration<double>(clk::now() - t0).count();
+	printf("%zu %s connections in %.3f s\n", fds.size(), user != nullptr ? "IDLE" : "idle", secs);
+	std::this_thread::sleep_for(std::chrono::seconds(hold));
+
+	auto after = usage_of(pid);
+	printf("gateway before: %8lu kB RSS %6lu threads\n", before.rss_kb, before.threads);
+	printf("gateway after:  %8lu kB RSS %6lu threads\n", after.rss_kb, after.threads);
+	if (!fds.empty() && after.rss_kb > before.rss_kb)
+		printf("per connection: %8.1f kB\n",
+		       static_cast<double>(after.rss_kb - before.rss_kb) / fds.size());
+	for (auto fd : fds) {
+		if (user != nullptr)
+			send_str(fd, "DONE\r\nb LOGOUT\r\n");
+		close(fd);
+	}
+	return fds.size() == count ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,175 @@
+/* SPDX-License-Identifier: AGPL-3.0-only */
+/* Copyright 2016+, Kopano and its licensors */
+#include <chrono>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <kopano/platform.h>
+#include <mapidefs.h>
+#include <mapi.h>
+#include <mapiutil.h>
+#include <edkmdb.h>
+#include <kopano/CommonUtil.h>
+#include <kopano/MAPIErrors.h>
+#include <kopano/charset/convert.h>
+#include <kopano/hl.hpp>
+#include <kopano/memory.hpp>
+#include "tbi.hpp"
+/*
+ * Fills a folder in the store of one user with messages (each with
+ * recipients, a multi-valued property, and every fourth with an
+ * attachment), then copies it with ICS into a folder in the store of
+ * another user, the way kopano-backup and the migration tools do. With
+ * enhanced ICS, that is exportMessageChangesAsStream on one side and
+ * importMessageFromStream on the other. Reports messages per second.
+ *
+ * Usage: icscopybench user1 pass1 user2 pass2 [count [body-kb]]
+ */
+
+using namespace KC;
+using clk = std::chrono::steady_clock;
+
+static KFolder make_folder(KStore &store, const std::string &name)
+{
+	object_ptr<IMAPIFolder> fld;
+	auto ret = store.open_root(MAPI_MODIFY)->CreateFolder(FOLDER_GENERIC,
+	           reinterpret_cast<const TCHAR *>(name.c_str()), nullptr, nullptr,
+	           OPEN_IF_EXISTS, &~fld);
+	if (ret != hrSuccess)
+		throw KMAPIError(ret);
+	return KFolder(std::move(fld));
+}
+
+static void drop_folder(KStore &store, KFolder &fld)
+{
+	memory_ptr<SPropValue> eid;
+	if (HrGetOneProp(fld, PR_ENTRYID, &~eid) != hrSuccess)
+		return;
+	store.open_root(MAPI_MODIFY)->DeleteFolder(eid->Value.bin.cb,
+		reinterpret_cast<const ENTRYID *>(eid->Value.bin.lpb), 0, nullptr,
+		DEL_MESSAGES | DEL_FOLDERS | DELETE_HARD_DELETE);
+}
+
+static void fill(KFolder &fld, unsigned int count, unsigned int body_kb)
+{
+	std::string body(body_kb * 1024, 'x');
+	char *cats[] = {const_cast<char *>("alpha"), const_cast<char *>("beta"), const_cast<char *>("gamma")};
+
+	for (unsigned int i = 0; i < count; ++i) {
+		auto msg = fld.create_message();
+		auto subject = "icscopybench " + std::to_string(i);
+		SPropValue p[3];
+		p[0].ulPropTag = PR_SUBJECT_A;
+		p[0].Value.lpszA = const_cast<char *>(subject.c_str());
+		p[1].ulPropTag = PR_BODY_A;
+		p[1].Value.lpszA = const_cast<char *>(body.c_str());
+		p[2].ulPropTag = PROP_TAG(PT_MV_STRING8, 0x6900);
+		p[2].Value.MVszA.cValues = 1 + i % 3;
+		p[2].Value.MVszA.lppszA = cats;
+		auto ret = msg->SetProps(3, p, nullptr);
+		if (ret != hrSuccess)
+			throw KMAPIError(ret);
+
+		for (unsigned int r = 0; r < 4; ++r) {
+			auto addr = "rcpt" + std::to_string(r) + "@example.com";
+			SPropValue rp[4];
+			rp[0].ulPropTag = PR_RECIPIENT_TYPE;
+			rp[0].Value.ul = r == 0 ? MAPI_TO : MAPI_CC;
+			rp[1].ulPropTag = PR_DISPLAY_NAME_A;
+			rp[1].Value.lpszA = const_cast<char *>(addr.c_str());
+			rp[2].ulPropTag = PR_ADDRTYPE_A;
+			rp[2].Value.lpszA = const_cast<char *>("SMTP");
+			rp[3].ulPropTag = PR_EMAIL_ADDRESS_A;
+			rp[3].Value.lpszA = const_cast<char *>(addr.c_str());
+			memory_ptr<ADRLIST> al;
+			ret = MAPIAllocateBuffer(CbNewADRLIST(1), &~al);
+			if (ret != hrSuccess)
+				throw KMAPIError(ret);
+			al->cEntries = 1;
+			al->aEntries[0].cValues = 4;
+			al->aEntries[0].rgPropVals = rp;
+			ret = msg->ModifyRecipients(MODRECIP_ADD, al);
+			if (ret != hrSuccess)
+				throw KMAPIError(ret);
+		}
+
+		if (i % 4 == 0) {
+			auto at = msg.create_attach();
+			SPropValue ap[3];
+			ap[0].ulPropTag = PR_ATTACH_METHOD;
+			ap[0].Value.ul = ATTACH_BY_VALUE;
+			ap[1].ulPropTag = PR_ATTACH_FILENAME_A;
+			ap[1].Value.lpszA = const_cast<char *>("data.bin");
+			ap[2].ulPropTag = PR_ATTACH_DATA_BIN;
+			ap[2].Value.bin.cb = body.size();
+			ap[2].Value.bin.lpb = reinterpret_cast<BYTE *>(const_cast<char *>(body.data()));
+			ret = at->SetProps(3, ap, nullptr);
+			if (ret != hrSuccess)
+				throw KMAPIError(ret);
+			at.save_changes();
+		}
+		msg.save_changes();
+	}
+}
+
+static void copy(KFolder &src, KFolder &dst)
+{
+	object_ptr<IExchangeExportChanges> exp;
+	object_ptr<IExchangeImportContentsChanges> imp;
+	auto ret = src->OpenProperty(PR_CONTENTS_SYNCHRONIZER, &IID_IExchangeExportChanges, 0, 0, &~exp);
+	if (ret != hrSuccess)
+		throw KMAPIError(ret);
+	ret = dst->OpenProperty(PR_COLLECTOR, &IID_IExchangeImportContentsChanges, 0, 0, &~imp);
+	if (ret != hrSuccess)
+		throw KMAPIError(ret);
+	ret = imp->Config(nullptr, 0);
+	if (ret != hrSuccess)
+		throw KMAPIError(ret);
+	ret = exp->Config(nullptr, SYNC_NORMAL, imp, nullptr, nullptr, nullptr, 0);
+	if (ret != hrSuccess)
+		throw KMAPIError(ret);
+	unsigned int steps = 0, progress = 0;
+	do {
+		ret = exp->Synchronize(&steps, &progress);
+		if (FAILED(ret))
+			throw KMAPIError(ret);
+	} while (ret == SYNC_W_PROGRESS);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 5) {
+		fprintf(stderr, "Usage: %s user1 pass1 user2 pass2 [count [body-kb]]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	unsigned int count = argc > 5 ? strtoul(argv[5], nullptr, 0) : 1000;
+	unsigned int body_kb = argc > 6 ? strtoul(argv[6], nullptr, 0) : 4;
+	auto name = "icscopybench-" + std::to_string(getpid());
+
+	try {
+		auto u1 = convert_to<std::wstring>(argv[1]), p1 = convert_to<std::wstring>(argv[2]);
+		auto u2 = convert_to<std::wstring>(argv[3]), p2 = convert_to<std::wstring>(argv[4]);
+		auto store1 = KSession(u1.c_str(), p1.c_str()).open_default_store();
+		auto store2 = KSession(u2.c_str(), p2.c_str()).open_default_store();
+		auto src = make_folder(store1, name), dst = make_folder(store2, name);
+
+		auto t0 = clk::now();
+		fill(src, count, body_kb);
+		auto t1 = clk::now();
+		copy(src, dst);
+		auto t2 = clk::now();
+
+		auto fill_s = std::chrono::duration<double>(t1 - t0).count();
+		auto copy_s = std::chrono::duration<double>(t2 - t1).count();
+		printf("%u messages, %u kB body, 4 recipients, 1 in 4 with attachment\n", count, body_kb);
+		printf("create: %.3f s, %.1f msg/s\n", fill_s, count / fill_s);
+		printf("copy:   %.3f s, %.1f msg/s\n", copy_s, count / copy_s);
+		drop_folder(store1, src);
+		drop_folder(store2, dst);
+	} catch (const KMAPIError &e) {
+		fprintf(stderr, "%s (%x)\n", e.what(), e.code());
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
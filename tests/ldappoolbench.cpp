@@ -0,0 +1,174 @@
+/* SPDX-License-Identifier: AGPL-3.0-only */
+/* Copyright 2016+, Kopano and its licensors */
+#include <kopano/platform.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ldap.h>
+#include <kopano/ECConfig.h>
+#include "StatsClient.h"
+#include "LDAPPool.h"
+/*
+ * Resolves every DN below a search base with base-scope searches, the way
+ * the LDAP plugin resolves group members and managers: first one search
+ * at a time per leased connection, then pipelined, from several threads
+ * sharing a connection pool. Point it at a local slapd, e.g.
+ *
+ * Usage: ldappoolbench ldap://localhost/ dc=example,dc=com
+ *        [binddn bindpw [threads [pool-size [depth]]]]
+ */
+
+using namespace KC;
+using namespace std::string_literals;
+using clk = std::chrono::steady_clock;
+
+static const char *bind_dn, *bind_pw, *uri;
+static struct timeval timeout = {30, 0};
+
+static LDAP *connect_ldap()
+{
+	static const int version = LDAP_VERSION3;
+	LDAP *ld = nullptr;
+	auto rc = ldap_initialize(&ld, uri);
+	if (rc != LDAP_SUCCESS)
+		throw std::runtime_error("ldap_initialize: "s + ldap_err2string(rc));
+	ldap_set_option(ld, LDAP_OPT_PROTOCOL_VERSION, &version);
+	ldap_set_option(ld, LDAP_OPT_REFERRALS, LDAP_OPT_OFF);
+	struct berval cred;
+	cred.bv_val = const_cast<char *>(bind_pw);
+	cred.bv_len = strlen(bind_pw);
+	rc = ldap_sasl_bind_s(ld, *bind_dn != '\0' ? bind_dn : nullptr,
+	     LDAP_SASL_SIMPLE, &cred, nullptr, nullptr, nullptr);
+	if (rc != LDAP_SUCCESS) {
+		ldap_unbind_ext(ld, nullptr, nullptr);
+		throw std::runtime_error("bind: "s + ldap_err2string(rc));
+	}
+	return ld;
+}
+
+static std::vector<std::string> list_dns(LDAPPool &pool, const char *base)
+{
+	static const char *const attrs[] = {"1.1", nullptr};
+	std::vector<std::string> dns;
+	auto l = pool.acquire(connect_ldap);
+	LDAPMessage *res = nullptr;
+	auto rc = ldap_search_ext_s(l.get(), base, LDAP_SCOPE_SUBTREE, nullptr,
+	          const_cast<char **>(attrs), 0, nullptr, nullptr, &timeout, 0, &res);
+	if (rc != LDAP_SUCCESS && rc != LDAP_SIZELIMIT_EXCEEDED) {
+		ldap_msgfree(res);
+		throw std::runtime_error("listing "s + base + ": " + ldap_err2string(rc));
+	}
+	for (auto e = ldap_first_entry(l.get(), res); e != nullptr; e = ldap_next_entry(l.get(), e)) {
+		auto dn = ldap_get_dn(l.get(), e);
+		dns.emplace_back(dn);
+		ldap_memfree(dn);
+	}
+	ldap_msgfree(res);
+	return dns;
+}
+
+/* One search at a time, each on its own lease, like my_ldap_search_s */
+static size_t resolve_serial(LDAPPool &pool, const std::vector<std::string> &dns)
+{
+	size_t found = 0;
+	for (const auto &dn : dns) {
+		auto l = pool.acquire(connect_ldap);
+		LDAPMessage *res = nullptr;
+		auto t0 = clk::now();
+		auto rc = ldap_search_ext_s(l.get(), dn.c_str(), LDAP_SCOPE_BASE,
+		          nullptr, nullptr, 0, nullptr, nullptr, &timeout, 0, &res);
+		l.done(std::chrono::duration_cast<std::chrono::microseconds>(clk::now() - t0).count(), 1, rc == LDAP_SUCCESS);
+		if (rc == LDAP_SUCCESS && ldap_count_entries(l.get(), res) == 1)
+			++found;
+		ldap_msgfree(res);
+	}
+	return found;
+}
+
+static size_t resolve_pipelined(LDAPPool &pool, const std::vector<std::string> &dns,
+    unsigned int depth)
+{
+	std::vector<LDAPPool::pipeline::search> s;
+	for (const auto &dn : dns)
+		s.push_back({dn, "", LDAP_SCOPE_BASE, nullptr});
+	std::vector<bool> done(s.size());
+	size_t found = 0;
+	auto l = pool.acquire(connect_ldap);
+	LDAPPool::pipeline pipe(l, depth, &timeout);
+	auto rc = pipe.run(s, done, [&](size_t, int err, LDAPMessage *res) {
+		if (err == LDAP_SUCCESS && ldap_count_entries(l.get(), res) == 1)
+			++found;
+	});
+	if (rc != LDAP_SUCCESS)
+		fprintf(stderr, "pipeline: %s\n", ldap_err2string(rc));
+	return found;
+}
+
+static void print_stat(const std::string &name, const std::string &, const std::string &value, void *)
+{
+	if (strncmp(name.c_str(), "ldap_", 5) == 0)
+		printf("  %-20s %s\n", name.c_str(), value.c_str());
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s uri base [binddn bindpw [threads [pool-size [depth]]]]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	uri = argv[1];
+	bind_dn = argc > 3 ? argv[3] : "";
+	bind_pw = argc > 4 ? argv[4] : "";
+	unsigned int nthr = argc > 5 ? strtoul(argv[5], nullptr, 0) : 8;
+	unsigned int npool = argc > 6 ? strtoul(argv[6], nullptr, 0) : 4;
+	unsigned int depth = argc > 7 ? strtoul(argv[7], nullptr, 0) : 32;
+
+	static const configsetting_t defaults[] = {{nullptr, nullptr}};
+	std::shared_ptr<ECConfig> cfg(ECConfig::Create(defaults));
+	auto sc = std::make_shared<ECStatsCollector>(cfg);
+	LDAPPool pool(sc, npool);
+	std::vector<std::string> dns;
+	try {
+		dns = list_dns(pool, argv[2]);
+	} catch (const std::exception &e) {
+		fprintf(stderr, "%s\n", e.what());
+		return EXIT_FAILURE;
+	}
+	printf("%zu DNs, %u threads, %u connections, depth %u\n", dns.size(), nthr, npool, depth);
+
+	bool ok = true;
+	for (auto pipelined : {false, true}) {
+		std::vector<std::thread> thr;
+		std::atomic<size_t> found{0};
+		std::atomic<bool> failed{false};
+		auto t0 = clk::now();
+		for (unsigned int i = 0; i < nthr; ++i)
+			thr.emplace_back([&]() {
+				try {
+					found += pipelined ? resolve_pipelined(pool, dns, depth) :
+					         resolve_serial(pool, dns);
+				} catch (const std::exception &e) {
+					fprintf(stderr, "%s\n", e.what());
+					failed = true;
+				}
+			});
+		for (auto &t : thr)
+			t.join();
+		auto secs = std::chrono::duration<double>(clk::now() - t0).count();
+		printf("%-10s %8.3f s %10.0f lookups/s\n", pipelined ? "pipelined" : "serial",
+		       secs, secs > 0 ? nthr * dns.size() / secs : 0);
+		if (failed || found != nthr * dns.size()) {
+			fprintf(stderr, "%s: resolved %zu of %zu\n", pipelined ? "pipelined" : "serial",
+			        found.load(), nthr * dns.size());
+			ok = false;
+		}
+	}
+	sc->ForEachStat(print_stat, nullptr);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,10 +1,15 @@
 /* SPDX-License-Identifier: LGPL-3.0-or-later */
 /* Copyright 2016, Kopano and its licensors */
 #include <chrono>
+#include <thread>
 #include <utility>
+#include <vector>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
+#include <kopano/platform.h>
 #include <mapix.h>
 /*
  * This program simulates MAPIAllocateMore allocations to measure allocation
@@ -28,8 +33,18 @@
  * 5. Now go, hack on MAPIAllocateMore, and bring down that walltime.
  *
  * The allocation sizes do not matter, so that is fixed.
+ *
+ * == Mixed sizes, threads ==
+ * Afterwards, row sets with property arrays and strings of varying sizes
+ * are built and torn down (like QueryRows results), and a number of threads
+ * allocate children of one shared root at the same time. Each child is
+ * filled and checked, to see that no two of them overlap.
+ *
+ * Usage: mapialloctime [threads]
  */
 
+using namespace KC;
+
 /* MAPIAllocateBuffer size distribution */
 static constexpr std::pair<unsigned int, unsigned int> dist[] = {
 	{0, 590147}, {1, 458653}, {2, 22764}, {3, 13161}, {4, 15343},
@@ -53,7 +68,77 @@ static constexpr std::pair<unsigned int, unsigned int> dist[] = {
 };
 static constexpr size_t alloc_size = 32;
 
-int main()
+static size_t ns_since(const struct timespec &start)
+{
+	struct timespec stop;
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	auto delta = std::chrono::seconds(stop.tv_sec) + std::chrono::nanoseconds(stop.tv_nsec) -
+	             (std::chrono::seconds(start.tv_sec) + std::chrono::nanoseconds(start.tv_nsec));
+	return delta.count();
+}
+
+/* A root with @rows "rows" of 12 properties, a third of them strings */
+static bool rowset(unsigned int rows)
+{
+	static constexpr size_t sizes[] = {9, 17, 24, 33, 48, 70, 130, 260};
+	void *root = nullptr;
+	if (MAPIAllocateBuffer(rows * 12 * 16, &root) != hrSuccess)
+		return false;
+	std::vector<std::pair<unsigned char *, size_t>> kids;
+	kids.reserve(rows * 4);
+	for (unsigned int i = 0; i < rows * 4; ++i) {
+		void *p = nullptr;
+		auto z = sizes[i % ARRAY_SIZE(sizes)];
+		if (MAPIAllocateMore(z, root, &p) != hrSuccess ||
+		    reinterpret_cast<uintptr_t>(p) % alignof(::max_align_t) != 0)
+			return false;
+		memset(p, i, z);
+		kids.emplace_back(static_cast<unsigned char *>(p), z);
+	}
+	bool ok = true;
+	for (size_t i = 0; i < kids.size() && ok; ++i)
+		for (size_t j = 0; j < kids[i].second; ++j)
+			if (kids[i].first[j] != static_cast<unsigned char>(i)) {
+				ok = false;
+				break;
+			}
+	MAPIFreeBuffer(root);
+	return ok;
+}
+
+static bool shared_root(unsigned int nthr, unsigned int per_thread)
+{
+	void *root = nullptr;
+	if (MAPIAllocateBuffer(alloc_size, &root) != hrSuccess)
+		return false;
+	std::vector<std::vector<unsigned int *>> kids(nthr);
+	std::vector<std::thread> thr;
+	for (unsigned int t = 0; t < nthr; ++t)
+		thr.emplace_back([&, t]() {
+			for (unsigned int i = 0; i < per_thread; ++i) {
+				void *p = nullptr;
+				if (MAPIAllocateMore(sizeof(unsigned int) * 4, root, &p) != hrSuccess)
+					continue;
+				auto u = static_cast<unsigned int *>(p);
+				u[0] = u[1] = u[2] = u[3] = t * per_thread + i;
+				kids[t].push_back(u);
+			}
+		});
+	for (auto &t : thr)
+		t.join();
+	bool ok = true;
+	for (unsigned int t = 0; t < nthr; ++t) {
+		if (kids[t].size() != per_thread)
+			ok = false;
+		for (unsigned int i = 0; i < kids[t].size(); ++i)
+			if (kids[t][i][0] != t * per_thread + i || kids[t][i][3] != kids[t][i][0])
+				ok = false;
+	}
+	MAPIFreeBuffer(root);
+	return ok;
+}
+
+int main(int argc, char **argv)
 {
 	struct timespec gstart, gstop, start, stop;
 	size_t cnt_alloc = 0, cnt_more = 0;
@@ -90,5 +175,23 @@ int main()
 
 	printf("MAPIAllocateBuffer calls: %zu\n", cnt_alloc);
 	printf("MAPIAllocateMore calls: %zu\n", cnt_more);
-	return EXIT_SUCCESS;
+
+	bool ok = true;
+	for (unsigned int rows : {10, 100, 1000, 10000}) {
+		unsigned int reps = 1000000 / rows / 4;
+		clock_gettime(CLOCK_MONOTONIC, &gstart);
+		for (unsigned int i = 0; i < reps; ++i)
+			ok &= rowset(rows);
+		printf("rowset of %u rows: %zu ns\n", rows, ns_since(gstart) / reps);
+	}
+
+	unsigned int nthr = argc > 1 ? strtoul(argv[1], nullptr, 0) : 4;
+	clock_gettime(CLOCK_MONOTONIC, &gstart);
+	for (unsigned int i = 0; i < 20; ++i)
+		ok &= shared_root(nthr, 50000);
+	printf("%u threads on one root: %zu ns per MAPIAllocateMore\n", nthr,
+	       ns_since(gstart) / (20 * nthr * 50000));
+	if (!ok)
+		fprintf(stderr, "Allocation check failed\n");
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,206 @@
+/* SPDX-License-Identifier: AGPL-3.0-only */
+/* Copyright 2016+, Kopano and its licensors */
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+#include <kopano/platform.h>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdsoap2.h>
+#include <kopano/ECConfig.h>
+#include <kopano/memory.hpp>
+#include "ECSerializer.h"
+#include "ECAttachmentStorage.h"
+#include "ECS3Attachment.h"
+/*
+ * Stores objects of various sizes into an S3 bucket through the server's
+ * attachment_storage=s3 backend, reads them back as a blob and through a
+ * serializer, verifies them, and removes them again. Objects above
+ * attachment_s3_part_size go through the parallel multipart path; with
+ * attachment_s3_cache_path set, the second read of each object shows the
+ * local cache. Point it at a scratch bucket (e.g. a local MinIO).
+ *
+ * Usage: s3bench server.cfg [size...]
+ */
+
+using namespace KC;
+using clk = std::chrono::steady_clock;
+
+#ifdef HAVE_LIBS3_H
+namespace {
+
+class mem_serializer final : public ECSerializer {
+	public:
+	mem_serializer(std::string &s) : m_data(s) {}
+	ECRESULT SetBuffer(void *) override { return KCERR_NO_SUPPORT; }
+	ECRESULT Write(const void *p, size_t size, size_t n) override
+	{
+		m_data.append(static_cast<const char *>(p), size * n);
+		return erSuccess;
+	}
+	ECRESULT Read(void *p, size_t size, size_t n) override
+	{
+		if (m_pos + size * n > m_data.size())
+			return KCERR_CALL_FAILED;
+		memcpy(p, &m_data[m_pos], size * n);
+		m_pos += size * n;
+		return erSuccess;
+	}
+	ECRESULT Skip(size_t size, size_t n) override
+	{
+		m_pos += size * n;
+		return erSuccess;
+	}
+	ECRESULT Flush() override { return erSuccess; }
+	ECRESULT Stat(ULONG *, ULONG *) override { return KCERR_NO_SUPPORT; }
+
+	private:
+	std::string &m_data;
+	size_t m_pos = 0;
+};
+
+}
+
+static double mbps(size_t bytes, double secs)
+{
+	return secs > 0 ? bytes / secs / 1048576 : 0;
+}
+
+static double since(clk::time_point t)
+{
+	return std::chrono::duration<double>(clk::now() - t).count();
+}
+
+static bool bench(ECS3Attachment *s3, unsigned int siid, size_t size)
+{
+	std::string data(size, '\0'), back;
+	std::mt19937 rng(siid);
+	for (auto &c : data)
+		c = rng();
+
+	ext_siid id(siid);
+	auto t0 = clk::now();
+	auto ret = s3->SaveAttachmentInstance(id, 0, data.size(),
+	           reinterpret_cast<unsigned char *>(&data[0]));
+	auto t_put = since(t0);
+	if (ret != erSuccess) {
+		fprintf(stderr, "%u: save failed: 0x%x\n", siid, ret);
+		return false;
+	}
+
+	/* Blob load (the gsoap path), twice: from S3, then from the cache */
+	double t_get[2]{};
+	bool ok = true;
+	for (unsigned int pass = 0; pass < 2 && ok; ++pass) {
+		auto soap = soap_new();
+		size_t got = 0;
+		unsigned char *buf = nullptr;
+		t0 = clk::now();
+		ret = s3->LoadAttachmentInstance(soap, id, &got, &buf);
+		t_get[pass] = since(t0);
+		if (ret != erSuccess || got != size || memcmp(buf, data.data(), size) != 0) {
+			fprintf(stderr, "%u: blob load mismatch (%zu/%zu bytes)\n", siid, got, size);
+			ok = false;
+		}
+		soap_destroy(soap);
+		soap_end(soap);
+		soap_free(soap);
+	}
+
+	/* Serializer load (the streaming path) */
+	mem_serializer sink(back);
+	size_t got = 0;
+	t0 = clk::now();
+	ret = s3->LoadAttachmentInstance(id, &got, &sink);
+	auto t_stream = since(t0);
+	if (ok && (ret != erSuccess || back != data)) {
+		fprintf(stderr, "%u: stream load mismatch (%zu/%zu bytes)\n", siid, back.size(), size);
+		ok = false;
+	}
+
+	/* Serializer save; reads back the first round's data */
+	mem_serializer source(data);
+	t0 = clk::now();
+	ret = s3->SaveAttachmentInstance(id, 0, data.size(), &source);
+	auto t_sput = since(t0);
+	if (ok && ret != erSuccess) {
+		fprintf(stderr, "%u: stream save failed\n", siid);
+		ok = false;
+	}
+	if (s3->DeleteAttachmentInstance(id, false) != erSuccess)
+		fprintf(stderr, "%u: delete failed\n", siid);
+	printf("%12zu %10.1f %10.1f %10.1f %10.1f %10.1f\n", size,
+	       mbps(size, t_put), mbps(size, t_sput), mbps(size, t_get[0]),
+	       mbps(size, t_get[1]), mbps(size, t_stream));
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: s3bench server.cfg [size...]\n");
+		return EXIT_FAILURE;
+	}
+	const configsetting_t defaults[] = {
+		{"attachment_storage", "s3"},
+		{"attachment_path", "/var/lib/kopano/attachments"},
+		{"attachment_compression", "0"},
+		{"attachment_s3_hostname", ""},
+		{"attachment_s3_protocol", "https"},
+		{"attachment_s3_uristyle", "virtualhost"},
+		{"attachment_s3_accesskeyid", ""},
+		{"attachment_s3_secretaccesskey", ""},
+		{"attachment_s3_bucketname", ""},
+		{"attachment_s3_region", ""},
+		{"attachment_s3_part_size", "8M", CONFIGSETTING_SIZE},
+		{"attachment_s3_parallel", "4"},
+		{"attachment_s3_cache_path", ""},
+		{"attachment_s3_cache_size", "1G", CONFIGSETTING_SIZE},
+		{nullptr, nullptr},
+	};
+	std::shared_ptr<ECConfig> cfg(ECConfig::Create(defaults));
+	if (!cfg->LoadSettings(argv[1], true) || cfg->HasErrors()) {
+		fprintf(stderr, "%s: cannot load configuration\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+	cfg->AddSetting("attachment_storage", "s3");
+
+	std::vector<size_t> sizes;
+	for (int i = 2; i < argc; ++i)
+		sizes.push_back(strtoull(argv[i], nullptr, 0));
+	if (sizes.empty())
+		sizes = {4096, 1 << 20, 16 << 20, 64 << 20};
+
+	std::unique_ptr<ECAttachmentConfig> atcfg;
+	if (ECAttachmentConfig::create(GUID{}, cfg, &unique_tie(atcfg)) != erSuccess) {
+		fprintf(stderr, "S3 backend initialization failed\n");
+		return EXIT_FAILURE;
+	}
+	std::unique_ptr<ECAttachmentStorage> st(atcfg->new_handle(nullptr));
+	auto s3 = dynamic_cast<ECS3Attachment *>(st.get());
+	if (s3 == nullptr) {
+		fprintf(stderr, "attachment_storage is not s3\n");
+		return EXIT_FAILURE;
+	}
+	printf("%12s %10s %10s %10s %10s %10s  (MB/s)\n", "size", "put", "put-strm",
+	       "get", "get-again", "get-strm");
+	bool ok = true;
+	/* High instance ids, to stay clear of a live server's objects */
+	unsigned int siid = 0xfffff000 + (getpid() & 0xff) * 16;
+	for (auto size : sizes)
+		ok &= bench(s3, siid++, size);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+#else
+int main()
+{
+	fprintf(stderr, "Not built with libs3\n");
+	return EXIT_FAILURE;
+}
+#endif
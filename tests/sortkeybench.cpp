@@ -0,0 +1,155 @@
+/* SPDX-License-Identifier: AGPL-3.0-only */
+/* Copyright 2016+, Kopano and its licensors */
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <kopano/platform.h>
+#include <kopano/ECKeyTable.h>
+#include <kopano/ustringutil.h>
+/*
+ * Loads a synthetic table of messages into an ECKeyTable sorted by two
+ * PT_UNICODE columns (sender, subject), the way ECGenericObjectTable does
+ * when a folder is opened, and then re-sorts it by (subject, sender).
+ * Senders come from a small pool, as in a real inbox. This is done with a
+ * collator per string (how it used to be), with the per-thread collators,
+ * and with the sort key memo in addition.
+ *
+ * Usage: sortkeybench [rows [locale [memo-bytes]]]
+ */
+
+using namespace KC;
+using clk = std::chrono::steady_clock;
+
+namespace {
+
+struct row {
+	std::string sender, subject;
+};
+
+}
+
+static double since(clk::time_point t)
+{
+	return std::chrono::duration<double>(clk::now() - t).count();
+}
+
+static std::vector<row> make_rows(size_t n)
+{
+	static const char *const first[] = {"Anna", "Bj\xc3\xb6rn", "Chlo\xc3\xa9", "Dirk", "\xc3\x89mile", "Fatima", "G\xc3\xbcnther", "Hana", "Ingrid", "Jos\xc3\xa9", "Kees", "\xc5\x81ukasz"};
+	static const char *const last[] = {"de Vries", "M\xc3\xbcller", "O'Brien", "Smith", "\xc3\x85str\xc3\xb6m", "Nakamura", "Garc\xc3\xad" "a", "(Support)", "van Dijk", "Nowak"};
+	static const char *const words[] = {"meeting", "report", "invoice", "Quarterly", "review", "\xc3\xa4nderung", "build", "failed", "lunch", "release", "notes", "\xc3\xa9t\xc3\xa9"};
+	static const char *const prefix[] = {"", "", "", "RE: ", "FW: ", "'"};
+	std::mt19937 rng(1);
+	std::vector<std::string> senders;
+	for (unsigned int i = 0; i < 2000; ++i)
+		senders.emplace_back(std::string(first[rng() % ARRAY_SIZE(first)]) + " " +
+			last[rng() % ARRAY_SIZE(last)] + " " + std::to_string(i));
+	/* Few senders write most of the mail */
+	std::geometric_distribution<unsigned int> popular(0.01);
+	std::vector<row> rows(n);
+	for (auto &r : rows) {
+		r.sender = senders[popular(rng) % senders.size()];
+		r.subject = prefix[rng() % ARRAY_SIZE(prefix)];
+		for (unsigned int w = 3 + rng() % 5; w > 0; --w)
+			r.subject += std::string(words[rng() % ARRAY_SIZE(words)]) + " ";
+		r.subject += std::to_string(rng() % 1000);
+	}
+	return rows;
+}
+
+/* What createSortKeyDataFromUTF8 did before: a fresh collator each time */
+static std::string uncached_key(const std::string &s, const ECLocale &locale)
+{
+	UErrorCode status = U_ZERO_ERROR;
+	std::unique_ptr<U_ICU_NAMESPACE::Collator> coll(U_ICU_NAMESPACE::Collator::createInstance(locale, status));
+	auto us = U_ICU_NAMESPACE::UnicodeString::fromUTF8(s);
+	us.truncate(255);
+	if (us.startsWith("'") || us.startsWith("("))
+		us.remove(0, 1);
+	U_ICU_NAMESPACE::CollationKey key;
+	coll->getCollationKey(us, key, status);
+	int32_t z = 0;
+	auto p = key.getByteArray(z);
+	return std::string(reinterpret_cast<const char *>(p), z);
+}
+
+static std::string sort_key(const std::string &s, const ECLocale &locale, bool uncached)
+{
+	if (uncached)
+		return uncached_key(s, locale);
+	return createSortKeyDataFromUTF8(s.c_str(), 255, locale);
+}
+
+/*
+ * Fill @table sorted by the two columns in the given order, and return the
+ * keys, to compare the modes with each other.
+ */
+static std::vector<std::string> load(ECKeyTable &table,
+    const std::vector<row> &rows, const ECLocale &locale, bool uncached,
+    bool by_subject)
+{
+	std::vector<std::string> keys;
+	keys.reserve(rows.size() * 2);
+	table.Clear();
+	for (size_t i = 0; i < rows.size(); ++i) {
+		std::vector<ECSortCol> cols(2);
+		cols[0].key = sort_key(by_subject ? rows[i].subject : rows[i].sender, locale, uncached);
+		cols[1].key = sort_key(by_subject ? rows[i].sender : rows[i].subject, locale, uncached);
+		keys.push_back(cols[0].key);
+		keys.push_back(cols[1].key);
+		sObjectTableKey id(i + 1, 0);
+		table.UpdateRow(ECKeyTable::TABLE_ROW_ADD, &id, std::move(cols), nullptr);
+	}
+	return keys;
+}
+
+int main(int argc, char **argv)
+{
+	size_t nrows = argc > 1 ? strtoull(argv[1], nullptr, 0) : 100000;
+	auto locale = createLocaleFromName(argc > 2 ? argv[2] : "en_US");
+	size_t memo = argc > 3 ? strtoull(argv[3], nullptr, 0) : 1 << 20;
+	auto rows = make_rows(nrows);
+
+	static const struct {
+		const char *name;
+		bool uncached;
+		size_t memo;
+	} modes[] = {
+		{"collator per string", true, 0},
+		{"cached collator", false, 0},
+		{"cached + memo", false, memo},
+	};
+	printf("%zu rows, locale %s, memo %zu bytes per thread\n", nrows, locale.getName(), memo);
+	printf("%-20s %10s %10s %12s\n", "", "load (s)", "resort (s)", "rows/s");
+	std::vector<std::string> ref;
+	bool ok = true;
+	for (const auto &m : modes) {
+		set_sortkey_cache_size(m.memo);
+		ECKeyTable table;
+		auto t0 = clk::now();
+		auto keys = load(table, rows, locale, m.uncached, false);
+		auto t_load = since(t0);
+		t0 = clk::now();
+		load(table, rows, locale, m.uncached, true);
+		auto t_sort = since(t0);
+		unsigned int count = 0, cur = 0;
+		table.GetRowCount(&count, &cur);
+		if (count != nrows) {
+			fprintf(stderr, "%s: table has %u rows\n", m.name, count);
+			ok = false;
+		}
+		if (ref.empty())
+			ref = std::move(keys);
+		else if (keys != ref) {
+			fprintf(stderr, "%s: sort keys differ\n", m.name);
+			ok = false;
+		}
+		printf("%-20s %10.3f %10.3f %12.0f\n", m.name, t_load, t_sort,
+		       t_load > 0 ? nrows / t_load : 0);
+	}
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
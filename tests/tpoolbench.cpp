@@ -0,0 +1,101 @@
+/* SPDX-License-Identifier: AGPL-3.0-only */
+/* Copyright 2016+, Kopano and its licensors */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <kopano/platform.h>
+#include <kopano/ECThreadPool.h>
+/*
+ * Measures the enqueue-to-start latency of ECThreadPool tasks, once with the
+ * shared FIFO list and once in work-stealing mode. A number of producer
+ * threads enqueue short tasks (a bit of spinning each) in bursts; every task
+ * records how long it sat in the queue.
+ *
+ * Usage: tpoolbench [workers [producers [tasks-per-producer]]]
+ */
+
+using namespace KC;
+using clk = std::chrono::steady_clock;
+
+namespace {
+
+class bench_task final : public ECTask {
+	public:
+	bench_task(time_point *enq, double *out, std::atomic<size_t> &d) :
+		m_enq(enq), m_out(out), m_done(d)
+	{}
+
+	protected:
+	void run() override
+	{
+		*m_out = std::chrono::duration<double, std::micro>(clk::now() - *m_enq).count();
+		/* ~2µs of "work" */
+		auto until = clk::now() + std::chrono::microseconds(2);
+		while (clk::now() < until)
+			;
+		++m_done;
+	}
+
+	private:
+	time_point *m_enq;
+	double *m_out;
+	std::atomic<size_t> &m_done;
+};
+
+}
+
+static void run(bool steal, unsigned int nwork, unsigned int nprod,
+    unsigned int ntask)
+{
+	ECThreadPool pool("bench", nwork);
+	pool.enable_work_stealing(steal);
+	size_t total = static_cast<size_t>(nprod) * ntask;
+	std::vector<time_point> enq(total);
+	std::vector<double> lat(total);
+	std::atomic<size_t> done{0};
+	std::vector<std::thread> prod;
+
+	auto start = clk::now();
+	for (unsigned int p = 0; p < nprod; ++p)
+		prod.emplace_back([&, p]() {
+			for (unsigned int i = 0; i < ntask; ++i) {
+				auto k = static_cast<size_t>(p) * ntask + i;
+				/*
+				 * The task must not read the stamp before enqueue has
+				 * written it; the pool's queue lock orders that.
+				 */
+				pool.enqueue(new bench_task(&enq[k], &lat[k], done), true, &enq[k]);
+				if (i % 64 == 63)
+					std::this_thread::sleep_for(std::chrono::microseconds(50));
+			}
+		});
+	for (auto &t : prod)
+		t.join();
+	while (done < total)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	auto dt = std::chrono::duration<double>(clk::now() - start).count();
+
+	std::sort(lat.begin(), lat.end());
+	printf("%-6s %.0f tasks/s  p50 %.1f µs  p99 %.1f µs  max %.1f µs\n",
+	       steal ? "steal" : "fifo", total / dt, lat[total / 2],
+	       lat[total * 99 / 100], lat[total - 1]);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int nwork = argc > 1 ? strtoul(argv[1], nullptr, 0) : 16;
+	unsigned int nprod = argc > 2 ? strtoul(argv[2], nullptr, 0) : 8;
+	unsigned int ntask = argc > 3 ? strtoul(argv[3], nullptr, 0) : 100000;
+
+	if (nwork == 0 || nprod == 0 || ntask == 0) {
+		fprintf(stderr, "Usage: tpoolbench [workers [producers [tasks-per-producer]]]\n");
+		return EXIT_FAILURE;
+	}
+	run(false, nwork, nprod, ntask);
+	run(true, nwork, nprod, ntask);
+	return EXIT_SUCCESS;
+}